@@ -0,0 +1,523 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "channel.h"
+#include "memory.h"
+#include "object.h"
+#include "table.h"
+
+// every channel in the process, so vms on different threads can find each other by name.
+static Channel* channels = NULL;
+static pthread_mutex_t registryLock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef enum {
+    MESSAGE_NIL,
+    MESSAGE_FALSE,
+    MESSAGE_TRUE,
+    MESSAGE_NUMBER,
+    MESSAGE_STRING,
+    MESSAGE_INSTANCE, // class name, field count, then each field's name and value.
+    MESSAGE_REF // an instance already written earlier in the message.
+} MessageTag;
+
+static void freeMessage(Message* message) {
+    free(message->bytes);
+    message->bytes = NULL;
+    message->length = 0;
+}
+
+Channel* openChannel(const char* name, int length, int capacity) {
+    pthread_mutex_lock(&registryLock);
+    Channel* channel = channels;
+    while (channel != NULL) {
+        if ((int)strlen(channel->name) == length && memcmp(channel->name, name, length) == 0) break;
+        channel = channel->next;
+    }
+
+    // first opener decides the capacity.
+    if (channel == NULL) {
+        channel = (Channel*)malloc(sizeof(Channel));
+        if (channel == NULL) exit(1);
+        channel->name = (char*)malloc(length + 1);
+        channel->messages = (Message*)malloc(sizeof(Message) * capacity);
+        if (channel->name == NULL || channel->messages == NULL) exit(1);
+        memcpy(channel->name, name, length);
+        channel->name[length] = '\0';
+        channel->refCount = 0;
+        channel->capacity = capacity;
+        channel->head = 0;
+        channel->count = 0;
+        channel->closed = false;
+        pthread_mutex_init(&channel->lock, NULL);
+        pthread_cond_init(&channel->notEmpty, NULL);
+        pthread_cond_init(&channel->notFull, NULL);
+        channel->next = channels;
+        channels = channel;
+    }
+
+    channel->refCount++;
+    pthread_mutex_unlock(&registryLock);
+    return channel;
+}
+
+void releaseChannel(Channel* channel) {
+    pthread_mutex_lock(&registryLock);
+    if (--channel->refCount > 0) {
+        pthread_mutex_unlock(&registryLock);
+        return;
+    }
+
+    // unlink from the registry.
+    Channel** link = &channels;
+    while (*link != channel) link = &(*link)->next;
+    *link = channel->next;
+    pthread_mutex_unlock(&registryLock);
+
+    // undelivered messages die with the channel.
+    for (int i = 0; i < channel->count; i++) {
+        freeMessage(&channel->messages[(channel->head + i) % channel->capacity]);
+    }
+    pthread_mutex_destroy(&channel->lock);
+    pthread_cond_destroy(&channel->notEmpty);
+    pthread_cond_destroy(&channel->notFull);
+    free(channel->messages);
+    free(channel->name);
+    free(channel);
+}
+
+// writing a value graph into a message.
+
+typedef struct {
+    ObjInstance* instance;
+    int index; // next entry of the field table to write.
+} EncodeFrame;
+
+typedef struct {
+    Message message;
+    size_t capacity;
+
+    // instances already written, keyed by address, so shared and cyclic references survive the copy.
+    ObjInstance** seen;
+    uint32_t* seenIds;
+    int seenCount;
+    int seenCapacity; // power of two.
+
+    EncodeFrame* frames; // instances whose fields are still being written.
+    int frameCount;
+    int frameCapacity;
+} Encoder;
+
+static void writeBytes(Encoder* encoder, const void* bytes, size_t length) {
+    if (encoder->message.length + length > encoder->capacity) {
+        size_t capacity = encoder->capacity < 64 ? 64 : encoder->capacity * 2;
+        while (capacity < encoder->message.length + length) capacity *= 2;
+        encoder->message.bytes = (uint8_t*)realloc(encoder->message.bytes, capacity);
+        if (encoder->message.bytes == NULL) exit(1);
+        encoder->capacity = capacity;
+    }
+    memcpy(encoder->message.bytes + encoder->message.length, bytes, length);
+    encoder->message.length += length;
+}
+
+static void writeByte(Encoder* encoder, uint8_t byte) {
+    writeBytes(encoder, &byte, 1);
+}
+
+static void writeUint32(Encoder* encoder, uint32_t value) {
+    writeBytes(encoder, &value, sizeof(value));
+}
+
+static void writeString(Encoder* encoder, ObjString* string) {
+    writeUint32(encoder, (uint32_t)string->length);
+    writeBytes(encoder, string->chars, string->length);
+}
+
+static uint32_t hashPointer(void* pointer) {
+    uintptr_t bits = (uintptr_t)pointer;
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdull;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
+}
+
+// find the id of an already written instance. returns false and records a new id otherwise.
+static bool findOrAddSeen(Encoder* encoder, ObjInstance* instance, uint32_t* id) {
+    if (encoder->seenCount + 1 > encoder->seenCapacity * TABLE_MAX_LOAD) {
+        int oldCapacity = encoder->seenCapacity;
+        ObjInstance** oldSeen = encoder->seen;
+        uint32_t* oldIds = encoder->seenIds;
+        encoder->seenCapacity = GROW_CAPACITY(oldCapacity);
+        encoder->seen = (ObjInstance**)calloc(encoder->seenCapacity, sizeof(ObjInstance*));
+        encoder->seenIds = (uint32_t*)malloc(sizeof(uint32_t) * encoder->seenCapacity);
+        if (encoder->seen == NULL || encoder->seenIds == NULL) exit(1);
+
+        for (int i = 0; i < oldCapacity; i++) {
+            if (oldSeen[i] == NULL) continue;
+            uint32_t index = hashPointer(oldSeen[i]) & (encoder->seenCapacity - 1);
+            while (encoder->seen[index] != NULL) index = (index + 1) & (encoder->seenCapacity - 1);
+            encoder->seen[index] = oldSeen[i];
+            encoder->seenIds[index] = oldIds[i];
+        }
+        free(oldSeen);
+        free(oldIds);
+    }
+
+    uint32_t index = hashPointer(instance) & (encoder->seenCapacity - 1);
+    while (encoder->seen[index] != NULL) {
+        if (encoder->seen[index] == instance) {
+            *id = encoder->seenIds[index];
+            return true;
+        }
+        index = (index + 1) & (encoder->seenCapacity - 1);
+    }
+
+    encoder->seen[index] = instance;
+    encoder->seenIds[index] = (uint32_t)encoder->seenCount++;
+    return false;
+}
+
+static bool writeValue(VM* vm, Encoder* encoder, Value value) {
+    if (IS_NIL(value)) {
+        writeByte(encoder, MESSAGE_NIL);
+    } else if (IS_BOOL(value)) {
+        writeByte(encoder, AS_BOOL(value) ? MESSAGE_TRUE : MESSAGE_FALSE);
+    } else if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        writeByte(encoder, MESSAGE_NUMBER);
+        writeBytes(encoder, &number, sizeof(number));
+    } else if (IS_STRING(value)) {
+        writeByte(encoder, MESSAGE_STRING);
+        writeString(encoder, AS_STRING(value));
+    } else if (IS_INSTANCE(value)) {
+        ObjInstance* instance = AS_INSTANCE(value);
+        uint32_t id;
+        if (findOrAddSeen(encoder, instance, &id)) {
+            writeByte(encoder, MESSAGE_REF);
+            writeUint32(encoder, id);
+            return true;
+        }
+
+        // the field table counts tombstones too.
+        uint32_t fieldCount = 0;
+        for (int i = 0; i < instance->fields.capacity; i++) {
+            if (instance->fields.entries[i].key != NULL) fieldCount++;
+        }
+        writeByte(encoder, MESSAGE_INSTANCE);
+        writeString(encoder, instance->klass->name);
+        writeUint32(encoder, fieldCount);
+        if (fieldCount == 0) return true;
+
+        // fields follow right after their instance. the caller's loop writes them.
+        if (encoder->frameCount == encoder->frameCapacity) {
+            encoder->frameCapacity = GROW_CAPACITY(encoder->frameCapacity);
+            encoder->frames = (EncodeFrame*)realloc(encoder->frames,
+                sizeof(EncodeFrame) * encoder->frameCapacity);
+            if (encoder->frames == NULL) exit(1);
+        }
+        encoder->frames[encoder->frameCount].instance = instance;
+        encoder->frames[encoder->frameCount].index = 0;
+        encoder->frameCount++;
+    } else {
+        runtimeError(vm, "Can only send numbers, strings, booleans, nil and instances.");
+        return false;
+    }
+    return true;
+}
+
+// copy a value graph out of the vm heap. walks with an explicit stack so deep lists don't overflow the c stack.
+static bool encodeMessage(VM* vm, Value value, Message* message) {
+    Encoder encoder;
+    encoder.message.bytes = NULL;
+    encoder.message.length = 0;
+    encoder.capacity = 0;
+    encoder.seen = NULL;
+    encoder.seenIds = NULL;
+    encoder.seenCount = 0;
+    encoder.seenCapacity = 0;
+    encoder.frames = NULL;
+    encoder.frameCount = 0;
+    encoder.frameCapacity = 0;
+
+    bool ok = writeValue(vm, &encoder, value);
+    while (ok && encoder.frameCount > 0) {
+        EncodeFrame* frame = &encoder.frames[encoder.frameCount - 1];
+        Table* fields = &frame->instance->fields;
+        while (frame->index < fields->capacity && fields->entries[frame->index].key == NULL) {
+            frame->index++;
+        }
+        if (frame->index == fields->capacity) {
+            encoder.frameCount--;
+            continue;
+        }
+
+        Entry* entry = &fields->entries[frame->index++];
+        writeString(&encoder, entry->key);
+        ok = writeValue(vm, &encoder, entry->value);
+    }
+
+    free(encoder.seen);
+    free(encoder.seenIds);
+    free(encoder.frames);
+    if (!ok) {
+        freeMessage(&encoder.message);
+        return false;
+    }
+    *message = encoder.message;
+    return true;
+}
+
+// rebuilding a value graph in the receiving vm.
+
+typedef struct {
+    ObjInstance* instance;
+    uint32_t remaining; // fields still to read.
+} DecodeFrame;
+
+typedef struct {
+    const uint8_t* current;
+
+    ObjInstance** instances; // by id, for MESSAGE_REF.
+    int instanceCount;
+    int instanceCapacity;
+
+    DecodeFrame* frames;
+    int frameCount;
+    int frameCapacity;
+} Decoder;
+
+static uint32_t readUint32(Decoder* decoder) {
+    uint32_t value;
+    memcpy(&value, decoder->current, sizeof(value));
+    decoder->current += sizeof(value);
+    return value;
+}
+
+// strings are interned in the receiving vm, so equality by identity keeps working.
+static ObjString* readString(VM* vm, Decoder* decoder) {
+    uint32_t length = readUint32(decoder);
+    ObjString* string = copyString(vm, (const char*)decoder->current, (int)length);
+    decoder->current += length;
+    return string;
+}
+
+static bool readValue(VM* vm, Decoder* decoder, Value* value) {
+    switch (*decoder->current++) {
+        case MESSAGE_NIL: *value = NIL_VAL; return true;
+        case MESSAGE_FALSE: *value = BOOL_VAL(false); return true;
+        case MESSAGE_TRUE: *value = BOOL_VAL(true); return true;
+        case MESSAGE_NUMBER: {
+            double number;
+            memcpy(&number, decoder->current, sizeof(number));
+            decoder->current += sizeof(number);
+            *value = exactNumber(number);
+            return true;
+        }
+        case MESSAGE_STRING:
+            *value = OBJ_VAL(readString(vm, decoder));
+            return true;
+        case MESSAGE_REF:
+            *value = OBJ_VAL(decoder->instances[readUint32(decoder)]);
+            return true;
+        case MESSAGE_INSTANCE: {
+            // instances take the receiver's class of the same name.
+            ObjString* name = readString(vm, decoder);
+            Value klass;
+            if (!tableGet(&vm->globals, name, &klass) || !IS_CLASS(klass)) {
+                runtimeError(vm, "Undefined class '%s' in received message.", name->chars);
+                return false;
+            }
+            ObjInstance* instance = newInstance(vm, AS_CLASS(klass));
+            uint32_t fieldCount = readUint32(decoder);
+
+            if (decoder->instanceCount == decoder->instanceCapacity) {
+                decoder->instanceCapacity = GROW_CAPACITY(decoder->instanceCapacity);
+                decoder->instances = (ObjInstance**)realloc(decoder->instances,
+                    sizeof(ObjInstance*) * decoder->instanceCapacity);
+                if (decoder->instances == NULL) exit(1);
+            }
+            decoder->instances[decoder->instanceCount++] = instance;
+
+            if (fieldCount > 0) {
+                if (decoder->frameCount == decoder->frameCapacity) {
+                    decoder->frameCapacity = GROW_CAPACITY(decoder->frameCapacity);
+                    decoder->frames = (DecodeFrame*)realloc(decoder->frames,
+                        sizeof(DecodeFrame) * decoder->frameCapacity);
+                    if (decoder->frames == NULL) exit(1);
+                }
+                decoder->frames[decoder->frameCount].instance = instance;
+                decoder->frames[decoder->frameCount].remaining = fieldCount;
+                decoder->frameCount++;
+            }
+            *value = OBJ_VAL(instance);
+            return true;
+        }
+    }
+    return false; // unreachable.
+}
+
+static bool decodeMessage(VM* vm, Message* message, Value* result) {
+    Decoder decoder;
+    decoder.current = message->bytes;
+    decoder.instances = NULL;
+    decoder.instanceCount = 0;
+    decoder.instanceCapacity = 0;
+    decoder.frames = NULL;
+    decoder.frameCount = 0;
+    decoder.frameCapacity = 0;
+
+    bool ok = readValue(vm, &decoder, result);
+    if (ok) {
+        // every instance hangs off the root as soon as it is created,
+        // so the root plus the field being read are the only gc roots needed.
+        push(vm, *result);
+        while (ok && decoder.frameCount > 0) {
+            DecodeFrame* frame = &decoder.frames[decoder.frameCount - 1];
+            if (frame->remaining == 0) {
+                decoder.frameCount--;
+                continue;
+            }
+            frame->remaining--;
+            ObjInstance* instance = frame->instance;
+
+            push(vm, OBJ_VAL(readString(vm, &decoder)));
+            Value value;
+            ok = readValue(vm, &decoder, &value);
+            if (ok) {
+                push(vm, value);
+                tableSet(vm, &instance->fields, AS_STRING(vm->stackTop[-2]), value);
+                pop(vm);
+            }
+            pop(vm);
+        }
+        pop(vm);
+    }
+
+    free(decoder.instances);
+    free(decoder.frames);
+    return ok;
+}
+
+// natives.
+
+static bool checkChannel(VM* vm, Value value) {
+    if (IS_CHANNEL(value)) return true;
+    runtimeError(vm, "Expected a channel.");
+    return false;
+}
+
+static bool checkArity(VM* vm, int arity, int argCount) {
+    if (argCount == arity) return true;
+    runtimeError(vm, "Expected %d arguments but got %d.", arity, argCount);
+    return false;
+}
+
+// channel(name, capacity) opens the named channel.
+static bool channelNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 2, argCount)) return false;
+    if (!IS_STRING(args[0])) {
+        runtimeError(vm, "Channel name must be a string.");
+        return false;
+    }
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1 ||
+            AS_NUMBER(args[1]) != (int)AS_NUMBER(args[1])) {
+        runtimeError(vm, "Channel capacity must be a positive integer.");
+        return false;
+    }
+
+    ObjString* name = AS_STRING(args[0]);
+    Channel* channel = openChannel(name->chars, name->length, (int)AS_NUMBER(args[1]));
+    args[-1] = OBJ_VAL(newChannel(vm, channel));
+    return true;
+}
+
+// send(channel, value) copies value into the channel. blocks while it is full.
+static bool sendNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 2, argCount) || !checkChannel(vm, args[0])) return false;
+    Channel* channel = AS_CHANNEL(args[0]);
+
+    // copy outside the lock. the encoder never touches another vm.
+    Message message;
+    if (!encodeMessage(vm, args[1], &message)) return false;
+
+    pthread_mutex_lock(&channel->lock);
+    while (channel->count == channel->capacity && !channel->closed) {
+        pthread_cond_wait(&channel->notFull, &channel->lock);
+    }
+    if (channel->closed) {
+        pthread_mutex_unlock(&channel->lock);
+        freeMessage(&message);
+        runtimeError(vm, "Send on closed channel '%s'.", channel->name);
+        return false;
+    }
+    channel->messages[(channel->head + channel->count) % channel->capacity] = message;
+    channel->count++;
+    pthread_cond_signal(&channel->notEmpty);
+    pthread_mutex_unlock(&channel->lock);
+
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+// take the oldest message. returns false if there is none and the caller shouldn't wait.
+static bool takeMessage(Channel* channel, bool wait, Message* message) {
+    pthread_mutex_lock(&channel->lock);
+    while (wait && channel->count == 0 && !channel->closed) {
+        pthread_cond_wait(&channel->notEmpty, &channel->lock);
+    }
+    if (channel->count == 0) {
+        pthread_mutex_unlock(&channel->lock);
+        return false;
+    }
+    *message = channel->messages[channel->head];
+    channel->head = (channel->head + 1) % channel->capacity;
+    channel->count--;
+    pthread_cond_signal(&channel->notFull);
+    pthread_mutex_unlock(&channel->lock);
+    return true;
+}
+
+static bool receive(VM* vm, int argCount, Value* args, bool wait) {
+    if (!checkArity(vm, 1, argCount) || !checkChannel(vm, args[0])) return false;
+
+    Message message;
+    if (!takeMessage(AS_CHANNEL(args[0]), wait, &message)) {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+    bool ok = decodeMessage(vm, &message, &args[-1]);
+    freeMessage(&message);
+    return ok;
+}
+
+// receive(channel) blocks until a message arrives. returns nil once the channel is closed and drained.
+static bool receiveNative(VM* vm, int argCount, Value* args) {
+    return receive(vm, argCount, args, true);
+}
+
+// tryReceive(channel) returns nil right away when the channel is empty.
+static bool tryReceiveNative(VM* vm, int argCount, Value* args) {
+    return receive(vm, argCount, args, false);
+}
+
+// closeChannel(channel) wakes every blocked sender and receiver. queued messages can still be received.
+static bool closeChannelNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 1, argCount) || !checkChannel(vm, args[0])) return false;
+    Channel* channel = AS_CHANNEL(args[0]);
+
+    pthread_mutex_lock(&channel->lock);
+    channel->closed = true;
+    pthread_cond_broadcast(&channel->notEmpty);
+    pthread_cond_broadcast(&channel->notFull);
+    pthread_mutex_unlock(&channel->lock);
+
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+void defineChannelNatives(VM* vm) {
+    defineNative(vm, "channel", channelNative);
+    defineNative(vm, "send", sendNative);
+    defineNative(vm, "receive", receiveNative);
+    defineNative(vm, "tryReceive", tryReceiveNative);
+    defineNative(vm, "closeChannel", closeChannelNative);
+}
@@ -0,0 +1,39 @@
+#ifndef clox_channel_h
+#define clox_channel_h
+
+#include <pthread.h>
+
+#include "common.h"
+#include "vm.h"
+
+// a message copied out of one vm's heap. it references nothing in any vm,
+// so it can sit in a channel while its sender collects garbage.
+typedef struct {
+    uint8_t* bytes;
+    size_t length;
+} Message;
+
+// bounded queue of messages shared by every vm in the process.
+// channels are found by name and freed when the last ObjChannel goes away.
+typedef struct Channel {
+    char* name;
+    int refCount; // guarded by the registry lock.
+    struct Channel* next; // next channel in the registry.
+
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    Message* messages; // ring buffer.
+    int capacity;
+    int head; // index of the oldest message.
+    int count;
+    bool closed;
+} Channel;
+
+// find the channel with this name or create it with the given capacity.
+Channel* openChannel(const char* name, int length, int capacity);
+void releaseChannel(Channel* channel);
+// define channel, send, receive, tryReceive and closeChannel as natives.
+void defineChannelNatives(VM* vm);
+
+#endif
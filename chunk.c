@@ -2,6 +2,7 @@
 
 #include "chunk.h"
 #include "memory.h"
+#include "object.h"
 #include "vm.h"
 
 void initChunk(Chunk* chunk) {
@@ -10,21 +11,25 @@ void initChunk(Chunk* chunk) {
     chunk->code = NULL;
     chunk->lines = NULL;
     initValueArray(&chunk->constants);
+    chunk->handlerCount = 0;
+    chunk->handlerCapacity = 0;
+    chunk->handlers = NULL;
 }
 
-void freeChunk(Chunk* chunk) {
-    FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
-    freeValueArray(&chunk->constants);
+void freeChunk(VM* vm, Chunk* chunk) {
+    FREE_ARRAY(vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(vm, int, chunk->lines, chunk->capacity);
+    freeValueArray(vm, &chunk->constants);
+    FREE_ARRAY(vm, Handler, chunk->handlers, chunk->handlerCapacity);
     initChunk(chunk);
 }
 
-void writeChunk(Chunk* chunk, uint8_t byte, int line) {
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line) {
     if (chunk->capacity < chunk->count + 1) {
         int oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(oldCapacity);
-        chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
+        chunk->code = GROW_ARRAY(vm, uint8_t, chunk->code, oldCapacity, chunk->capacity);
+        chunk->lines = GROW_ARRAY(vm, int, chunk->lines, oldCapacity, chunk->capacity);
     }
 
     chunk->code[chunk->count] = byte;
@@ -32,10 +37,196 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
     chunk->count++;
 }
 
-int addConstant(Chunk* chunk, Value value) {
+int addConstant(VM* vm, Chunk* chunk, Value value) {
     // push constant value to stack temporarily to prevent gc from freeing the object.
-    push(value);
-    writeValueArray(&chunk->constants, value);
-    pop();
+    push(vm, value);
+    writeValueArray(vm, &chunk->constants, value);
+    pop(vm);
     return chunk->constants.count - 1;
-}
\ No newline at end of file
+}
+
+void addHandler(VM* vm, Chunk* chunk, Handler handler) {
+    if (chunk->handlerCapacity < chunk->handlerCount + 1) {
+        int oldCapacity = chunk->handlerCapacity;
+        chunk->handlerCapacity = GROW_CAPACITY(oldCapacity);
+        chunk->handlers = GROW_ARRAY(vm, Handler, chunk->handlers, oldCapacity, chunk->handlerCapacity);
+    }
+    chunk->handlers[chunk->handlerCount++] = handler;
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_CLASS:
+        case OP_METHOD:
+        case OP_IMPORT:
+        case OP_RESERVE:
+        case OP_GUARD_NUMBER:
+        case OP_LOAD_NIL:
+        case OP_LOAD_TRUE:
+        case OP_LOAD_FALSE:
+        case OP_PUSH_R:
+        case OP_POP_R:
+            return 2;
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_INVOKE:
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+        case OP_MOVE:
+        case OP_LOAD_CONSTANT:
+        case OP_NOT_R:
+        case OP_NEGATE_R:
+        case OP_NEGATE_NUMBER_R:
+            return 3;
+        case OP_EQUAL_R:
+        case OP_GREATER_R:
+        case OP_LESS_R:
+        case OP_ADD_R:
+        case OP_SUBTRACT_R:
+        case OP_MULTIPLY_R:
+        case OP_DIVIDE_R:
+        case OP_GREATER_NUMBER_R:
+        case OP_LESS_NUMBER_R:
+        case OP_ADD_NUMBER_R:
+        case OP_SUBTRACT_NUMBER_R:
+        case OP_MULTIPLY_NUMBER_R:
+        case OP_DIVIDE_NUMBER_R:
+        case OP_JUMP_IF_FALSE_R:
+            return 4;
+        case OP_CLOSURE: {
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[chunk->code[offset + 1]]);
+            return 2 + function->upvalueCount * 2;
+        }
+        default:
+            return 1;
+    }
+}
+
+// values an instruction leaves on the stack minus the ones it takes.
+static int stackEffect(Chunk* chunk, int offset) {
+    switch (chunk->code[offset]) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLASS:
+        case OP_PUSH_R:
+            return 1;
+        // the module's namespace, then the nil its script returns.
+        case OP_IMPORT:
+            return 2;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_PROPERTY:
+        case OP_GET_SUPER:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+        case OP_RETURN:
+        case OP_INHERIT:
+        case OP_METHOD:
+        case OP_THROW:
+        case OP_POP_R:
+            return -1;
+        // the arguments are replaced by the result. a super invoke also takes the superclass.
+        case OP_CALL:
+        case OP_TAIL_CALL:
+            return -chunk->code[offset + 1];
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+            return -chunk->code[offset + 2];
+        case OP_SUPER_INVOKE:
+        case OP_TAIL_SUPER_INVOKE:
+            return -chunk->code[offset + 2] - 1;
+        default:
+            return 0;
+    }
+}
+
+static void reachOffset(int* heights, int* work, int* workCount, int offset, int height) {
+    if (heights[offset] >= 0) return;
+    heights[offset] = height;
+    work[(*workCount)++] = offset;
+}
+
+int chunkStackSlots(Chunk* chunk, int arity) {
+    int slots = arity + 1;
+    if (chunk->count == 0) return slots;
+    // height of the stack before each instruction. -1 until it is reached.
+    int* heights = (int*)malloc(sizeof(int) * chunk->count);
+    int* work = (int*)malloc(sizeof(int) * chunk->count);
+    if (heights == NULL || work == NULL) exit(1);
+    for (int i = 0; i < chunk->count; i++) heights[i] = -1;
+    int workCount = 0;
+    reachOffset(heights, work, &workCount, 0, slots);
+    // a handler starts with the stack cut back to its depth and the error on top.
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        reachOffset(heights, work, &workCount, handler->target, handler->depth + 1);
+    }
+
+    while (workCount > 0) {
+        int offset = work[--workCount];
+        int height = heights[offset];
+        for (;;) {
+            uint8_t op = chunk->code[offset];
+            int next = offset + instructionLength(chunk, offset);
+            if (op == OP_RESERVE) {
+                // registers are the frame's first slots.
+                if (height < chunk->code[offset + 1]) height = chunk->code[offset + 1];
+            } else {
+                height += stackEffect(chunk, offset);
+            }
+            if (height > slots) slots = height;
+
+            if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_FALSE_R) {
+                int jump = (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+                if (next + jump < chunk->count) reachOffset(heights, work, &workCount, next + jump, height);
+                if (op == OP_JUMP) break;
+            } else if (op == OP_LOOP) {
+                int jump = (chunk->code[next - 2] << 8) | chunk->code[next - 1];
+                if (next - jump >= 0) reachOffset(heights, work, &workCount, next - jump, height);
+                break;
+            } else if (op == OP_RETURN || op == OP_THROW) {
+                break;
+            }
+            if (next >= chunk->count || heights[next] >= 0) break;
+            heights[next] = height;
+            offset = next;
+        }
+    }
+    free(heights);
+    free(work);
+    return slots;
+}
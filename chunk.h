@@ -34,27 +34,89 @@ typedef enum {
     OP_JUMP_IF_FALSE,
     OP_LOOP,
     OP_CALL,
+    OP_TAIL_CALL,
     OP_INVOKE,
     OP_SUPER_INVOKE,
+    OP_TAIL_INVOKE,
+    OP_TAIL_SUPER_INVOKE,
     OP_CLOSURE,
     OP_CLOSE_UPVALUE,
     OP_RETURN,
     OP_CLASS,
     OP_INHERIT,
-    OP_METHOD
+    OP_METHOD,
+    OP_THROW,
+    OP_IMPORT,
+    // arithmetic on operands the compiler proved to be numbers. nothing is checked.
+    OP_GREATER_NUMBER,
+    OP_LESS_NUMBER,
+    OP_ADD_NUMBER,
+    OP_SUBTRACT_NUMBER,
+    OP_MULTIPLY_NUMBER,
+    OP_DIVIDE_NUMBER,
+    OP_NEGATE_NUMBER,
+    // register instructions. only the optimizing tier emits these. registers
+    // are the slots of the callframe they run in.
+    OP_RESERVE,
+    OP_GUARD_NUMBER,
+    OP_MOVE,
+    OP_LOAD_CONSTANT,
+    OP_LOAD_NIL,
+    OP_LOAD_TRUE,
+    OP_LOAD_FALSE,
+    OP_PUSH_R,
+    OP_POP_R,
+    OP_EQUAL_R,
+    OP_GREATER_R,
+    OP_LESS_R,
+    OP_ADD_R,
+    OP_SUBTRACT_R,
+    OP_MULTIPLY_R,
+    OP_DIVIDE_R,
+    OP_NOT_R,
+    OP_NEGATE_R,
+    // arithmetic on registers known to hold numbers. nothing is checked.
+    OP_GREATER_NUMBER_R,
+    OP_LESS_NUMBER_R,
+    OP_ADD_NUMBER_R,
+    OP_SUBTRACT_NUMBER_R,
+    OP_MULTIPLY_NUMBER_R,
+    OP_DIVIDE_NUMBER_R,
+    OP_NEGATE_NUMBER_R,
+    OP_JUMP_IF_FALSE_R
 } OpCode;
 
+// an entry in a chunk's exception table. an error thrown while ip is in
+// [start, end) continues at target, with the frame's stack cut back to depth
+// slots and the error pushed on top.
+typedef struct {
+    int start;
+    int end;
+    int target;
+    int depth;
+} Handler;
+
 typedef struct {
     int count;
     int capacity;
     uint8_t* code;
     int* lines;
     ValueArray constants;
+    // exception table, inner try blocks before the ones around them.
+    int handlerCount;
+    int handlerCapacity;
+    Handler* handlers;
 } Chunk;
 
 void initChunk(Chunk* chunck);
-void freeChunk(Chunk* chunk);
-void writeChunk(Chunk* chunk, uint8_t byte, int line);
-int addConstant(Chunk* chunk, Value value);
+void freeChunk(VM* vm, Chunk* chunk);
+void writeChunk(VM* vm, Chunk* chunk, uint8_t byte, int line);
+int addConstant(VM* vm, Chunk* chunk, Value value);
+void addHandler(VM* vm, Chunk* chunk, Handler handler);
+// bytes the instruction at offset takes up, operands included.
+int instructionLength(Chunk* chunk, int offset);
+// deepest the stack of a callframe running chunk gets, counted from slot zero.
+// the frame starts with the callee and arity arguments.
+int chunkStackSlots(Chunk* chunk, int arity);
 
 #endif
\ No newline at end of file
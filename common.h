@@ -6,12 +6,21 @@
 #include <stdint.h>
 
 // #define DEBUG_PRINT_CODE
+// #define DEBUG_PRINT_OPTIMIZE
 // #define DEBUG_TRACE_EXECUTION
 // #define DEBUG_STRESS_GC
 // #define DEBUG_LOG_GC
+// #define DEBUG_COUNT_FRAMES
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+// every interpreter entry point takes the vm it operates on.
+typedef struct VM VM;
+
 #define NAN_BOXING true 
 
+// objects refer to each other with 32-bit references into the heap's pages
+// instead of pointers, see memory.h.
+// #define COMPRESSED_HEAP
+
 #endif
\ No newline at end of file
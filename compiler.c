@@ -5,16 +5,28 @@
 #include "common.h"
 #include "compiler.h"
 #include "memory.h"
+#include "optimize.h"
 #include "scanner.h"
-#ifdef DEBUG_PRINT_CODE
+#if defined(DEBUG_PRINT_CODE) || defined(DEBUG_PRINT_OPTIMIZE)
 #include "debug.h"
 #endif
 
-typedef struct {
+typedef struct Compiler_ Compiler;
+typedef struct ClassCompiler ClassCompiler;
+
+// all state of one compilation. threaded through every compiler function
+// so independent vms can compile at the same time.
+typedef struct Parser {
+  VM* vm;
+  Scanner scanner;
   Token current;
   Token previous;
   bool hadError;
   bool panicMode;
+  bool lazy; // skip function bodies and compile each on its first call.
+  int numberEnd; // end of the last expression known to leave a number. -1 if none.
+  Compiler* compiler; // compiler of the function currently being compiled.
+  ClassCompiler* currentClass; // current class being compiled.
 } Parser;
 
 typedef enum {
@@ -31,7 +43,7 @@ typedef enum {
   PREC_PRIMARY
 } Precedence;
 
-typedef void (*ParseFn)(bool canAssign);
+typedef void (*ParseFn)(Parser* parser, bool canAssign);
 
 typedef struct {
   ParseFn prefix;
@@ -43,6 +55,7 @@ typedef struct {
   Token name;
   int depth;
   bool isCaptured; // whether a local is captured by a closure.
+  bool isNumber; // holds a number on every path to the code being compiled.
 } Local;
 
 typedef struct {
@@ -57,7 +70,7 @@ typedef enum {
   TYPE_SCRIPT
 } FunctionType;
 
-typedef struct Compiler_ {
+struct Compiler_ {
   struct Compiler_* enclosing; // compiler points back to the compiler of function that encloses it.
   ObjFunction* function;
   FunctionType type;
@@ -66,158 +79,285 @@ typedef struct Compiler_ {
   int localCount; // how many locals are in scope.
   Upvalue upvalues[UINT8_COUNT]; // upvalue array.
   int scopeDepth; // number of blocks surrouding the current bit of code being compiled.
-} Compiler;
+  int lastCall; // offset of the most recent call or invoke, used to detect calls in tail position.
+  int tryDepth; // try blocks around the code being compiled. their frame must stay for the handler.
+  const Token* captured; // upvalue names of a lazy body, which has no enclosing compiler to resolve them in.
+  int capturedCount;
+};
+
+// which locals hold a number at a point of the code. where paths meet, a
+// local stays a number only if it is one on all of them.
+typedef struct {
+  bool number[UINT8_COUNT];
+  int count;
+} Types;
+
+// where the compiler was, to go back there and compile the same code again.
+typedef struct {
+  Scanner scanner;
+  Token current;
+  Token previous;
+  int count;
+  int constantCount;
+  int handlerCount;
+  int lastCall;
+} Checkpoint;
+
+// a loop's body is compiled assuming the types it starts with hold on every
+// iteration. if the end of the body breaks that, the assumption is weakened
+// and the loop compiled again. the types only ever lose numbers, so this stops.
+typedef struct {
+  Checkpoint start;
+  Types entry; // assumed at the condition.
+  Types next; // assumed where the increment of a for loop starts, the end of the body.
+  Types exit; // when the condition fails.
+  bool redo;
+  int passes;
+} Loop;
+
+#define MAX_LOOP_PASSES 4
 
 // class compiler forms a linked list from innermost class being compiled to all of the enclosing class.
-typedef struct ClassCompiler {
+struct ClassCompiler {
   struct ClassCompiler* enclosing;
   bool hasSuperclass;
-} ClassCompiler;
-
-Parser parser;
-Compiler* current = NULL;
-// current class being compiled.
-ClassCompiler* currentClass = NULL;
-Chunk* compilingChunk;
+};
 
-static Chunk* currentChunk() {
+static Chunk* currentChunk(Parser* parser) {
   // current chunk is the chunk owned by function in the middle of being compiled. 
-  return &current->function->chunk;
+  return &parser->compiler->function->chunk;
 }
 
-static void errorAt(Token* token, const char* message) {
-  if (parser.panicMode) return;
-  parser.panicMode = true;
-  fprintf(stderr, "[line %d] Error", token->line);
+static void errorAt(Parser* parser, Token* token, const char* message) {
+  if (parser->panicMode) return;
+  parser->panicMode = true;
+  fprintf(parser->vm->err, "[line %d] Error", token->line);
 
   if (token->type == TOKEN_EOF) {
-    fprintf(stderr, " at end");
+    fprintf(parser->vm->err, " at end");
   } else if (token->type == TOKEN_ERROR) {
 
   } else {
-    fprintf(stderr, " at '%.*s'", token->length, token->start);
+    fprintf(parser->vm->err, " at '%.*s'", token->length, token->start);
   }
 
-  fprintf(stderr, ": %s\n", message);
-  parser.hadError = true;
+  fprintf(parser->vm->err, ": %s\n", message);
+  parser->hadError = true;
 }
 
-static void error(const char* message) {
-  errorAt(&parser.previous, message);
+static void error(Parser* parser, const char* message) {
+  errorAt(parser, &parser->previous, message);
 }
 
-static void errorAtCurrent(const char* message) {
-  errorAt(&parser.current, message);
+static void errorAtCurrent(Parser* parser, const char* message) {
+  errorAt(parser, &parser->current, message);
 }
 
-static void advance() {
-  parser.previous = parser.current;
+static void advance(Parser* parser) {
+  parser->previous = parser->current;
 
   for (;;) {
-    parser.current = scanToken();
-    if (parser.current.type != TOKEN_ERROR) break;
+    parser->current = scanToken(&parser->scanner);
+    if (parser->current.type != TOKEN_ERROR) break;
 
-    errorAtCurrent(parser.current.start);
+    errorAtCurrent(parser, parser->current.start);
   }
 }
 
-static void consume(TokenType type, const char* message) {
-  if (parser.current.type == type) {
-    advance();
+static void consume(Parser* parser, TokenType type, const char* message) {
+  if (parser->current.type == type) {
+    advance(parser);
     return;
   }
 
-  errorAtCurrent(message);
+  errorAtCurrent(parser, message);
 }
 
-static bool check(TokenType type) {
+static bool check(Parser* parser, TokenType type) {
   // doesn't advance.
-  return parser.current.type == type;
+  return parser->current.type == type;
 }
 
-static bool match(TokenType type) {
-  if (!check(type)) return false;
-  advance();
+static bool match(Parser* parser, TokenType type) {
+  if (!check(parser, type)) return false;
+  advance(parser);
   return true;
 }
 
-static void emitByte(uint8_t byte) {
-  writeChunk(currentChunk(), byte, parser.previous.line);
+static void emitByte(Parser* parser, uint8_t byte) {
+  writeChunk(parser->vm, currentChunk(parser), byte, parser->previous.line);
 }
 
-static int emitJump(uint8_t instruction) {
-  emitByte(instruction);
-  emitByte(0xff);
-  emitByte(0xff);
-  return currentChunk()->count - 2;
+static int emitJump(Parser* parser, uint8_t instruction) {
+  emitByte(parser, instruction);
+  emitByte(parser, 0xff);
+  emitByte(parser, 0xff);
+  return currentChunk(parser)->count - 2;
 }
 
-static void emitBytes(uint8_t byte1, uint8_t byte2) {
-  emitByte(byte1);
-  emitByte(byte2);
+static void emitBytes(Parser* parser, uint8_t byte1, uint8_t byte2) {
+  emitByte(parser, byte1);
+  emitByte(parser, byte2);
 }
 
-static void emitLoop(int loopStart) {
-  emitByte(OP_LOOP);
+static void emitLoop(Parser* parser, int loopStart) {
+  emitByte(parser, OP_LOOP);
 
-  int offset = currentChunk()->count - loopStart + 2;
-  if (offset > UINT16_MAX) error("Loop body too large.");
+  int offset = currentChunk(parser)->count - loopStart + 2;
+  if (offset > UINT16_MAX) error(parser, "Loop body too large.");
 
-  emitByte((offset >> 8) & 0xff);
-  emitByte(offset & 0xff);
+  emitByte(parser, (offset >> 8) & 0xff);
+  emitByte(parser, offset & 0xff);
 }
 
-static void emitReturn() {
+static void emitReturn(Parser* parser) {
   // return this if compiling initializer
-  if (current->type == TYPE_INITIALIZER) {
-    emitBytes(OP_GET_LOCAL, 0);
+  if (parser->compiler->type == TYPE_INITIALIZER) {
+    emitBytes(parser, OP_GET_LOCAL, 0);
   } else {
     // implicitly return nil.
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
-  emitByte(OP_RETURN);
+  emitByte(parser, OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
-  int constant = addConstant(currentChunk(), value);
+static uint8_t makeConstant(Parser* parser, Value value) {
+  int constant = addConstant(parser->vm, currentChunk(parser), value);
   if (constant > UINT8_MAX) {
-    error("Too many constants in one chunk.");
+    error(parser, "Too many constants in one chunk.");
     return 0;
   }
 
   return (uint8_t)constant;
 }
 
-static void emitConstant(Value value) {
-  emitBytes(OP_CONSTANT, makeConstant(value));
+static void emitConstant(Parser* parser, Value value) {
+  emitBytes(parser, OP_CONSTANT, makeConstant(parser, value));
+}
+
+// the expression just compiled leaves a number.
+static void markNumber(Parser* parser) {
+  parser->numberEnd = currentChunk(parser)->count;
+}
+
+// whether the expression just compiled is known to leave a number. anything
+// emitted after a marked one means another expression ended since.
+static bool leftNumber(Parser* parser) {
+  return parser->numberEnd == currentChunk(parser)->count;
+}
+
+static void saveTypes(Parser* parser, Types* types) {
+  types->count = parser->compiler->localCount;
+  for (int i = 0; i < types->count; i++) types->number[i] = parser->compiler->locals[i].isNumber;
+}
+
+// a closure can assign a captured local whenever it is called, so those are never known.
+static void restoreTypes(Parser* parser, const Types* types) {
+  for (int i = 0; i < types->count; i++) {
+    Local* local = &parser->compiler->locals[i];
+    local->isNumber = types->number[i] && !local->isCaptured;
+  }
+}
+
+// meet the path that ended in types.
+static void mergeTypes(Parser* parser, const Types* types) {
+  for (int i = 0; i < types->count; i++) {
+    if (!types->number[i]) parser->compiler->locals[i].isNumber = false;
+  }
+}
+
+static void saveCheckpoint(Parser* parser, Checkpoint* checkpoint) {
+  checkpoint->scanner = parser->scanner;
+  checkpoint->current = parser->current;
+  checkpoint->previous = parser->previous;
+  checkpoint->count = currentChunk(parser)->count;
+  checkpoint->constantCount = currentChunk(parser)->constants.count;
+  checkpoint->handlerCount = currentChunk(parser)->handlerCount;
+  checkpoint->lastCall = parser->compiler->lastCall;
+}
+
+// drop what was compiled since the checkpoint. functions compiled in between are left to the gc.
+static void restoreCheckpoint(Parser* parser, const Checkpoint* checkpoint) {
+  parser->scanner = checkpoint->scanner;
+  parser->current = checkpoint->current;
+  parser->previous = checkpoint->previous;
+  currentChunk(parser)->count = checkpoint->count;
+  currentChunk(parser)->constants.count = checkpoint->constantCount;
+  currentChunk(parser)->handlerCount = checkpoint->handlerCount;
+  parser->compiler->lastCall = checkpoint->lastCall;
+  parser->numberEnd = -1;
+}
+
+static void beginLoop(Parser* parser, Loop* loop) {
+  saveCheckpoint(parser, &loop->start);
+  saveTypes(parser, &loop->entry);
+  loop->next = loop->entry;
+  loop->redo = false;
+  loop->passes = 0;
+}
+
+// a jump back to where types were assumed must not bring a local that isn't a number.
+static void checkBackEdge(Parser* parser, Loop* loop, Types* assumed) {
+  for (int i = 0; i < assumed->count; i++) {
+    if (assumed->number[i] && !parser->compiler->locals[i].isNumber) {
+      assumed->number[i] = false;
+      loop->redo = true;
+    }
+  }
+}
+
+// false if the loop has to be compiled again, from where the compiler has been wound back to.
+static bool endLoop(Parser* parser, Loop* loop) {
+  // code with errors never runs, so it isn't worth compiling again.
+  if (!loop->redo || parser->hadError) {
+    restoreTypes(parser, &loop->exit);
+    return true;
+  }
+  restoreCheckpoint(parser, &loop->start);
+  loop->redo = false;
+  if (++loop->passes == MAX_LOOP_PASSES) {
+    memset(loop->entry.number, 0, sizeof(loop->entry.number));
+    memset(loop->next.number, 0, sizeof(loop->next.number));
+  }
+  restoreTypes(parser, &loop->entry);
+  return false;
 }
 
-static void patchJump(int offset) {
-  int jump = currentChunk()->count - offset - 2;
+static void patchJump(Parser* parser, int offset) {
+  int jump = currentChunk(parser)->count - offset - 2;
   
   if (jump > UINT16_MAX) {
-    error("Too much code to jump over.");
+    error(parser, "Too much code to jump over.");
   }
 
-  currentChunk()->code[offset] = (jump >> 8) & 0xff;
-  currentChunk()->code[offset + 1] = jump & 0xff;
+  currentChunk(parser)->code[offset] = (jump >> 8) & 0xff;
+  currentChunk(parser)->code[offset + 1] = jump & 0xff;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+static void initCompiler(Parser* parser, Compiler* compiler, FunctionType type) {
   // set current compiler to be enclosing compiler of the new compiler being initialized.
-  compiler->enclosing = current;
+  compiler->enclosing = parser->compiler;
   compiler->function = NULL;
   compiler->type = type;
   compiler->localCount = 0;
   compiler->scopeDepth = 0;
+  compiler->lastCall = -1;
+  compiler->tryDepth = 0;
+  compiler->captured = NULL;
+  compiler->capturedCount = 0;
   // create top-level function object to compile to.
-  compiler->function = newFunction();
-  current = compiler;
+  compiler->function = newFunction(parser->vm);
+  parser->compiler = compiler;
+  // name the new function, not the enclosing one.
+  if (type != TYPE_SCRIPT) {
+    parser->compiler->function->name = copyString(parser->vm, parser->previous.start, parser->previous.length);
+  }
 
   // compiler implicity claims stack slot zero for internal use.
-  Local* local = &current->locals[current->localCount++];
+  Local* local = &parser->compiler->locals[parser->compiler->localCount++];
   local->depth = 0;
   local->isCaptured = false;
+  local->isNumber = false;
   if (type != TYPE_FUNCTION) {
     local->name.start = "this";
     local->name.length = 4;
@@ -227,63 +367,76 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
   }
 }
 
-static ObjFunction* endCompiler() {
-  emitReturn();
-  ObjFunction* function = current->function;
+static ObjFunction* endCompiler(Parser* parser) {
+  emitReturn(parser);
+  ObjFunction* function = parser->compiler->function;
+  if (!parser->hadError) {
+    #ifdef DEBUG_PRINT_OPTIMIZE
+      printf("before optimizing:\n");
+      disassembleChunk(currentChunk(parser), function->name != NULL ? function->name->chars : "<script>");
+    #endif
+    optimizeChunk(parser->vm, currentChunk(parser));
+    #ifdef DEBUG_PRINT_OPTIMIZE
+      printf("after optimizing:\n");
+      disassembleChunk(currentChunk(parser), function->name != NULL ? function->name->chars : "<script>");
+    #endif
+    // callframes reserve this much stack. push doesn't check.
+    function->maxSlots = chunkStackSlots(currentChunk(parser), function->arity);
+  }
   #ifdef DEBUG_PRINT_CODE
-    if (!parser.hadError) {
-      disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
+    if (!parser->hadError) {
+      disassembleChunk(currentChunk(parser), function->name != NULL ? function->name->chars : "<script>");
     }
   #endif
 
   // restores enclosing compiler to be the current compiler
-  current = current->enclosing;
+  parser->compiler = parser->compiler->enclosing;
 
   return function;
 }
 
-static void beginScope() {
-  current->scopeDepth++;
+static void beginScope(Parser* parser) {
+  parser->compiler->scopeDepth++;
 }
 
-static void endScope() {
-  current->scopeDepth--;
+static void endScope(Parser* parser) {
+  parser->compiler->scopeDepth--;
 
-  while (current->localCount > 0 && 
-    current->locals[current->localCount - 1].depth > current->scopeDepth) {
-      if (current->locals[current->localCount - 1].isCaptured) {
-        emitByte(OP_CLOSE_UPVALUE);
+  while (parser->compiler->localCount > 0 && 
+    parser->compiler->locals[parser->compiler->localCount - 1].depth > parser->compiler->scopeDepth) {
+      if (parser->compiler->locals[parser->compiler->localCount - 1].isCaptured) {
+        emitByte(parser, OP_CLOSE_UPVALUE);
       } else {
-        emitByte(OP_POP);
+        emitByte(parser, OP_POP);
       }
-      current->localCount--;
+      parser->compiler->localCount--;
     }
 }
 
-static void expression();
-static void statement();
-static void declaration();
+static void expression(Parser* parser);
+static void statement(Parser* parser);
+static void declaration(Parser* parser);
 static ParseRule* getRule(TokenType type);
-static void parsePrecedence(Precedence precedence);
+static void parsePrecedence(Parser* parser, Precedence precedence);
 
-static uint8_t identifierConstant(Token* name) {
+static uint8_t identifierConstant(Parser* parser, Token* name) {
   // add lexeme to chunk's constant table as a string. 
   // use index for define operand.
-  return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+  return makeConstant(parser, OBJ_VAL(copyString(parser->vm, name->start, name->length)));
 }
 
-static bool identifiersEqual(Token* a, Token* b) {
+static bool identifiersEqual(const Token* a, const Token* b) {
   if (a->length != b->length) return false;
   return memcmp(a->start, b->start, a->length) == 0;
 }
 
-static int resolveLocal(Compiler* compiler, Token* name) {
+static int resolveLocal(Parser* parser, Compiler* compiler, Token* name) {
   // loop through block scopes for the current function from innermost to outermost.
   for (int i = compiler->localCount - 1; i >= 0; i--) {
     Local* local = &compiler->locals[i];
     if (identifiersEqual(name, &local->name)) {
       if (local->depth == -1) {
-        error("Can't read local variable in its own initializer.");
+        error(parser, "Can't read local variable in its own initializer.");
       }
       return i;
     }
@@ -292,7 +445,7 @@ static int resolveLocal(Compiler* compiler, Token* name) {
   return -1;
 }
 
-static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+static int addUpvalue(Parser* parser, Compiler* compiler, uint8_t index, bool isLocal) {
   int upvalueCount = compiler->function->upvalueCount;
   
   // check if function has upvalue that closes over the variable.
@@ -305,7 +458,7 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
 
   // limit number of upvalue.
   if (upvalueCount == UINT8_COUNT) {
-    error("Too many closure variables in function.");
+    error(parser, "Too many closure variables in function.");
     return 0;
   }
 
@@ -315,419 +468,657 @@ static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
   return compiler->function->upvalueCount++;
 }
 
-static int resolveUpvalue(Compiler* compiler, Token* name) {
-  if (compiler->enclosing == NULL) return -1;
+static int resolveUpvalue(Parser* parser, Compiler* compiler, Token* name) {
+  if (compiler->enclosing == NULL) {
+    // a lazy body captures what its names resolved to when it was skipped.
+    for (int i = 0; i < compiler->capturedCount; i++) {
+      if (identifiersEqual(name, &compiler->captured[i])) return i;
+    }
+    return -1;
+  }
 
   // resolve the identifier as local variable in enclosing compiler.
-  int local = resolveLocal(compiler->enclosing, name);
+  int local = resolveLocal(parser, compiler->enclosing, name);
   if (local != -1) {
     // mark local as captured when create upvalue.
     compiler->enclosing->locals[local].isCaptured = true;
-    return addUpvalue(compiler, (uint8_t)local, true);
+    compiler->enclosing->locals[local].isNumber = false;
+    return addUpvalue(parser, compiler, (uint8_t)local, true);
   }
 
   // a function captures either a local or upvalue from immediately surrounding function.
-  int upvalue = resolveUpvalue(compiler->enclosing, name);
+  int upvalue = resolveUpvalue(parser, compiler->enclosing, name);
   if (upvalue != -1) {
-    return addUpvalue(compiler, (uint8_t) upvalue, false);
+    return addUpvalue(parser, compiler, (uint8_t) upvalue, false);
   }
 
   return -1;
 }
 
-static void addLocal(Token name) {
-  if (current->localCount == UINT8_COUNT) {
-    error("Too many local variablles in function.");
+static void addLocal(Parser* parser, Token name) {
+  if (parser->compiler->localCount == UINT8_COUNT) {
+    error(parser, "Too many local variablles in function.");
     return;
   }
 
-  Local* local = &current->locals[current->localCount++];
+  Local* local = &parser->compiler->locals[parser->compiler->localCount++];
   // lifetime of variable name string is okay.
   local->name = name;
   local->depth = -1;
   // initially, all locals are not captured.
   local->isCaptured = false;
+  local->isNumber = false;
 }
 
-static void declareVariable() {
+static void declareVariable(Parser* parser) {
   // records existence of the variable in local scope.
-  if (current->scopeDepth == 0) return;
+  if (parser->compiler->scopeDepth == 0) return;
 
-  Token* name = &parser.previous;
+  Token* name = &parser->previous;
   // check if variable with same name exists in local scope.
-  for (int i = current->localCount - 1; i >= 0; i--) {
-    Local* local = &current->locals[i];
-    if (local->depth != -1 && local->depth < current->scopeDepth) {
+  for (int i = parser->compiler->localCount - 1; i >= 0; i--) {
+    Local* local = &parser->compiler->locals[i];
+    if (local->depth != -1 && local->depth < parser->compiler->scopeDepth) {
       break;
     }
 
     if (identifiersEqual(name, &local->name)) {
-      error("Already a variable with this name in this scope.");
+      error(parser, "Already a variable with this name in this scope.");
     }
   }
 
-  addLocal(*name);
+  addLocal(parser, *name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
-  consume(TOKEN_IDENTIFIER, errorMessage);
+static uint8_t parseVariable(Parser* parser, const char* errorMessage) {
+  consume(parser, TOKEN_IDENTIFIER, errorMessage);
 
-  declareVariable();
+  declareVariable(parser);
   // no need to put variable name in constant table for local scope.
-  if (current->scopeDepth > 0) return 0;
+  if (parser->compiler->scopeDepth > 0) return 0;
 
-  return identifierConstant(&parser.previous);
+  return identifierConstant(parser, &parser->previous);
 }
 
-static void markInitialized() {
+static void markInitialized(Parser* parser) {
   // to handle top-level function.
-  if (current->scopeDepth == 0) return;
-  current->locals[current->localCount - 1].depth = current->scopeDepth;
+  if (parser->compiler->scopeDepth == 0) return;
+  parser->compiler->locals[parser->compiler->localCount - 1].depth = parser->compiler->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
-  if (current->scopeDepth > 0) {
-    markInitialized();
+static void defineVariable(Parser* parser, uint8_t global) {
+  if (parser->compiler->scopeDepth > 0) {
+    markInitialized(parser);
     return;
   }
 
-  emitBytes(OP_DEFINE_GLOBAL, global);
+  emitBytes(parser, OP_DEFINE_GLOBAL, global);
 }
 
-static uint8_t argumentList() {
+static uint8_t argumentList(Parser* parser) {
   uint8_t argCount = 0;
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
       // each argument expression leaves its value on the stack for function call.
-      expression();
+      expression(parser);
       if (argCount == 255) {
-        error("can't have more than 255 arguments.");
+        error(parser, "can't have more than 255 arguments.");
       }
       argCount++;
-    } while (match(TOKEN_COMMA));
+    } while (match(parser, TOKEN_COMMA));
   }
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after arguments.");
   return argCount;
 }
 
-static void and_(bool canAssign) {
-  int endJump = emitJump(OP_JUMP_IF_FALSE);
+static void and_(Parser* parser, bool canAssign) {
+  int endJump = emitJump(parser, OP_JUMP_IF_FALSE);
 
-  emitByte(OP_POP);
+  emitByte(parser, OP_POP);
 
-  parsePrecedence(PREC_AND);
+  // the right operand may not run.
+  Types left;
+  saveTypes(parser, &left);
+  parsePrecedence(parser, PREC_AND);
+  mergeTypes(parser, &left);
 
-  patchJump(endJump);
+  patchJump(parser, endJump);
+  parser->numberEnd = -1;
 }
 
-static void or_(bool canAssign) {
-  int elseJump = emitJump(OP_JUMP_IF_FALSE);
-  int endJump = emitJump(OP_JUMP);
+static void or_(Parser* parser, bool canAssign) {
+  int elseJump = emitJump(parser, OP_JUMP_IF_FALSE);
+  int endJump = emitJump(parser, OP_JUMP);
 
-  patchJump(elseJump);
-  emitByte(OP_POP);
+  patchJump(parser, elseJump);
+  emitByte(parser, OP_POP);
 
-  parsePrecedence(PREC_OR);
-  patchJump(endJump);
+  Types left;
+  saveTypes(parser, &left);
+  parsePrecedence(parser, PREC_OR);
+  mergeTypes(parser, &left);
+  patchJump(parser, endJump);
+  parser->numberEnd = -1;
 }
 
-static void binary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void binary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
+  bool numbers = leftNumber(parser);
   ParseRule* rule = getRule(operatorType);
-  parsePrecedence((Precedence)(rule->precedence + 1));
+  parsePrecedence(parser, (Precedence)(rule->precedence + 1));
+  // operands known to be numbers need no check.
+  numbers = numbers && leftNumber(parser);
   switch (operatorType) {
-    case TOKEN_BANG_EQUAL: emitBytes(OP_EQUAL, OP_NOT); break;
-    case TOKEN_EQUAL_EQUAL: emitByte(OP_EQUAL); break;
-    case TOKEN_GREATER: emitByte(OP_GREATER); break;
-    case TOKEN_GREATER_EQUAL: emitBytes(OP_LESS, OP_NOT); break;
-    case TOKEN_LESS: emitByte(OP_LESS); break;
-    case TOKEN_LESS_EQUAL: emitBytes(OP_GREATER, OP_NOT); break;
-    case TOKEN_PLUS: emitByte(OP_ADD); break;
-    case TOKEN_MINUS: emitByte(OP_SUBTRACT); break;
-    case TOKEN_STAR: emitByte(OP_MULTIPLY); break;
-    case TOKEN_SLASH: emitByte(OP_DIVIDE); break;
+    case TOKEN_BANG_EQUAL: emitBytes(parser, OP_EQUAL, OP_NOT); break;
+    case TOKEN_EQUAL_EQUAL: emitByte(parser, OP_EQUAL); break;
+    case TOKEN_GREATER: emitByte(parser, numbers ? OP_GREATER_NUMBER : OP_GREATER); break;
+    case TOKEN_GREATER_EQUAL: emitBytes(parser, numbers ? OP_LESS_NUMBER : OP_LESS, OP_NOT); break;
+    case TOKEN_LESS: emitByte(parser, numbers ? OP_LESS_NUMBER : OP_LESS); break;
+    case TOKEN_LESS_EQUAL: emitBytes(parser, numbers ? OP_GREATER_NUMBER : OP_GREATER, OP_NOT); break;
+    case TOKEN_PLUS:
+      emitByte(parser, numbers ? OP_ADD_NUMBER : OP_ADD);
+      if (numbers) markNumber(parser);
+      break;
+    // the checked ones only get past their check with numbers, so they leave one too.
+    case TOKEN_MINUS:
+      emitByte(parser, numbers ? OP_SUBTRACT_NUMBER : OP_SUBTRACT);
+      markNumber(parser);
+      break;
+    case TOKEN_STAR:
+      emitByte(parser, numbers ? OP_MULTIPLY_NUMBER : OP_MULTIPLY);
+      markNumber(parser);
+      break;
+    case TOKEN_SLASH:
+      emitByte(parser, numbers ? OP_DIVIDE_NUMBER : OP_DIVIDE);
+      markNumber(parser);
+      break;
     default: return;
   }
 }
 
-static void call(bool canAssign) {
-  uint8_t argCount = argumentList();
-  emitBytes(OP_CALL, argCount);
+static void call(Parser* parser, bool canAssign) {
+  uint8_t argCount = argumentList(parser);
+  emitBytes(parser, OP_CALL, argCount);
+  parser->compiler->lastCall = currentChunk(parser)->count - 2;
 }
 
-static void dot(bool canAssign) {
-  consume(TOKEN_IDENTIFIER, "Expect property name after '.'.");
-  uint8_t name = identifierConstant(&parser.previous);
+static void dot(Parser* parser, bool canAssign) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect property name after '.'.");
+  uint8_t name = identifierConstant(parser, &parser->previous);
 
   // only compile equal when can assign is true.
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(OP_SET_PROPERTY, name);
-  } else if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    emitBytes(OP_INVOKE, name);
-    emitByte(argCount);
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    emitBytes(parser, OP_SET_PROPERTY, name);
+  } else if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    emitBytes(parser, OP_INVOKE, name);
+    emitByte(parser, argCount);
+    parser->compiler->lastCall = currentChunk(parser)->count - 3;
   } else {
-    emitBytes(OP_GET_PROPERTY, name);
+    emitBytes(parser, OP_GET_PROPERTY, name);
   }
 }
 
-static void literal(bool canAssign) {
-  switch (parser.previous.type) {
-    case TOKEN_FALSE: emitByte(OP_FALSE); break;
-    case TOKEN_NIL: emitByte(OP_NIL); break;
-    case TOKEN_TRUE: emitByte(OP_TRUE); break;
+static void literal(Parser* parser, bool canAssign) {
+  switch (parser->previous.type) {
+    case TOKEN_FALSE: emitByte(parser, OP_FALSE); break;
+    case TOKEN_NIL: emitByte(parser, OP_NIL); break;
+    case TOKEN_TRUE: emitByte(parser, OP_TRUE); break;
     default: return; // unreachable
   }
 }
 
-static void expression() {
-  parsePrecedence(PREC_ASSIGNMENT);
+static void expression(Parser* parser) {
+  parsePrecedence(parser, PREC_ASSIGNMENT);
 }
 
-static void block() {
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    declaration();
+static void block(Parser* parser) {
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    declaration(parser);
   }
 
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-static void function(FunctionType type) {
-  // create separate compiler for each function being compiled.
-  Compiler compiler;
-  if (type != TYPE_SCRIPT) {
-    current->function->name = copyString(parser.previous.start, parser.previous.length);
+static Token syntheticToken(const char* text) {
+  Token token;
+  token.start = text;
+  token.length = (int)strlen(text);
+  return token;
+}
+
+// capture name if it resolves to a variable of an enclosing function.
+static void captureName(Parser* parser, Token name, Token* names, int* nameCount) {
+  if (resolveLocal(parser, parser->compiler, &name) != -1) return;
+  int upvalue = resolveUpvalue(parser, parser->compiler, &name);
+  if (upvalue == *nameCount) names[(*nameCount)++] = name;
+}
+
+// skip to the end of a function body without compiling it. every name in it
+// that could refer to a variable of an enclosing function is captured, since
+// the enclosing compilers are gone by the time the body is compiled. names
+// the body ends up shadowing are captured too, which costs only a slot.
+static void skipBody(Parser* parser, Token start) {
+  Token names[UINT8_COUNT];
+  int nameCount = 0;
+  int depth = 1;
+  TokenType last = TOKEN_LEFT_BRACE;
+  while (depth > 0 && !check(parser, TOKEN_EOF)) {
+    advance(parser);
+    Token token = parser->previous;
+    switch (token.type) {
+      case TOKEN_LEFT_BRACE: depth++; break;
+      case TOKEN_RIGHT_BRACE: depth--; break;
+      case TOKEN_IDENTIFIER:
+        // property names never refer to variables.
+        if (last != TOKEN_DOT) captureName(parser, token, names, &nameCount);
+        break;
+      case TOKEN_SUPER:
+        // super also reads this.
+        captureName(parser, syntheticToken("super"), names, &nameCount);
+        // fall through.
+      case TOKEN_THIS:
+        captureName(parser, syntheticToken("this"), names, &nameCount);
+        break;
+      default:
+        break;
+    }
+    last = token.type;
   }
-  // this sets current compiler. all bytecode will be emitted to the chunk owned by the compiler.
-  initCompiler(&compiler, type);
-  beginScope();
+  if (depth > 0) {
+    errorAtCurrent(parser, "Expect '}' after block.");
+    return;
+  }
+
+  int length = (int)(parser->previous.start + parser->previous.length - start.start);
+  size_t size = sizeof(LazyBody) + sizeof(Token) * nameCount + length + 1;
+  LazyBody* body = (LazyBody*)reallocate(parser->vm, NULL, 0, size);
+  body->size = size;
+  body->line = start.line;
+  body->type = parser->compiler->type;
+  body->inClass = parser->currentClass != NULL;
+  body->hasSuperclass = body->inClass && parser->currentClass->hasSuperclass;
+  body->upvalueCount = nameCount;
+  body->upvalues = (Token*)(body + 1);
+  body->source = (char*)(body->upvalues + nameCount);
+  memcpy(body->source, start.start, length);
+  body->source[length] = '\0';
+  // names point into the copy, except this and super, which are literals.
+  for (int i = 0; i < nameCount; i++) {
+    body->upvalues[i] = names[i];
+    if (names[i].start >= start.start && names[i].start < start.start + length) {
+      body->upvalues[i].start = body->source + (names[i].start - start.start);
+    }
+  }
+  parser->compiler->function->lazy = body;
+}
+
+// parameter list and body of the function being compiled. a lazy body is skipped.
+static void functionBody(Parser* parser, bool lazy) {
+  beginScope(parser);
 
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after function name.");
+  Token start = parser->previous;
   
   // function parameters
-  if (!check(TOKEN_RIGHT_PAREN)) {
+  if (!check(parser, TOKEN_RIGHT_PAREN)) {
     do {
-      current->function->arity++;
-      if (current->function->arity > 255) {
-        errorAtCurrent("Can't have more than 255 parameters.");
+      parser->compiler->function->arity++;
+      if (parser->compiler->function->arity > 255) {
+        errorAtCurrent(parser, "Can't have more than 255 parameters.");
       }
       // parameter is simply a local variable. it has no initalizer.
-      uint8_t constant = parseVariable("Expect parameter name.");
-      defineVariable(constant);
-    } while (match(TOKEN_COMMA));
+      uint8_t constant = parseVariable(parser, "Expect parameter name.");
+      defineVariable(parser, constant);
+    } while (match(parser, TOKEN_COMMA));
   }
 
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before function body.");
-  block();
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before function body.");
+  if (!lazy) {
+    block(parser);
+    return;
+  }
+  skipBody(parser, start);
+}
+
+static void function(Parser* parser, FunctionType type) {
+  // create separate compiler for each function being compiled.
+  Compiler compiler;
+  // this sets current compiler. all bytecode will be emitted to the chunk owned by the compiler.
+  initCompiler(parser, &compiler, type);
+  functionBody(parser, parser->lazy);
 
-  ObjFunction* function = endCompiler();
+  ObjFunction* function = parser->compiler->function;
+  // a skipped body gets its code on the first call.
+  if (function->lazy != NULL) {
+    parser->compiler = parser->compiler->enclosing;
+  } else {
+    endCompiler(parser);
+  }
   // store function object as constant in surrounding function's constant table.
-  uint8_t constant = makeConstant(OBJ_VAL(function));
+  uint8_t constant = makeConstant(parser, OBJ_VAL(function));
   // emit instruction to tell vm to create closure object to wrap function object.
-  emitBytes(OP_CLOSURE, constant);
+  emitBytes(parser, OP_CLOSURE, constant);
 
   //emit upvalues
   // op_closure has variable-sized encoding.
   for (int i = 0; i < function->upvalueCount; i++) {
-    emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
-    emitByte(compiler.upvalues[i].index);
+    emitByte(parser, compiler.upvalues[i].isLocal ? 1 : 0);
+    emitByte(parser, compiler.upvalues[i].index);
   }
 }
 
-static void method() {
-  consume(TOKEN_IDENTIFIER, "Expect method name.");
-  uint8_t constant = identifierConstant(&parser.previous);
+static void method(Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect method name.");
+  uint8_t constant = identifierConstant(parser, &parser->previous);
 
   FunctionType type = TYPE_METHOD;
   // check if is initializer
-  if (parser.previous.length == 4 && memcmp(parser.previous.start, "init", 4) == 0) {
+  if (parser->previous.length == 4 && memcmp(parser->previous.start, "init", 4) == 0) {
     type = TYPE_INITIALIZER;
   }
-  function(type);
+  function(parser, type);
 
-  emitBytes(OP_METHOD, constant);
+  emitBytes(parser, OP_METHOD, constant);
 }
 
 
 
-static void namedVariable(Token name, bool canAssign) {
+static void namedVariable(Parser* parser, Token name, bool canAssign) {
   uint8_t getOp, setOp;
-  int arg = resolveLocal(current, &name);
+  int arg = resolveLocal(parser, parser->compiler, &name);
   if (arg != -1) {
     // found local in some block scope.
     getOp = OP_GET_LOCAL;
     setOp = OP_SET_LOCAL;
-  } else if ((arg = resolveUpvalue(current, &name)) != -1 ) {
+  } else if ((arg = resolveUpvalue(parser, parser->compiler, &name)) != -1 ) {
     // found local variable declared in surrounding functions.
     getOp = OP_GET_UPVALUE;
     setOp = OP_SET_UPVALUE;
   } else {
     // assume global variable.
-    arg = identifierConstant(&name);
+    arg = identifierConstant(parser, &name);
     getOp = OP_GET_GLOBAL;
     setOp = OP_SET_GLOBAL;
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    expression();
-    emitBytes(setOp, (uint8_t)arg);
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    bool number = leftNumber(parser);
+    emitBytes(parser, setOp, (uint8_t)arg);
+    if (setOp == OP_SET_LOCAL) {
+      Local* local = &parser->compiler->locals[arg];
+      local->isNumber = number && !local->isCaptured;
+    }
+    if (number) markNumber(parser);
   } else {
-    emitBytes(getOp, (uint8_t)arg);
+    emitBytes(parser, getOp, (uint8_t)arg);
+    if (getOp == OP_GET_LOCAL && parser->compiler->locals[arg].isNumber) markNumber(parser);
   }
 }
 
-static void funDeclaration() {
+static void funDeclaration(Parser* parser) {
   // function declaration creates and stores funciton as variable.
-  uint8_t global = parseVariable("Expect function name.");
-  markInitialized();
-  function(TYPE_FUNCTION);
-  defineVariable(global);
+  uint8_t global = parseVariable(parser, "Expect function name.");
+  markInitialized(parser);
+  function(parser, TYPE_FUNCTION);
+  defineVariable(parser, global);
 }
 
-static void expressionStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after expression.");
-  emitByte(OP_POP);
+static void expressionStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after expression.");
+  emitByte(parser, OP_POP);
 }
 
-static void varDeclaration() {
-  uint8_t global = parseVariable("Expect variable name.");
+static void varDeclaration(Parser* parser) {
+  uint8_t global = parseVariable(parser, "Expect variable name.");
 
   // variable initializer is excuted first.
   // this leavees value on the stack.
-  if (match(TOKEN_EQUAL)) {
-    expression();
+  bool number = false;
+  if (match(parser, TOKEN_EQUAL)) {
+    expression(parser);
+    number = leftNumber(parser);
   } else {
-    emitByte(OP_NIL);
+    emitByte(parser, OP_NIL);
   }
-  consume(TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after variable declaration.");
 
   // define instruction takes that value and stores it.
-  defineVariable(global);
+  defineVariable(parser, global);
+  if (parser->compiler->scopeDepth > 0) {
+    parser->compiler->locals[parser->compiler->localCount - 1].isNumber = number;
+  }
 }
 
-static void printStatement() {
-  expression();
-  consume(TOKEN_SEMICOLON, "Expect ';' after value.");
-  emitByte(OP_PRINT);
+static void printStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after value.");
+  emitByte(parser, OP_PRINT);
 }
 
-static void returnStatement() {
+static void returnStatement(Parser* parser) {
   // check if return from top-level script.
-  if (current->type == TYPE_SCRIPT) {
-    error("Can't return from top-level code.");
+  if (parser->compiler->type == TYPE_SCRIPT) {
+    error(parser, "Can't return from top-level code.");
   }
 
-  if (match(TOKEN_SEMICOLON)) {
+  if (match(parser, TOKEN_SEMICOLON)) {
     // return value not provided.
-    emitReturn();
+    emitReturn(parser);
   } else {
-    if (current->type == TYPE_INITIALIZER) {
-      error("Can't return a value from initizalizer");
+    if (parser->compiler->type == TYPE_INITIALIZER) {
+      error(parser, "Can't return a value from initizalizer");
+    }
+    expression(parser);
+    consume(parser, TOKEN_SEMICOLON, "Expect ';' after return value.");
+    // call is the last instruction of the return value, reuse the current frame.
+    // op_return is still emitted for callees that don't replace the frame (natives, classes)
+    // and for short-circuit jumps landing after the call.
+    // lastCall is -1 until a call is compiled, which a one-byte return value like nil would match.
+    Chunk* chunk = currentChunk(parser);
+    int last = parser->compiler->lastCall;
+    if (last >= 0 && last < chunk->count && last + instructionLength(chunk, last) == chunk->count && parser->compiler->tryDepth == 0) {
+      switch (chunk->code[last]) {
+        case OP_CALL: chunk->code[last] = OP_TAIL_CALL; break;
+        case OP_INVOKE: chunk->code[last] = OP_TAIL_INVOKE; break;
+        case OP_SUPER_INVOKE: chunk->code[last] = OP_TAIL_SUPER_INVOKE; break;
+      }
     }
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after return value.");
-    emitByte(OP_RETURN);
+    emitByte(parser, OP_RETURN);
   }
 }
 
-static void forStatement() {
+static void forStatement(Parser* parser) {
   // variable declared in a for statement should be scoped to the loop.
-  beginScope();
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
+  beginScope(parser);
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'for'.");
   // initializer
-  if (match(TOKEN_SEMICOLON)) {
+  if (match(parser, TOKEN_SEMICOLON)) {
     // no 
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
   } else {
-    expressionStatement();
-  }
-
-  // condition
-  int loopStart = currentChunk()->count;
-  int exitJump = -1;
-  if (!match(TOKEN_SEMICOLON)) {
-    expression();
-    consume(TOKEN_SEMICOLON, "Expect ';' after loop condition.");
-
-    exitJump = emitJump(OP_JUMP_IF_FALSE);
-    emitByte(OP_POP);
+    expressionStatement(parser);
   }
-  // increment
-  if (!match(TOKEN_RIGHT_PAREN)) {
-    // unconditional jump over increment clause's code.
-    int bodyJump = emitJump(OP_JUMP);
-    int incrementStart = currentChunk()->count;
-    expression();
-    emitByte(OP_POP);
-    consume(TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
 
-    // jump to top of for loop for next iteration
-    emitLoop(loopStart);
-    // update to jump to increment after body statement.
-    loopStart = incrementStart;
-    patchJump(bodyJump);
-  }
+  Loop loop;
+  beginLoop(parser, &loop);
+  do {
+    // condition
+    int loopStart = currentChunk(parser)->count;
+    int exitJump = -1;
+    if (!match(parser, TOKEN_SEMICOLON)) {
+      expression(parser);
+      consume(parser, TOKEN_SEMICOLON, "Expect ';' after loop condition.");
+
+      exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+      emitByte(parser, OP_POP);
+    }
+    saveTypes(parser, &loop.exit);
+    // increment
+    bool hasIncrement = !match(parser, TOKEN_RIGHT_PAREN);
+    if (hasIncrement) {
+      // unconditional jump over increment clause's code.
+      int bodyJump = emitJump(parser, OP_JUMP);
+      int incrementStart = currentChunk(parser)->count;
+      // the increment runs after the body, which hasn't been compiled yet.
+      restoreTypes(parser, &loop.next);
+      expression(parser);
+      emitByte(parser, OP_POP);
+      consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after for clauses.");
+
+      // jump to top of for loop for next iteration
+      emitLoop(parser, loopStart);
+      checkBackEdge(parser, &loop, &loop.entry);
+      restoreTypes(parser, &loop.exit);
+      // update to jump to increment after body statement.
+      loopStart = incrementStart;
+      patchJump(parser, bodyJump);
+    }
 
-  statement();
-  emitLoop(loopStart);
+    statement(parser);
+    emitLoop(parser, loopStart);
+    checkBackEdge(parser, &loop, hasIncrement ? &loop.next : &loop.entry);
 
-  if (exitJump != -1) {
-    patchJump(exitJump);
-    emitByte(OP_POP);
-  }
+    if (exitJump != -1) {
+      patchJump(parser, exitJump);
+      emitByte(parser, OP_POP);
+    }
+  } while (!endLoop(parser, &loop));
 
-  endScope();
+  endScope(parser);
 }
 
-static void ifStatement() {
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+static void ifStatement(Parser* parser) {
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'if'.");
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
 
-  int thenJump = emitJump(OP_JUMP_IF_FALSE);
+  int thenJump = emitJump(parser, OP_JUMP_IF_FALSE);
   // to clean up condition value left on the stack.
-  emitByte(OP_POP);
+  emitByte(parser, OP_POP);
+  Types condition;
+  saveTypes(parser, &condition);
   // backpatching to know how far to jump.
-  statement();
+  statement(parser);
+  Types then;
+  saveTypes(parser, &then);
 
   // jump over else branch after running the then branch.
-  int elseJump = emitJump(OP_JUMP);
-
-  patchJump(thenJump);
-  emitByte(OP_POP);
-
-  if (match(TOKEN_ELSE)) statement();
-
-  patchJump(elseJump);
-}
-
-static void whileStatement() {
-  int loopStart = currentChunk()->count;
-  consume(TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
-
-  int exitJump = emitJump(OP_JUMP_IF_FALSE);
-  emitByte(OP_POP);
-  statement();
-
-  emitLoop(loopStart);
-  
-
-  patchJump(exitJump);
-  emitByte(OP_POP);
+  int elseJump = emitJump(parser, OP_JUMP);
+
+  patchJump(parser, thenJump);
+  emitByte(parser, OP_POP);
+
+  restoreTypes(parser, &condition);
+  if (match(parser, TOKEN_ELSE)) statement(parser);
+  mergeTypes(parser, &then);
+
+  patchJump(parser, elseJump);
+}
+
+static void whileStatement(Parser* parser) {
+  Loop loop;
+  beginLoop(parser, &loop);
+  do {
+    int loopStart = currentChunk(parser)->count;
+    consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'while'.");
+    expression(parser);
+    consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after condition.");
+
+    int exitJump = emitJump(parser, OP_JUMP_IF_FALSE);
+    emitByte(parser, OP_POP);
+    saveTypes(parser, &loop.exit);
+    statement(parser);
+
+    emitLoop(parser, loopStart);
+    checkBackEdge(parser, &loop, &loop.entry);
+
+    patchJump(parser, exitJump);
+    emitByte(parser, OP_POP);
+  } while (!endLoop(parser, &loop));
+}
+
+static void importDeclaration(Parser* parser) {
+  consume(parser, TOKEN_STRING, "Expect module name after 'import'.");
+  uint8_t name = makeConstant(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2)));
+  // import "name" as variable binds the module's namespace. as is a keyword only here.
+  bool bind = check(parser, TOKEN_IDENTIFIER) && parser->current.length == 2 &&
+      memcmp(parser->current.start, "as", 2) == 0;
+  uint8_t variable = 0;
+  if (bind) {
+    advance(parser);
+    variable = parseVariable(parser, "Expect variable name after 'as'.");
+  }
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after import.");
+  // the module runs in a namespace of its own, see module.h. the namespace is
+  // left under the nil the module's script returns.
+  emitBytes(parser, OP_IMPORT, name);
+  emitByte(parser, OP_POP);
+  if (bind) {
+    defineVariable(parser, variable);
+  } else {
+    emitByte(parser, OP_POP);
+  }
 }
 
-static void synchronize() {
-  parser.panicMode = false;
-
-  while (parser.current.type != TOKEN_EOF) {
-    if (parser.previous.type == TOKEN_SEMICOLON) return;
-    switch (parser.current.type) {
+static void throwStatement(Parser* parser) {
+  expression(parser);
+  consume(parser, TOKEN_SEMICOLON, "Expect ';' after thrown value.");
+  emitByte(parser, OP_THROW);
+}
+
+// the try block runs with no extra instructions. its range goes into the
+// chunk's exception table and the vm only looks there when something is thrown.
+static void tryStatement(Parser* parser) {
+  // the handler cuts the stack back to the locals in scope here.
+  int depth = parser->compiler->localCount;
+  Types before;
+  saveTypes(parser, &before);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' after 'try'.");
+  int start = currentChunk(parser)->count;
+  parser->compiler->tryDepth++;
+  beginScope(parser);
+  block(parser);
+  endScope(parser);
+  parser->compiler->tryDepth--;
+  int end = currentChunk(parser)->count;
+  int exitJump = emitJump(parser, OP_JUMP);
+  Types after;
+  saveTypes(parser, &after);
+  // the error can come from anywhere in the try block, after any of its assignments.
+  for (int i = 0; i < before.count; i++) before.number[i] = false;
+  restoreTypes(parser, &before);
+
+  // the handler lands here with the error on top of the stack, in the catch variable's slot.
+  int target = currentChunk(parser)->count;
+  consume(parser, TOKEN_CATCH, "Expect 'catch' after try block.");
+  consume(parser, TOKEN_LEFT_PAREN, "Expect '(' after 'catch'.");
+  consume(parser, TOKEN_IDENTIFIER, "Expect error variable name.");
+  beginScope(parser);
+  addLocal(parser, parser->previous);
+  markInitialized(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after error variable.");
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before catch block.");
+  block(parser);
+  endScope(parser);
+  mergeTypes(parser, &after);
+  patchJump(parser, exitJump);
+
+  Handler handler = {start, end, target, depth};
+  addHandler(parser->vm, currentChunk(parser), handler);
+}
+
+static void synchronize(Parser* parser) {
+  parser->panicMode = false;
+
+  while (parser->current.type != TOKEN_EOF) {
+    if (parser->previous.type == TOKEN_SEMICOLON) return;
+    switch (parser->current.type) {
       case TOKEN_CLASS:
       case TOKEN_FUN:
       case TOKEN_VAR:
@@ -736,179 +1127,186 @@ static void synchronize() {
       case TOKEN_WHILE:
       case TOKEN_PRINT:
       case TOKEN_RETURN:
+      case TOKEN_TRY:
+      case TOKEN_THROW:
+      case TOKEN_IMPORT:
         return;
       default:
         ;
     }
 
-    advance();
-  }
-}
-
-static void statement() {
-  if (match(TOKEN_PRINT)) {
-    printStatement();
-  } else if (match(TOKEN_FOR)) {
-    forStatement();
-  } else if (match(TOKEN_IF)) {
-    ifStatement();
-  } else if (match(TOKEN_RETURN)) {
-    returnStatement();
-  } else if (match(TOKEN_WHILE)) {
-    whileStatement();
-  } else if (match(TOKEN_LEFT_BRACE)) {
-    beginScope();
-    block();
-    endScope();
-  } else {
-    expressionStatement();
+    advance(parser);
   }
 }
 
-static void grouping(bool canAssign) {
-  expression();
-  consume(TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
+static void statement(Parser* parser) {
+  if (match(parser, TOKEN_PRINT)) {
+    printStatement(parser);
+  } else if (match(parser, TOKEN_FOR)) {
+    forStatement(parser);
+  } else if (match(parser, TOKEN_IF)) {
+    ifStatement(parser);
+  } else if (match(parser, TOKEN_RETURN)) {
+    returnStatement(parser);
+  } else if (match(parser, TOKEN_WHILE)) {
+    whileStatement(parser);
+  } else if (match(parser, TOKEN_TRY)) {
+    tryStatement(parser);
+  } else if (match(parser, TOKEN_THROW)) {
+    throwStatement(parser);
+  } else if (match(parser, TOKEN_LEFT_BRACE)) {
+    beginScope(parser);
+    block(parser);
+    endScope(parser);
+  } else {
+    expressionStatement(parser);
+  }
 }
 
-static void number(bool canAssign) {
-  double value = strtod(parser.previous.start, NULL);
-  emitConstant(NUMBER_VAL(value));
+static void grouping(Parser* parser, bool canAssign) {
+  expression(parser);
+  consume(parser, TOKEN_RIGHT_PAREN, "Expect ')' after expression.");
 }
 
-static void string(bool canAssign) {
-  emitConstant(OBJ_VAL(copyString(parser.previous.start + 1, parser.previous.length - 2)));
+static void number(Parser* parser, bool canAssign) {
+  double value = strtod(parser->previous.start, NULL);
+  emitConstant(parser, exactNumber(value));
+  markNumber(parser);
 }
 
-static void variable(bool canAssign) {
-  namedVariable(parser.previous, canAssign);
+static void string(Parser* parser, bool canAssign) {
+  emitConstant(parser, OBJ_VAL(copyString(parser->vm, parser->previous.start + 1, parser->previous.length - 2)));
 }
 
-static Token syntheticToken(const char* text) {
-  Token token;
-  token.start = text;
-  token.length = (int)strlen(text);
-  return token;
+static void variable(Parser* parser, bool canAssign) {
+  namedVariable(parser, parser->previous, canAssign);
 }
 
 
 
-static void classDeclaration() {
-  consume(TOKEN_IDENTIFIER, "Expect class name.");
-  Token className = parser.previous;
+static void classDeclaration(Parser* parser) {
+  consume(parser, TOKEN_IDENTIFIER, "Expect class name.");
+  Token className = parser->previous;
   // add class name to constant table.
-  uint8_t nameConstant = identifierConstant(&parser.previous);
+  uint8_t nameConstant = identifierConstant(parser, &parser->previous);
   // bind class object to a variable.
-  declareVariable();
+  declareVariable(parser);
 
   // emit instruction to create class object at runtime.
-  emitBytes(OP_CLASS, nameConstant);
+  emitBytes(parser, OP_CLASS, nameConstant);
   // define variable before class body 
   // so it can be referred inside bodies of its own method
-  defineVariable(nameConstant);
+  defineVariable(parser, nameConstant);
 
   // update current class.
   ClassCompiler classCompiler;
-  classCompiler.enclosing = currentClass;
+  classCompiler.enclosing = parser->currentClass;
   classCompiler.hasSuperclass = false;
-  currentClass = &classCompiler;
+  parser->currentClass = &classCompiler;
 
   // check for inheritance.
-  if (match(TOKEN_LESS)) {
-    consume(TOKEN_IDENTIFIER, "Expect superclass name.");
+  if (match(parser, TOKEN_LESS)) {
+    consume(parser, TOKEN_IDENTIFIER, "Expect superclass name.");
     // push superclass and subclass value on stack.
-    variable(false);
+    variable(parser, false);
 
     // prevent inheriting from self.
-    if (identifiersEqual(&className, &parser.previous)) {
-      error("A class can't inherit from itself.");
+    if (identifiersEqual(&className, &parser->previous)) {
+      error(parser, "A class can't inherit from itself.");
     }
 
     // subclass has a local variable referencing to its superclass
-    beginScope();
-    addLocal(syntheticToken("super"));
-    defineVariable(0);
+    beginScope(parser);
+    addLocal(parser, syntheticToken("super"));
+    defineVariable(parser, 0);
 
-    namedVariable(className, false);
-    emitByte(OP_INHERIT);
+    namedVariable(parser, className, false);
+    emitByte(parser, OP_INHERIT);
     classCompiler.hasSuperclass = true;
   }
 
-  namedVariable(className, false);
-  consume(TOKEN_LEFT_BRACE, "Expect '{' before class body.");
+  namedVariable(parser, className, false);
+  consume(parser, TOKEN_LEFT_BRACE, "Expect '{' before class body.");
   // compile methods.
-  while (!check(TOKEN_RIGHT_BRACE) && !check(TOKEN_EOF)) {
-    method();
+  while (!check(parser, TOKEN_RIGHT_BRACE) && !check(parser, TOKEN_EOF)) {
+    method(parser);
   }
-  consume(TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
-  emitByte(OP_POP);
+  consume(parser, TOKEN_RIGHT_BRACE, "Expect '}' after class body.");
+  emitByte(parser, OP_POP);
 
   if (classCompiler.hasSuperclass) {
-    endScope();
+    endScope(parser);
   }
 
   // reset current class.
-  currentClass = currentClass->enclosing;
+  parser->currentClass = parser->currentClass->enclosing;
 }
 
-static void declaration() {
-  if (match(TOKEN_CLASS)) {
-    classDeclaration();
-  } else if (match(TOKEN_FUN)) {
+static void declaration(Parser* parser) {
+  if (match(parser, TOKEN_CLASS)) {
+    classDeclaration(parser);
+  } else if (match(parser, TOKEN_FUN)) {
     // handle function declaration
-    funDeclaration();
-  } else if (match(TOKEN_VAR)) {
-    varDeclaration();
+    funDeclaration(parser);
+  } else if (match(parser, TOKEN_VAR)) {
+    varDeclaration(parser);
+  } else if (match(parser, TOKEN_IMPORT)) {
+    importDeclaration(parser);
   } else {
-    statement();
+    statement(parser);
   }
 
   // synchronization
-  if (parser.panicMode) synchronize();
+  if (parser->panicMode) synchronize(parser);
 }
 
-static void super_(bool canAssign) {
+static void super_(Parser* parser, bool canAssign) {
   // check if in class with superclass.
-  if (currentClass == NULL) {
-    error("Can't user 'super' outside of a class.");
-  } else if (!currentClass->hasSuperclass) {
-    error("Can't use 'super' in a class with no superclass.");
+  if (parser->currentClass == NULL) {
+    error(parser, "Can't user 'super' outside of a class.");
+  } else if (!parser->currentClass->hasSuperclass) {
+    error(parser, "Can't use 'super' in a class with no superclass.");
   }
   // not a super call expression, it is super access expression.
-  consume(TOKEN_DOT, "Expect '.' after 'super'.");
-  consume(TOKEN_IDENTIFIER, "Expcet superclass method name.");
-  uint8_t name = identifierConstant(&parser.previous);
+  consume(parser, TOKEN_DOT, "Expect '.' after 'super'.");
+  consume(parser, TOKEN_IDENTIFIER, "Expcet superclass method name.");
+  uint8_t name = identifierConstant(parser, &parser->previous);
 
   // get superclass and the receiver and push on stack.
-  namedVariable(syntheticToken("this"), false);
+  namedVariable(parser, syntheticToken("this"), false);
   
   // fast supercall
-  if (match(TOKEN_LEFT_PAREN)) {
-    uint8_t argCount = argumentList();
-    namedVariable(syntheticToken("super"), false);
+  if (match(parser, TOKEN_LEFT_PAREN)) {
+    uint8_t argCount = argumentList(parser);
+    namedVariable(parser, syntheticToken("super"), false);
     // combine op_get_super ad op_callp[p]
-    emitBytes(OP_SUPER_INVOKE, name);
-    emitByte(argCount);
+    emitBytes(parser, OP_SUPER_INVOKE, name);
+    emitByte(parser, argCount);
+    parser->compiler->lastCall = currentChunk(parser)->count - 3;
   } else {
-    namedVariable(syntheticToken("super"), false);
-    emitBytes(OP_GET_SUPER, name);
+    namedVariable(parser, syntheticToken("super"), false);
+    emitBytes(parser, OP_GET_SUPER, name);
   }
 
 }
 
-static void this_(bool canAssign) {
-  variable(false);
+static void this_(Parser* parser, bool canAssign) {
+  variable(parser, false);
 }
 
-static void unary(bool canAssign) {
-  TokenType operatorType = parser.previous.type;
+static void unary(Parser* parser, bool canAssign) {
+  TokenType operatorType = parser->previous.type;
 
   // compile the operand.
-  parsePrecedence(PREC_UNARY);
+  parsePrecedence(parser, PREC_UNARY);
 
   // Emit the operator instruction.
   switch (operatorType) {
-    case TOKEN_BANG: emitByte(OP_NOT); break;
-    case TOKEN_MINUS: emitByte(OP_NEGATE); break;
+    case TOKEN_BANG: emitByte(parser, OP_NOT); break;
+    case TOKEN_MINUS:
+      emitByte(parser, leftNumber(parser) ? OP_NEGATE_NUMBER : OP_NEGATE);
+      markNumber(parser);
+      break;
     default: return;
   }
 }
@@ -952,6 +1350,10 @@ ParseRule rules[] = {
   [TOKEN_TRUE]          = {literal,     NULL,   PREC_NONE},
   [TOKEN_VAR]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_WHILE]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_TRY]           = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_CATCH]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_THROW]         = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_IMPORT]        = {NULL,     NULL,   PREC_NONE},
   [TOKEN_ERROR]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_EOF]           = {NULL,     NULL,   PREC_NONE},
 };
@@ -960,51 +1362,118 @@ static ParseRule* getRule(TokenType type) {
   return &rules[type];
 }
 
-static void parsePrecedence(Precedence precedence) {
-  advance();
-  ParseFn prefixRule = getRule(parser.previous.type)->prefix;
+static void parsePrecedence(Parser* parser, Precedence precedence) {
+  advance(parser);
+  ParseFn prefixRule = getRule(parser->previous.type)->prefix;
   if (prefixRule == NULL) {
-    error("Expect expression.");
+    error(parser, "Expect expression.");
+    return;
   }
 
   bool canAssign = precedence <= PREC_ASSIGNMENT;
-  prefixRule(canAssign);
+  prefixRule(parser, canAssign);
 
-  while (precedence <= getRule(parser.current.type)->precedence) {
-    advance();
-    ParseFn infixRule = getRule(parser.previous.type)->infix;
-    infixRule(canAssign);
+  while (precedence <= getRule(parser->current.type)->precedence) {
+    advance(parser);
+    ParseFn infixRule = getRule(parser->previous.type)->infix;
+    infixRule(parser, canAssign);
   }
 
-  if (canAssign && match(TOKEN_EQUAL)) {
-    error("Invalid assignment target.");
+  if (canAssign && match(parser, TOKEN_EQUAL)) {
+    error(parser, "Invalid assignment target.");
   }
 }
 
-ObjFunction* compile(const char* source) {
-  initScanner(source);
-  Compiler compiler;
-  initCompiler(&compiler, TYPE_SCRIPT);
-
+ObjFunction* compile(VM* vm, const char* source) {
+  Parser parser;
+  parser.vm = vm;
+  parser.compiler = NULL;
+  parser.currentClass = NULL;
   parser.hadError = false;
   parser.panicMode = false;
+  parser.lazy = vm->lazyFunctions;
+  parser.numberEnd = -1;
+  initScanner(&parser.scanner, source);
+
+  // functions being compiled are reachable by the gc through the vm.
+  struct Parser* enclosing = vm->parser;
+  vm->parser = &parser;
+
+  Compiler compiler;
+  initCompiler(&parser, &compiler, TYPE_SCRIPT);
 
-  advance();
+  advance(&parser);
   
-  while (!match(TOKEN_EOF)) {
-    declaration();
+  while (!match(&parser, TOKEN_EOF)) {
+    declaration(&parser);
   }
 
-  ObjFunction* function = endCompiler();
+  ObjFunction* function = endCompiler(&parser);
+  vm->parser = enclosing;
   return parser.hadError ? NULL : function;
 }
 
-void markCompilerRoots() {
+ObjFunction* compileBody(VM* vm, const LazyBody* body, const char* name) {
+  Parser parser;
+  parser.vm = vm;
+  parser.compiler = NULL;
+  parser.currentClass = NULL;
+  parser.hadError = false;
+  parser.panicMode = false;
+  parser.lazy = vm->lazyFunctions;
+  parser.numberEnd = -1;
+  initScanner(&parser.scanner, body->source);
+  parser.scanner.line = body->line;
+
+  struct Parser* enclosing = vm->parser;
+  vm->parser = &parser;
+  ClassCompiler classCompiler;
+  classCompiler.enclosing = NULL;
+  classCompiler.hasSuperclass = body->hasSuperclass;
+  if (body->inClass) parser.currentClass = &classCompiler;
+
+  parser.previous = syntheticToken(name);
+  Compiler compiler;
+  initCompiler(&parser, &compiler, (FunctionType)body->type);
+  compiler.captured = body->upvalues;
+  compiler.capturedCount = body->upvalueCount;
+
+  advance(&parser);
+  functionBody(&parser, false);
+  consume(&parser, TOKEN_EOF, "Expect end of function body.");
+  ObjFunction* compiled = endCompiler(&parser);
+  vm->parser = enclosing;
+  return parser.hadError ? NULL : compiled;
+}
+
+void adoptBody(VM* vm, ObjFunction* function, ObjFunction* compiled) {
+  freeChunk(vm, &function->chunk);
+  function->chunk = compiled->chunk;
+  function->maxSlots = compiled->maxSlots;
+  initChunk(&compiled->chunk);
+  freeLazyBody(vm, function->lazy);
+  function->lazy = NULL;
+}
+
+bool compileLazyBody(VM* vm, ObjFunction* function) {
+  // the function's name is already interned, so naming the scratch function allocates nothing new.
+  ObjFunction* compiled = compileBody(vm, function->lazy, function->name->chars);
+  if (compiled == NULL) return false;
+  adoptBody(vm, function, compiled);
+  return true;
+}
+
+void freeLazyBody(VM* vm, LazyBody* body) {
+  reallocate(vm, body, body->size, 0);
+}
+
+void markCompilerRoots(VM* vm) {
+  if (vm->parser == NULL) return;
   // iterate over function declarations.
-  Compiler* compiler = current;
+  Compiler* compiler = vm->parser->compiler;
   while (compiler != NULL) {
     // compiler only uses function object.
-    markObject((Obj*)compiler->function);
+    markObject(vm, (Obj*)compiler->function);
     compiler = compiler->enclosing;
   }
 }
\ No newline at end of file
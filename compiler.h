@@ -2,9 +2,32 @@
 #define clox_compiler_h
 
 #include "object.h"
+#include "scanner.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
-void markCompilerRoots();
+// a function body whose compilation waits for the function's first call.
+// one allocation holds the struct, the upvalue names and a copy of the source.
+typedef struct LazyBody {
+  size_t size;
+  int line; // line the source starts on.
+  int type; // FunctionType of the function.
+  bool inClass;
+  bool hasSuperclass;
+  int upvalueCount;
+  Token* upvalues; // names the body captures, in upvalue order.
+  char* source; // parameter list and body.
+} LazyBody;
 
-#endif
\ No newline at end of file
+ObjFunction* compile(VM* vm, const char* source);
+// compile the body of a function that compile() skipped under vm->lazyFunctions.
+// false after reporting a compile error. the function stays lazy then.
+bool compileLazyBody(VM* vm, ObjFunction* function);
+// compile a skipped body into a scratch function named name, possibly in another
+// vm. it carries only the code. NULL after reporting a compile error.
+ObjFunction* compileBody(VM* vm, const LazyBody* body, const char* name);
+// move the code of a scratch function into the function whose body was skipped.
+void adoptBody(VM* vm, ObjFunction* function, ObjFunction* compiled);
+void freeLazyBody(VM* vm, LazyBody* body);
+void markCompilerRoots(VM* vm);
+
+#endif
@@ -37,16 +37,43 @@ static int byteInstruction(const char* name, Chunk* chunk, int offset) {
 static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset) {
     uint16_t jump = (uint16_t)(chunk->code[offset + 1] << 8);
     jump |= chunk->code[offset + 2];
-    printf("%-16s %4d -> %4d\n", name, offset, offset + 3, sign * jump);
+    printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
     return offset + 3;
 }
 
+// operands are registers, printed as r<slot>.
+static int registerInstruction(const char* name, Chunk* chunk, int offset, int operands) {
+    printf("%-16s", name);
+    for (int i = 1; i <= operands; i++) printf(" r%d", chunk->code[offset + i]);
+    printf("\n");
+    return offset + operands + 1;
+}
+
+static int loadConstantInstruction(const char* name, Chunk* chunk, int offset) {
+    uint8_t constant = chunk->code[offset + 2];
+    printf("%-16s r%d %4d '", name, chunk->code[offset + 1], constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 3;
+}
+
+static int registerJumpInstruction(const char* name, Chunk* chunk, int offset) {
+    uint16_t jump = (uint16_t)(chunk->code[offset + 2] << 8);
+    jump |= chunk->code[offset + 3];
+    printf("%-16s r%d %4d -> %d\n", name, chunk->code[offset + 1], offset, offset + 4 + jump);
+    return offset + 4;
+}
+
 void disassembleChunk(Chunk* chunk, const char* name) {
     printf("== %s ==\n", name);
 
     for (int offset = 0; offset < chunk->count;) {
         offset = disassembleInstruction(chunk, offset);
     }
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        printf("try %04d-%04d -> %04d depth %d\n", handler->start, handler->end, handler->target, handler->depth);
+    }
 }
 
 int disassembleInstruction(Chunk* chunk, int offset) {
@@ -118,10 +145,16 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+        case OP_TAIL_CALL:
+            return byteInstruction("OP_TAIL_CALL", chunk, offset);
         case OP_INVOKE:
             return invokeInstruction("OP_INVOKE", chunk, offset);
         case OP_SUPER_INVOKE:
             return invokeInstruction("OP_SUPER_INVOKE", chunk, offset);
+        case OP_TAIL_INVOKE:
+            return invokeInstruction("OP_TAIL_INVOKE", chunk, offset);
+        case OP_TAIL_SUPER_INVOKE:
+            return invokeInstruction("OP_TAIL_SUPER_INVOKE", chunk, offset);
         case OP_CLOSURE:
             offset++;
             uint8_t constant = chunk->code[offset++];
@@ -147,6 +180,76 @@ int disassembleInstruction(Chunk* chunk, int offset) {
             return simpleInstruction("OP_INHERIT", offset);
         case OP_METHOD:
             return constantInstruction("OP_METHOD", chunk, offset);
+        case OP_THROW:
+            return simpleInstruction("OP_THROW", offset);
+        case OP_IMPORT:
+            return constantInstruction("OP_IMPORT", chunk, offset);
+        case OP_GREATER_NUMBER:
+            return simpleInstruction("OP_GREATER_NUMBER", offset);
+        case OP_LESS_NUMBER:
+            return simpleInstruction("OP_LESS_NUMBER", offset);
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+        case OP_NEGATE_NUMBER:
+            return simpleInstruction("OP_NEGATE_NUMBER", offset);
+        case OP_RESERVE:
+            return byteInstruction("OP_RESERVE", chunk, offset);
+        case OP_GUARD_NUMBER:
+            return registerInstruction("OP_GUARD_NUMBER", chunk, offset, 1);
+        case OP_MOVE:
+            return registerInstruction("OP_MOVE", chunk, offset, 2);
+        case OP_LOAD_CONSTANT:
+            return loadConstantInstruction("OP_LOAD_CONSTANT", chunk, offset);
+        case OP_LOAD_NIL:
+            return registerInstruction("OP_LOAD_NIL", chunk, offset, 1);
+        case OP_LOAD_TRUE:
+            return registerInstruction("OP_LOAD_TRUE", chunk, offset, 1);
+        case OP_LOAD_FALSE:
+            return registerInstruction("OP_LOAD_FALSE", chunk, offset, 1);
+        case OP_PUSH_R:
+            return registerInstruction("OP_PUSH_R", chunk, offset, 1);
+        case OP_POP_R:
+            return registerInstruction("OP_POP_R", chunk, offset, 1);
+        case OP_EQUAL_R:
+            return registerInstruction("OP_EQUAL_R", chunk, offset, 3);
+        case OP_GREATER_R:
+            return registerInstruction("OP_GREATER_R", chunk, offset, 3);
+        case OP_LESS_R:
+            return registerInstruction("OP_LESS_R", chunk, offset, 3);
+        case OP_ADD_R:
+            return registerInstruction("OP_ADD_R", chunk, offset, 3);
+        case OP_SUBTRACT_R:
+            return registerInstruction("OP_SUBTRACT_R", chunk, offset, 3);
+        case OP_MULTIPLY_R:
+            return registerInstruction("OP_MULTIPLY_R", chunk, offset, 3);
+        case OP_DIVIDE_R:
+            return registerInstruction("OP_DIVIDE_R", chunk, offset, 3);
+        case OP_NOT_R:
+            return registerInstruction("OP_NOT_R", chunk, offset, 2);
+        case OP_NEGATE_R:
+            return registerInstruction("OP_NEGATE_R", chunk, offset, 2);
+        case OP_GREATER_NUMBER_R:
+            return registerInstruction("OP_GREATER_NUMBER_R", chunk, offset, 3);
+        case OP_LESS_NUMBER_R:
+            return registerInstruction("OP_LESS_NUMBER_R", chunk, offset, 3);
+        case OP_ADD_NUMBER_R:
+            return registerInstruction("OP_ADD_NUMBER_R", chunk, offset, 3);
+        case OP_SUBTRACT_NUMBER_R:
+            return registerInstruction("OP_SUBTRACT_NUMBER_R", chunk, offset, 3);
+        case OP_MULTIPLY_NUMBER_R:
+            return registerInstruction("OP_MULTIPLY_NUMBER_R", chunk, offset, 3);
+        case OP_DIVIDE_NUMBER_R:
+            return registerInstruction("OP_DIVIDE_NUMBER_R", chunk, offset, 3);
+        case OP_NEGATE_NUMBER_R:
+            return registerInstruction("OP_NEGATE_NUMBER_R", chunk, offset, 2);
+        case OP_JUMP_IF_FALSE_R:
+            return registerJumpInstruction("OP_JUMP_IF_FALSE_R", chunk, offset);
         default: 
             printf("Unkown opcode %d\n", instruction);
             return offset + 1;
@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "io.h"
+#include "memory.h"
+#include "vm.h"
+
+// epoll events handled per wait.
+#define EVENTS_MAX 64
+
+static int64_t now(void) {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return (int64_t)time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+void initEventLoop(EventLoop* loop) {
+    loop->epollFd = -1;
+    loop->ready = NULL;
+    loop->readyHead = 0;
+    loop->readyCount = 0;
+    loop->readyCapacity = 0;
+    loop->timers = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->readers = NULL;
+    loop->writers = NULL;
+    loop->fdCapacity = 0;
+    loop->waiting = 0;
+    loop->joiners = NULL;
+    loop->joinerCount = 0;
+    loop->joinerCapacity = 0;
+    loop->taskCount = 0;
+    loop->pipeClass = NULL;
+}
+
+void freeEventLoop(EventLoop* loop) {
+    if (loop->epollFd != -1) close(loop->epollFd);
+    free(loop->ready);
+    free(loop->timers);
+    free(loop->readers);
+    free(loop->writers);
+    free(loop->joiners);
+    initEventLoop(loop);
+}
+
+void resetEventLoop(EventLoop* loop) {
+    loop->readyHead = 0;
+    loop->readyCount = 0;
+    loop->timerCount = 0;
+    for (int fd = 0; fd < loop->fdCapacity; fd++) {
+        loop->readers[fd].fiber = NULL;
+        loop->readers[fd].data = NULL;
+        loop->writers[fd].fiber = NULL;
+        loop->writers[fd].data = NULL;
+    }
+    loop->waiting = 0;
+    loop->joinerCount = 0;
+    loop->taskCount = 0;
+}
+
+void markEventLoop(VM* vm) {
+    EventLoop* loop = &vm->loop;
+    for (int i = 0; i < loop->readyCount; i++) {
+        ReadyFiber* ready = &loop->ready[(loop->readyHead + i) % loop->readyCapacity];
+        markObject(vm, (Obj*)ready->fiber);
+        markValue(vm, ready->value);
+    }
+    for (int i = 0; i < loop->timerCount; i++) {
+        markObject(vm, (Obj*)loop->timers[i].fiber);
+    }
+    for (int fd = 0; fd < loop->fdCapacity; fd++) {
+        markObject(vm, (Obj*)loop->readers[fd].fiber);
+        markObject(vm, (Obj*)loop->writers[fd].fiber);
+        markObject(vm, (Obj*)loop->writers[fd].data);
+    }
+    for (int i = 0; i < loop->joinerCount; i++) {
+        markObject(vm, (Obj*)loop->joiners[i].fiber);
+        markObject(vm, (Obj*)loop->joiners[i].task);
+    }
+    markObject(vm, (Obj*)loop->pipeClass);
+}
+
+static void makeReady(EventLoop* loop, ObjFiber* fiber, Value value) {
+    if (loop->readyCount == loop->readyCapacity) {
+        // unroll the ring into a bigger buffer.
+        int capacity = GROW_CAPACITY(loop->readyCapacity);
+        ReadyFiber* ready = (ReadyFiber*)malloc(sizeof(ReadyFiber) * capacity);
+        if (ready == NULL) exit(1);
+        for (int i = 0; i < loop->readyCount; i++) {
+            ready[i] = loop->ready[(loop->readyHead + i) % loop->readyCapacity];
+        }
+        free(loop->ready);
+        loop->ready = ready;
+        loop->readyHead = 0;
+        loop->readyCapacity = capacity;
+    }
+    ReadyFiber* slot = &loop->ready[(loop->readyHead + loop->readyCount) % loop->readyCapacity];
+    slot->fiber = fiber;
+    slot->value = value;
+    loop->readyCount++;
+}
+
+static void pushTimer(EventLoop* loop, ObjFiber* fiber, int64_t deadline) {
+    if (loop->timerCount == loop->timerCapacity) {
+        loop->timerCapacity = GROW_CAPACITY(loop->timerCapacity);
+        loop->timers = (Timer*)realloc(loop->timers, sizeof(Timer) * loop->timerCapacity);
+        if (loop->timers == NULL) exit(1);
+    }
+    // sift up.
+    int i = loop->timerCount++;
+    while (i > 0 && loop->timers[(i - 1) / 2].deadline > deadline) {
+        loop->timers[i] = loop->timers[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    loop->timers[i].fiber = fiber;
+    loop->timers[i].deadline = deadline;
+}
+
+static ObjFiber* popTimer(EventLoop* loop) {
+    ObjFiber* fiber = loop->timers[0].fiber;
+    Timer last = loop->timers[--loop->timerCount];
+    // sift the last timer down from the root.
+    int i = 0;
+    for (;;) {
+        int child = i * 2 + 1;
+        if (child >= loop->timerCount) break;
+        if (child + 1 < loop->timerCount &&
+                loop->timers[child + 1].deadline < loop->timers[child].deadline) child++;
+        if (last.deadline <= loop->timers[child].deadline) break;
+        loop->timers[i] = loop->timers[child];
+        i = child;
+    }
+    if (loop->timerCount > 0) loop->timers[i] = last;
+    return fiber;
+}
+
+static void ensureFd(EventLoop* loop, int fd) {
+    if (fd < loop->fdCapacity) return;
+    int capacity = loop->fdCapacity;
+    while (capacity <= fd) capacity = GROW_CAPACITY(capacity);
+    loop->readers = (Waiter*)realloc(loop->readers, sizeof(Waiter) * capacity);
+    loop->writers = (Waiter*)realloc(loop->writers, sizeof(Waiter) * capacity);
+    if (loop->readers == NULL || loop->writers == NULL) exit(1);
+    memset(loop->readers + loop->fdCapacity, 0, sizeof(Waiter) * (capacity - loop->fdCapacity));
+    memset(loop->writers + loop->fdCapacity, 0, sizeof(Waiter) * (capacity - loop->fdCapacity));
+    loop->fdCapacity = capacity;
+}
+
+// register fd with epoll. edge-triggered, so operations are always tried before a fiber parks.
+static bool watch(EventLoop* loop, int fd) {
+    if (loop->epollFd == -1) {
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epollFd == -1) return false;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.fd = fd;
+    return epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) == 0 || errno == EEXIST;
+}
+
+// try the operation without blocking. returns false if it would block.
+static bool attempt(VM* vm, int fd, Waiter* op, Value* result) {
+    switch (op->kind) {
+        case WAIT_READ: {
+            char* buffer = (char*)malloc(op->size);
+            if (buffer == NULL) exit(1);
+            ssize_t length = read(fd, buffer, op->size);
+            if (length < 0) {
+                free(buffer);
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                *result = NIL_VAL;
+                return true;
+            }
+            // end of file reads as the empty string.
+            *result = OBJ_VAL(copyString(vm, buffer, (int)length));
+            free(buffer);
+            return true;
+        }
+        case WAIT_WRITE: {
+            ObjString* data = op->data;
+            while (op->offset < data->length) {
+                ssize_t length = write(fd, data->chars + op->offset, data->length - op->offset);
+                if (length < 0) {
+                    if (errno == EINTR) continue;
+                    if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                    *result = NIL_VAL;
+                    return true;
+                }
+                op->offset += (int)length;
+            }
+            *result = NUMBER_VAL(data->length);
+            return true;
+        }
+        case WAIT_ACCEPT: {
+            int connection = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (connection < 0) {
+                if (errno == EAGAIN || errno == EWOULDBLOCK) return false;
+                *result = NIL_VAL;
+                return true;
+            }
+            *result = NUMBER_VAL(connection);
+            return true;
+        }
+        case WAIT_CONNECT: {
+            // only retried once the socket is writable. the connect itself already ran.
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) error = errno;
+            if (error == EINPROGRESS) return false;
+            if (error != 0) {
+                close(fd);
+                *result = NIL_VAL;
+                return true;
+            }
+            *result = NUMBER_VAL(fd);
+            return true;
+        }
+    }
+    return false; // unreachable.
+}
+
+static void retry(VM* vm, int fd, Waiter* waiter) {
+    if (waiter->fiber == NULL) return;
+    // the waiter keeps its fiber and data alive while the result is built.
+    Value result;
+    if (!attempt(vm, fd, waiter, &result)) return;
+
+    ObjFiber* fiber = waiter->fiber;
+    waiter->fiber = NULL;
+    waiter->data = NULL;
+    vm->loop.waiting--;
+    makeReady(&vm->loop, fiber, result);
+}
+
+// move fibers whose fds or timers are ready onto the ready queue.
+static void pollEvents(VM* vm, bool block) {
+    EventLoop* loop = &vm->loop;
+    int timeout = block ? -1 : 0;
+    if (block && loop->timerCount > 0) {
+        int64_t wait = loop->timers[0].deadline - now();
+        if (wait <= 0) {
+            timeout = 0;
+        } else {
+            // round up so the timer has expired when epoll returns.
+            int64_t milliseconds = (wait + 999999) / 1000000;
+            timeout = milliseconds > INT_MAX ? INT_MAX : (int)milliseconds;
+        }
+    }
+
+    if (loop->epollFd != -1) {
+        struct epoll_event events[EVENTS_MAX];
+        int count = epoll_wait(loop->epollFd, events, EVENTS_MAX, timeout);
+        // interrupted waits just run the timers.
+        for (int i = 0; i < count; i++) {
+            int fd = events[i].data.fd;
+            if (fd >= loop->fdCapacity) continue;
+            uint32_t flags = events[i].events;
+            if (flags & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) retry(vm, fd, &loop->readers[fd]);
+            if (flags & (EPOLLOUT | EPOLLHUP | EPOLLERR)) retry(vm, fd, &loop->writers[fd]);
+        }
+    } else if (timeout > 0) {
+        struct timespec time;
+        time.tv_sec = timeout / 1000;
+        time.tv_nsec = (long)(timeout % 1000) * 1000000;
+        nanosleep(&time, NULL);
+    }
+
+    int64_t time = now();
+    while (loop->timerCount > 0 && loop->timers[0].deadline <= time) {
+        makeReady(loop, popTimer(loop), NIL_VAL);
+    }
+}
+
+// switch to the next ready fiber. the running fiber must already be parked somewhere.
+static bool schedule(VM* vm) {
+    EventLoop* loop = &vm->loop;
+    while (loop->readyCount == 0) {
+        if (loop->waiting == 0 && loop->timerCount == 0) {
+            runtimeError(vm, "Deadlock. Every fiber is waiting.");
+            return false;
+        }
+        pollEvents(vm, true);
+    }
+
+    ReadyFiber next = loop->ready[loop->readyHead];
+    loop->readyHead = (loop->readyHead + 1) % loop->readyCapacity;
+    loop->readyCount--;
+    return transferFiber(vm, next.fiber, next.value);
+}
+
+// park the running fiber in the native call whose arguments start at args.
+static void park(VM* vm, Value* args) {
+    vm->stackTop = args;
+    vm->fiber->state = FIBER_WAITING;
+}
+
+// run op now if it can complete. otherwise park the running fiber on fd until it does.
+static bool perform(VM* vm, Value* args, int fd, Waiter op) {
+    Value result;
+    if (attempt(vm, fd, &op, &result)) {
+        args[-1] = result;
+        return true;
+    }
+
+    EventLoop* loop = &vm->loop;
+    ensureFd(loop, fd);
+    bool reading = op.kind == WAIT_READ || op.kind == WAIT_ACCEPT;
+    Waiter* waiter = reading ? &loop->readers[fd] : &loop->writers[fd];
+    if (waiter->fiber != NULL) {
+        runtimeError(vm, "Another fiber is already waiting on fd %d.", fd);
+        return false;
+    }
+    if (!watch(loop, fd)) {
+        runtimeError(vm, "Can't wait on fd %d: %s.", fd, strerror(errno));
+        return false;
+    }
+
+    op.fiber = vm->fiber;
+    *waiter = op;
+    loop->waiting++;
+    park(vm, args);
+    return schedule(vm);
+}
+
+bool finishTask(VM* vm, Value result) {
+    EventLoop* loop = &vm->loop;
+    ObjFiber* task = vm->fiber;
+    task->state = FIBER_DONE;
+    loop->taskCount--;
+
+    for (int i = 0; i < loop->joinerCount;) {
+        Joiner* joiner = &loop->joiners[i];
+        if (joiner->task == task) {
+            makeReady(loop, joiner->fiber, result);
+        } else if (joiner->task == NULL && loop->taskCount == 0) {
+            makeReady(loop, joiner->fiber, NIL_VAL);
+        } else {
+            i++;
+            continue;
+        }
+        *joiner = loop->joiners[--loop->joinerCount];
+    }
+    return schedule(vm);
+}
+
+bool yieldTask(VM* vm) {
+    vm->fiber->state = FIBER_WAITING;
+    makeReady(&vm->loop, vm->fiber, NIL_VAL);
+    // give fds and timers a chance so busy tasks can't starve them.
+    pollEvents(vm, false);
+    return schedule(vm);
+}
+
+static bool join(VM* vm, Value* args, ObjFiber* task) {
+    EventLoop* loop = &vm->loop;
+    if (loop->joinerCount == loop->joinerCapacity) {
+        loop->joinerCapacity = GROW_CAPACITY(loop->joinerCapacity);
+        loop->joiners = (Joiner*)realloc(loop->joiners, sizeof(Joiner) * loop->joinerCapacity);
+        if (loop->joiners == NULL) exit(1);
+    }
+    loop->joiners[loop->joinerCount].fiber = vm->fiber;
+    loop->joiners[loop->joinerCount].task = task;
+    loop->joinerCount++;
+    park(vm, args);
+    return schedule(vm);
+}
+
+// natives.
+
+static bool checkArity(VM* vm, int arity, int argCount) {
+    if (argCount == arity) return true;
+    runtimeError(vm, "Expected %d arguments but got %d.", arity, argCount);
+    return false;
+}
+
+static bool checkFd(VM* vm, Value value, int* fd) {
+    if (!IS_NUMBER(value) || AS_NUMBER(value) < 0 || AS_NUMBER(value) != (int)AS_NUMBER(value)) {
+        runtimeError(vm, "Expected a file descriptor.");
+        return false;
+    }
+    *fd = (int)AS_NUMBER(value);
+    return true;
+}
+
+static bool checkPath(VM* vm, Value value, struct sockaddr_un* address) {
+    if (!IS_STRING(value) || AS_STRING(value)->length >= (int)sizeof(address->sun_path)) {
+        runtimeError(vm, "Expected a socket path shorter than %d bytes.", (int)sizeof(address->sun_path));
+        return false;
+    }
+    memset(address, 0, sizeof(*address));
+    address->sun_family = AF_UNIX;
+    memcpy(address->sun_path, AS_CSTRING(value), AS_STRING(value)->length);
+    return true;
+}
+
+static void setField(VM* vm, ObjInstance* instance, const char* name, Value value) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    tableSet(vm, &instance->fields, AS_STRING(vm->stackTop[-1]), value);
+    pop(vm);
+}
+
+// spawn(fn) queues a task. it starts once the running fiber waits.
+static bool spawnNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 1, argCount)) return false;
+    if (!IS_CLOSURE(args[0]) || FROM_REF(ObjFunction, AS_CLOSURE(args[0])->function)->arity != 0) {
+        runtimeError(vm, "Task needs a function that takes no parameters.");
+        return false;
+    }
+    ObjFiber* task = newFiber(vm, AS_CLOSURE(args[0]));
+    task->isTask = true;
+    vm->loop.taskCount++;
+    makeReady(&vm->loop, task, NIL_VAL);
+    args[-1] = OBJ_VAL(task);
+    return true;
+}
+
+// await(task) waits for task to finish and returns what its function returned.
+static bool awaitNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 1, argCount)) return false;
+    if (!IS_FIBER(args[0]) || !AS_FIBER(args[0])->isTask) {
+        runtimeError(vm, "Can only await tasks.");
+        return false;
+    }
+    ObjFiber* task = AS_FIBER(args[0]);
+    if (task->state == FIBER_DONE) {
+        // finished tasks keep their result in slot zero.
+        args[-1] = task->stackTop > task->stack ? task->stack[0] : NIL_VAL;
+        return true;
+    }
+    if (task == vm->fiber) {
+        runtimeError(vm, "A task can't await itself.");
+        return false;
+    }
+    return join(vm, args, task);
+}
+
+// runTasks() waits until every spawned task has finished.
+static bool runTasksNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 0, argCount)) return false;
+    if (vm->fiber->isTask) {
+        runtimeError(vm, "A task can't wait for every task.");
+        return false;
+    }
+    args[-1] = NIL_VAL;
+    if (vm->loop.taskCount == 0) return true;
+    return join(vm, args, NULL);
+}
+
+// sleep(ms) parks the running fiber until the time has passed.
+static bool sleepNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 1, argCount)) return false;
+    if (!IS_NUMBER(args[0]) || AS_NUMBER(args[0]) < 0) {
+        runtimeError(vm, "Sleep time must be a non-negative number.");
+        return false;
+    }
+    pushTimer(&vm->loop, vm->fiber, now() + (int64_t)(AS_NUMBER(args[0]) * 1000000));
+    park(vm, args);
+    return schedule(vm);
+}
+
+// openFile(path, mode) with mode "r", "w" or "a". returns an fd or nil.
+static bool openFileNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 2, argCount)) return false;
+    if (!IS_STRING(args[0]) || !IS_STRING(args[1])) {
+        runtimeError(vm, "Expected a path and a mode.");
+        return false;
+    }
+
+    const char* mode = AS_CSTRING(args[1]);
+    int flags;
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        runtimeError(vm, "File mode must be \"r\", \"w\" or \"a\".");
+        return false;
+    }
+
+    int fd = open(AS_CSTRING(args[0]), flags | O_NONBLOCK | O_CLOEXEC, 0644);
+    args[-1] = fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+    return true;
+}
+
+// pipe() returns an instance with reader and writer fds.
+static bool pipeNative(VM* vm, int argCount, Value* args) {
+    if (!checkArity(vm, 0, argCount)) return false;
+    int fds[2];
+    if (pipe2(fds, O_NONBLOCK | O_CLOEXEC) < 0) {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+    ObjInstance* instance = newInstance(vm, vm->loop.pipeClass);
+    // the callee slot keeps the instance alive while its fields are set.
+    args[-1] = OBJ_VAL(instance);
+    setField(vm, instance, "reader", NUMBER_VAL(fds[0]));
+    setField(vm, instance, "writer", NUMBER_VAL(fds[1]));
+    return true;
+}
+
+// listen(path) binds a unix-domain socket. returns the listening fd or nil.
+static bool listenNative(VM* vm, int argCount, Value* args) {
+    struct sockaddr_un address;
+    if (!checkArity(vm, 1, argCount) || !checkPath(vm, args[0], &address)) return false;
+
+    args[-1] = NIL_VAL;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return true;
+    // a stale socket file from an earlier run would make bind fail.
+    unlink(address.sun_path);
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 || listen(fd, SOMAXCONN) < 0) {
+        close(fd);
+        return true;
+    }
+    args[-1] = NUMBER_VAL(fd);
+    return true;
+}
+
+// accept(fd) waits for a connection and returns its fd.
+static bool acceptNative(VM* vm, int argCount, Value* args) {
+    int fd;
+    if (!checkArity(vm, 1, argCount) || !checkFd(vm, args[0], &fd)) return false;
+    Waiter op = {NULL, WAIT_ACCEPT, 0, NULL, 0};
+    return perform(vm, args, fd, op);
+}
+
+// connect(path) connects to a unix-domain socket. returns the fd or nil.
+static bool connectNative(VM* vm, int argCount, Value* args) {
+    struct sockaddr_un address;
+    if (!checkArity(vm, 1, argCount) || !checkPath(vm, args[0], &address)) return false;
+
+    args[-1] = NIL_VAL;
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return true;
+    if (connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0) {
+        args[-1] = NUMBER_VAL(fd);
+        return true;
+    }
+    if (errno != EINPROGRESS) {
+        close(fd);
+        return true;
+    }
+    Waiter op = {NULL, WAIT_CONNECT, 0, NULL, 0};
+    return perform(vm, args, fd, op);
+}
+
+// read(fd, size) returns up to size bytes, "" at end of file or nil on error.
+static bool readNative(VM* vm, int argCount, Value* args) {
+    int fd;
+    if (!checkArity(vm, 2, argCount) || !checkFd(vm, args[0], &fd)) return false;
+    if (!IS_NUMBER(args[1]) || AS_NUMBER(args[1]) < 1) {
+        runtimeError(vm, "Read size must be a positive number.");
+        return false;
+    }
+    Waiter op = {NULL, WAIT_READ, (int)AS_NUMBER(args[1]), NULL, 0};
+    return perform(vm, args, fd, op);
+}
+
+// write(fd, string) writes all of string. returns its length or nil on error.
+static bool writeNative(VM* vm, int argCount, Value* args) {
+    int fd;
+    if (!checkArity(vm, 2, argCount) || !checkFd(vm, args[0], &fd)) return false;
+    if (!IS_STRING(args[1])) {
+        runtimeError(vm, "Can only write strings.");
+        return false;
+    }
+    Waiter op = {NULL, WAIT_WRITE, 0, AS_STRING(args[1]), 0};
+    return perform(vm, args, fd, op);
+}
+
+// close(fd) closes fd. fibers waiting on it get nil.
+static bool closeNative(VM* vm, int argCount, Value* args) {
+    int fd;
+    if (!checkArity(vm, 1, argCount) || !checkFd(vm, args[0], &fd)) return false;
+
+    EventLoop* loop = &vm->loop;
+    if (fd < loop->fdCapacity) {
+        Waiter* waiters[] = {&loop->readers[fd], &loop->writers[fd]};
+        for (int i = 0; i < 2; i++) {
+            if (waiters[i]->fiber == NULL) continue;
+            makeReady(loop, waiters[i]->fiber, NIL_VAL);
+            waiters[i]->fiber = NULL;
+            waiters[i]->data = NULL;
+            loop->waiting--;
+        }
+    }
+    if (loop->epollFd != -1) epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, fd, NULL);
+    close(fd);
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+void defineIoNatives(VM* vm) {
+    ObjString* name = copyString(vm, "Pipe", 4);
+    push(vm, OBJ_VAL(name));
+    vm->loop.pipeClass = newClass(vm, name);
+    pop(vm);
+
+    defineNative(vm, "spawn", spawnNative);
+    defineNative(vm, "await", awaitNative);
+    defineNative(vm, "runTasks", runTasksNative);
+    defineNative(vm, "sleep", sleepNative);
+    defineNative(vm, "openFile", openFileNative);
+    defineNative(vm, "pipe", pipeNative);
+    defineNative(vm, "listen", listenNative);
+    defineNative(vm, "accept", acceptNative);
+    defineNative(vm, "connect", connectNative);
+    defineNative(vm, "read", readNative);
+    defineNative(vm, "write", writeNative);
+    defineNative(vm, "close", closeNative);
+}
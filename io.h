@@ -0,0 +1,80 @@
+#ifndef clox_io_h
+#define clox_io_h
+
+#include <stdint.h>
+
+#include "common.h"
+#include "object.h"
+
+typedef enum {
+    WAIT_READ,
+    WAIT_WRITE,
+    WAIT_ACCEPT,
+    WAIT_CONNECT
+} WaitKind;
+
+// a fiber parked until its fd is ready. the loop retries the operation
+// itself and resumes the fiber with the outcome.
+typedef struct {
+    ObjFiber* fiber; // NULL when nobody waits.
+    WaitKind kind;
+    int size; // most bytes to read.
+    ObjString* data; // string being written.
+    int offset; // bytes of data already written.
+} Waiter;
+
+typedef struct {
+    ObjFiber* fiber;
+    int64_t deadline; // monotonic clock in nanoseconds.
+} Timer;
+
+typedef struct {
+    ObjFiber* fiber;
+    Value value; // result of the call the fiber is parked in.
+} ReadyFiber;
+
+typedef struct {
+    ObjFiber* fiber;
+    ObjFiber* task; // task being awaited. NULL waits for every task.
+} Joiner;
+
+// per-vm scheduler for tasks, the fibers started by spawn(). a fiber that
+// would block parks here and the loop switches to the next ready one,
+// waiting in epoll only when nothing is ready.
+typedef struct {
+    int epollFd; // -1 until the first fiber waits on an fd.
+
+    ReadyFiber* ready; // ring buffer of fibers to switch to.
+    int readyHead;
+    int readyCount;
+    int readyCapacity;
+
+    Timer* timers; // min-heap on deadline.
+    int timerCount;
+    int timerCapacity;
+
+    Waiter* readers; // indexed by fd.
+    Waiter* writers;
+    int fdCapacity;
+    int waiting; // fibers parked on fds.
+
+    Joiner* joiners;
+    int joinerCount;
+    int joinerCapacity;
+
+    int taskCount; // tasks that haven't finished.
+    ObjClass* pipeClass; // class of the instances pipe() returns.
+} EventLoop;
+
+void initEventLoop(EventLoop* loop);
+void freeEventLoop(EventLoop* loop);
+// forget every parked fiber and pending task. used after runtime errors.
+void resetEventLoop(EventLoop* loop);
+void markEventLoop(VM* vm);
+// called when a task's function returns. switches to the next fiber.
+bool finishTask(VM* vm, Value result);
+// requeue the running task behind the ready ones.
+bool yieldTask(VM* vm);
+void defineIoNatives(VM* vm);
+
+#endif
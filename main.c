@@ -1,14 +1,24 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <dirent.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include "common.h"
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 
+#include "pool.h"
+#include "serialize.h"
+#include "snapshot.h"
+#include "tier.h"
 #include "vm.h"
 
-static void repl() {
+static void repl(VM* vm) {
     char line[1024];
     for (;;) {
         printf("> ");
@@ -18,7 +28,7 @@ static void repl() {
             break;
         }
 
-        interpret(line);
+        interpret(vm, line);
     } 
 }
 
@@ -48,29 +58,313 @@ static char* readFile(const char* path) {
     return buffer;
 }
 
-static void runFile(const char* path) {
+// read a whole file without complaining. returns NULL if it can't be read.
+static uint8_t* readBinary(const char* path, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    uint8_t* buffer = fileSize < 0 ? NULL : (uint8_t*)malloc(fileSize + 1);
+    if (buffer != NULL && fread(buffer, 1, fileSize, file) < (size_t)fileSize) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    *length = (size_t)fileSize;
+    return buffer;
+}
+
+// the bytecode cache of script.lox is script.loxc, its image script.loxi and its snapshot script.loxs.
+static char* cachePath(const char* path, char suffix) {
+    char* cache = (char*)malloc(strlen(path) + 2);
+    if (cache == NULL) exit(1);
+    sprintf(cache, "%s%c", path, suffix);
+    return cache;
+}
+
+// malloc'ed directory part of path. "." if it has none.
+static char* directoryOf(const char* path) {
+    const char* slash = strrchr(path, '/');
+    if (slash == NULL) return strdup(".");
+    size_t length = slash == path ? 1 : (size_t)(slash - path);
+    char* dir = strndup(path, length);
+    if (dir == NULL) exit(1);
+    return dir;
+}
+
+static bool isImage(const char* path) {
+    size_t length = strlen(path);
+    return length >= 5 && strcmp(path + length - 5, ".loxi") == 0;
+}
+
+static void writeBinary(const char* path, const uint8_t* bytes, size_t length) {
+    FILE* file = fopen(path, "wb");
+    if (file == NULL || fwrite(bytes, 1, length, file) < length || fclose(file) != 0) {
+        fprintf(stderr, "Could not write \"%s\".\n", path);
+        exit(74);
+    }
+}
+
+// compile without running and write a bytecode cache, or an image if asked for one.
+static void compileFile(VM* vm, const char* path, bool image) {
+    char* source = readFile(path);
+    ObjFunction* function = compile(vm, source);
+    if (function == NULL) exit(65);
+
+    size_t length;
+    uint64_t sourceHash = hashBytes(source, strlen(source));
+    uint8_t* bytes = image ? writeImage(function, sourceHash, &length)
+                           : serializeFunction(function, sourceHash, &length);
+    if (bytes == NULL) exit(65);
+    char* cache = cachePath(path, image ? 'i' : 'c');
+    writeBinary(cache, bytes, length);
+
+    free(cache);
+    free(bytes);
+    free(source);
+}
+
+// compile every function body without running anything. errors in a script
+// run with --lazy only show up when the function is called, this finds them all.
+static void verifyFile(VM* vm, const char* path) {
+    char* source = readFile(path);
+    ObjFunction* function = compile(vm, source);
+    free(source);
+    if (function == NULL) exit(65);
+}
+
+// after a script has run, save everything its globals reach.
+static void snapshotFile(VM* vm, const char* path) {
+    size_t length;
+    uint8_t* bytes = snapshotHeap(vm, &length);
+    if (bytes == NULL) exit(70);
+    char* snapshot = cachePath(path, 's');
+    writeBinary(snapshot, bytes, length);
+    free(snapshot);
+    free(bytes);
+}
+
+static void restoreFile(VM* vm, const char* path) {
+    size_t length;
+    uint8_t* bytes = readBinary(path, &length);
+    if (bytes == NULL || !restoreHeap(vm, bytes, length)) {
+        fprintf(stderr, "Could not restore snapshot \"%s\".\n", path);
+        exit(65);
+    }
+    free(bytes);
+}
+
+static void runImage(VM* vm, const char* path) {
+    ObjFunction* function = loadImage(vm, path);
+    if (function == NULL) {
+        fprintf(stderr, "Could not load image \"%s\".\n", path);
+        exit(65);
+    }
+    if (interpretFunction(vm, function) == INTERPRET_RUNTIME_ERROR) exit(70);
+}
+
+static void runFile(VM* vm, const char* path) {
+    if (isImage(path)) {
+        runImage(vm, path);
+        return;
+    }
     char* source = readFile(path);
-    InterpretResult result = interpret(source);
+
+    // the cache is keyed on the hash of the source, not its mtime, so an
+    // edited script never runs stale bytecode. anything that doesn't check
+    // out is ignored and the source is compiled as usual.
+    ObjFunction* function = NULL;
+    char* cache = cachePath(path, 'c');
+    size_t length;
+    uint8_t* bytes = readBinary(cache, &length);
+    if (bytes != NULL) {
+        function = deserializeFunction(vm, bytes, length, hashBytes(source, strlen(source)));
+        free(bytes);
+    }
+    free(cache);
+
+    InterpretResult result = function != NULL ? interpretFunction(vm, function) : interpret(vm, source);
     free(source);
 
     if (result == INTERPRET_COMPILE_ERROR) exit(65);
     if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+static int compareNames(const void* a, const void* b) {
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// run every .lox script in a directory on a pool of worker threads.
+// output is replayed in file name order once each script finishes.
+static int runDirectory(const char* path, int workerCount) {
+    DIR* dir = opendir(path);
+    if (dir == NULL) {
+        fprintf(stderr, "Could not open directory \"%s\".\n", path);
+        exit(74);
+    }
+
+    char** paths = NULL;
+    int count = 0;
+    int capacity = 0;
+    struct dirent* entry;
+    while ((entry = readdir(dir)) != NULL) {
+        size_t length = strlen(entry->d_name);
+        if (length < 4 || strcmp(entry->d_name + length - 4, ".lox") != 0) continue;
+
+        if (count == capacity) {
+            capacity = capacity < 8 ? 8 : capacity * 2;
+            paths = (char**)realloc(paths, sizeof(char*) * capacity);
+            if (paths == NULL) exit(1);
+        }
+        paths[count] = (char*)malloc(strlen(path) + length + 2);
+        if (paths[count] == NULL) exit(1);
+        sprintf(paths[count], "%s/%s", path, entry->d_name);
+        count++;
+    }
+    closedir(dir);
+    qsort(paths, count, sizeof(char*), compareNames);
+
+    char** sources = (char**)malloc(sizeof(char*) * (count + 1));
+    Job* jobs = (Job*)malloc(sizeof(Job) * (count + 1));
+    if (sources == NULL || jobs == NULL) exit(1);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+
+    WorkerPool pool;
+    initWorkerPool(&pool, workerCount);
+    for (int i = 0; i < count; i++) {
+        sources[i] = readFile(paths[i]);
+        initJob(&jobs[i], sources[i]);
+        poolSubmit(&pool, &jobs[i]);
+    }
+
+    int status = 0;
+    for (int i = 0; i < count; i++) {
+        InterpretResult result = poolWait(&jobs[i]);
+        fwrite(jobs[i].output, 1, jobs[i].outputLength, stdout);
+        fwrite(jobs[i].errors, 1, jobs[i].errorsLength, stderr);
+        // report the first failure like runFile would.
+        if (status == 0 && result == INTERPRET_COMPILE_ERROR) status = 65;
+        if (status == 0 && result == INTERPRET_RUNTIME_ERROR) status = 70;
+
+        freeJob(&jobs[i]);
+        free(sources[i]);
+        free(paths[i]);
+    }
+    freeWorkerPool(&pool);
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    fprintf(stderr, "%d scripts on %d workers in %.3fs (%.2f scripts/s).\n",
+        count, workerCount, elapsed, count / elapsed);
+
+    free(jobs);
+    free(sources);
+    free(paths);
+    return status;
+}
+
+static void usage() {
+    fprintf(stderr, "Usage: clox [--jobs n dir] [--compile path] [--image path] [--verify path]\n"
+        "            [--restore snapshot] [--snapshot] [--lazy] [--path dirs]\n"
+        "            [--tier calls] [--dump-ir] [--gc-threads n] [path]\n");
+    exit(64);
+}
+
 int main(int argc, const char* argv[]) {
-    initVM();
+    // writes to a closed pipe or socket return an error to the script instead of killing the process.
+    signal(SIGPIPE, SIG_IGN);
+
+    int workerCount = 0;
+    bool compileOnly = false;
+    bool image = false;
+    bool snapshot = false;
+    bool lazy = false;
+    bool verify = false;
+    bool dumpIR = false;
+    int tierThreshold = TIER_THRESHOLD;
+    int markThreads = 1;
+    const char* restore = NULL;
+    const char* modulePath = NULL;
+    const char* path = NULL;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+            workerCount = atoi(argv[++i]);
+            if (workerCount < 1) usage();
+        } else if (strcmp(argv[i], "--compile") == 0) {
+            compileOnly = true;
+        } else if (strcmp(argv[i], "--image") == 0) {
+            compileOnly = true;
+            image = true;
+        } else if (strcmp(argv[i], "--lazy") == 0) {
+            lazy = true;
+        } else if (strcmp(argv[i], "--verify") == 0) {
+            verify = true;
+        } else if (strcmp(argv[i], "--tier") == 0 && i + 1 < argc) {
+            // calls before a function is optimized. 0 turns the tier off.
+            tierThreshold = atoi(argv[++i]);
+            if (tierThreshold < 0) usage();
+        } else if (strcmp(argv[i], "--gc-threads") == 0 && i + 1 < argc) {
+            // threads marking a big heap.
+            markThreads = atoi(argv[++i]);
+            if (markThreads < 1) usage();
+        } else if (strcmp(argv[i], "--dump-ir") == 0) {
+            dumpIR = true;
+        } else if (strcmp(argv[i], "--snapshot") == 0) {
+            snapshot = true;
+        } else if (strcmp(argv[i], "--path") == 0 && i + 1 < argc) {
+            modulePath = argv[++i];
+        } else if (strcmp(argv[i], "--restore") == 0 && i + 1 < argc) {
+            restore = argv[++i];
+        } else if (path == NULL) {
+            path = argv[i];
+        } else {
+            usage();
+        }
+    }
+
+    if (workerCount > 0) {
+        if (path == NULL || compileOnly || snapshot || restore != NULL || lazy || verify) usage();
+        return runDirectory(path, workerCount);
+    }
+    if ((compileOnly || snapshot) && path == NULL) usage();
+    if (compileOnly && (snapshot || restore != NULL)) usage();
+    if (verify && (path == NULL || compileOnly || snapshot || restore != NULL || lazy)) usage();
+    // caches and images hold compiled code, so --compile never defers bodies.
+    if (lazy && compileOnly) usage();
+
+    VM vm;
+    initVM(&vm);
+    vm.lazyFunctions = lazy;
+    vm.tierThreshold = tierThreshold;
+    vm.dumpIR = dumpIR;
+    vm.markThreads = markThreads;
+    // import searches --path, then $LOX_PATH, then the script's own directory.
+    char* scriptDir = NULL;
+    if (modulePath == NULL) modulePath = getenv("LOX_PATH");
+    if (modulePath == NULL && path != NULL) modulePath = scriptDir = directoryOf(path);
+    vm.modulePath = modulePath;
 
     Chunk chunk;
     initChunk(&chunk);
+    if (restore != NULL) restoreFile(&vm, restore);
     
-    if (argc == 1) {
-        repl();
-    } else if (argc == 2) {
-        runFile(argv[1]);
+    if (path == NULL) {
+        repl(&vm);
+    } else if (verify) {
+        verifyFile(&vm, path);
+    } else if (compileOnly) {
+        compileFile(&vm, path, image);
     } else {
-        fprintf(stderr, "Usage: clox [path]\n");
+        runFile(&vm, path);
+        if (snapshot) snapshotFile(&vm, path);
     }
 
-    freeVM();
+    freeVM(&vm);
+    free(scriptDir);
     return 0;
 }
\ No newline at end of file
@@ -1,26 +1,38 @@
+#define _DEFAULT_SOURCE
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
 
+#include "channel.h"
 #include "compiler.h"
 #include "memory.h"
+#include "tier.h"
 #include "vm.h"
 
 #ifdef DEBUG_LOG_GC
-#include <stdio.h>
 #include "debug.h"
 #endif
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
+static void countAllocation(VM* vm, size_t oldSize, size_t newSize) {
+    vm->bytesAllocated += newSize - oldSize;
     // trigger GC before allocation
-    if (newSize > oldSize) {
+    if (newSize > oldSize && !vm->pauseGC) {
         #ifdef DEBUG_STRESS_GC
-            collectGarbage();
+            collectGarbage(vm);
         #endif
+        if (vm->bytesAllocated > vm->nextGC) {
+            collectGarbage(vm);
+        }
     }
-    // if (vm.bytesAllocated > vm.nextGC) {
-    //     collectGarbage();
-    // }
+}
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize) {
+    countAllocation(vm, oldSize, newSize);
 
-    vm.bytesAllocated = newSize - oldSize;
     if (newSize == 0) {
         free(pointer);
         return NULL;
@@ -31,42 +43,167 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
     return result;
 }
 
-void markObject(Obj* object) {
+// gray work of one mark thread. the owner pushes and takes at the bottom and
+// the other mark threads steal from the top, as in a chase-lev deque. an item
+// is a gray object, or a range of table entries with its low bit set.
+typedef uintptr_t Gray;
+
+typedef struct {
+    int64_t size; // a power of two.
+    _Atomic Gray items[];
+} GrayArray;
+
+typedef struct {
+    Entry* entries;
+    int count;
+} EntryRange;
+
+struct MarkPhase;
+
+typedef struct {
+    _Alignas(64) _Atomic int64_t top;
+    _Alignas(64) _Atomic int64_t bottom;
+    _Atomic(GrayArray*) array;
+    VM* vm;
+    struct MarkPhase* phase;
+    // arrays outgrown and ranges handed out. freed once marking is done.
+    void** garbage;
+    int garbageCount;
+    int garbageCapacity;
+    uint32_t seed; // picks the thread to steal from.
+    pthread_t thread;
+} Marker;
+
+typedef struct MarkPhase {
+    Marker* markers;
+    int count;
+    _Atomic int idle; // mark threads that found no work anywhere.
+} MarkPhase;
+
+// the marker of the running thread while a collection marks in parallel.
+static _Thread_local Marker* currentMarker = NULL;
+
+static void keepUntilMarked(Marker* marker, void* pointer) {
+    if (marker->garbageCapacity < marker->garbageCount + 1) {
+        marker->garbageCapacity = GROW_CAPACITY(marker->garbageCapacity);
+        marker->garbage = (void**)realloc(marker->garbage, sizeof(void*) * marker->garbageCapacity);
+        if (marker->garbage == NULL) exit(1);
+    }
+    marker->garbage[marker->garbageCount++] = pointer;
+}
+
+static GrayArray* newGrayArray(int64_t size) {
+    GrayArray* array = (GrayArray*)malloc(sizeof(GrayArray) + sizeof(array->items[0]) * size);
+    if (array == NULL) exit(1);
+    array->size = size;
+    return array;
+}
+
+static GrayArray* growGray(Marker* marker, GrayArray* old, int64_t top, int64_t bottom) {
+    GrayArray* array = newGrayArray(old->size * 2);
+    for (int64_t i = top; i < bottom; i++) {
+        Gray gray = atomic_load_explicit(&old->items[i & (old->size - 1)], memory_order_relaxed);
+        atomic_store_explicit(&array->items[i & (array->size - 1)], gray, memory_order_relaxed);
+    }
+    atomic_store_explicit(&marker->array, array, memory_order_release);
+    // a thief may still be reading the old one.
+    keepUntilMarked(marker, old);
+    return array;
+}
+
+static void pushGray(Marker* marker, Gray gray) {
+    int64_t bottom = atomic_load_explicit(&marker->bottom, memory_order_relaxed);
+    int64_t top = atomic_load_explicit(&marker->top, memory_order_acquire);
+    GrayArray* array = atomic_load_explicit(&marker->array, memory_order_relaxed);
+    if (bottom - top > array->size - 1) array = growGray(marker, array, top, bottom);
+    atomic_store_explicit(&array->items[bottom & (array->size - 1)], gray, memory_order_relaxed);
+    // a thief that sees the new bottom sees the item and what it points to.
+    atomic_store_explicit(&marker->bottom, bottom + 1, memory_order_release);
+}
+
+// only the owner takes. false if its deque is empty.
+static bool takeGray(Marker* marker, Gray* gray) {
+    int64_t bottom = atomic_load_explicit(&marker->bottom, memory_order_relaxed) - 1;
+    GrayArray* array = atomic_load_explicit(&marker->array, memory_order_relaxed);
+    atomic_store_explicit(&marker->bottom, bottom, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t top = atomic_load_explicit(&marker->top, memory_order_relaxed);
+    if (top > bottom) {
+        atomic_store_explicit(&marker->bottom, bottom + 1, memory_order_relaxed);
+        return false;
+    }
+    *gray = atomic_load_explicit(&array->items[bottom & (array->size - 1)], memory_order_relaxed);
+    if (top < bottom) return true;
+    // the last item. thieves may be after it too.
+    bool won = atomic_compare_exchange_strong_explicit(&marker->top, &top, top + 1,
+        memory_order_seq_cst, memory_order_relaxed);
+    atomic_store_explicit(&marker->bottom, bottom + 1, memory_order_relaxed);
+    return won;
+}
+
+// false if the deque is empty or another thread got the item first.
+static bool stealGray(Marker* victim, Gray* gray) {
+    int64_t top = atomic_load_explicit(&victim->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    int64_t bottom = atomic_load_explicit(&victim->bottom, memory_order_acquire);
+    if (top >= bottom) return false;
+    GrayArray* array = atomic_load_explicit(&victim->array, memory_order_acquire);
+    *gray = atomic_load_explicit(&array->items[top & (array->size - 1)], memory_order_relaxed);
+    return atomic_compare_exchange_strong_explicit(&victim->top, &top, top + 1,
+        memory_order_seq_cst, memory_order_relaxed);
+}
+
+void markObject(VM* vm, Obj* object) {
     if (object == NULL) return;
-    // don't mark already marked object to avoid loop.
-    if (object->isMarked) return;
-    // set flag.
+    Page* page = pageOf(object);
+    size_t granule = (size_t)((uint8_t*)object - (uint8_t*)page) >> 3;
+    uint64_t bit = (uint64_t)1 << (granule & 63);
+    _Atomic uint64_t* marks = &page->marks[granule >> 6];
+    Marker* marker = currentMarker;
+    if (marker != NULL) {
+        // other mark threads may reach the object too. the one that sets its bit grays it.
+        if (atomic_fetch_or_explicit(marks, bit, memory_order_relaxed) & bit) return;
+    } else {
+        // don't mark already marked object to avoid loop.
+        uint64_t word = atomic_load_explicit(marks, memory_order_relaxed);
+        if (word & bit) return;
+        // set flag.
+        atomic_store_explicit(marks, word | bit, memory_order_relaxed);
+    }
 #ifdef DEBUG_LOG_GC
     printf("%p mark ", (void *) object);
     printValue(OBJ_VAL(object));
     printf("\n");
 #endif
-    object->isMarked = true;
+    if (marker != NULL) {
+        pushGray(marker, (Gray)object);
+        return;
+    }
 
     // add gray objects to worklist.
-    if (vm.grayCapacity < vm.grayCount + 1) {
-        vm.grayCapacity = GROW_CAPACITY(vm.grayCapacity);
+    if (vm->grayCapacity < vm->grayCount + 1) {
+        vm->grayCapacity = GROW_CAPACITY(vm->grayCapacity);
         // calls system realloc.
         // gray stack not managed by GC.
-        vm.grayStack = (Obj**)realloc(vm.grayStack, sizeof(Obj*) * vm.grayCapacity);
+        vm->grayStack = (Obj**)realloc(vm->grayStack, sizeof(Obj*) * vm->grayCapacity);
         // abort on allocation failure
-        if (vm.grayStack == NULL) exit(1); 
+        if (vm->grayStack == NULL) exit(1); 
     }
-    vm.grayStack[vm.grayCount++] = object;
+    vm->grayStack[vm->grayCount++] = object;
 }
 
-void markValue(Value value) {
+void markValue(VM* vm, Value value) {
     // only mark object value since they are allocated on heap.
-    if (IS_OBJ(value)) markObject(AS_OBJ(value));
+    if (IS_OBJ(value)) markObject(vm, AS_OBJ(value));
 }
 
-static void markArray(ValueArray* array) {
+static void markArray(VM* vm, ValueArray* array) {
     for (int i = 0; i < array->count; i++) {
-        markValue(array->values[i]);
+        markValue(vm, array->values[i]);
     }
 }
 
-static void blackenObject(Obj* object) {
+static void blackenObject(VM* vm, Obj* object) {
 #ifdef DEBUG_LOG_GC
     printf("%p blacken ", (void*)object);
     printValue(OBJ_VAL(object));
@@ -76,21 +213,38 @@ static void blackenObject(Obj* object) {
     switch (object->type) {
         case OBJ_BOUND_METHOD: {
             ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            markValue(bound->receiver);
-            markObject((Obj*)bound->method);
+            markValue(vm, bound->receiver);
+            markObject(vm, (Obj*)FROM_REF(ObjClosure, bound->method));
+            break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            markObject((Obj*)klass->name);
-            markTable(&klass->methods);
+            markObject(vm, (Obj*)klass->name);
+            markTable(vm, &klass->methods);
             break;
         }
         case OBJ_CLOSURE: {
             // closure has reference to function it wraps and array of pointer to upvalues it captures.
             ObjClosure* closure = (ObjClosure*)object;
-            markObject((Obj*)closure->function);
+            markObject(vm, (Obj*)FROM_REF(ObjFunction, closure->function));
             for (int i = 0; i < closure->upvalueCount; i++) {
-                markObject((Obj*)closure->upvalues[i]);
+                markObject(vm, (Obj*)FROM_REF(ObjUpvalue, closure->upvalues[i]));
+            }
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            markObject(vm, (Obj*)fiber->caller);
+            // the running fiber's stacks live in the vm and are marked as roots.
+            if (fiber == vm->fiber) break;
+            for (Value* slot = fiber->stack; slot < fiber->stackTop; slot++) {
+                markValue(vm, *slot);
+            }
+            for (int i = 0; i < fiber->frameCount; i++) {
+                markObject(vm, (Obj*)fiber->frames[i].closure);
+            }
+            for (ObjUpvalue* upvalue = fiber->openUpvalues; upvalue != NULL; upvalue = FROM_REF(ObjUpvalue, upvalue->next)) {
+                markObject(vm, (Obj*)upvalue);
             }
             break;
         }
@@ -98,177 +252,487 @@ static void blackenObject(Obj* object) {
             // function has reference to string object containing the function's name.
             // function also has constant table.
             ObjFunction* function = (ObjFunction*)object;
-            markObject((Obj*)function->name);
-            markArray(&function->chunk.constants);
+            markObject(vm, (Obj*)function->name);
+            markObject(vm, (Obj*)function->module);
+            markArray(vm, &function->chunk.constants);
+            // a cached class keeps its methods and the values taken from them.
+            for (int i = 0; i < function->invokeCacheCount; i++) {
+                markObject(vm, (Obj*)function->invokeCaches[i].klass);
+            }
             break;
         }
         case OBJ_INSTANCE: {
             // mark instance class and field table.
             ObjInstance* instance = (ObjInstance*)object;
-            markObject((Obj*)instance->klass);
-            markTable(&instance->fields);
+            markObject(vm, (Obj*)instance->klass);
+            markTable(vm, &instance->fields);
             break;
         }
         case OBJ_UPVALUE:
             // trace reference to closed-over value from upvalue.
-            markValue(((ObjUpvalue*)object)->closed);
+            markValue(vm, ((ObjUpvalue*)object)->closed);
+            // an open upvalue needs the stack it points into.
+            markObject(vm, (Obj*)((ObjUpvalue*)object)->fiber);
             break;
-        // native and string objects contain no outgoing references.
+        // channel, native and string objects contain no outgoing references.
+        case OBJ_CHANNEL:
         case OBJ_NATIVE:
         case OBJ_STRING:
             break;
     }
 }
 
-static void freeObject(Obj* object) {
+// a collection is marked on vm->markThreads threads once the heap is this big.
+// below it marking is over before the threads would have started.
+#define PARALLEL_MARK_MIN (4 * 1024 * 1024)
+// tables with more entries are marked in ranges of this many.
+#define MARK_RANGE 1024
+#define GRAY_INITIAL 1024
+
+bool splitEntries(VM* vm, Entry* entries, int count) {
+    Marker* marker = currentMarker;
+    if (marker == NULL || count <= MARK_RANGE) return false;
+    int rangeCount = (count + MARK_RANGE - 1) / MARK_RANGE;
+    EntryRange* ranges = (EntryRange*)malloc(sizeof(EntryRange) * rangeCount);
+    if (ranges == NULL) exit(1);
+    keepUntilMarked(marker, ranges);
+    for (int i = 0; i < rangeCount; i++) {
+        ranges[i].entries = entries + i * MARK_RANGE;
+        ranges[i].count = i == rangeCount - 1 ? count - i * MARK_RANGE : MARK_RANGE;
+        pushGray(marker, (Gray)&ranges[i] | 1);
+    }
+    return true;
+}
+
+static void blackenGray(Marker* marker, Gray gray) {
+    if (gray & 1) {
+        EntryRange* range = (EntryRange*)(gray & ~(Gray)1);
+        markEntries(marker->vm, range->entries, range->count);
+    } else {
+        blackenObject(marker->vm, (Obj*)gray);
+    }
+}
+
+static bool stealWork(Marker* marker, Gray* gray) {
+    MarkPhase* phase = marker->phase;
+    // start at a random thread so thieves spread out.
+    marker->seed ^= marker->seed << 13;
+    marker->seed ^= marker->seed >> 17;
+    marker->seed ^= marker->seed << 5;
+    int start = (int)(marker->seed % (uint32_t)phase->count);
+    for (int i = 0; i < phase->count; i++) {
+        Marker* victim = &phase->markers[(start + i) % phase->count];
+        if (victim != marker && stealGray(victim, gray)) return true;
+    }
+    return false;
+}
+
+static bool workLeft(MarkPhase* phase) {
+    for (int i = 0; i < phase->count; i++) {
+        Marker* marker = &phase->markers[i];
+        if (atomic_load_explicit(&marker->top, memory_order_acquire) <
+            atomic_load_explicit(&marker->bottom, memory_order_acquire)) return true;
+    }
+    return false;
+}
+
+// blacken until no thread has gray work left.
+static void drainMarker(Marker* marker) {
+    MarkPhase* phase = marker->phase;
+    Gray gray;
+    for (;;) {
+        while (takeGray(marker, &gray)) blackenGray(marker, gray);
+        if (stealWork(marker, &gray)) {
+            blackenGray(marker, gray);
+            continue;
+        }
+        // only a busy thread makes work, so once every thread is idle at
+        // once every deque is empty for good.
+        atomic_fetch_add(&phase->idle, 1);
+        while (!workLeft(phase)) {
+            if (atomic_load(&phase->idle) == phase->count) return;
+            sched_yield();
+        }
+        atomic_fetch_sub(&phase->idle, 1);
+    }
+}
+
+static void* markThread(void* argument) {
+    Marker* marker = (Marker*)argument;
+    currentMarker = marker;
+    drainMarker(marker);
+    currentMarker = NULL;
+    return NULL;
+}
+
+// the collecting thread is the first marker. roots are grayed onto its deque
+// and the other threads steal from there.
+static void startMarking(VM* vm, MarkPhase* phase) {
+    phase->count = vm->markThreads;
+    // the deque ends are cache-line aligned, so the array has to be too.
+    void* markers;
+    if (posix_memalign(&markers, _Alignof(Marker), sizeof(Marker) * phase->count) != 0) exit(1);
+    phase->markers = (Marker*)markers;
+    atomic_init(&phase->idle, 0);
+    for (int i = 0; i < phase->count; i++) {
+        Marker* marker = &phase->markers[i];
+        atomic_init(&marker->top, 0);
+        atomic_init(&marker->bottom, 0);
+        atomic_init(&marker->array, newGrayArray(GRAY_INITIAL));
+        marker->vm = vm;
+        marker->phase = phase;
+        marker->garbage = NULL;
+        marker->garbageCount = 0;
+        marker->garbageCapacity = 0;
+        marker->seed = (uint32_t)i * 2654435761u + 1;
+    }
+    currentMarker = &phase->markers[0];
+}
+
+static void markInParallel(MarkPhase* phase) {
+    for (int i = 1; i < phase->count; i++) {
+        Marker* marker = &phase->markers[i];
+        if (pthread_create(&marker->thread, NULL, markThread, marker) != 0) exit(1);
+    }
+    drainMarker(&phase->markers[0]);
+    for (int i = 1; i < phase->count; i++) {
+        pthread_join(phase->markers[i].thread, NULL);
+    }
+    currentMarker = NULL;
+
+    for (int i = 0; i < phase->count; i++) {
+        Marker* marker = &phase->markers[i];
+        for (int j = 0; j < marker->garbageCount; j++) free(marker->garbage[j]);
+        free(marker->garbage);
+        free(atomic_load(&marker->array));
+    }
+    free(phase->markers);
+}
+
+// free what an object owns. its slot is given back by the sweep.
+static void freeObject(VM* vm, Obj* object) {
     #ifdef DEBUG_LOG_GC
         printf("%p free type %d\n", (void*)object, object->type);
     #endif
     switch (object->type) {
-        case OBJ_BOUND_METHOD: {
-            ObjBoundMethod* bound = (ObjBoundMethod*)object;
-            FREE(ObjBoundMethod, object);
+        case OBJ_CHANNEL: {
+            // drop this vm's reference. the channel goes away with its last one.
+            releaseChannel(((ObjChannel*)object)->channel);
             break;
         }
         case OBJ_CLASS: {
             ObjClass* klass = (ObjClass*)object;
-            freeTable(&klass->methods);
-            FREE(ObjClass, object);
+            freeTable(vm, &klass->methods);
             break;
         }
         // handle closure object.
         case OBJ_CLOSURE: {
             ObjClosure* closure = (ObjClosure*)object;
             // free upvalue array.
-            FREE_ARRAY(ObjUpvalue*, closure->upvalues, closure->upvalueCount);
+            FREE_ARRAY(vm, OBJ_REF(ObjUpvalue), closure->upvalues, closure->upvalueCount);
             // only free the closure object, and not the function object because the closure doesn't own the function.
-            FREE(ObjClosure, object);
+            break;
+        }
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            FREE_ARRAY(vm, CallFrame, fiber->frames, fiber->frameCapacity);
+            FREE_ARRAY(vm, Value, fiber->stack, fiber->stackCapacity);
             break;
         }
         // handle function object.
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*)object;
-            // free function object's chunk.
-            freeChunk(&function->chunk);
-            FREE(ObjFunction, object);
+            // free function object's chunk. code and lines of image functions belong to the mapping.
+            if (function->image != NULL) {
+                freeValueArray(vm, &function->chunk.constants);
+            } else {
+                freeChunk(vm, &function->chunk);
+            }
+            if (function->lazy != NULL) freeLazyBody(vm, function->lazy);
+            if (function->tier != NULL) freeTier(function->tier);
+            FREE_ARRAY(vm, InvokeCache, function->invokeCaches, function->invokeCacheCount);
             break;
         }
         // free instance object.
         case OBJ_INSTANCE: {
             ObjInstance* instance = (ObjInstance*)object;
             // free instance field table.
-            freeTable(&instance->fields);
-            FREE(ObjInstance, object);
-            break;
-        }
-        // handle native function object.
-        case OBJ_NATIVE: {
-            FREE(ObjNative, object);
+            freeTable(vm, &instance->fields);
             break;
         }
         // handle string object.
         case OBJ_STRING: {
             ObjString* string = (ObjString*)object;
             // free string object's char array
-            FREE_ARRAY(char, string->chars, string->length + 1);
-            FREE(ObjString, object);
+            FREE_ARRAY(vm, char, string->chars, string->length + 1);
             break;
         }
+        // bound method, native and upvalue objects own nothing else.
+        case OBJ_BOUND_METHOD:
+        case OBJ_NATIVE:
         case OBJ_UPVALUE:
-            FREE(ObjUpvalue, object);
             break;
     }
 }
 
-void freeObjects() {
-    // free vm objects.
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        Obj* next = object->next;
-        freeObject(object);
-        object = next;
+// pages are shared by every vm in the process. they are mapped a batch at a
+// time and kept when a vm gives them back.
+#define PAGE_BATCH 32
+// objects start after the page header.
+#define PAGE_FIRST ((sizeof(Page) + 7) & ~(size_t)7)
+
+static pthread_mutex_t pageLock = PTHREAD_MUTEX_INITIALIZER;
+static Page* sparePages = NULL;
+
+#ifdef COMPRESSED_HEAP
+_Static_assert((1 << REF_OFFSET_BITS) == HEAP_PAGE_SIZE / 8, "a reference's offset must cover a page");
+
+uintptr_t heapPages[HEAP_MAX_PAGES];
+// indexes handed out so far. pages keep theirs while they are spare.
+static size_t heapPageCount = 1;
+#endif
+
+static Page* takePage(void) {
+    pthread_mutex_lock(&pageLock);
+    if (sparePages == NULL) {
+#ifdef COMPRESSED_HEAP
+        if (heapPageCount + PAGE_BATCH > HEAP_MAX_PAGES) {
+            fprintf(stderr, "Object heap exhausted.\n");
+            exit(1);
+        }
+#endif
+        // map one page more than needed and trim it to page alignment.
+        size_t length = (size_t)HEAP_PAGE_SIZE * (PAGE_BATCH + 1);
+        uint8_t* block = (uint8_t*)mmap(NULL, length, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (block == (uint8_t*)MAP_FAILED) exit(1);
+        uint8_t* start = (uint8_t*)(((uintptr_t)block + HEAP_PAGE_SIZE - 1) & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+        uint8_t* end = start + (size_t)HEAP_PAGE_SIZE * PAGE_BATCH;
+        if (start > block) munmap(block, start - block);
+        if (block + length > end) munmap(end, block + length - end);
+        for (int i = PAGE_BATCH - 1; i >= 0; i--) {
+            Page* page = (Page*)(start + (size_t)HEAP_PAGE_SIZE * i);
+            page->next = sparePages;
+            sparePages = page;
+#ifdef COMPRESSED_HEAP
+            page->index = (uint32_t)heapPageCount;
+            heapPages[heapPageCount++] = (uintptr_t)page;
+#endif
+        }
+    }
+    Page* page = sparePages;
+    sparePages = page->next;
+    pthread_mutex_unlock(&pageLock);
+    return page;
+}
+
+static void releasePage(Page* page) {
+    // hand the memory back to the system but keep the address.
+#ifdef COMPRESSED_HEAP
+    uint32_t index = page->index;
+    madvise(page, HEAP_PAGE_SIZE, MADV_DONTNEED);
+    page->index = index;
+#else
+    madvise(page, HEAP_PAGE_SIZE, MADV_DONTNEED);
+#endif
+    pthread_mutex_lock(&pageLock);
+    page->next = sparePages;
+    sparePages = page;
+    pthread_mutex_unlock(&pageLock);
+}
+
+void initHeap(Heap* heap) {
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        heap->classes[i].pages = NULL;
+        heap->classes[i].unswept = NULL;
+        heap->classes[i].current = NULL;
+        heap->classes[i].slot = 0;
+    }
+}
+
+// free the unmarked objects of a page and clear its marks. returns the objects left.
+static int sweepPage(VM* vm, Page* page) {
+    size_t size = (size_t)page->sizeClass << 3;
+    size_t before = vm->bytesAllocated;
+    int live = 0;
+    for (int i = 0; i < PAGE_WORDS; i++) {
+        uint64_t marks = atomic_load_explicit(&page->marks[i], memory_order_relaxed);
+        uint64_t dead = page->allocated[i] & ~marks;
+        while (dead != 0) {
+            int bit = __builtin_ctzll(dead);
+            dead &= dead - 1;
+            freeObject(vm, (Obj*)((uint8_t*)page + ((size_t)(i * 64 + bit) << 3)));
+            vm->bytesAllocated -= size;
+        }
+        page->allocated[i] &= marks;
+        atomic_store_explicit(&page->marks[i], 0, memory_order_relaxed);
+        live += __builtin_popcountll(page->allocated[i]);
+    }
+    // the threshold was set before anything was freed. once every page is
+    // swept it is again a multiple of what the collection kept.
+    vm->nextGC -= (before - vm->bytesAllocated) * GC_HEAP_GROW_FACTOR;
+    return live;
+}
+
+// the next page with room for an object of a size class. sweeps one if there is one left.
+static Page* nextPage(VM* vm, int sizeClass) {
+    SizeClass* objects = &vm->heap.classes[sizeClass];
+    while (objects->unswept != NULL) {
+        Page* page = objects->unswept;
+        objects->unswept = page->next;
+        page->next = objects->pages;
+        objects->pages = page;
+        if (sweepPage(vm, page) < page->slotCount) return page;
     }
+    Page* page = takePage();
+    page->sizeClass = sizeClass;
+    page->slotCount = (int)((HEAP_PAGE_SIZE - PAGE_FIRST) / ((size_t)sizeClass << 3));
+    memset(page->allocated, 0, sizeof(page->allocated));
+    for (int i = 0; i < PAGE_WORDS; i++) atomic_init(&page->marks[i], 0);
+    page->next = objects->pages;
+    objects->pages = page;
+    return page;
+}
+
+Obj* allocateObject(VM* vm, size_t size, ObjType type) {
+    size = (size + 7) & ~(size_t)7;
+    countAllocation(vm, 0, size);
+
+    int sizeClass = (int)(size >> 3);
+    SizeClass* objects = &vm->heap.classes[sizeClass];
+    Obj* object = NULL;
+    while (object == NULL) {
+        Page* page = objects->current;
+        // a free slot is one whose allocated bit is clear.
+        while (page != NULL && objects->slot < page->slotCount) {
+            size_t offset = PAGE_FIRST + (size_t)objects->slot++ * size;
+            size_t granule = offset >> 3;
+            uint64_t bit = (uint64_t)1 << (granule & 63);
+            if (!(page->allocated[granule >> 6] & bit)) {
+                page->allocated[granule >> 6] |= bit;
+                object = (Obj*)((uint8_t*)page + offset);
+                break;
+            }
+        }
+        if (object == NULL) {
+            objects->current = nextPage(vm, sizeClass);
+            objects->slot = 0;
+        }
+    }
+    object->type = type;
+
+    #ifdef DEBUG_LOG_GC
+        printf("%p allocate %zu for %d\n", (void*)object, size, type);
+    #endif
+
+    return object;
+}
+
+// sweep every page the last collection left. pages left empty go back to the pool.
+static void finishSweep(VM* vm) {
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        SizeClass* objects = &vm->heap.classes[i];
+        while (objects->unswept != NULL) {
+            Page* page = objects->unswept;
+            objects->unswept = page->next;
+            if (sweepPage(vm, page) == 0) {
+                releasePage(page);
+            } else {
+                page->next = objects->pages;
+                objects->pages = page;
+            }
+        }
+    }
+}
+
+void freeObjects(VM* vm) {
+    // free vm objects. with no marks set, sweeping frees every one.
+    finishSweep(vm);
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        SizeClass* objects = &vm->heap.classes[i];
+        objects->unswept = objects->pages;
+        objects->pages = NULL;
+    }
+    finishSweep(vm);
+    initHeap(&vm->heap);
     // free vm gray stack.
-    free(vm.grayStack);
+    free(vm->grayStack);
 }
 
-static void markRoots() {
+static void markRoots(VM* vm) {
     // iterate roots in vm stack
-    for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
-        markValue(*slot);
+    for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
+        markValue(vm, *slot);
     }
 
     // mark closure object in vm callframes.
-    for (int i = 0; i < vm.frameCount; i++) {
-        markObject((Obj*)vm.frames[i].closure);
+    for (int i = 0; i < vm->frameCount; i++) {
+        markObject(vm, (Obj*)vm->frames[i].closure);
     }
 
     // mark open upvalues in vm open upvalue list.
-    for (ObjUpvalue* upvalue = vm.openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
-        markObject((Obj*)upvalue);
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = FROM_REF(ObjUpvalue, upvalue->next)) {
+        markObject(vm, (Obj*)upvalue);
     }
+    // suspended fibers on the resume chain.
+    markObject(vm, (Obj*)vm->fiber);
+    markObject(vm, (Obj*)vm->mainFiber);
+    markEventLoop(vm);
+    markValue(vm, vm->exception);
 
     // mark roots in global variables.
-    markTable(&vm.globals);
+    markTable(vm, &vm->globals);
+    markTable(vm, &vm->builtins);
+    markTable(vm, &vm->modules);
+    for (Script* script = vm->scripts; script != NULL; script = script->next) {
+        markObject(vm, (Obj*)script->function);
+    }
 
     // compiler also uses memory from heap for literals and constant table.
-    markCompilerRoots();
-    markObject((Obj*)vm.initString);
+    markCompilerRoots(vm);
+    markObject(vm, (Obj*)vm->initString);
 }
 
-static void traceReferences() {
+static void traceReferences(VM* vm) {
     // iterate object in gray stack and mark as black.
-    while (vm.grayCount > 0) {
-        Obj* object = vm.grayStack[--vm.grayCount];
-        blackenObject(object);
-    }
-}
-
-static void sweep() {
-    Obj* previous = NULL;
-    Obj* object = vm.objects;
-    while (object != NULL) {
-        if (object->isMarked) {
-            // skip black object.
-            // reset black object.
-            object->isMarked = false;
-            previous = object;
-            object = object->next;
-        } else {
-            // unlink white object from the list
-            Obj* unreached = object;
-            object = object->next;
-            if (previous != NULL) {
-                previous->next = object;
-            } else {
-                // free first node.
-                vm.objects = object;
-            }
-
-            // free white object.
-            freeObject(unreached);
-
-        }
+    while (vm->grayCount > 0) {
+        Obj* object = vm->grayStack[--vm->grayCount];
+        blackenObject(vm, object);
     }
 }
 
-void collectGarbage() {
+void collectGarbage(VM* vm) {
 #ifdef DEBUG_LOG_GC
     printf("-- gc begin\n");
-    size_t before = vm.bytesAllocated;
 #endif
 
-    markRoots();
-    traceReferences();
+    // marks are reused, so the last collection's garbage has to be gone first.
+    finishSweep(vm);
+    MarkPhase phase;
+    bool parallel = vm->markThreads > 1 && vm->bytesAllocated >= PARALLEL_MARK_MIN;
+    if (parallel) startMarking(vm, &phase);
+    markRoots(vm);
+    if (parallel) {
+        markInParallel(&phase);
+    } else {
+        traceReferences(vm);
+    }
     // remove string object in vm string table.
-    tableRemoveWhite(&vm.strings);
-    sweep();
+    tableRemoveWhite(&vm->strings);
+
+    // every page is swept when allocation gets to it.
+    for (int i = 0; i < HEAP_SIZE_CLASSES; i++) {
+        SizeClass* objects = &vm->heap.classes[i];
+        objects->unswept = objects->pages;
+        objects->pages = NULL;
+        objects->current = NULL;
+    }
 
-    // adjust gc threshold.
-    vm.nextGC = vm.bytesAllocated * GC_HEAP_GROW_FACTOR;
+    // adjust gc threshold. sweeping lowers it by what it frees.
+    vm->nextGC = vm->bytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
     printf("-- gc end\n");
-    printf("   collected %zu byte (from %zu to %zu) next at %zu\n", before - vm.bytesAllocated, before, vm.bytesAllocated, vm.nextGC);
+    printf("   %zu byte allocated, next at %zu before sweeping\n", vm->bytesAllocated, vm->nextGC);
 #endif
 }
\ No newline at end of file
@@ -1,30 +1,104 @@
 #ifndef clox_memory_h
 #define clox_memory_h
 
+#include <stdatomic.h>
+
 #include "common.h"
 #include "object.h"
 
-#define ALLOCATE(type, count) \
-    (type*)reallocate(NULL, 0, sizeof(type) * (count))
+#define ALLOCATE(vm, type, count) \
+    (type*)reallocate(vm, NULL, 0, sizeof(type) * (count))
 
-#define FREE(type, pointer) reallocate(pointer, sizeof(type), 0)
+#define FREE(vm, type, pointer) reallocate(vm, pointer, sizeof(type), 0)
 
 #define GROW_CAPACITY(capacity) \
     ((capacity) < 8 ? 8 : (capacity) * 2)
 
-#define GROW_ARRAY(type, pointer, oldCount, newCount) \
-    (type*)reallocate(pointer, sizeof(type) * (oldCount), \
+#define GROW_ARRAY(vm, type, pointer, oldCount, newCount) \
+    (type*)reallocate(vm, pointer, sizeof(type) * (oldCount), \
         sizeof(type) * (newCount))
 
-#define FREE_ARRAY(type, pointer, oldCount) \
-    reallocate(pointer, sizeof(type) * (oldCount), 0)
+#define FREE_ARRAY(vm, type, pointer, oldCount) \
+    reallocate(vm, pointer, sizeof(type) * (oldCount), 0)
 
 #define GC_HEAP_GROW_FACTOR 2 
 
-void* reallocate(void* pointer, size_t oldSize, size_t newSize);
-void markObject(Obj* object);
-void markValue();
-void collectGarbage();
-void freeObjects();
+// objects are sized in 8-byte units. a page holds objects of one size.
+#define HEAP_SIZE_CLASSES 32
+// the biggest object a size class holds. there is no path for bigger ones.
+#define HEAP_MAX_OBJECT ((HEAP_SIZE_CLASSES - 1) * 8)
+#define HEAP_PAGE_SIZE (64 * 1024)
+// words of a bitmap with a bit for every 8 bytes of a page.
+#define PAGE_WORDS (HEAP_PAGE_SIZE / 8 / 64)
+
+// an aligned block of objects of one size. its header has a bit for each
+// object allocated and each object marked, so the collector never writes to
+// object memory.
+typedef struct Page {
+    struct Page* next;
+    int sizeClass; // object size in 8-byte units.
+    int slotCount;
+#ifdef COMPRESSED_HEAP
+    uint32_t index; // in heapPages.
+#endif
+    uint64_t allocated[PAGE_WORDS];
+    _Atomic uint64_t marks[PAGE_WORDS]; // set by every mark thread at once.
+} Page;
+
+typedef struct {
+    Page* pages; // swept since the last collection.
+    Page* unswept; // may still hold garbage from the last collection.
+    Page* current; // page being allocated from.
+    int slot; // next slot of current to look at.
+} SizeClass;
+
+// a vm's objects. a collection only marks. each page is swept when allocation
+// next needs room in it, or at the start of the next collection.
+typedef struct {
+    SizeClass classes[HEAP_SIZE_CLASSES];
+} Heap;
+
+static inline Page* pageOf(Obj* object) {
+    return (Page*)((uintptr_t)object & ~(uintptr_t)(HEAP_PAGE_SIZE - 1));
+}
+
+#ifdef COMPRESSED_HEAP
+// the low bits of a reference are the object's offset in its page.
+#define REF_OFFSET_BITS 13
+// 2^19 pages of 64 KB, so references reach 32 GB of objects.
+#define HEAP_MAX_PAGES ((size_t)1 << (32 - REF_OFFSET_BITS))
+
+// the address of every page a vm has been given, by index. entry 0 is never
+// used, so reference 0 decodes to NULL.
+extern uintptr_t heapPages[HEAP_MAX_PAGES];
+
+static inline ObjRef objToRef(Obj* object) {
+    if (object == NULL) return 0;
+    Page* page = pageOf(object);
+    return (page->index << REF_OFFSET_BITS) | (ObjRef)(((uint8_t*)object - (uint8_t*)page) >> 3);
+}
+
+static inline Obj* refToObj(ObjRef ref) {
+    return (Obj*)(heapPages[ref >> REF_OFFSET_BITS] + ((uintptr_t)(ref & ((1 << REF_OFFSET_BITS) - 1)) << 3));
+}
+#endif
+
+static inline bool isMarked(Obj* object) {
+    Page* page = pageOf(object);
+    size_t granule = (size_t)((uint8_t*)object - (uint8_t*)page) >> 3;
+    return (atomic_load_explicit(&page->marks[granule >> 6], memory_order_relaxed) >> (granule & 63)) & 1;
+}
+
+void initHeap(Heap* heap);
+Obj* allocateObject(VM* vm, size_t size, ObjType type);
+
+void* reallocate(VM* vm, void* pointer, size_t oldSize, size_t newSize);
+void markObject(VM* vm, Obj* object);
+void markValue(VM* vm, Value value);
+// while marking in parallel, hand out the entries of a big table in ranges
+// the other mark threads can take. false if they are to be marked now.
+bool splitEntries(VM* vm, Entry* entries, int count);
+void collectGarbage(VM* vm);
+void freeObjects(VM* vm);
 
 #endif
\ No newline at end of file
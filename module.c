@@ -0,0 +1,100 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "module.h"
+#include "serialize.h"
+
+// read a whole file into a malloc'ed, nul-terminated buffer. NULL if it can't be read.
+static char* readWhole(const char* path, size_t* length) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+
+    fseek(file, 0L, SEEK_END);
+    long fileSize = ftell(file);
+    rewind(file);
+
+    char* buffer = fileSize < 0 ? NULL : (char*)malloc(fileSize + 1);
+    if (buffer != NULL && fread(buffer, 1, fileSize, file) < (size_t)fileSize) {
+        free(buffer);
+        buffer = NULL;
+    }
+    fclose(file);
+    if (buffer == NULL) return NULL;
+    buffer[fileSize] = '\0';
+    *length = (size_t)fileSize;
+    return buffer;
+}
+
+static bool fileExists(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return false;
+    fclose(file);
+    return true;
+}
+
+ObjString* findModule(VM* vm, ObjString* name) {
+    char path[4096];
+    // an absolute name skips the search path.
+    const char* dirs = name->chars[0] == '/' ? "" : vm->modulePath != NULL ? vm->modulePath : MODULE_PATH_DEFAULT;
+    for (;;) {
+        const char* end = strchr(dirs, ':');
+        if (end == NULL) end = dirs + strlen(dirs);
+        int dirLength = (int)(end - dirs);
+        // an empty entry is the name as it stands.
+        int length = snprintf(path, sizeof(path), "%.*s%s%s.lox",
+            dirLength, dirs, dirLength > 0 ? "/" : "", name->chars);
+        if (length < (int)sizeof(path) && fileExists(path)) return copyString(vm, path, length);
+        if (*end == '\0') break;
+        dirs = end + 1;
+    }
+    runtimeError(vm, "Can't find module \"%s\".", name->chars);
+    return NULL;
+}
+
+// write the bytecode cache of a freshly compiled module. a cache that can't
+// be written costs only the next run a compile. a torn one fails its hash check.
+static void writeCache(ObjFunction* function, uint64_t sourceHash, const char* cache) {
+    size_t length;
+    uint8_t* bytes = serializeFunction(function, sourceHash, &length);
+    if (bytes == NULL) return;
+    FILE* file = fopen(cache, "wb");
+    if (file != NULL) {
+        fwrite(bytes, 1, length, file);
+        fclose(file);
+    }
+    free(bytes);
+}
+
+ObjFunction* loadModule(VM* vm, ObjString* path) {
+    size_t length;
+    char* source = readWhole(path->chars, &length);
+    if (source == NULL) {
+        runtimeError(vm, "Could not read module \"%s\".", path->chars);
+        return NULL;
+    }
+    uint64_t sourceHash = hashBytes(source, length);
+
+    char* cache = (char*)malloc(path->length + 2);
+    if (cache == NULL) exit(1);
+    sprintf(cache, "%sc", path->chars);
+
+    ObjFunction* function = NULL;
+    size_t cacheLength;
+    uint8_t* bytes = (uint8_t*)readWhole(cache, &cacheLength);
+    if (bytes != NULL) {
+        function = deserializeFunction(vm, bytes, cacheLength, sourceHash);
+        free(bytes);
+    }
+    if (function == NULL) {
+        function = compile(vm, source);
+        // lazily compiled functions have no code to cache yet, so nothing is written for them.
+        if (function != NULL) writeCache(function, sourceHash, cache);
+    }
+    free(cache);
+    free(source);
+
+    if (function == NULL) runtimeError(vm, "Can't compile module \"%s\".", path->chars);
+    return function;
+}
@@ -0,0 +1,28 @@
+#ifndef clox_module_h
+#define clox_module_h
+
+#include "common.h"
+#include "object.h"
+#include "vm.h"
+
+// search path used when the vm has none of its own.
+#define MODULE_PATH_DEFAULT "."
+
+// import "name" loads name.lox from the first directory on vm->modulePath
+// that has it. its bytecode is cached next to it as name.loxc and reused for
+// as long as the source hashes the same.
+//
+// a module runs once per vm, in a namespace of its own: an instance whose
+// fields are its globals. its top-level var, fun and class go there, and its
+// functions keep using it wherever they are called from. it sees the vm's
+// builtins but not the importer's globals, and the importer only sees what
+// it defines through the namespace. import "name" as x; binds the namespace
+// to x. importing the same module again binds the same instance.
+
+// find the file of the module called name. returns its path, or NULL after reporting a runtime error.
+ObjString* findModule(VM* vm, ObjString* name);
+// load the bytecode cache of the module at path, or compile it if the cache
+// is missing or stale. returns its top-level function, or NULL after reporting a runtime error.
+ObjFunction* loadModule(VM* vm, ObjString* path);
+
+#endif
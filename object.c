@@ -1,96 +1,136 @@
 #include <stdio.h>
 #include <string.h>
 
+#include "channel.h"
 #include "memory.h"
 #include "object.h"
 #include "value.h"
 #include "vm.h"
 #include "table.h"
 
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
-
-static Obj* allocateObject(size_t size, ObjType type) {
-    // allocates an obj on the heap and initializes state
-    Obj* object = (Obj*)reallocate(NULL, 0, size);
-    object->type = type;
-    object->isMarked = false;
-
-    // insert allocated object to vm's linked list
-    object->next = vm.objects;
-    vm.objects = object;
-
-    #ifdef DEBUG_LOG_GC
-        printf("%p allocate %zu for %d\n", (void*)object, size, type);
-    #endif
-
-    return object;
-}
-
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method) {
-    ObjBoundMethod* bound = ALLOCATE_OBJ(ObjBoundMethod, OBJ_BOUND_METHOD);
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
+
+// allocateObject indexes the heap's size classes by size, so every object
+// type has to fit the biggest one.
+#define ASSERT_OBJ_FITS(type) \
+    _Static_assert(sizeof(type) <= HEAP_MAX_OBJECT, #type " is too big for a heap size class")
+
+ASSERT_OBJ_FITS(ObjBoundMethod);
+ASSERT_OBJ_FITS(ObjChannel);
+ASSERT_OBJ_FITS(ObjClass);
+ASSERT_OBJ_FITS(ObjClosure);
+ASSERT_OBJ_FITS(ObjFiber);
+ASSERT_OBJ_FITS(ObjFunction);
+ASSERT_OBJ_FITS(ObjInstance);
+ASSERT_OBJ_FITS(ObjNative);
+ASSERT_OBJ_FITS(ObjString);
+ASSERT_OBJ_FITS(ObjUpvalue);
+
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method) {
+    ObjBoundMethod* bound = ALLOCATE_OBJ(vm, ObjBoundMethod, OBJ_BOUND_METHOD);
     bound->receiver = receiver;
-    bound->method = method;
+    bound->method = TO_REF(method);
     return bound;
 }
 
-ObjClass* newClass(ObjString* name) {
-    ObjClass* klass = ALLOCATE_OBJ(ObjClass, OBJ_CLASS);
+ObjClass* newClass(VM* vm, ObjString* name) {
+    ObjClass* klass = ALLOCATE_OBJ(vm, ObjClass, OBJ_CLASS);
     klass->name = name;
     initTable(&klass->methods);
     return klass;
 }
 
-ObjClosure* newClosure(ObjFunction* function) {
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
     // allocate upvalue array
-    ObjUpvalue** upvalues = ALLOCATE(ObjUpvalue*, function->upvalueCount);
+    OBJ_REF(ObjUpvalue)* upvalues = ALLOCATE(vm, OBJ_REF(ObjUpvalue), function->upvalueCount);
 
     for (int i = 0; i < function->upvalueCount; i++) {
-        upvalues[i] = NULL;
+        upvalues[i] = TO_REF(NULL);
     }
 
-    ObjClosure* closure = ALLOCATE_OBJ(ObjClosure, OBJ_CLOSURE);
-    closure->function = function;
+    ObjClosure* closure = ALLOCATE_OBJ(vm, ObjClosure, OBJ_CLOSURE);
+    closure->function = TO_REF(function);
     closure->upvalues = upvalues;
     closure->upvalueCount = function->upvalueCount;
     return closure;
 }
 
-ObjFunction* newFunction() {
+ObjFiber* newFiber(VM* vm, ObjClosure* closure) {
+    // allocate the stacks first. they aren't objects, so a collection in between can't lose them.
+    CallFrame* frames = ALLOCATE(vm, CallFrame, FRAMES_INITIAL);
+    Value* stack = ALLOCATE(vm, Value, STACK_INITIAL);
+
+    ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->frames = frames;
+    fiber->frameCount = 0;
+    fiber->frameCapacity = FRAMES_INITIAL;
+    fiber->stack = stack;
+    fiber->stackTop = stack;
+    fiber->stackCapacity = STACK_INITIAL;
+    fiber->openUpvalues = NULL;
+    fiber->caller = NULL;
+    fiber->state = FIBER_RUNNING;
+    fiber->isTask = false;
+    if (closure != NULL) {
+        // closure sits in slot zero until the first resume calls it.
+        *fiber->stackTop++ = OBJ_VAL(closure);
+        fiber->state = FIBER_NEW;
+    }
+    return fiber;
+}
+
+ObjFunction* newFunction(VM* vm) {
     // allocate memory and initialize function object.
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     function->arity = 0;
     function->upvalueCount = 0;
+    function->maxSlots = 1;
     function->name = NULL;
+    function->image = NULL;
+    function->pending = NULL;
+    function->lazy = NULL;
+    function->calls = 0;
+    function->numberArgs = UINT32_MAX;
+    function->tier = NULL;
+    function->invokeCaches = NULL;
+    function->invokeCacheCount = 0;
+    function->module = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjInstance* newInstance(ObjClass* klass) {
-    ObjInstance* instance = ALLOCATE_OBJ(ObjInstance, OBJ_INSTANCE);
+ObjChannel* newChannel(VM* vm, struct Channel* channel) {
+    ObjChannel* object = ALLOCATE_OBJ(vm, ObjChannel, OBJ_CHANNEL);
+    object->channel = channel;
+    return object;
+}
+
+ObjInstance* newInstance(VM* vm, ObjClass* klass) {
+    ObjInstance* instance = ALLOCATE_OBJ(vm, ObjInstance, OBJ_INSTANCE);
     instance->klass = klass;
     // init field table.
     initTable(&instance->fields);
     return instance;
 }
 
-ObjNative* newNative(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjNative* newNative(VM* vm, NativeFn function) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
+static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash) {
     // create new ObjString on the heap and initalizes fields
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
     // push string object to stack temporarily.
-    push(OBJ_VAL(string));
+    push(vm, OBJ_VAL(string));
     // set string in internal strings hash table.
-    tableSet(&vm.strings, string, NIL_VAL);
-    pop();
+    tableSet(vm, &vm->strings, string, NIL_VAL);
+    pop(vm);
     return string;
 }
 
@@ -104,76 +144,83 @@ static uint32_t hashString(const char* key, int length) {
     return hash;
 }
 
-ObjString* takeString(char* chars, int length) {
+ObjString* takeString(VM* vm, char* chars, int length) {
     uint32_t hash = hashString(chars, length);
     // check if string is interned.
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != NULL) {
         // free memory since ownership is passed and no longer need the duplicate string.
-        FREE_ARRAY(char, chars, length + 1);
+        FREE_ARRAY(vm, char, chars, length + 1);
         return interned;
     }
 
-    return allocateString(chars, length, hash);
+    return allocateString(vm, chars, length, hash);
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
     // check if string is interned.
-    ObjString * interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString * interned = tableFindString(&vm->strings, chars, length, hash);
     if (interned != NULL) return interned;
 
     // allocate new array on heap for characters and trailing terminator
-    char* heapChars = ALLOCATE(char, length + 1);
+    char* heapChars = ALLOCATE(vm, char, length + 1);
     // copy characters from lexeme to array
     memcpy(heapChars, chars, length);
     heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(vm, heapChars, length, hash);
 }
 
-static void printFunction(ObjFunction* function) {
+static void printFunction(FILE* file, ObjFunction* function) {
     if (function->name == NULL) {
-        printf("<script>");
+        fprintf(file, "<script>");
         return;
     }
-    printf("<fn %s>", function->name->chars);
+    fprintf(file, "<fn %s>", function->name->chars);
 }
 
-ObjUpvalue* newUpvalue(Value* slot) {
-    ObjUpvalue* upvalue = ALLOCATE_OBJ(ObjUpvalue, OBJ_UPVALUE);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
     upvalue->closed = NIL_VAL;
     upvalue->location = slot;
-    upvalue->next = NULL;
+    upvalue->next = TO_REF(NULL);
+    upvalue->fiber = vm->fiber;
     return upvalue;
 }
 
-void printObject(Value value) {
+void printObject(FILE* file, Value value) {
     switch (OBJ_TYPE(value)) {
         case OBJ_BOUND_METHOD:
-            printFunction(AS_BOUND_METHOD(value)->method->function);
+            printFunction(file, FROM_REF(ObjFunction, FROM_REF(ObjClosure, AS_BOUND_METHOD(value)->method)->function));
+            break;
+        case OBJ_CHANNEL:
+            fprintf(file, "<channel %s>", AS_CHANNEL(value)->name);
             break;
         case OBJ_CLASS:
-            printf("%s", AS_CLASS(value)->name->chars);
+            fprintf(file, "%s", AS_CLASS(value)->name->chars);
             break;
         // handle closure object.
         case OBJ_CLOSURE:
-            printFunction(AS_CLOSURE(value)->function);
+            printFunction(file, FROM_REF(ObjFunction, AS_CLOSURE(value)->function));
+            break;
+        case OBJ_FIBER:
+            fprintf(file, "<fiber>");
             break;
         // handle function object.
         case OBJ_FUNCTION:
-            printFunction(AS_FUNCTION(value));
+            printFunction(file, AS_FUNCTION(value));
             break;
         case OBJ_INSTANCE:
-            printf("%s instance", AS_INSTANCE(value)->klass->name->chars);
+            fprintf(file, "%s instance", AS_INSTANCE(value)->klass->name->chars);
             break;
         case OBJ_NATIVE:
-            printf("<native fn>");
+            fprintf(file, "<native fn>");
             break;
         case OBJ_STRING:
-            printf("%s", AS_CSTRING(value));
+            fprintf(file, "%s", AS_CSTRING(value));
             break;
         case OBJ_UPVALUE:
-            printf("upvalue");
+            fprintf(file, "upvalue");
             break;
     }
 }
\ No newline at end of file
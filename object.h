@@ -10,10 +10,14 @@
 
 // check if value is bound method.
 #define IS_BOUND_METHOD(value) isObjType(value, OBJ_BOUND_METHOD)
+// check if value is channel object.
+#define IS_CHANNEL(value) isObjType(value, OBJ_CHANNEL)
 // check if value is class object.
 #define IS_CLASS(value) isObjType(value, OBJ_CLASS)
 // check if value is closure object.
 #define IS_CLOSURE(value) isObjType(value, OBJ_CLOSURE)
+// check if value is fiber object.
+#define IS_FIBER(value) isObjType(value, OBJ_FIBER)
 // check if value is function object.
 #define IS_FUNCTION(value) isObjType(value, OBJ_FUNCTION)
 // check if value is instance object.
@@ -23,10 +27,14 @@
 
 // convert to bound method.
 #define AS_BOUND_METHOD(value) ((ObjBoundMethod*)AS_OBJ(value))
+// convert value to the shared channel it wraps.
+#define AS_CHANNEL(value) (((ObjChannel*)AS_OBJ(value))->channel)
 // convert value to class object.
 #define AS_CLASS(value) ((ObjClass*)AS_OBJ(value))
 // convert object value to closure object.
 #define AS_CLOSURE(value) ((ObjClosure*)AS_OBJ(value))
+// convert value to fiber object.
+#define AS_FIBER(value) ((ObjFiber*)AS_OBJ(value))
 // convert object value to function object.
 #define AS_FUNCTION(value) ((ObjFunction*)AS_OBJ(value))
 #define AS_STRING(value) ((ObjString*)AS_OBJ(value))
@@ -38,8 +46,10 @@
 
 typedef enum {
     OBJ_BOUND_METHOD,
+    OBJ_CHANNEL,
     OBJ_CLASS,
     OBJ_CLOSURE,
+    OBJ_FIBER,
     OBJ_FUNCTION,
     OBJ_INSTANCE,
     OBJ_NATIVE,
@@ -47,22 +57,46 @@ typedef enum {
     OBJ_UPVALUE
 } ObjType;
 
+// marks and the list of objects live in the heap's pages, see memory.h.
 struct Obj {
     ObjType type;
-    bool isMarked;
-    struct Obj* next;
 };
 
+#ifdef COMPRESSED_HEAP
+// an object's page, by its index in the page table, and its offset in that
+// page in 8-byte units. 0 is NULL.
+typedef uint32_t ObjRef;
+// a field that refers to an object of type, and reading and writing it.
+#define OBJ_REF(type) ObjRef
+#define FROM_REF(type, ref) ((type*)refToObj(ref))
+#define TO_REF(object) objToRef((Obj*)(object))
+#else
+#define OBJ_REF(type) type*
+#define FROM_REF(type, ref) (ref)
+#define TO_REF(object) (object)
+#endif
+
 typedef struct {
     Obj obj;
     int arity; // number of parameters.
     int upvalueCount; // number of upvalue.
+    int maxSlots; // stack slots a callframe of it can use, slot zero included.
     Chunk chunk; // each function has its own chunk.
     ObjString* name; // function name.
+    struct Image* image; // mapped image its code and lines live in. NULL if compiled here.
+    const struct ImageFunction* pending; // image record whose constants haven't been loaded yet.
+    struct LazyBody* lazy; // body skipped by the compiler, compiled on the first call.
+    int calls; // calls counted toward optimizing it. -1 once the tier has given up on it.
+    uint32_t numberArgs; // bit i stays set while every call passes a number as argument i.
+    struct Tier* tier; // optimized code, once the function is hot.
+    struct InvokeCache* invokeCaches; // one per constant, for the invokes of that name. NULL until one runs.
+    int invokeCacheCount;
+    struct ObjInstance* module; // namespace of the module it was declared in. NULL in the script, which uses vm->globals.
 } ObjFunction;
 
-// native function takes argument count and pointer to first argument on the stack.
-typedef Value (*NativeFn)(int argCount, Value* args);
+// native function takes the calling vm, argument count and pointer to first argument on the stack.
+// it stores its result in args[-1], the callee slot. returns false after reporting a runtime error.
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
 
 // it doesn't push a callframe when called. it has no bytecode.
 typedef struct {
@@ -72,33 +106,65 @@ typedef struct {
 
 typedef struct ObjUpvalue {
     Obj obj;
-    Value* location;
+    OBJ_REF(struct ObjUpvalue) next; // the next upvalue in the linked list.
+    Value* location; // points into a stack, which is outside the heap, so it stays a pointer.
     Value closed; // closed upvalue on heap.
-    struct ObjUpvalue* next; // pointer to the next upvalue in the linked list.
+    struct ObjFiber* fiber; // fiber whose stack an open upvalue points into. NULL once closed.
 } ObjUpvalue;
 
 struct ObjString {
     Obj obj;
     int length;
-    char* chars;
     uint32_t hash;
+    char* chars;
 };
 
 // ObjClosure wrap ObjFunction and capture surrounding local variables.
 typedef struct {
     Obj obj;
-    ObjFunction* function;
-    ObjUpvalue** upvalues; // pointer to array of upvalue pointers.
+    OBJ_REF(ObjFunction) function;
+    OBJ_REF(ObjUpvalue)* upvalues; // pointer to array of upvalue references.
     int upvalueCount;
 } ObjClosure;
 
+// a callframe represents a single ongoing function call.
+typedef struct {
+    ObjClosure* closure;
+    uint8_t* ip; // caller's ip. when return from a function. the VM will jump to ip of the caller's callframe.
+    Value* slots; // points to the VM's stack at the first slot this function can use.
+} CallFrame;
+
+typedef enum {
+    FIBER_NEW, // created but never resumed.
+    FIBER_SUSPENDED, // parked in a yield.
+    FIBER_RUNNING, // running, or waiting for a fiber it resumed.
+    FIBER_WAITING, // parked in the event loop.
+    FIBER_DONE // returned or died with a runtime error.
+} FiberState;
+
+// a suspendable thread of execution with its own stacks.
+// the running fiber's stacks are loaded into the vm, so the copies here are only current while it is switched out.
+typedef struct ObjFiber {
+    Obj obj;
+    CallFrame* frames;
+    int frameCount;
+    int frameCapacity;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+    struct ObjFiber* caller; // fiber that resumed this one and gets control back when it yields.
+    FiberState state;
+    bool isTask; // started by spawn(). the event loop runs it instead of a resume.
+} ObjFiber;
+
 typedef struct {
     Obj obj;
     ObjString* name; // class name.
     Table methods; // class methods.
 } ObjClass;
 
-typedef struct {
+typedef struct ObjInstance {
     Obj obj;
     ObjClass* klass; // pointer to class thaat it is an instance of.
     Table fields; // state of instance by hash table.
@@ -106,27 +172,54 @@ typedef struct {
 
 typedef struct {
     Obj obj;
+    OBJ_REF(ObjClosure) method;
     Value receiver;
-    ObjClosure* method;
 } ObjBoundMethod;
 
+// what an invoke can do in place of calling the method, without a callframe.
+typedef enum {
+    INLINE_NONE, // call it.
+    INLINE_GETTER, // return this.field;
+    INLINE_SETTER, // this.field = argument;
+    INLINE_CONSTANT, // return a constant, nil, true or false.
+    INLINE_THIS // return this;
+} InlineKind;
+
+// method the last invoke of a name found, for receivers of one class.
+typedef struct InvokeCache {
+    ObjClass* klass; // NULL while empty.
+    ObjClosure* method;
+    InlineKind kind;
+    Value value; // field name of a getter or setter, result of a constant.
+} InvokeCache;
+
+// a vm's handle on a channel. the channel itself lives outside every heap.
+typedef struct {
+    Obj obj;
+    struct Channel* channel; // holds one reference.
+} ObjChannel;
+
 
 // create bound method.
-ObjBoundMethod* newBoundMethod(Value receiver, ObjClosure* method);
+ObjBoundMethod* newBoundMethod(VM* vm, Value receiver, ObjClosure* method);
+// wrap a channel reference. the object takes ownership of the reference.
+ObjChannel* newChannel(VM* vm, struct Channel* channel);
 // create new class.
-ObjClass* newClass(ObjString* name);
+ObjClass* newClass(VM* vm, ObjString* name);
 // create new closure.
-ObjClosure* newClosure(ObjFunction* function);
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+// create fiber that will run closure when first resumed. NULL creates the vm's main fiber.
+ObjFiber* newFiber(VM* vm, ObjClosure* closure);
 // create new function.
-ObjFunction* newFunction();
+ObjFunction* newFunction(VM* vm);
 // create new instance.
-ObjInstance* newInstance(ObjClass* klass);
+ObjInstance* newInstance(VM* vm, ObjClass* klass);
 // create native function.
-ObjNative* newNative(NativeFn function);
-ObjString* takeString(char* chars, int length);
-ObjString* copyString(const char* chars, int length);
-ObjUpvalue* newUpvalue(Value* slot);
-void printObject(Value value);
+ObjNative* newNative(VM* vm, NativeFn function);
+ObjString* takeString(VM* vm, char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+void printObject(FILE* file, Value value);
 
 static inline bool isObjType(Value value, ObjType type) {
   return IS_OBJ(value) && OBJ_TYPE(value) == type;
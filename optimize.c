@@ -0,0 +1,375 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "optimize.h"
+#include "value.h"
+
+// passes run until nothing changes. each pass can only remove code, so this is a safety net.
+#define MAX_PASSES 16
+
+// a decoded instruction. jumps name the instruction they go to rather than
+// an offset, so instructions can be dropped without repatching anything.
+typedef struct {
+    uint8_t op;
+    int from; // offset in the original code. operands are copied from there.
+    int length;
+    int line;
+    int target; // instruction a jump goes to.
+    int constant; // operand of OP_CONSTANT, which folding may replace.
+    bool removed;
+} Instr;
+
+typedef struct {
+    VM* vm;
+    Chunk* chunk;
+    Instr* instrs; // count + 1 entries. the last one stands for the end of the code.
+    int count;
+    bool* labels; // instructions a jump or the exception table points at.
+    bool* reached;
+    int* handlers; // start, end and target of every handler as instruction indices.
+    bool changed;
+} Optimizer;
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP;
+}
+
+// first instruction still there at or after index.
+static int live(Optimizer* optimizer, int index) {
+    while (index < optimizer->count && optimizer->instrs[index].removed) index++;
+    return index;
+}
+
+static int liveAfter(Optimizer* optimizer, int index) {
+    return live(optimizer, index + 1);
+}
+
+static void removeInstr(Optimizer* optimizer, int index) {
+    optimizer->instrs[index].removed = true;
+    optimizer->changed = true;
+}
+
+// the value an instruction pushes, if it is a literal.
+static bool literal(Optimizer* optimizer, Instr* instr, Value* value) {
+    switch (instr->op) {
+        case OP_CONSTANT: *value = optimizer->chunk->constants.values[instr->constant]; return true;
+        case OP_NIL: *value = NIL_VAL; return true;
+        case OP_TRUE: *value = BOOL_VAL(true); return true;
+        case OP_FALSE: *value = BOOL_VAL(false); return true;
+        default: return false;
+    }
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+// turn instr into one that pushes value. false if the constant table is full.
+static bool setLiteral(Optimizer* optimizer, Instr* instr, Value value) {
+    if (IS_BOOL(value)) {
+        instr->op = AS_BOOL(value) ? OP_TRUE : OP_FALSE;
+        instr->length = 1;
+        return true;
+    }
+    ValueArray* constants = &optimizer->chunk->constants;
+    int constant = -1;
+    double number = AS_NUMBER(value);
+    for (int i = 0; i < constants->count && constant == -1; i++) {
+        // 0 and -0 are equal but aren't the same constant.
+        Value existing = constants->values[i];
+        if (!IS_NUMBER(existing) || IS_INT(existing) != IS_INT(value)) continue;
+        double other = AS_NUMBER(existing);
+        if (memcmp(&other, &number, sizeof(double)) == 0) constant = i;
+    }
+    if (constant == -1) {
+        if (constants->count > UINT8_MAX) return false;
+        constant = addConstant(optimizer->vm, optimizer->chunk, value);
+    }
+    instr->op = OP_CONSTANT;
+    instr->length = 2;
+    instr->constant = constant;
+    return true;
+}
+
+// fold a binary operator over two literals. operands it would raise a runtime error on are left alone.
+static bool foldBinary(uint8_t op, Value a, Value b, Value* result) {
+    if (op == OP_EQUAL) {
+        *result = BOOL_VAL(valuesEqual(a, b));
+        return true;
+    }
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (op) {
+        case OP_GREATER:
+        case OP_GREATER_NUMBER: *result = BOOL_VAL(x > y); return true;
+        case OP_LESS:
+        case OP_LESS_NUMBER: *result = BOOL_VAL(x < y); return true;
+        case OP_ADD:
+        case OP_ADD_NUMBER: *result = exactNumber(x + y); return true;
+        case OP_SUBTRACT:
+        case OP_SUBTRACT_NUMBER: *result = exactNumber(x - y); return true;
+        case OP_MULTIPLY:
+        case OP_MULTIPLY_NUMBER: *result = exactNumber(x * y); return true;
+        case OP_DIVIDE:
+        case OP_DIVIDE_NUMBER: *result = exactNumber(x / y); return true;
+        default: return false;
+    }
+}
+
+static bool foldUnary(uint8_t op, Value a, Value* result) {
+    if (op == OP_NOT) {
+        *result = BOOL_VAL(isFalsey(a));
+        return true;
+    }
+    if ((op == OP_NEGATE || op == OP_NEGATE_NUMBER) && IS_NUMBER(a)) {
+        *result = exactNumber(-AS_NUMBER(a));
+        return true;
+    }
+    return false;
+}
+
+// pushes that can be dropped along with the pop after them.
+static bool isPurePush(uint8_t op) {
+    return op == OP_CONSTANT || op == OP_NIL || op == OP_TRUE || op == OP_FALSE ||
+        op == OP_GET_LOCAL || op == OP_GET_UPVALUE;
+}
+
+static void markLabels(Optimizer* optimizer) {
+    memset(optimizer->labels, 0, sizeof(bool) * (optimizer->count + 1));
+    for (int i = 0; i < optimizer->count; i++) {
+        Instr* instr = &optimizer->instrs[i];
+        if (instr->removed || !isJump(instr->op)) continue;
+        instr->target = live(optimizer, instr->target);
+        optimizer->labels[instr->target] = true;
+    }
+    for (int i = 0; i < optimizer->chunk->handlerCount * 3; i++) {
+        optimizer->labels[live(optimizer, optimizer->handlers[i])] = true;
+    }
+}
+
+// a jump to an unconditional jump goes straight to where that one goes. a
+// failed conditional jump to another conditional jump fails that one too,
+// since the condition is still on the stack. conditional jumps only go forward.
+static void threadJumps(Optimizer* optimizer) {
+    for (int i = 0; i < optimizer->count; i++) {
+        Instr* instr = &optimizer->instrs[i];
+        if (instr->removed || !isJump(instr->op)) continue;
+        for (int hops = 0; hops < optimizer->count; hops++) {
+            Instr* next = &optimizer->instrs[live(optimizer, instr->target)];
+            if (next == instr || live(optimizer, instr->target) == optimizer->count) break;
+            bool follows = next->op == OP_JUMP || next->op == OP_LOOP ||
+                (instr->op == OP_JUMP_IF_FALSE && next->op == OP_JUMP_IF_FALSE);
+            if (!follows) break;
+            int target = live(optimizer, next->target);
+            if (target == instr->target) break;
+            if (instr->op == OP_JUMP_IF_FALSE && target <= i) break;
+            instr->target = target;
+            optimizer->changed = true;
+        }
+    }
+}
+
+static void peephole(Optimizer* optimizer) {
+    bool* labels = optimizer->labels;
+    for (int i = live(optimizer, 0); i < optimizer->count; i = liveAfter(optimizer, i)) {
+        Instr* first = &optimizer->instrs[i];
+        int j = liveAfter(optimizer, i);
+        if (j == optimizer->count) break;
+        Instr* second = &optimizer->instrs[j];
+        Value a, b, result;
+
+        // a jump to the next instruction goes nowhere, whether or not it is taken.
+        if ((second->op == OP_JUMP || second->op == OP_JUMP_IF_FALSE) && live(optimizer, second->target) == liveAfter(optimizer, j)) {
+            removeInstr(optimizer, j);
+            continue;
+        }
+        // control can enter the middle of a pattern at a label, so patterns stop there.
+        if (labels[j]) continue;
+
+        if (literal(optimizer, first, &a)) {
+            int k = liveAfter(optimizer, j);
+            if (k < optimizer->count && !labels[k] && literal(optimizer, second, &b) &&
+                    foldBinary(optimizer->instrs[k].op, a, b, &result) && setLiteral(optimizer, first, result)) {
+                removeInstr(optimizer, j);
+                removeInstr(optimizer, k);
+                continue;
+            }
+            if (foldUnary(second->op, a, &result) && setLiteral(optimizer, first, result)) {
+                removeInstr(optimizer, j);
+                continue;
+            }
+            // the condition is known. the pop on either path stays.
+            if (second->op == OP_JUMP_IF_FALSE) {
+                if (isFalsey(a)) {
+                    second->op = OP_JUMP;
+                    optimizer->changed = true;
+                } else {
+                    removeInstr(optimizer, j);
+                }
+                continue;
+            }
+        }
+
+        if (!isPurePush(first->op)) continue;
+        if (second->op == OP_POP) {
+            removeInstr(optimizer, i);
+            removeInstr(optimizer, j);
+            continue;
+        }
+        // a push whose only use is a pop at the jump's target skips both.
+        if (second->op != OP_JUMP) continue;
+        int target = live(optimizer, second->target);
+        if (target < optimizer->count && optimizer->instrs[target].op == OP_POP) {
+            removeInstr(optimizer, i);
+            second->target = liveAfter(optimizer, target);
+            labels[second->target] = true;
+        }
+    }
+}
+
+static void removeUnreachable(Optimizer* optimizer) {
+    int* stack = (int*)malloc(sizeof(int) * (optimizer->count + optimizer->chunk->handlerCount + 1));
+    if (stack == NULL) exit(1);
+    memset(optimizer->reached, 0, sizeof(bool) * (optimizer->count + 1));
+    int top = 0;
+    stack[top++] = live(optimizer, 0);
+    for (int i = 0; i < optimizer->chunk->handlerCount; i++) {
+        stack[top++] = live(optimizer, optimizer->handlers[i * 3 + 2]);
+    }
+    while (top > 0) {
+        int index = stack[--top];
+        if (index >= optimizer->count || optimizer->reached[index]) continue;
+        optimizer->reached[index] = true;
+        Instr* instr = &optimizer->instrs[index];
+        if (isJump(instr->op)) stack[top++] = live(optimizer, instr->target);
+        if (instr->op != OP_JUMP && instr->op != OP_LOOP && instr->op != OP_RETURN && instr->op != OP_THROW) {
+            stack[top++] = liveAfter(optimizer, index);
+        }
+    }
+    free(stack);
+
+    for (int i = 0; i < optimizer->count; i++) {
+        if (!optimizer->instrs[i].removed && !optimizer->reached[i]) removeInstr(optimizer, i);
+    }
+}
+
+// write the instructions that are left back into the chunk. false if a jump no longer fits.
+static bool encode(Optimizer* optimizer) {
+    Chunk* chunk = optimizer->chunk;
+    int* offsets = (int*)malloc(sizeof(int) * (optimizer->count + 1));
+    if (offsets == NULL) exit(1);
+    int count = 0;
+    for (int i = 0; i < optimizer->count; i++) {
+        offsets[i] = count;
+        if (!optimizer->instrs[i].removed) count += optimizer->instrs[i].length;
+    }
+    offsets[optimizer->count] = count;
+
+    uint8_t* code = ALLOCATE(optimizer->vm, uint8_t, count);
+    int* lines = ALLOCATE(optimizer->vm, int, count);
+    for (int i = 0; i < optimizer->count; i++) {
+        Instr* instr = &optimizer->instrs[i];
+        if (instr->removed) continue;
+        int offset = offsets[i];
+        for (int j = 0; j < instr->length; j++) lines[offset + j] = instr->line;
+        if (instr->op == OP_CONSTANT) {
+            code[offset] = OP_CONSTANT;
+            code[offset + 1] = (uint8_t)instr->constant;
+        } else if (isJump(instr->op)) {
+            // a removed target means the next instruction that is left.
+            int target = offsets[instr->target];
+            int jump = target > offset ? target - offset - 3 : offset + 3 - target;
+            if ((instr->op == OP_JUMP_IF_FALSE && target <= offset) || jump > UINT16_MAX) {
+                FREE_ARRAY(optimizer->vm, uint8_t, code, count);
+                FREE_ARRAY(optimizer->vm, int, lines, count);
+                free(offsets);
+                return false;
+            }
+            if (instr->op != OP_JUMP_IF_FALSE) instr->op = target > offset ? OP_JUMP : OP_LOOP;
+            code[offset] = instr->op;
+            code[offset + 1] = (jump >> 8) & 0xff;
+            code[offset + 2] = jump & 0xff;
+        } else {
+            memcpy(code + offset, chunk->code + instr->from, instr->length);
+            code[offset] = instr->op;
+        }
+    }
+
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        Handler* handler = &chunk->handlers[i];
+        handler->start = offsets[optimizer->handlers[i * 3]];
+        handler->end = offsets[optimizer->handlers[i * 3 + 1]];
+        handler->target = offsets[optimizer->handlers[i * 3 + 2]];
+    }
+    FREE_ARRAY(optimizer->vm, uint8_t, chunk->code, chunk->capacity);
+    FREE_ARRAY(optimizer->vm, int, chunk->lines, chunk->capacity);
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = count;
+    chunk->capacity = count;
+    free(offsets);
+    return true;
+}
+
+void optimizeChunk(VM* vm, Chunk* chunk) {
+    Optimizer optimizer;
+    optimizer.vm = vm;
+    optimizer.chunk = chunk;
+
+    // decode. indexAt maps the offset an instruction starts at to its index.
+    int* indexAt = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    optimizer.instrs = (Instr*)malloc(sizeof(Instr) * (chunk->count + 1));
+    optimizer.labels = (bool*)malloc(sizeof(bool) * (chunk->count + 1));
+    optimizer.reached = (bool*)malloc(sizeof(bool) * (chunk->count + 1));
+    optimizer.handlers = (int*)malloc(sizeof(int) * (chunk->handlerCount * 3 + 1));
+    if (indexAt == NULL || optimizer.instrs == NULL || optimizer.labels == NULL ||
+            optimizer.reached == NULL || optimizer.handlers == NULL) exit(1);
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += optimizer.instrs[count - 1].length) {
+        Instr* instr = &optimizer.instrs[count];
+        instr->op = chunk->code[offset];
+        instr->from = offset;
+        instr->length = instructionLength(chunk, offset);
+        instr->line = chunk->lines[offset];
+        instr->target = -1;
+        instr->constant = instr->op == OP_CONSTANT ? chunk->code[offset + 1] : -1;
+        instr->removed = false;
+        indexAt[offset] = count++;
+    }
+    optimizer.count = count;
+    indexAt[chunk->count] = count;
+    for (int i = 0; i < count; i++) {
+        Instr* instr = &optimizer.instrs[i];
+        if (!isJump(instr->op)) continue;
+        int jump = (chunk->code[instr->from + 1] << 8) | chunk->code[instr->from + 2];
+        instr->target = indexAt[instr->from + 3 + (instr->op == OP_LOOP ? -jump : jump)];
+    }
+    for (int i = 0; i < chunk->handlerCount; i++) {
+        optimizer.handlers[i * 3] = indexAt[chunk->handlers[i].start];
+        optimizer.handlers[i * 3 + 1] = indexAt[chunk->handlers[i].end];
+        optimizer.handlers[i * 3 + 2] = indexAt[chunk->handlers[i].target];
+    }
+    free(indexAt);
+
+    bool optimized = false;
+    for (int pass = 0; pass < MAX_PASSES; pass++) {
+        optimizer.changed = false;
+        markLabels(&optimizer);
+        threadJumps(&optimizer);
+        markLabels(&optimizer);
+        peephole(&optimizer);
+        removeUnreachable(&optimizer);
+        if (!optimizer.changed) break;
+        optimized = true;
+    }
+    // code that can't be encoded any more is left as the compiler wrote it.
+    if (optimized) encode(&optimizer);
+
+    free(optimizer.instrs);
+    free(optimizer.labels);
+    free(optimizer.reached);
+    free(optimizer.handlers);
+}
@@ -0,0 +1,13 @@
+#ifndef clox_optimize_h
+#define clox_optimize_h
+
+#include "chunk.h"
+#include "common.h"
+
+// peephole pass over a finished chunk: folds constant arithmetic and
+// comparisons, folds branches on constant conditions, drops unreachable code
+// and push/pop pairs, and threads jumps through jumps. line info and the
+// exception table follow the instructions that are kept.
+void optimizeChunk(VM* vm, Chunk* chunk);
+
+#endif
@@ -0,0 +1,281 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "compiler.h"
+#include "pool.h"
+#include "serialize.h"
+
+static void initQueue(JobQueue* queue) {
+    for (size_t i = 0; i < POOL_QUEUE_CAPACITY; i++) {
+        atomic_init(&queue->slots[i].sequence, i);
+        queue->slots[i].job = NULL;
+    }
+    atomic_init(&queue->enqueuePos, 0);
+    atomic_init(&queue->dequeuePos, 0);
+}
+
+static bool enqueue(JobQueue* queue, Job* job) {
+    size_t pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+    JobSlot* slot;
+    for (;;) {
+        slot = &queue->slots[pos & (POOL_QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+        if (diff == 0) {
+            // slot is free for this position. claim it.
+            if (atomic_compare_exchange_weak_explicit(&queue->enqueuePos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // consumers haven't freed the slot yet. queue is full.
+            return false;
+        } else {
+            // another producer claimed the position first.
+            pos = atomic_load_explicit(&queue->enqueuePos, memory_order_relaxed);
+        }
+    }
+
+    slot->job = job;
+    // publish the job to consumers.
+    atomic_store_explicit(&slot->sequence, pos + 1, memory_order_release);
+    return true;
+}
+
+static bool dequeue(JobQueue* queue, Job** job) {
+    size_t pos = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+    JobSlot* slot;
+    for (;;) {
+        slot = &queue->slots[pos & (POOL_QUEUE_CAPACITY - 1)];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(&queue->dequeuePos, &pos, pos + 1,
+                    memory_order_relaxed, memory_order_relaxed)) break;
+        } else if (diff < 0) {
+            // nothing published at this position. queue is empty.
+            return false;
+        } else {
+            pos = atomic_load_explicit(&queue->dequeuePos, memory_order_relaxed);
+        }
+    }
+
+    *job = slot->job;
+    // hand the slot back to producers for the next lap around the ring.
+    atomic_store_explicit(&slot->sequence, pos + POOL_QUEUE_CAPACITY, memory_order_release);
+    return true;
+}
+
+// compile in the worker's vm. the bytecode handed back holds no pointers into its heap.
+static void compileJob(VM* vm, Job* job) {
+    FILE* err = open_memstream(&job->errors, &job->errorsLength);
+    if (err == NULL) exit(74);
+    vm->err = err;
+
+    ObjFunction* function = job->kind == JOB_COMPILE ? compile(vm, job->source)
+                                                     : compileBody(vm, job->body, job->name);
+    size_t length = 0;
+    uint8_t* bytes = function != NULL ? serializeFunction(function, 0, &length) : NULL;
+    job->result = bytes != NULL ? INTERPRET_OK : INTERPRET_COMPILE_ERROR;
+    job->output = (char*)bytes;
+    job->outputLength = length;
+
+    fclose(err);
+    vm->err = stderr;
+}
+
+static void runJob(VM* vm, Job* job) {
+    if (job->kind != JOB_RUN) {
+        compileJob(vm, job);
+        return;
+    }
+    // capture what the script writes.
+    FILE* out = open_memstream(&job->output, &job->outputLength);
+    FILE* err = open_memstream(&job->errors, &job->errorsLength);
+    if (out == NULL || err == NULL) exit(74);
+    vm->out = out;
+    vm->err = err;
+
+    job->result = interpret(vm, job->source);
+
+    fclose(out);
+    fclose(err);
+    vm->out = stdout;
+    vm->err = stderr;
+    // next job starts from a clean global namespace.
+    resetGlobals(vm);
+}
+
+static void* workerMain(void* arg) {
+    WorkerPool* pool = (WorkerPool*)arg;
+    VM vm;
+    initVM(&vm);
+
+    for (;;) {
+        sem_wait(&pool->available);
+        Job* job;
+        // the semaphore guarantees a job is queued, but its producer may still be publishing it.
+        while (!dequeue(&pool->queue, &job)) sched_yield();
+        // null job tells the worker to shut down.
+        if (job == NULL) break;
+
+        runJob(&vm, job);
+        sem_post(&job->done);
+    }
+
+    freeVM(&vm);
+    return NULL;
+}
+
+void initWorkerPool(WorkerPool* pool, int workerCount) {
+    initQueue(&pool->queue);
+    sem_init(&pool->available, 0, 0);
+    pool->workerCount = workerCount;
+    pool->threads = (pthread_t*)malloc(sizeof(pthread_t) * workerCount);
+    if (pool->threads == NULL) exit(1);
+
+    for (int i = 0; i < workerCount; i++) {
+        if (pthread_create(&pool->threads[i], NULL, workerMain, pool) != 0) {
+            fprintf(stderr, "Could not start worker thread.\n");
+            exit(71);
+        }
+    }
+}
+
+void freeWorkerPool(WorkerPool* pool) {
+    // queued jobs run before the shutdown signals.
+    for (int i = 0; i < pool->workerCount; i++) {
+        poolSubmit(pool, NULL);
+    }
+    for (int i = 0; i < pool->workerCount; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    free(pool->threads);
+    pool->threads = NULL;
+    pool->workerCount = 0;
+    sem_destroy(&pool->available);
+}
+
+void initJob(Job* job, const char* source) {
+    job->kind = JOB_RUN;
+    job->source = source;
+    job->body = NULL;
+    job->name = NULL;
+    job->result = INTERPRET_OK;
+    job->output = NULL;
+    job->outputLength = 0;
+    job->errors = NULL;
+    job->errorsLength = 0;
+    sem_init(&job->done, 0, 0);
+}
+
+void freeJob(Job* job) {
+    free(job->output);
+    free(job->errors);
+    job->output = NULL;
+    job->errors = NULL;
+    sem_destroy(&job->done);
+}
+
+void poolSubmit(WorkerPool* pool, Job* job) {
+    // a full queue drains as workers pick up jobs.
+    while (!enqueue(&pool->queue, job)) sched_yield();
+    sem_post(&pool->available);
+}
+
+InterpretResult poolWait(Job* job) {
+    sem_wait(&job->done);
+    return job->result;
+}
+
+// the jobs compiling one source, and for split sources the functions whose bodies they compile.
+typedef struct {
+    Job* jobs;
+    ObjFunction** targets;
+    int count;
+} CompileBatch;
+
+// skip the bodies of source's functions on this thread, which only takes a
+// scan, and queue a job for each body. vm->err gets the scan's errors.
+static void splitSource(WorkerPool* pool, VM* vm, const char* source, Script** script, CompileBatch* batch) {
+    bool lazy = vm->lazyFunctions;
+    vm->lazyFunctions = true;
+    ObjFunction* function = compile(vm, source);
+    vm->lazyFunctions = lazy;
+    if (function == NULL) return;
+    *script = newScript(vm, function);
+
+    // a skipped function, method included, is a constant of the script. its nested functions go with it.
+    ValueArray* constants = &function->chunk.constants;
+    batch->jobs = (Job*)malloc(sizeof(Job) * (constants->count + 1));
+    batch->targets = (ObjFunction**)malloc(sizeof(ObjFunction*) * (constants->count + 1));
+    if (batch->jobs == NULL || batch->targets == NULL) exit(1);
+    for (int i = 0; i < constants->count; i++) {
+        if (!IS_FUNCTION(constants->values[i]) || AS_FUNCTION(constants->values[i])->lazy == NULL) continue;
+        ObjFunction* target = AS_FUNCTION(constants->values[i]);
+        Job* job = &batch->jobs[batch->count];
+        initJob(job, NULL);
+        job->kind = JOB_COMPILE_BODY;
+        job->body = target->lazy;
+        job->name = target->name->chars;
+        batch->targets[batch->count++] = target;
+    }
+    // the script holds the targets, so their bodies and names stay put while workers read them.
+    for (int i = 0; i < batch->count; i++) poolSubmit(pool, &batch->jobs[i]);
+}
+
+bool poolCompile(WorkerPool* pool, VM* vm, const char** sources, int count, Script** scripts) {
+    // with at least a source per worker, each job compiles a whole source.
+    // with fewer, sources are split into function bodies to keep the workers busy.
+    bool split = count < pool->workerCount;
+    CompileBatch* batches = (CompileBatch*)calloc(count + 1, sizeof(CompileBatch));
+    if (batches == NULL) exit(1);
+    for (int i = 0; i < count; i++) {
+        scripts[i] = NULL;
+        if (split) {
+            splitSource(pool, vm, sources[i], &scripts[i], &batches[i]);
+            continue;
+        }
+        batches[i].jobs = (Job*)malloc(sizeof(Job));
+        if (batches[i].jobs == NULL) exit(1);
+        initJob(&batches[i].jobs[0], sources[i]);
+        batches[i].jobs[0].kind = JOB_COMPILE;
+        batches[i].count = 1;
+        poolSubmit(pool, &batches[i].jobs[0]);
+    }
+
+    // load the results in order, so errors come out the same on every run.
+    bool ok = true;
+    for (int i = 0; i < count; i++) {
+        CompileBatch* batch = &batches[i];
+        bool failed = split && scripts[i] == NULL;
+        for (int j = 0; j < batch->count; j++) {
+            Job* job = &batch->jobs[j];
+            InterpretResult result = poolWait(job);
+            fwrite(job->errors, 1, job->errorsLength, vm->err);
+            ObjFunction* compiled = NULL;
+            if (result == INTERPRET_OK && !failed) {
+                compiled = deserializeFunction(vm, (uint8_t*)job->output, job->outputLength, 0);
+            }
+            if (compiled == NULL) {
+                failed = true;
+            } else if (split) {
+                adoptBody(vm, batch->targets[j], compiled);
+            } else {
+                scripts[i] = newScript(vm, compiled);
+            }
+            freeJob(job);
+        }
+        if (failed && scripts[i] != NULL) {
+            releaseScript(vm, scripts[i]);
+            scripts[i] = NULL;
+        }
+        if (failed) ok = false;
+        free(batch->jobs);
+        free(batch->targets);
+    }
+    free(batches);
+    return ok;
+}
@@ -0,0 +1,74 @@
+#ifndef clox_pool_h
+#define clox_pool_h
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "common.h"
+#include "vm.h"
+
+// capacity of the job queue. must be a power of two.
+#define POOL_QUEUE_CAPACITY 1024
+
+typedef enum {
+    JOB_RUN, // interpret source.
+    JOB_COMPILE, // compile source. output is the serialized top-level function.
+    JOB_COMPILE_BODY, // compile a function body a lazy compile skipped. output is the serialized scratch function.
+} JobKind;
+
+// a script submitted to the pool. the submitter owns the job and its source.
+typedef struct {
+    JobKind kind;
+    const char* source;
+    const struct LazyBody* body; // body and function name for JOB_COMPILE_BODY.
+    const char* name;
+    InterpretResult result;
+    char* output; // what the script printed. owned by the job.
+    size_t outputLength;
+    char* errors; // compile and runtime errors. owned by the job.
+    size_t errorsLength;
+    sem_t done; // posted by the worker once result, output and errors are set.
+} Job;
+
+typedef struct {
+    atomic_size_t sequence;
+    Job* job;
+} JobSlot;
+
+// bounded multi-producer multi-consumer queue. every slot carries a sequence
+// number that tells producers and consumers whose turn it is, so enqueue and
+// dequeue only ever contend on a single compare-and-swap.
+typedef struct {
+    JobSlot slots[POOL_QUEUE_CAPACITY];
+    _Alignas(64) atomic_size_t enqueuePos;
+    _Alignas(64) atomic_size_t dequeuePos;
+} JobQueue;
+
+// each worker thread owns an isolated vm for its whole lifetime,
+// so vm startup is paid once per thread instead of once per script.
+typedef struct {
+    JobQueue queue;
+    sem_t available; // number of jobs in the queue. idle workers sleep on it.
+    pthread_t* threads;
+    int workerCount;
+} WorkerPool;
+
+void initWorkerPool(WorkerPool* pool, int workerCount);
+// waits for queued jobs to finish and joins the workers.
+void freeWorkerPool(WorkerPool* pool);
+
+void initJob(Job* job, const char* source);
+void freeJob(Job* job);
+void poolSubmit(WorkerPool* pool, Job* job);
+// block until the job has run.
+InterpretResult poolWait(Job* job);
+
+// compile sources into scripts of vm on the pool's workers, like calling
+// compileScript on each. workers compile in their own vms and hand back
+// bytecode, which is loaded into vm here, interning its strings there.
+// every function body is compiled, even with vm->lazyFunctions. scripts[i]
+// is NULL if sources[i] doesn't compile. false if any of them doesn't.
+bool poolCompile(WorkerPool* pool, VM* vm, const char** sources, int count, Script** scripts);
+
+#endif
@@ -19,6 +19,7 @@ typedef enum {
   TOKEN_FOR, TOKEN_FUN, TOKEN_IF, TOKEN_NIL, TOKEN_OR,
   TOKEN_PRINT, TOKEN_RETURN, TOKEN_SUPER, TOKEN_THIS,
   TOKEN_TRUE, TOKEN_VAR, TOKEN_WHILE,
+  TOKEN_TRY, TOKEN_CATCH, TOKEN_THROW, TOKEN_IMPORT,
 
   TOKEN_ERROR, TOKEN_EOF
 } TokenType;
@@ -30,7 +31,13 @@ typedef struct {
   int line;
 } Token;
 
-void initScanner(const char* source);
-Token scanToken();
+typedef struct {
+  const char* start;
+  const char* current;
+  int line;
+} Scanner;
+
+void initScanner(Scanner* scanner, const char* source);
+Token scanToken(Scanner* scanner);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,574 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "serialize.h"
+#include "vm.h"
+
+// nested functions are read recursively and each one being read sits on the vm stack.
+#define FUNCTION_DEPTH_MAX 128
+// code sections start on a page of their own.
+#define IMAGE_PAGE_SIZE 4096
+
+typedef enum {
+    CONSTANT_NUMBER,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION
+} ConstantTag;
+
+uint64_t hashBytes(const void* bytes, size_t length) {
+    // 64-bit fnv-1a.
+    const uint8_t* current = (const uint8_t*)bytes;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= current[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+void writeBytes(Writer* writer, const void* bytes, size_t length) {
+    if (length == 0) return;
+    if (writer->length + length > writer->capacity) {
+        size_t capacity = writer->capacity < 256 ? 256 : writer->capacity * 2;
+        while (capacity < writer->length + length) capacity *= 2;
+        writer->bytes = (uint8_t*)realloc(writer->bytes, capacity);
+        if (writer->bytes == NULL) exit(1);
+        writer->capacity = capacity;
+    }
+    memcpy(writer->bytes + writer->length, bytes, length);
+    writer->length += length;
+}
+
+void writeInt(Writer* writer, int32_t value) {
+    writeBytes(writer, &value, sizeof(value));
+}
+
+void writeCode(Writer* writer, Chunk* chunk) {
+    writeInt(writer, chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+    // the line table is run-length encoded as line and run pairs.
+    int runs = 0;
+    for (int i = 0; i < chunk->count; i++) {
+        if (i == 0 || chunk->lines[i] != chunk->lines[i - 1]) runs++;
+    }
+    writeInt(writer, runs);
+    for (int i = 0; i < chunk->count;) {
+        int start = i;
+        while (i < chunk->count && chunk->lines[i] == chunk->lines[start]) i++;
+        writeInt(writer, chunk->lines[start]);
+        writeInt(writer, i - start);
+    }
+    writeInt(writer, chunk->handlerCount);
+    writeBytes(writer, chunk->handlers, sizeof(Handler) * chunk->handlerCount);
+}
+
+static void writeString(Writer* writer, ObjString* string) {
+    writeInt(writer, string->length);
+    writeBytes(writer, string->chars, string->length);
+}
+
+static bool writeFunction(Writer* writer, ObjFunction* function) {
+    // a body the compiler skipped has no code yet.
+    if (function->lazy != NULL) return false;
+    writeInt(writer, function->arity);
+    writeInt(writer, function->upvalueCount);
+    writeInt(writer, function->maxSlots);
+    // the top-level script has no name.
+    if (function->name == NULL) {
+        writeInt(writer, -1);
+    } else {
+        writeString(writer, function->name);
+    }
+
+    Chunk* chunk = &function->chunk;
+    writeCode(writer, chunk);
+
+    writeInt(writer, chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value constant = chunk->constants.values[i];
+        uint8_t tag;
+        if (IS_NUMBER(constant)) {
+            double number = AS_NUMBER(constant);
+            tag = CONSTANT_NUMBER;
+            writeBytes(writer, &tag, 1);
+            writeBytes(writer, &number, sizeof(number));
+        } else if (IS_STRING(constant)) {
+            tag = CONSTANT_STRING;
+            writeBytes(writer, &tag, 1);
+            writeString(writer, AS_STRING(constant));
+        } else if (IS_FUNCTION(constant)) {
+            tag = CONSTANT_FUNCTION;
+            writeBytes(writer, &tag, 1);
+            if (!writeFunction(writer, AS_FUNCTION(constant))) return false;
+        } else {
+            // the compiler only makes the constants above.
+            return false;
+        }
+    }
+    return true;
+}
+
+uint8_t* serializeFunction(ObjFunction* function, uint64_t sourceHash, size_t* length) {
+    Writer writer = {NULL, 0, 0};
+    // leave room for the header. it needs the payload hash.
+    BytecodeHeader header;
+    memset(&header, 0, sizeof(header));
+    writeBytes(&writer, &header, sizeof(header));
+
+    if (!writeFunction(&writer, function)) {
+        free(writer.bytes);
+        return NULL;
+    }
+
+    memcpy(header.magic, "LOXC", 4);
+    header.version = BYTECODE_VERSION;
+    header.sourceHash = sourceHash;
+    header.payloadLength = writer.length - sizeof(header);
+    header.payloadHash = hashBytes(writer.bytes + sizeof(header), header.payloadLength);
+    memcpy(writer.bytes, &header, sizeof(header));
+
+    *length = writer.length;
+    return writer.bytes;
+}
+
+bool readBytes(Reader* reader, void* bytes, size_t length) {
+    if ((size_t)(reader->end - reader->current) < length) return false;
+    memcpy(bytes, reader->current, length);
+    reader->current += length;
+    return true;
+}
+
+bool readCount(Reader* reader, int32_t* count, size_t elementSize) {
+    if (!readBytes(reader, count, sizeof(*count))) return false;
+    return *count >= 0 && (size_t)*count <= (size_t)(reader->end - reader->current) / elementSize;
+}
+
+// a handler must cover and land inside the code and keep the stack within a frame.
+static bool validHandler(const Handler* handler, int count) {
+    return handler->start >= 0 && handler->start <= handler->end && handler->end <= count &&
+        handler->target >= 0 && handler->target < count &&
+        handler->depth >= 0 && handler->depth < UINT8_COUNT;
+}
+
+bool validStackSlots(ObjFunction* function) {
+    // an instruction pushes at most one value, or reserves up to a byte of registers.
+    return function->maxSlots > function->arity &&
+        function->maxSlots <= function->arity + 1 + function->chunk.count + UINT8_COUNT;
+}
+
+bool readCode(VM* vm, Reader* reader, Chunk* chunk) {
+    int32_t count;
+    if (!readCount(reader, &count, 1)) return false;
+    if (count == 0) return true;
+
+    uint8_t* code = ALLOCATE(vm, uint8_t, count);
+    int* lines = ALLOCATE(vm, int, count);
+    memcpy(code, reader->current, count);
+    reader->current += count;
+    chunk->code = code;
+    chunk->lines = lines;
+    chunk->count = count;
+    chunk->capacity = count;
+
+    int32_t runs;
+    if (!readCount(reader, &runs, 2 * sizeof(int32_t))) return false;
+    int filled = 0;
+    for (int i = 0; i < runs; i++) {
+        int32_t line = 0, length = 0;
+        readBytes(reader, &line, sizeof(line));
+        readBytes(reader, &length, sizeof(length));
+        // the runs must cover the code exactly.
+        if (length <= 0 || length > count - filled) return false;
+        for (int j = 0; j < length; j++) lines[filled++] = line;
+    }
+    if (filled != count) return false;
+
+    int32_t handlerCount;
+    if (!readCount(reader, &handlerCount, sizeof(Handler))) return false;
+    for (int i = 0; i < handlerCount; i++) {
+        Handler handler;
+        readBytes(reader, &handler, sizeof(handler));
+        if (!validHandler(&handler, count)) return false;
+        addHandler(vm, chunk, handler);
+    }
+    return true;
+}
+
+static ObjString* readString(VM* vm, Reader* reader) {
+    int32_t length;
+    if (!readCount(reader, &length, 1)) return NULL;
+    ObjString* string = copyString(vm, (const char*)reader->current, length);
+    reader->current += length;
+    return string;
+}
+
+static ObjFunction* readFunction(VM* vm, Reader* reader, int depth) {
+    if (depth > FUNCTION_DEPTH_MAX) return NULL;
+
+    int32_t arity, upvalueCount, maxSlots, nameLength;
+    if (!readBytes(reader, &arity, sizeof(arity)) ||
+            !readBytes(reader, &upvalueCount, sizeof(upvalueCount)) ||
+            !readBytes(reader, &maxSlots, sizeof(maxSlots)) ||
+            !readBytes(reader, &nameLength, sizeof(nameLength))) return NULL;
+    if (arity < 0 || arity > 255 || upvalueCount < 0 || upvalueCount > UINT8_COUNT) return NULL;
+
+    ObjFunction* function = newFunction(vm);
+    // keep the function alive while its parts are allocated.
+    push(vm, OBJ_VAL(function));
+    function->arity = arity;
+    function->upvalueCount = upvalueCount;
+    function->maxSlots = maxSlots;
+    bool ok = true;
+
+    if (nameLength >= 0) {
+        ok = (size_t)nameLength <= (size_t)(reader->end - reader->current);
+        if (ok) {
+            function->name = copyString(vm, (const char*)reader->current, nameLength);
+            reader->current += nameLength;
+        }
+    }
+
+    if (ok) ok = readCode(vm, reader, &function->chunk) && validStackSlots(function);
+
+    int32_t constantCount = 0;
+    if (ok) ok = readCount(reader, &constantCount, 1);
+    for (int i = 0; ok && i < constantCount; i++) {
+        uint8_t tag;
+        if (!readBytes(reader, &tag, 1)) {
+            ok = false;
+            break;
+        }
+        switch (tag) {
+            case CONSTANT_NUMBER: {
+                double number;
+                ok = readBytes(reader, &number, sizeof(number));
+                if (ok) addConstant(vm, &function->chunk, exactNumber(number));
+                break;
+            }
+            case CONSTANT_STRING: {
+                ObjString* string = readString(vm, reader);
+                ok = string != NULL;
+                if (ok) addConstant(vm, &function->chunk, OBJ_VAL(string));
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = readFunction(vm, reader, depth + 1);
+                ok = nested != NULL;
+                if (ok) addConstant(vm, &function->chunk, OBJ_VAL(nested));
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+    }
+
+    pop(vm);
+    return ok ? function : NULL;
+}
+
+ObjFunction* deserializeFunction(VM* vm, const uint8_t* bytes, size_t length, uint64_t sourceHash) {
+    BytecodeHeader header;
+    if (length < sizeof(header)) return NULL;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, "LOXC", 4) != 0 ||
+            header.version != BYTECODE_VERSION ||
+            header.sourceHash != sourceHash ||
+            header.payloadLength != length - sizeof(header)) return NULL;
+
+    // the checksum catches truncated and corrupted files before anything is allocated.
+    const uint8_t* payload = bytes + sizeof(header);
+    if (hashBytes(payload, header.payloadLength) != header.payloadHash) return NULL;
+
+    Reader reader = {payload, payload + header.payloadLength};
+    ObjFunction* function = readFunction(vm, &reader, 0);
+    if (reader.current != reader.end) return NULL;
+    return function;
+}
+
+typedef struct {
+    Writer code;
+    Writer lines;
+    Writer strings;
+    Writer functions;
+} ImageWriter;
+
+static void alignWriter(Writer* writer, size_t alignment) {
+    static const uint8_t zeros[1] = {0};
+    while (writer->length % alignment != 0) writeBytes(writer, zeros, 1);
+}
+
+static uint32_t writeImageString(ImageWriter* writer, ObjString* string) {
+    uint32_t offset = (uint32_t)writer->strings.length;
+    uint32_t length = (uint32_t)string->length;
+    writeBytes(&writer->strings, &length, sizeof(length));
+    writeBytes(&writer->strings, string->chars, length);
+    alignWriter(&writer->strings, 4);
+    return offset;
+}
+
+static bool writeImageFunction(ImageWriter* writer, ObjFunction* function, uint32_t* offset) {
+    if (function->lazy != NULL) return false;
+    Chunk* chunk = &function->chunk;
+    ImageFunction record;
+    memset(&record, 0, sizeof(record));
+    record.arity = function->arity;
+    record.upvalueCount = function->upvalueCount;
+    record.maxSlots = function->maxSlots;
+    record.name = function->name == NULL ? IMAGE_NONE : writeImageString(writer, function->name);
+    record.code = (uint32_t)writer->code.length;
+    record.count = (uint32_t)chunk->count;
+    record.lines = (uint32_t)writer->lines.length;
+    record.constantCount = (uint32_t)chunk->constants.count;
+    record.handlerCount = (uint32_t)chunk->handlerCount;
+    writeBytes(&writer->code, chunk->code, chunk->count);
+    for (int i = 0; i < chunk->count; i++) {
+        int32_t line = chunk->lines[i];
+        writeBytes(&writer->lines, &line, sizeof(line));
+    }
+
+    // reserve the record and its constants. nested functions are appended after them.
+    *offset = (uint32_t)writer->functions.length;
+    writeBytes(&writer->functions, &record, sizeof(record));
+    size_t constants = writer->functions.length;
+    for (int i = 0; i < chunk->constants.count; i++) {
+        ImageConstant constant;
+        memset(&constant, 0, sizeof(constant));
+        writeBytes(&writer->functions, &constant, sizeof(constant));
+    }
+    writeBytes(&writer->functions, chunk->handlers, sizeof(Handler) * chunk->handlerCount);
+
+    for (int i = 0; i < chunk->constants.count; i++) {
+        Value value = chunk->constants.values[i];
+        ImageConstant constant;
+        memset(&constant, 0, sizeof(constant));
+        if (IS_NUMBER(value)) {
+            constant.tag = CONSTANT_NUMBER;
+            constant.number = AS_NUMBER(value);
+        } else if (IS_STRING(value)) {
+            constant.tag = CONSTANT_STRING;
+            constant.ref = writeImageString(writer, AS_STRING(value));
+        } else if (IS_FUNCTION(value)) {
+            constant.tag = CONSTANT_FUNCTION;
+            if (!writeImageFunction(writer, AS_FUNCTION(value), &constant.ref)) return false;
+        } else {
+            return false;
+        }
+        memcpy(writer->functions.bytes + constants + i * sizeof(constant), &constant, sizeof(constant));
+    }
+    return true;
+}
+
+uint8_t* writeImage(ObjFunction* function, uint64_t sourceHash, size_t* length) {
+    ImageWriter writer;
+    memset(&writer, 0, sizeof(writer));
+    ImageHeader header;
+    memset(&header, 0, sizeof(header));
+
+    Writer image = {NULL, 0, 0};
+    if (!writeImageFunction(&writer, function, &header.root)) {
+        free(writer.code.bytes);
+        free(writer.lines.bytes);
+        free(writer.strings.bytes);
+        free(writer.functions.bytes);
+        return NULL;
+    }
+
+    memcpy(header.magic, "LOXI", 4);
+    header.version = IMAGE_VERSION;
+    header.sourceHash = sourceHash;
+    writeBytes(&image, &header, sizeof(header));
+
+    // code gets its own pages so they hold nothing but code.
+    alignWriter(&image, IMAGE_PAGE_SIZE);
+    header.codeOffset = (uint32_t)image.length;
+    header.codeLength = (uint32_t)writer.code.length;
+    writeBytes(&image, writer.code.bytes, writer.code.length);
+    alignWriter(&image, 8);
+    header.linesOffset = (uint32_t)image.length;
+    header.linesLength = (uint32_t)writer.lines.length;
+    writeBytes(&image, writer.lines.bytes, writer.lines.length);
+    alignWriter(&image, 8);
+    header.stringsOffset = (uint32_t)image.length;
+    header.stringsLength = (uint32_t)writer.strings.length;
+    writeBytes(&image, writer.strings.bytes, writer.strings.length);
+    alignWriter(&image, 8);
+    header.functionsOffset = (uint32_t)image.length;
+    header.functionsLength = (uint32_t)writer.functions.length;
+    writeBytes(&image, writer.functions.bytes, writer.functions.length);
+    memcpy(image.bytes, &header, sizeof(header));
+
+    free(writer.code.bytes);
+    free(writer.lines.bytes);
+    free(writer.strings.bytes);
+    free(writer.functions.bytes);
+    *length = image.length;
+    return image.bytes;
+}
+
+static const ImageHeader* imageHeader(Image* image) {
+    return (const ImageHeader*)image->base;
+}
+
+// find a record in the functions section, checking that it, its constants and its handlers fit.
+static const ImageFunction* imageRecord(Image* image, uint32_t offset) {
+    const ImageHeader* header = imageHeader(image);
+    if (offset % 8 != 0 || (uint64_t)offset + sizeof(ImageFunction) > header->functionsLength) return NULL;
+    const ImageFunction* record = (const ImageFunction*)(image->base + header->functionsOffset + offset);
+    uint64_t end = (uint64_t)offset + sizeof(ImageFunction) +
+        (uint64_t)record->constantCount * sizeof(ImageConstant) +
+        (uint64_t)record->handlerCount * sizeof(Handler);
+    if (end > header->functionsLength || record->constantCount > UINT8_COUNT) return NULL;
+    return record;
+}
+
+static ObjString* imageString(VM* vm, Image* image, uint32_t offset) {
+    const ImageHeader* header = imageHeader(image);
+    if (offset % 4 != 0 || (uint64_t)offset + sizeof(uint32_t) > header->stringsLength) return NULL;
+    const uint8_t* string = image->base + header->stringsOffset + offset;
+    uint32_t length;
+    memcpy(&length, string, sizeof(length));
+    if ((uint64_t)offset + sizeof(uint32_t) + length > header->stringsLength || length > INT32_MAX) return NULL;
+    return copyString(vm, (const char*)string + sizeof(length), (int)length);
+}
+
+// make a function whose code and lines point into the image. its constants stay pending.
+static ObjFunction* imageFunction(VM* vm, Image* image, uint32_t offset) {
+    const ImageHeader* header = imageHeader(image);
+    const ImageFunction* record = imageRecord(image, offset);
+    if (record == NULL ||
+            record->arity < 0 || record->arity > 255 ||
+            record->upvalueCount < 0 || record->upvalueCount > UINT8_COUNT ||
+            record->count == 0 || record->count > INT32_MAX ||
+            (uint64_t)record->code + record->count > header->codeLength ||
+            record->lines % 4 != 0 ||
+            (uint64_t)record->lines + (uint64_t)record->count * sizeof(int32_t) > header->linesLength) return NULL;
+
+    ObjFunction* function = newFunction(vm);
+    push(vm, OBJ_VAL(function));
+    function->arity = record->arity;
+    function->upvalueCount = record->upvalueCount;
+    function->image = image;
+    function->pending = record;
+    // the mapping is read-only. nothing writes to a chunk once it is compiled.
+    function->chunk.code = (uint8_t*)(image->base + header->codeOffset + record->code);
+    function->chunk.lines = (int*)(image->base + header->linesOffset + record->lines);
+    function->chunk.count = (int)record->count;
+    function->chunk.capacity = (int)record->count;
+    function->maxSlots = record->maxSlots;
+    if (!validStackSlots(function)) {
+        pop(vm);
+        return NULL;
+    }
+    // the exception table follows the constants and is used in place too.
+    Handler* handlers = (Handler*)((const ImageConstant*)(record + 1) + record->constantCount);
+    for (uint32_t i = 0; i < record->handlerCount; i++) {
+        if (!validHandler(&handlers[i], function->chunk.count)) {
+            pop(vm);
+            return NULL;
+        }
+    }
+    function->chunk.handlers = handlers;
+    function->chunk.handlerCount = (int)record->handlerCount;
+    function->chunk.handlerCapacity = (int)record->handlerCount;
+
+    bool ok = true;
+    if (record->name != IMAGE_NONE) {
+        function->name = imageString(vm, image, record->name);
+        ok = function->name != NULL;
+    }
+    pop(vm);
+    return ok ? function : NULL;
+}
+
+bool loadImageConstants(VM* vm, ObjFunction* function) {
+    const ImageFunction* record = function->pending;
+    const ImageConstant* constants = (const ImageConstant*)(record + 1);
+    push(vm, OBJ_VAL(function));
+    bool ok = true;
+    for (uint32_t i = 0; ok && i < record->constantCount; i++) {
+        const ImageConstant* constant = &constants[i];
+        switch (constant->tag) {
+            case CONSTANT_NUMBER:
+                addConstant(vm, &function->chunk, exactNumber(constant->number));
+                break;
+            case CONSTANT_STRING: {
+                ObjString* string = imageString(vm, function->image, constant->ref);
+                ok = string != NULL;
+                if (ok) addConstant(vm, &function->chunk, OBJ_VAL(string));
+                break;
+            }
+            case CONSTANT_FUNCTION: {
+                ObjFunction* nested = imageFunction(vm, function->image, constant->ref);
+                ok = nested != NULL;
+                if (ok) addConstant(vm, &function->chunk, OBJ_VAL(nested));
+                break;
+            }
+            default:
+                ok = false;
+                break;
+        }
+    }
+    pop(vm);
+    if (!ok) {
+        function->chunk.constants.count = 0;
+        return false;
+    }
+    function->pending = NULL;
+    return true;
+}
+
+static bool sectionFits(size_t length, uint32_t offset, uint32_t sectionLength, size_t alignment) {
+    return offset % alignment == 0 && (uint64_t)offset + sectionLength <= length;
+}
+
+ObjFunction* loadImage(VM* vm, const char* path) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return NULL;
+    struct stat info;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(ImageHeader)) {
+        close(fd);
+        return NULL;
+    }
+    size_t length = (size_t)info.st_size;
+    void* base = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) return NULL;
+
+    const ImageHeader* header = (const ImageHeader*)base;
+    if (memcmp(header->magic, "LOXI", 4) != 0 ||
+            header->version != IMAGE_VERSION ||
+            !sectionFits(length, header->codeOffset, header->codeLength, 1) ||
+            !sectionFits(length, header->linesOffset, header->linesLength, 8) ||
+            !sectionFits(length, header->stringsOffset, header->stringsLength, 8) ||
+            !sectionFits(length, header->functionsOffset, header->functionsLength, 8)) {
+        munmap(base, length);
+        return NULL;
+    }
+
+    Image* image = (Image*)malloc(sizeof(Image));
+    if (image == NULL) exit(1);
+    image->base = (const uint8_t*)base;
+    image->length = length;
+    image->next = vm->images;
+    vm->images = image;
+
+    ObjFunction* function = imageFunction(vm, image, header->root);
+    if (function == NULL) return NULL;
+    if (!loadImageConstants(vm, function)) return NULL;
+    return function;
+}
+
+void freeImages(Image* images) {
+    while (images != NULL) {
+        Image* next = images->next;
+        munmap((void*)images->base, images->length);
+        free(images);
+        images = next;
+    }
+}
\ No newline at end of file
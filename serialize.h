@@ -0,0 +1,119 @@
+#ifndef clox_serialize_h
+#define clox_serialize_h
+
+#include "common.h"
+#include "object.h"
+
+// growable byte buffer the formats below are written into.
+typedef struct {
+    uint8_t* bytes;
+    size_t length;
+    size_t capacity;
+} Writer;
+
+// bounds-checked cursor over a buffer being read back.
+typedef struct {
+    const uint8_t* current;
+    const uint8_t* end;
+} Reader;
+
+void writeBytes(Writer* writer, const void* bytes, size_t length);
+void writeInt(Writer* writer, int32_t value);
+// write a chunk's code and its run-length encoded line table.
+void writeCode(Writer* writer, Chunk* chunk);
+bool readBytes(Reader* reader, void* bytes, size_t length);
+// read a count that must fit in what is left of the buffer.
+bool readCount(Reader* reader, int32_t* count, size_t elementSize);
+// read what writeCode wrote into an empty chunk. false if it doesn't check out.
+bool readCode(VM* vm, Reader* reader, Chunk* chunk);
+// false if a stored maxSlots can't belong to the function's code.
+bool validStackSlots(ObjFunction* function);
+
+// bump whenever the layout below or the instruction set changes.
+#define BYTECODE_VERSION 7
+
+// a compiled script on disk:
+//   header   magic "LOXC", version, hash of the source it was compiled from,
+//            payload length and hash of the payload.
+//   payload  the top-level function. a function is its arity, upvalue count,
+//            stack slots, name, code, line table, exception table and constants. function
+//            constants nest.
+// integers and doubles are stored in host byte order. a cache written on a
+// machine with a different byte order fails the version check.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint64_t payloadLength;
+    uint64_t payloadHash;
+} BytecodeHeader;
+
+uint64_t hashBytes(const void* bytes, size_t length);
+// returns a malloc'ed buffer or NULL if function holds a constant that can't be stored.
+uint8_t* serializeFunction(ObjFunction* function, uint64_t sourceHash, size_t* length);
+// returns NULL if the buffer is corrupt, from another version or compiled from different source.
+ObjFunction* deserializeFunction(VM* vm, const uint8_t* bytes, size_t length, uint64_t sourceHash);
+
+#define IMAGE_VERSION 7
+
+// a bytecode image is laid out to be mapped read-only and run in place, so
+// processes running the same image share its pages through the page cache.
+// it has no pointers, only offsets from the start of each section:
+//   code       bytecode of every function, page aligned.
+//   lines      line of every byte of code as int32.
+//   strings    uint32 length then the chars, 4-byte aligned.
+//   functions  ImageFunction records, each followed by its constants and exception table.
+// code and lines are used where they lie. constants are loaded per function
+// the first time it is closed over, which is when its strings are interned.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint64_t sourceHash;
+    uint32_t codeOffset;
+    uint32_t codeLength;
+    uint32_t linesOffset;
+    uint32_t linesLength;
+    uint32_t stringsOffset;
+    uint32_t stringsLength;
+    uint32_t functionsOffset;
+    uint32_t functionsLength;
+    uint32_t root; // record of the top-level function.
+} ImageHeader;
+
+#define IMAGE_NONE UINT32_MAX
+
+typedef struct ImageFunction {
+    int32_t arity;
+    int32_t upvalueCount;
+    int32_t maxSlots;
+    uint32_t name; // IMAGE_NONE for the top-level script.
+    uint32_t code;
+    uint32_t count; // bytes of code.
+    uint32_t lines;
+    uint32_t constantCount;
+    uint32_t handlerCount;
+    uint32_t padding; // keeps the constants after a record 8-byte aligned.
+} ImageFunction;
+
+typedef struct {
+    uint32_t tag;
+    uint32_t ref; // string or function record of the constant.
+    double number;
+} ImageConstant;
+
+typedef struct Image {
+    struct Image* next;
+    const uint8_t* base;
+    size_t length;
+} Image;
+
+// returns a malloc'ed image or NULL if function holds a constant that can't be stored.
+uint8_t* writeImage(ObjFunction* function, uint64_t sourceHash, size_t* length);
+// map an image and return its top-level function, or NULL if it can't be mapped or is invalid.
+// the mapping stays until the vm is freed.
+ObjFunction* loadImage(VM* vm, const char* path);
+// load the constants of a function from an image. false if the image is corrupt.
+bool loadImageConstants(VM* vm, ObjFunction* function);
+void freeImages(Image* images);
+
+#endif
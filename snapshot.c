@@ -0,0 +1,650 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "compiler.h"
+#include "memory.h"
+#include "serialize.h"
+#include "snapshot.h"
+
+#define SNAPSHOT_NONE UINT32_MAX
+
+typedef enum {
+    SNAPSHOT_NIL,
+    SNAPSHOT_FALSE,
+    SNAPSHOT_TRUE,
+    SNAPSHOT_NUMBER,
+    SNAPSHOT_OBJECT
+} SnapshotTag;
+
+// objects are stored in this order. a closure needs its function to be created.
+static int typeRank(ObjType type) {
+    switch (type) {
+        case OBJ_STRING: return 0;
+        case OBJ_NATIVE: return 1;
+        case OBJ_FUNCTION: return 2;
+        case OBJ_UPVALUE: return 3;
+        case OBJ_CLOSURE: return 4;
+        case OBJ_CLASS: return 5;
+        case OBJ_INSTANCE: return 6;
+        case OBJ_BOUND_METHOD: return 7;
+        default: return -1;
+    }
+}
+
+#define TYPE_RANKS 8
+
+typedef struct {
+    Obj* key;
+    uint32_t index;
+} ObjEntry;
+
+typedef struct {
+    VM* vm;
+    Obj** objects; // every reachable object, in the order they were found.
+    int count;
+    int capacity;
+    ObjEntry* entries; // object to index. open addressing.
+    int entryCapacity;
+    bool failed;
+} Snapshot;
+
+static ObjEntry* findEntry(ObjEntry* entries, int capacity, Obj* key) {
+    uint32_t index = (uint32_t)(((uintptr_t)key >> 3) * 2654435761u) & (capacity - 1);
+    for (;;) {
+        ObjEntry* entry = &entries[index];
+        if (entry->key == NULL || entry->key == key) return entry;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void growEntries(Snapshot* snapshot) {
+    int capacity = snapshot->entryCapacity < 64 ? 64 : snapshot->entryCapacity * 2;
+    ObjEntry* entries = (ObjEntry*)calloc(capacity, sizeof(ObjEntry));
+    if (entries == NULL) exit(1);
+    for (int i = 0; i < snapshot->entryCapacity; i++) {
+        ObjEntry* entry = &snapshot->entries[i];
+        if (entry->key == NULL) continue;
+        *findEntry(entries, capacity, entry->key) = *entry;
+    }
+    free(snapshot->entries);
+    snapshot->entries = entries;
+    snapshot->entryCapacity = capacity;
+}
+
+static void fail(Snapshot* snapshot, const char* message) {
+    if (!snapshot->failed) fprintf(snapshot->vm->err, "%s\n", message);
+    snapshot->failed = true;
+}
+
+static void visitObject(Snapshot* snapshot, Obj* object) {
+    if (object == NULL) return;
+    if ((snapshot->count + 1) * 2 > snapshot->entryCapacity) growEntries(snapshot);
+    ObjEntry* entry = findEntry(snapshot->entries, snapshot->entryCapacity, object);
+    if (entry->key != NULL) return;
+    if (typeRank(object->type) < 0) {
+        fail(snapshot, "Can't snapshot fibers or channels.");
+        return;
+    }
+
+    entry->key = object;
+    entry->index = (uint32_t)snapshot->count;
+    if (snapshot->count == snapshot->capacity) {
+        snapshot->capacity = GROW_CAPACITY(snapshot->capacity);
+        snapshot->objects = (Obj**)realloc(snapshot->objects, sizeof(Obj*) * snapshot->capacity);
+        if (snapshot->objects == NULL) exit(1);
+    }
+    snapshot->objects[snapshot->count++] = object;
+}
+
+static void visitValue(Snapshot* snapshot, Value value) {
+    if (IS_OBJ(value)) visitObject(snapshot, AS_OBJ(value));
+}
+
+static void visitTable(Snapshot* snapshot, Table* table) {
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        visitObject(snapshot, (Obj*)entry->key);
+        visitValue(snapshot, entry->value);
+    }
+}
+
+// find the builtin a native is bound to.
+static ObjString* nativeName(VM* vm, Obj* native) {
+    for (int i = 0; i < vm->builtins.capacity; i++) {
+        Entry* entry = &vm->builtins.entries[i];
+        if (entry->key != NULL && IS_OBJ(entry->value) && AS_OBJ(entry->value) == native) return entry->key;
+    }
+    return NULL;
+}
+
+static void traceObject(Snapshot* snapshot, Obj* object) {
+    switch (object->type) {
+        case OBJ_NATIVE:
+            if (nativeName(snapshot->vm, object) == NULL) fail(snapshot, "Can't snapshot a native that isn't a builtin.");
+            break;
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            if (function->pending != NULL && !loadImageConstants(snapshot->vm, function)) {
+                fail(snapshot, "Corrupt bytecode image.");
+                break;
+            }
+            // a body skipped by the compiler is compiled now so its code can be stored.
+            if (function->lazy != NULL && !compileLazyBody(snapshot->vm, function)) {
+                fail(snapshot, "Can't snapshot a function that doesn't compile.");
+                break;
+            }
+            visitObject(snapshot, (Obj*)function->name);
+            visitObject(snapshot, (Obj*)function->module);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                visitValue(snapshot, function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            visitObject(snapshot, (Obj*)klass->name);
+            visitTable(snapshot, &klass->methods);
+            break;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = (ObjUpvalue*)object;
+            if (upvalue->location != &upvalue->closed) {
+                fail(snapshot, "Can't snapshot a variable captured from a suspended fiber.");
+                break;
+            }
+            visitValue(snapshot, upvalue->closed);
+            break;
+        }
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            visitObject(snapshot, (Obj*)FROM_REF(ObjFunction, closure->function));
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                visitObject(snapshot, (Obj*)FROM_REF(ObjUpvalue, closure->upvalues[i]));
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            visitObject(snapshot, (Obj*)instance->klass);
+            visitTable(snapshot, &instance->fields);
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            visitValue(snapshot, bound->receiver);
+            visitObject(snapshot, (Obj*)FROM_REF(ObjClosure, bound->method));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+static void writeRef(Snapshot* snapshot, Writer* writer, Obj* object) {
+    uint32_t index = SNAPSHOT_NONE;
+    if (object != NULL) index = findEntry(snapshot->entries, snapshot->entryCapacity, object)->index;
+    writeBytes(writer, &index, sizeof(index));
+}
+
+static void writeValue(Snapshot* snapshot, Writer* writer, Value value) {
+    uint8_t tag;
+    if (IS_NUMBER(value)) {
+        double number = AS_NUMBER(value);
+        tag = SNAPSHOT_NUMBER;
+        writeBytes(writer, &tag, 1);
+        writeBytes(writer, &number, sizeof(number));
+    } else if (IS_OBJ(value)) {
+        tag = SNAPSHOT_OBJECT;
+        writeBytes(writer, &tag, 1);
+        writeRef(snapshot, writer, AS_OBJ(value));
+    } else {
+        tag = IS_NIL(value) ? SNAPSHOT_NIL : AS_BOOL(value) ? SNAPSHOT_TRUE : SNAPSHOT_FALSE;
+        writeBytes(writer, &tag, 1);
+    }
+}
+
+static void writeTable(Snapshot* snapshot, Writer* writer, Table* table) {
+    int count = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->entries[i].key != NULL) count++;
+    }
+    writeInt(writer, count);
+    for (int i = 0; i < table->capacity; i++) {
+        Entry* entry = &table->entries[i];
+        if (entry->key == NULL) continue;
+        writeRef(snapshot, writer, (Obj*)entry->key);
+        writeValue(snapshot, writer, entry->value);
+    }
+}
+
+static void writeObject(Snapshot* snapshot, Writer* writer, Obj* object) {
+    uint8_t type = (uint8_t)object->type;
+    writeBytes(writer, &type, 1);
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            writeInt(writer, string->length);
+            writeBytes(writer, string->chars, string->length);
+            break;
+        }
+        case OBJ_NATIVE: {
+            ObjString* name = nativeName(snapshot->vm, object);
+            writeInt(writer, name->length);
+            writeBytes(writer, name->chars, name->length);
+            break;
+        }
+        case OBJ_FUNCTION: {
+            ObjFunction* function = (ObjFunction*)object;
+            writeInt(writer, function->arity);
+            writeInt(writer, function->upvalueCount);
+            writeInt(writer, function->maxSlots);
+            writeRef(snapshot, writer, (Obj*)function->name);
+            writeRef(snapshot, writer, (Obj*)function->module);
+            writeCode(writer, &function->chunk);
+            writeInt(writer, function->chunk.constants.count);
+            for (int i = 0; i < function->chunk.constants.count; i++) {
+                writeValue(snapshot, writer, function->chunk.constants.values[i]);
+            }
+            break;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = (ObjClass*)object;
+            writeRef(snapshot, writer, (Obj*)klass->name);
+            writeTable(snapshot, writer, &klass->methods);
+            break;
+        }
+        case OBJ_UPVALUE:
+            writeValue(snapshot, writer, ((ObjUpvalue*)object)->closed);
+            break;
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            writeRef(snapshot, writer, (Obj*)FROM_REF(ObjFunction, closure->function));
+            writeInt(writer, closure->upvalueCount);
+            for (int i = 0; i < closure->upvalueCount; i++) {
+                writeRef(snapshot, writer, (Obj*)FROM_REF(ObjUpvalue, closure->upvalues[i]));
+            }
+            break;
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = (ObjInstance*)object;
+            writeRef(snapshot, writer, (Obj*)instance->klass);
+            writeTable(snapshot, writer, &instance->fields);
+            break;
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = (ObjBoundMethod*)object;
+            writeValue(snapshot, writer, bound->receiver);
+            writeRef(snapshot, writer, (Obj*)FROM_REF(ObjClosure, bound->method));
+            break;
+        }
+        default:
+            break;
+    }
+}
+
+uint8_t* snapshotHeap(VM* vm, size_t* length) {
+    Snapshot snapshot;
+    memset(&snapshot, 0, sizeof(snapshot));
+    snapshot.vm = vm;
+
+    // find everything the globals reach. the list doubles as the worklist.
+    visitTable(&snapshot, &vm->globals);
+    for (int i = 0; i < snapshot.count && !snapshot.failed; i++) {
+        traceObject(&snapshot, snapshot.objects[i]);
+    }
+    if (snapshot.failed) {
+        free(snapshot.objects);
+        free(snapshot.entries);
+        return NULL;
+    }
+
+    // sort by type and renumber. within a type objects go in reverse order of
+    // discovery, so most references point back to objects created earlier.
+    Obj** sorted = (Obj**)malloc(sizeof(Obj*) * (snapshot.count + 1));
+    if (sorted == NULL) exit(1);
+    int sortedCount = 0;
+    for (int rank = 0; rank < TYPE_RANKS; rank++) {
+        for (int i = snapshot.count - 1; i >= 0; i--) {
+            if (typeRank(snapshot.objects[i]->type) == rank) sorted[sortedCount++] = snapshot.objects[i];
+        }
+    }
+    for (int i = 0; i < sortedCount; i++) {
+        findEntry(snapshot.entries, snapshot.entryCapacity, sorted[i])->index = (uint32_t)i;
+    }
+    free(snapshot.objects);
+    snapshot.objects = sorted;
+
+    Writer writer = {NULL, 0, 0};
+    SnapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    writeBytes(&writer, &header, sizeof(header));
+    for (int i = 0; i < snapshot.count; i++) {
+        writeObject(&snapshot, &writer, snapshot.objects[i]);
+    }
+    writeTable(&snapshot, &writer, &vm->globals);
+
+    memcpy(header.magic, "LOXS", 4);
+    header.version = SNAPSHOT_VERSION;
+    header.objectCount = (uint32_t)snapshot.count;
+    header.payloadLength = writer.length - sizeof(header);
+    header.payloadHash = hashBytes(writer.bytes + sizeof(header), header.payloadLength);
+    memcpy(writer.bytes, &header, sizeof(header));
+
+    free(snapshot.objects);
+    free(snapshot.entries);
+    *length = writer.length;
+    return writer.bytes;
+}
+
+// a reference to an object that didn't exist yet when its record was read.
+// exactly one of value, object, table and ref is set.
+typedef struct {
+    Value* value;
+    Obj** object;
+    Table* table; // set key in table.
+    ObjString* key;
+    uint32_t index;
+    int type;
+#ifdef COMPRESSED_HEAP
+    ObjRef* ref;
+#endif
+} Fixup;
+
+typedef struct {
+    VM* vm;
+    Reader reader;
+    Obj** objects; // NULL until created.
+    uint32_t count;
+    uint32_t current; // index of the record being read.
+    Fixup* fixups;
+    int fixupCount;
+    int fixupCapacity;
+} Loader;
+
+typedef enum {
+    REF_ERROR,
+    REF_DEFERRED, // set by a fixup once every record is read.
+    REF_SET
+} RefResult;
+
+// stands in for an ObjType when a reference may be to any object.
+#define ANY_OBJECT -1
+
+static bool lookup(Loader* loader, uint32_t index, int type, Obj** object) {
+    if (index >= loader->count || loader->objects[index] == NULL) return false;
+    if (type != ANY_OBJECT && (int)loader->objects[index]->type != type) return false;
+    *object = loader->objects[index];
+    return true;
+}
+
+static void addFixup(Loader* loader, Fixup fixup) {
+    if (loader->fixupCount == loader->fixupCapacity) {
+        loader->fixupCapacity = GROW_CAPACITY(loader->fixupCapacity);
+        loader->fixups = (Fixup*)realloc(loader->fixups, sizeof(Fixup) * loader->fixupCapacity);
+        if (loader->fixups == NULL) exit(1);
+    }
+    loader->fixups[loader->fixupCount++] = fixup;
+}
+
+// read a reference into slot. references to objects that don't exist yet are
+// filled in once every record has been read.
+static bool readRef(Loader* loader, int type, bool optional, Obj** slot) {
+    uint32_t index;
+    if (!readBytes(&loader->reader, &index, sizeof(index))) return false;
+    *slot = NULL;
+    if (index == SNAPSHOT_NONE) return optional;
+    if (index >= loader->current) {
+        addFixup(loader, (Fixup){NULL, slot, NULL, NULL, index, type});
+        return index < loader->count;
+    }
+    return lookup(loader, index, type, slot);
+}
+
+#ifdef COMPRESSED_HEAP
+// read a reference into a field that holds an ObjRef.
+static bool readObjRef(Loader* loader, int type, ObjRef* slot) {
+    uint32_t index;
+    if (!readBytes(&loader->reader, &index, sizeof(index))) return false;
+    *slot = 0;
+    if (index == SNAPSHOT_NONE) return false;
+    if (index >= loader->current) {
+        addFixup(loader, (Fixup){.ref = slot, .index = index, .type = type});
+        return index < loader->count;
+    }
+    Obj* object;
+    if (!lookup(loader, index, type, &object)) return false;
+    *slot = TO_REF(object);
+    return true;
+}
+#else
+#define readObjRef(loader, type, slot) readRef(loader, type, false, (Obj**)(slot))
+#endif
+
+// read a reference to an object that was created before the current one.
+static bool readEarlier(Loader* loader, int type, Obj** object) {
+    uint32_t index;
+    if (!readBytes(&loader->reader, &index, sizeof(index))) return false;
+    return index < loader->current && lookup(loader, index, type, object);
+}
+
+// read a value into slot. a forward reference makes a fixup for slot, or for
+// key in table when table is given.
+static RefResult readValue(Loader* loader, Value* slot, Table* table, ObjString* key) {
+    uint8_t tag;
+    if (!readBytes(&loader->reader, &tag, 1)) return REF_ERROR;
+    switch (tag) {
+        case SNAPSHOT_NIL: *slot = NIL_VAL; return REF_SET;
+        case SNAPSHOT_FALSE: *slot = BOOL_VAL(false); return REF_SET;
+        case SNAPSHOT_TRUE: *slot = BOOL_VAL(true); return REF_SET;
+        case SNAPSHOT_NUMBER: {
+            double number;
+            if (!readBytes(&loader->reader, &number, sizeof(number))) return REF_ERROR;
+            *slot = exactNumber(number);
+            return REF_SET;
+        }
+        case SNAPSHOT_OBJECT: {
+            uint32_t index;
+            if (!readBytes(&loader->reader, &index, sizeof(index))) return REF_ERROR;
+            *slot = NIL_VAL;
+            if (index >= loader->count) return REF_ERROR;
+            if (index >= loader->current) {
+                addFixup(loader, (Fixup){table == NULL ? slot : NULL, NULL, table, key, index, ANY_OBJECT});
+                return REF_DEFERRED;
+            }
+            Obj* object;
+            if (!lookup(loader, index, ANY_OBJECT, &object)) return REF_ERROR;
+            *slot = OBJ_VAL(object);
+            return REF_SET;
+        }
+        default:
+            return REF_ERROR;
+    }
+}
+
+static bool readTable(Loader* loader, Table* table) {
+    int32_t count;
+    if (!readCount(&loader->reader, &count, sizeof(uint32_t) + 1)) return false;
+    for (int i = 0; i < count; i++) {
+        Obj* key;
+        Value value;
+        // keys are strings, which come before everything else.
+        if (!readEarlier(loader, OBJ_STRING, &key)) return false;
+        RefResult result = readValue(loader, &value, table, (ObjString*)key);
+        if (result == REF_ERROR) return false;
+        if (result == REF_SET) tableSet(loader->vm, table, (ObjString*)key, value);
+    }
+    return true;
+}
+
+static bool applyFixups(Loader* loader) {
+    for (int i = 0; i < loader->fixupCount; i++) {
+        Fixup* fixup = &loader->fixups[i];
+        Obj* object;
+        if (!lookup(loader, fixup->index, fixup->type, &object)) return false;
+        if (fixup->object != NULL) {
+            *fixup->object = object;
+#ifdef COMPRESSED_HEAP
+        } else if (fixup->ref != NULL) {
+            *fixup->ref = TO_REF(object);
+#endif
+        } else if (fixup->value != NULL) {
+            *fixup->value = OBJ_VAL(object);
+        } else {
+            tableSet(loader->vm, fixup->table, fixup->key, OBJ_VAL(object));
+        }
+    }
+    return true;
+}
+
+static bool readObject(Loader* loader) {
+    VM* vm = loader->vm;
+    Reader* reader = &loader->reader;
+    uint32_t i = loader->current;
+    uint8_t type;
+    if (!readBytes(reader, &type, 1)) return false;
+
+    switch (type) {
+        case OBJ_STRING:
+        case OBJ_NATIVE: {
+            int32_t length;
+            if (!readCount(reader, &length, 1)) return false;
+            ObjString* string = copyString(vm, (const char*)reader->current, length);
+            reader->current += length;
+            if (type == OBJ_STRING) {
+                loader->objects[i] = (Obj*)string;
+                return true;
+            }
+            // natives are bound to this vm's builtin of the same name.
+            Value native;
+            if (!tableGet(&vm->builtins, string, &native) || !IS_NATIVE(native)) return false;
+            loader->objects[i] = AS_OBJ(native);
+            return true;
+        }
+        case OBJ_FUNCTION: {
+            int32_t arity, upvalueCount, maxSlots;
+            if (!readBytes(reader, &arity, sizeof(arity)) ||
+                    !readBytes(reader, &upvalueCount, sizeof(upvalueCount)) ||
+                    !readBytes(reader, &maxSlots, sizeof(maxSlots))) return false;
+            if (arity < 0 || arity > 255 || upvalueCount < 0 || upvalueCount > UINT8_COUNT) return false;
+
+            ObjFunction* function = newFunction(vm);
+            function->arity = arity;
+            function->upvalueCount = upvalueCount;
+            function->maxSlots = maxSlots;
+            loader->objects[i] = (Obj*)function;
+            if (!readRef(loader, OBJ_STRING, true, (Obj**)&function->name) ||
+                    !readRef(loader, OBJ_INSTANCE, true, (Obj**)&function->module) ||
+                    !readCode(vm, reader, &function->chunk) ||
+                    !validStackSlots(function)) return false;
+
+            // size the constant table up front so fixups can point into it.
+            int32_t constantCount;
+            if (!readCount(reader, &constantCount, 1) || constantCount > UINT8_COUNT) return false;
+            ValueArray* constants = &function->chunk.constants;
+            if (constantCount > 0) {
+                constants->values = ALLOCATE(vm, Value, constantCount);
+                constants->capacity = constantCount;
+            }
+            for (int j = 0; j < constantCount; j++) {
+                constants->values[j] = NIL_VAL;
+                constants->count++;
+                if (readValue(loader, &constants->values[j], NULL, NULL) == REF_ERROR) return false;
+            }
+            return true;
+        }
+        case OBJ_UPVALUE: {
+            ObjUpvalue* upvalue = newUpvalue(vm, NULL);
+            upvalue->location = &upvalue->closed;
+            upvalue->fiber = NULL;
+            loader->objects[i] = (Obj*)upvalue;
+            return readValue(loader, &upvalue->closed, NULL, NULL) != REF_ERROR;
+        }
+        case OBJ_CLOSURE: {
+            Obj* function;
+            int32_t upvalueCount;
+            // functions come before closures.
+            if (!readEarlier(loader, OBJ_FUNCTION, &function) ||
+                    !readCount(reader, &upvalueCount, sizeof(uint32_t)) ||
+                    ((ObjFunction*)function)->upvalueCount != upvalueCount) return false;
+
+            ObjClosure* closure = newClosure(vm, (ObjFunction*)function);
+            loader->objects[i] = (Obj*)closure;
+            for (int j = 0; j < upvalueCount; j++) {
+                if (!readObjRef(loader, OBJ_UPVALUE, &closure->upvalues[j])) return false;
+            }
+            return true;
+        }
+        case OBJ_CLASS: {
+            ObjClass* klass = newClass(vm, NULL);
+            loader->objects[i] = (Obj*)klass;
+            return readRef(loader, OBJ_STRING, false, (Obj**)&klass->name) &&
+                readTable(loader, &klass->methods);
+        }
+        case OBJ_INSTANCE: {
+            ObjInstance* instance = newInstance(vm, NULL);
+            loader->objects[i] = (Obj*)instance;
+            return readRef(loader, OBJ_CLASS, false, (Obj**)&instance->klass) &&
+                readTable(loader, &instance->fields);
+        }
+        case OBJ_BOUND_METHOD: {
+            ObjBoundMethod* bound = newBoundMethod(vm, NIL_VAL, NULL);
+            loader->objects[i] = (Obj*)bound;
+            return readValue(loader, &bound->receiver, NULL, NULL) != REF_ERROR &&
+                readObjRef(loader, OBJ_CLOSURE, &bound->method);
+        }
+        default:
+            return false;
+    }
+}
+
+bool restoreHeap(VM* vm, const uint8_t* bytes, size_t length) {
+    SnapshotHeader header;
+    if (length < sizeof(header)) return false;
+    memcpy(&header, bytes, sizeof(header));
+    if (memcmp(header.magic, "LOXS", 4) != 0 ||
+            header.version != SNAPSHOT_VERSION ||
+            header.payloadLength != length - sizeof(header)) return false;
+    const uint8_t* payload = bytes + sizeof(header);
+    if (hashBytes(payload, header.payloadLength) != header.payloadHash) return false;
+    // every record is at least its type byte.
+    if (header.objectCount > header.payloadLength) return false;
+
+    Loader loader;
+    loader.vm = vm;
+    loader.reader.current = payload;
+    loader.reader.end = payload + header.payloadLength;
+    loader.count = header.objectCount;
+    loader.objects = (Obj**)calloc(loader.count + 1, sizeof(Obj*));
+    if (loader.objects == NULL) exit(1);
+    loader.fixups = NULL;
+    loader.fixupCount = 0;
+    loader.fixupCapacity = 0;
+
+    // nothing points at the objects until the globals are swapped in at the end,
+    // and all of them will be live, so don't collect while loading.
+    vm->pauseGC = true;
+    bool ok = true;
+    for (loader.current = 0; ok && loader.current < loader.count; loader.current++) {
+        ok = readObject(&loader);
+    }
+
+    // every object exists by now, so the globals resolve in one go.
+    Table globals;
+    initTable(&globals);
+    if (ok) {
+        ok = readTable(&loader, &globals) && loader.reader.current == loader.reader.end &&
+            applyFixups(&loader);
+    }
+    if (ok) {
+        freeTable(vm, &vm->globals);
+        vm->globals = globals;
+    } else {
+        // whatever was created is unreachable and goes with the next collection.
+        freeTable(vm, &globals);
+    }
+    vm->pauseGC = false;
+    free(loader.fixups);
+    free(loader.objects);
+    return ok;
+}
@@ -0,0 +1,32 @@
+#ifndef clox_snapshot_h
+#define clox_snapshot_h
+
+#include "common.h"
+#include "vm.h"
+
+#define SNAPSHOT_VERSION 7
+
+// a heap snapshot holds every object reachable from the globals so a vm can
+// start from it instead of running the code that built them.
+//   header   magic "LOXS", version, object count, payload length and hash.
+//   objects  one record per object. references are indices into this list.
+//            objects are sorted by type so the ones a record needs to be
+//            created come before it.
+//   globals  name and value of every global.
+// natives are stored by name and bound to the loading vm's builtins.
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t objectCount;
+    uint32_t padding;
+    uint64_t payloadLength;
+    uint64_t payloadHash;
+} SnapshotHeader;
+
+// returns a malloc'ed snapshot of vm's globals, or NULL after printing an
+// error if they reach something that can't be stored, like a fiber.
+uint8_t* snapshotHeap(VM* vm, size_t* length);
+// replace vm's globals with the ones in the snapshot. false if it is corrupt.
+bool restoreHeap(VM* vm, const uint8_t* bytes, size_t length);
+
+#endif
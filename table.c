@@ -11,8 +11,8 @@ void initTable(Table* table) {
     table->entries = NULL;
 }
 
-void freeTable(Table* table) {
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+void freeTable(VM* vm, Table* table) {
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
     initTable(table);
 }
 
@@ -45,9 +45,9 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
     }
 }
 
-static void adjustCapacity(Table* table, int capacity) {
+static void adjustCapacity(VM* vm, Table* table, int capacity) {
     // create bucket array with capacity entries
-    Entry* entries = ALLOCATE(Entry, capacity);
+    Entry* entries = ALLOCATE(vm, Entry, capacity);
     for (int i = 0; i < capacity; i++) {
         // initialize entry
         entries[i].key = NULL;
@@ -68,7 +68,7 @@ static void adjustCapacity(Table* table, int capacity) {
     }
 
     // release memory for the old array.
-    FREE_ARRAY(Entry, table->entries, table->capacity);
+    FREE_ARRAY(vm, Entry, table->entries, table->capacity);
 
     table->entries = entries;
     table->capacity = capacity;
@@ -85,11 +85,11 @@ bool tableGet(Table* table, ObjString* key, Value* value) {
     return true;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value) {
     // allocate entry array if necessary
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
-        adjustCapacity(table, capacity);
+        adjustCapacity(vm, table, capacity);
     }
 
     // find entry in hash table by key
@@ -118,11 +118,11 @@ bool tableDelete(Table* table, ObjString* key) {
     return true;
 }
 
-void tableAddAll(Table* from, Table* to) {
+void tableAddAll(VM* vm, Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
         if (entry->key != NULL) {
-            tableSet(to, entry->key, entry->value);
+            tableSet(vm, to, entry->key, entry->value);
         }
     }
 }
@@ -152,17 +152,22 @@ void tableRemoveWhite(Table* table) {
     // iterate entries in table and delete value for unmarked key. 
     for (int i = 0; i < table->capacity; i++) {
         Entry* entry = &table->entries[i];
-        if (entry->key != NULL && !entry->key->obj.isMarked) {
+        if (entry->key != NULL && !isMarked(&entry->key->obj)) {
             tableDelete(table, entry->key);
         }
     }
 }
 
-void markTable(Table* table) {
+void markTable(VM* vm, Table* table) {
+    if (splitEntries(vm, table->entries, table->capacity)) return;
+    markEntries(vm, table->entries, table->capacity);
+}
+
+void markEntries(VM* vm, Entry* entries, int count) {
     // iterate entries and mark key, value
-    for (int i = 0; i < table->capacity; i++) {
-        Entry* entry = &table->entries[i];
-        markObject((Obj*)entry->key);
-        markValue(entry->value);
+    for (int i = 0; i < count; i++) {
+        Entry* entry = &entries[i];
+        markObject(vm, (Obj*)entry->key);
+        markValue(vm, entry->value);
     }
 }
\ No newline at end of file
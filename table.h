@@ -20,20 +20,21 @@ typedef struct {
 } Table;
 
 void initTable(Table* table);
-void freeTable(Table* table);
+void freeTable(VM* vm, Table* table);
 // retrieve value.
 bool tableGet(Table* table, ObjString* key, Value* value);
 // add key/value to hash table.
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(VM* vm, Table* table, ObjString* key, Value value);
 // remove an entry from hash table.
 bool tableDelete(Table* table, ObjString* key);
 // copy all entries of one hash table to another.
-void tableAddAll(Table* from, Table* to);
+void tableAddAll(VM* vm, Table* from, Table* to);
 // look for string in a hash table.
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 // remove string object in table for gc.
 void tableRemoveWhite(Table* table);
 // mark key and value in table for gc.
-void markTable(Table* table);
+void markTable(VM* vm, Table* table);
+void markEntries(VM* vm, Entry* entries, int count);
 
 #endif
\ No newline at end of file
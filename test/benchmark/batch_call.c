@@ -0,0 +1,63 @@
+// calls a lox function once per record from c, first one call at a time
+// through callFunction(), then all at once through callBatch().
+// build from the repository root:
+//   cc -O2 -I. -o batch_call test/benchmark/batch_call.c $(ls *.c | grep -v main.c) -lm -pthread
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "vm.h"
+
+#define RECORDS 1000000
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+int main() {
+    VM vm;
+    initVM(&vm);
+    Script* script = compileScript(&vm,
+        "fun score(price, quantity) {\n"
+        "  if (quantity > 10) return price * quantity * 0.9;\n"
+        "  return price * quantity;\n"
+        "}\n");
+    if (script == NULL || runScript(&vm, script, true) != INTERPRET_OK) return 70;
+
+    Value* args = (Value*)malloc(sizeof(Value) * RECORDS * 2);
+    Value* results = (Value*)malloc(sizeof(Value) * RECORDS);
+    if (args == NULL || results == NULL) return 1;
+    for (int i = 0; i < RECORDS; i++) {
+        args[i * 2] = NUMBER_VAL(i % 100);
+        args[i * 2 + 1] = NUMBER_VAL(i % 20);
+    }
+
+    double start = now();
+    double sum = 0;
+    for (int i = 0; i < RECORDS; i++) {
+        Value result;
+        if (callFunction(&vm, "score", 2, &args[i * 2], &result) != INTERPRET_OK) return 70;
+        sum += AS_NUMBER(result);
+    }
+    double single = now() - start;
+    printf("callFunction: %.3fs (%.1f ns/record) sum %.1f\n", single, single / RECORDS * 1e9, sum);
+
+    Value score;
+    tableGet(&vm.globals, copyString(&vm, "score", 5), &score);
+    start = now();
+    if (callBatch(&vm, score, 2, RECORDS, args, results) != INTERPRET_OK) return 70;
+    double batch = now() - start;
+    sum = 0;
+    for (int i = 0; i < RECORDS; i++) sum += AS_NUMBER(results[i]);
+    printf("callBatch:    %.3fs (%.1f ns/record) sum %.1f\n", batch, batch / RECORDS * 1e9, sum);
+
+    free(args);
+    free(results);
+    releaseScript(&vm, script);
+    freeVM(&vm);
+    return 0;
+}
@@ -0,0 +1,116 @@
+// times collections of a heap of long-lived trees with garbage made between
+// them, then counts the memory a collection writes to in a forked child,
+// which is what copy-on-write has to copy, then times marking the trees on
+// more and more threads.
+// build from the repository root:
+//   cc -O2 -I. -o gc_pause test/benchmark/gc_pause.c $(ls *.c | grep -v main.c) -lm -pthread
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "vm.h"
+
+#define ROUNDS 20
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+// kB of a /proc/self/smaps_rollup field.
+static long smapsField(const char* name) {
+    FILE* file = fopen("/proc/self/smaps_rollup", "r");
+    if (file == NULL) return -1;
+    char line[256];
+    long total = 0;
+    size_t length = strlen(name);
+    while (fgets(line, sizeof(line), file) != NULL) {
+        if (strncmp(line, name, length) == 0) total += atol(line + length);
+    }
+    fclose(file);
+    return total;
+}
+
+static int compareDoubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+int main() {
+    VM vm;
+    initVM(&vm);
+    Script* script = compileScript(&vm,
+        "class Tree {\n"
+        "  init(depth) {\n"
+        "    if (depth > 0) {\n"
+        "      this.left = Tree(depth - 1);\n"
+        "      this.right = Tree(depth - 1);\n"
+        "    } else {\n"
+        "      this.left = nil;\n"
+        "      this.right = nil;\n"
+        "    }\n"
+        "  }\n"
+        "}\n"
+        "var live = Tree(18);\n"
+        "fun churn() {\n"
+        "  for (var i = 0; i < 20000; i = i + 1) Tree(3);\n"
+        "}\n");
+    if (script == NULL || runScript(&vm, script, true) != INTERPRET_OK) return 70;
+
+    double pauses[ROUNDS];
+    double churn = 0;
+    for (int i = 0; i < ROUNDS; i++) {
+        Value result;
+        double start = now();
+        if (callFunction(&vm, "churn", 0, NULL, &result) != INTERPRET_OK) return 70;
+        churn += now() - start;
+        start = now();
+        collectGarbage(&vm);
+        pauses[i] = now() - start;
+    }
+    qsort(pauses, ROUNDS, sizeof(double), compareDoubles);
+    printf("collect: min %.2f ms, median %.2f ms, max %.2f ms\n",
+        pauses[0] * 1e3, pauses[ROUNDS / 2] * 1e3, pauses[ROUNDS - 1] * 1e3);
+    printf("churn:   %.3fs for %d rounds\n", churn, ROUNDS);
+
+    // start the child right after a collection, like a worker forked from a warm parent.
+    collectGarbage(&vm);
+    fflush(stdout);
+    pid_t child = fork();
+    if (child == 0) {
+        long before = smapsField("Private_Dirty:");
+        collectGarbage(&vm);
+        long after = smapsField("Private_Dirty:");
+        printf("fork:    collection dirtied %ld kB of %ld kB resident\n", after - before, smapsField("Rss:"));
+        fflush(stdout);
+        _exit(0);
+    }
+    waitpid(child, NULL, 0);
+
+    // a collection right after another has nothing to sweep, so its pause is marking.
+    int threads[] = {1, 2, 4, 8};
+    for (int i = 0; i < 4; i++) {
+        vm.markThreads = threads[i];
+        collectGarbage(&vm);
+        double best = 1e9;
+        for (int j = 0; j < 5; j++) {
+            double start = now();
+            collectGarbage(&vm);
+            double pause = now() - start;
+            if (pause < best) best = pause;
+        }
+        printf("mark:    %d threads %.2f ms\n", threads[i], best * 1e3);
+    }
+
+    releaseScript(&vm, script);
+    freeVM(&vm);
+    return 0;
+}
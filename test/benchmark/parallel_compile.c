@@ -0,0 +1,91 @@
+// compiles the scripts named on the command line, first one after another
+// with compileScript(), then on worker pools of 1, 2, 4 and 8 threads with
+// poolCompile(), and reports throughput in MB of source per second.
+// one script is split into function bodies, several are compiled a file per job.
+// build from the repository root:
+//   cc -O2 -I. -o parallel_compile test/benchmark/parallel_compile.c $(ls *.c | grep -v main.c) -lm -pthread
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "pool.h"
+#include "vm.h"
+
+#define ROUNDS 20
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+static char* readFile(const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) return NULL;
+    fseek(file, 0L, SEEK_END);
+    long size = ftell(file);
+    rewind(file);
+    char* buffer = (char*)malloc(size + 1);
+    if (buffer == NULL || fread(buffer, 1, size, file) < (size_t)size) exit(74);
+    buffer[size] = '\0';
+    fclose(file);
+    return buffer;
+}
+
+int main(int argc, const char* argv[]) {
+    int count = argc - 1;
+    if (count < 1) {
+        fprintf(stderr, "Usage: parallel_compile script...\n");
+        return 64;
+    }
+    const char** sources = (const char**)malloc(sizeof(char*) * count);
+    Script** scripts = (Script**)malloc(sizeof(Script*) * count);
+    if (sources == NULL || scripts == NULL) return 1;
+    size_t bytes = 0;
+    for (int i = 0; i < count; i++) {
+        sources[i] = readFile(argv[i + 1]);
+        if (sources[i] == NULL) return 74;
+        bytes += strlen(sources[i]);
+    }
+    double megabytes = bytes / 1e6;
+
+    // every round starts from a fresh vm, so no string is interned beforehand.
+    double best = 1e9;
+    for (int round = 0; round < ROUNDS; round++) {
+        VM vm;
+        initVM(&vm);
+        double start = now();
+        for (int i = 0; i < count; i++) {
+            if (compileScript(&vm, sources[i]) == NULL) return 65;
+        }
+        double elapsed = now() - start;
+        if (elapsed < best) best = elapsed;
+        freeVM(&vm);
+    }
+    printf("compileScript:     %7.3f ms %8.1f MB/s\n", best * 1e3, megabytes / best);
+
+    for (int workers = 1; workers <= 8; workers *= 2) {
+        WorkerPool pool;
+        initWorkerPool(&pool, workers);
+        best = 1e9;
+        for (int round = 0; round < ROUNDS; round++) {
+            VM vm;
+            initVM(&vm);
+            double start = now();
+            if (!poolCompile(&pool, &vm, sources, count, scripts)) return 65;
+            double elapsed = now() - start;
+            if (elapsed < best) best = elapsed;
+            freeVM(&vm);
+        }
+        freeWorkerPool(&pool);
+        printf("poolCompile x%d:    %7.3f ms %8.1f MB/s\n", workers, best * 1e3, megabytes / best);
+    }
+
+    for (int i = 0; i < count; i++) free((char*)sources[i]);
+    free(sources);
+    free(scripts);
+    return 0;
+}
@@ -0,0 +1,1433 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "debug.h"
+#include "tier.h"
+#include "vm.h"
+
+// past these a function stays in the baseline tier.
+#define MAX_VALUES 4096
+#define MAX_REGISTERS 128
+// rounds of type inference, check elimination and cse. each round only
+// unchecks more operations or merges more values.
+#define MAX_ROUNDS 4
+
+typedef enum {
+    IR_PARAM,
+    IR_CONSTANT,
+    IR_NIL,
+    IR_TRUE,
+    IR_FALSE,
+    IR_PHI,
+    IR_ADD,
+    IR_SUBTRACT,
+    IR_MULTIPLY,
+    IR_DIVIDE,
+    IR_LESS,
+    IR_GREATER,
+    IR_NEGATE,
+    IR_EQUAL,
+    IR_NOT,
+    IR_GET_GLOBAL,
+    IR_SET_GLOBAL,
+    IR_GET_UPVALUE,
+    IR_SET_UPVALUE,
+    IR_GET_PROPERTY,
+    IR_SET_PROPERTY,
+    IR_CALL,
+    IR_TAIL_CALL,
+    IR_INVOKE,
+    IR_TAIL_INVOKE,
+    IR_PRINT,
+    IR_JUMP,
+    IR_BRANCH,
+    IR_RETURN
+} IrOp;
+
+static const char* irNames[] = {
+    "param", "constant", "nil", "true", "false", "phi",
+    "add", "subtract", "multiply", "divide", "less", "greater", "negate", "equal", "not",
+    "get_global", "set_global", "get_upvalue", "set_upvalue", "get_property", "set_property",
+    "call", "tail_call", "invoke", "tail_invoke", "print", "jump", "branch", "return"
+};
+
+// the types a value may have at runtime, as a set.
+#define TYPE_NUMBER 1
+#define TYPE_BOOL 2
+#define TYPE_NIL 4
+#define TYPE_STRING 8
+#define TYPE_OBJECT 16
+#define TYPE_ANY 31
+
+// an ssa value. instructions that produce nothing are values too, so every
+// instruction of a block is one.
+typedef struct {
+    IrOp op;
+    int block; // -1 once removed.
+    int line;
+    int operand; // constant, name, slot or argument count, depending on op.
+    int* args;
+    int argCount;
+    int type;
+    bool unchecked; // arithmetic whose operands are known to be numbers.
+    int replacement; // value this one turned out to be the same as. -1 if none.
+    int uses;
+    int reg;
+    bool onStack; // result stays on the stack for the instruction that reads it.
+} IrValue;
+
+typedef struct {
+    int start; // baseline code the block was lifted from.
+    int end;
+    int* values; // phis first, the terminator last.
+    int count;
+    int capacity;
+    int succs[2]; // for a branch, where it goes when the condition holds and when it doesn't.
+    int succCount;
+    int* preds; // phi arguments are in the same order.
+    int predCount;
+    int predCapacity;
+    int* exit; // stack at the end of the block while lifting.
+    int exitHeight;
+    int entryHeight;
+    bool reached;
+    bool lifted;
+    int order; // position in reverse postorder.
+    int idom;
+    bool inLoop;
+    int offset; // where the block was lowered to. -1 until it is.
+} IrBlock;
+
+typedef struct {
+    VM* vm;
+    ObjFunction* function;
+    Chunk* chunk;
+    IrValue* values;
+    int valueCount;
+    int valueCapacity;
+    IrBlock* blocks; // blocks[0] is a synthetic entry holding the parameters.
+    int blockCount;
+    int* rpo;
+    int rpoCount;
+    bool* known; // values a check on the current dominator path proved to be numbers.
+    bool* guarded; // parameter slots speculated to hold numbers.
+} Ir;
+
+// lowered code being written.
+typedef struct {
+    uint8_t* code;
+    int* lines;
+    int count;
+    int capacity;
+    int* fixups; // pairs of operand offset and the block the jump goes to.
+    int fixupCount;
+    int fixupCapacity;
+    int scratch; // register for breaking cycles of phi copies.
+    bool failed;
+} Lowering;
+
+static void* growArray(void* array, int* capacity, int count, size_t size) {
+    if (count < *capacity) return array;
+    *capacity = *capacity < 8 ? 8 : *capacity * 2;
+    array = realloc(array, size * *capacity);
+    if (array == NULL) exit(1);
+    return array;
+}
+
+static void appendInt(int** array, int* count, int* capacity, int value) {
+    *array = (int*)growArray(*array, capacity, *count, sizeof(int));
+    (*array)[(*count)++] = value;
+}
+
+static void insertValue(IrBlock* block, int index, int value) {
+    block->values = (int*)growArray(block->values, &block->capacity, block->count, sizeof(int));
+    memmove(block->values + index + 1, block->values + index, sizeof(int) * (block->count - index));
+    block->values[index] = value;
+    block->count++;
+}
+
+static void unlinkValue(IrBlock* block, int value) {
+    for (int i = 0; i < block->count; i++) {
+        if (block->values[i] != value) continue;
+        memmove(block->values + i, block->values + i + 1, sizeof(int) * (block->count - i - 1));
+        block->count--;
+        return;
+    }
+}
+
+static int newValue(Ir* ir, int block, IrOp op, int line, int operand, int argCount) {
+    ir->values = (IrValue*)growArray(ir->values, &ir->valueCapacity, ir->valueCount, sizeof(IrValue));
+    IrValue* value = &ir->values[ir->valueCount];
+    value->op = op;
+    value->block = block;
+    value->line = line;
+    value->operand = operand;
+    value->argCount = argCount;
+    value->args = argCount > 0 ? (int*)malloc(sizeof(int) * argCount) : NULL;
+    if (argCount > 0 && value->args == NULL) exit(1);
+    value->type = TYPE_ANY;
+    value->unchecked = false;
+    value->replacement = -1;
+    value->uses = 0;
+    value->reg = -1;
+    value->onStack = false;
+    IrBlock* owner = &ir->blocks[block];
+    insertValue(owner, owner->count, ir->valueCount);
+    return ir->valueCount++;
+}
+
+static int resolve(Ir* ir, int value) {
+    while (ir->values[value].replacement >= 0) value = ir->values[value].replacement;
+    return value;
+}
+
+static void removeValue(Ir* ir, int value) {
+    unlinkValue(&ir->blocks[ir->values[value].block], value);
+    ir->values[value].block = -1;
+}
+
+static void replaceValue(Ir* ir, int value, int with) {
+    removeValue(ir, value);
+    ir->values[value].replacement = with;
+}
+
+static bool hasResult(IrOp op) {
+    switch (op) {
+        case IR_SET_GLOBAL:
+        case IR_SET_UPVALUE:
+        case IR_SET_PROPERTY:
+        case IR_PRINT:
+        case IR_JUMP:
+        case IR_BRANCH:
+        case IR_RETURN:
+            return false;
+        default:
+            return true;
+    }
+}
+
+// operations that check their operands are numbers. add also takes strings.
+static bool isNumeric(IrOp op) {
+    return op >= IR_ADD && op <= IR_NEGATE;
+}
+
+// same operands give the same result, or the same error.
+static bool isPure(IrOp op) {
+    return (op >= IR_CONSTANT && op <= IR_FALSE) || (op >= IR_ADD && op <= IR_NOT);
+}
+
+// pure and can't fail, so it can run earlier than it would have or not at all.
+static bool isSafe(IrValue* value) {
+    if (value->op >= IR_CONSTANT && value->op <= IR_FALSE) return true;
+    if (value->op == IR_EQUAL || value->op == IR_NOT) return true;
+    return isNumeric(value->op) && value->unchecked;
+}
+
+// lifting bytecode into ssa form. the operand stack is treated as the
+// variables: every stack position holds an ssa value, locals included, and
+// blocks where positions disagree start with phis for them.
+
+static bool isSupported(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_POP:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_GET_PROPERTY:
+        case OP_SET_PROPERTY:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_ADD_NUMBER:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_NEGATE_NUMBER:
+        case OP_PRINT:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+        case OP_CALL:
+        case OP_TAIL_CALL:
+        case OP_INVOKE:
+        case OP_TAIL_INVOKE:
+        case OP_RETURN:
+            return true;
+        default:
+            // closures capture slots, which ssa can't see written through.
+            return false;
+    }
+}
+
+static int jumpTarget(Chunk* chunk, int offset) {
+    int jump = (chunk->code[offset + 1] << 8) | chunk->code[offset + 2];
+    return chunk->code[offset] == OP_LOOP ? offset + 3 - jump : offset + 3 + jump;
+}
+
+static void addEdge(Ir* ir, int from, int to) {
+    IrBlock* block = &ir->blocks[from];
+    block->succs[block->succCount++] = to;
+}
+
+static void postorder(Ir* ir, int index, int* order) {
+    IrBlock* block = &ir->blocks[index];
+    block->reached = true;
+    for (int i = block->succCount - 1; i >= 0; i--) {
+        if (!ir->blocks[block->succs[i]].reached) postorder(ir, block->succs[i], order);
+    }
+    order[ir->rpoCount++] = index;
+}
+
+static bool buildBlocks(Ir* ir) {
+    Chunk* chunk = ir->chunk;
+    int* blockAt = (int*)malloc(sizeof(int) * (chunk->count + 1));
+    if (blockAt == NULL) exit(1);
+    for (int i = 0; i <= chunk->count; i++) blockAt[i] = 0;
+
+    // a block starts at every jump target and after every jump or return.
+    blockAt[0] = 1;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        uint8_t op = chunk->code[offset];
+        if (!isSupported(op)) {
+            free(blockAt);
+            return false;
+        }
+        int next = offset + instructionLength(chunk, offset);
+        if (op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_LOOP) {
+            int target = jumpTarget(chunk, offset);
+            if (target < 0 || target >= chunk->count) {
+                free(blockAt);
+                return false;
+            }
+            blockAt[target] = 1;
+            blockAt[next] = 1;
+        } else if (op == OP_RETURN) {
+            blockAt[next] = 1;
+        }
+    }
+
+    ir->blockCount = 1;
+    for (int i = 0; i < chunk->count; i++) {
+        if (blockAt[i]) ir->blockCount++;
+    }
+    ir->blocks = (IrBlock*)calloc(ir->blockCount, sizeof(IrBlock));
+    if (ir->blocks == NULL) exit(1);
+    int index = 1;
+    ir->blocks[0].start = ir->blocks[0].end = -1;
+    for (int i = 0; i < chunk->count; i++) {
+        if (!blockAt[i]) {
+            blockAt[i] = -1;
+            continue;
+        }
+        if (index > 1) ir->blocks[index - 1].end = i;
+        ir->blocks[index].start = i;
+        blockAt[i] = index++;
+    }
+    ir->blocks[index - 1].end = chunk->count;
+
+    bool ok = true;
+    addEdge(ir, 0, 1);
+    for (int b = 1; b < ir->blockCount && ok; b++) {
+        IrBlock* block = &ir->blocks[b];
+        int last = block->start;
+        for (int offset = block->start; offset < block->end; offset += instructionLength(chunk, offset)) last = offset;
+        uint8_t op = chunk->code[last];
+        if (op == OP_JUMP || op == OP_LOOP) {
+            addEdge(ir, b, blockAt[jumpTarget(chunk, last)]);
+        } else if (op == OP_JUMP_IF_FALSE) {
+            addEdge(ir, b, b + 1);
+            addEdge(ir, b, blockAt[jumpTarget(chunk, last)]);
+        } else if (op != OP_RETURN) {
+            // code doesn't fall off the end of a chunk.
+            if (b + 1 == ir->blockCount) ok = false;
+            else addEdge(ir, b, b + 1);
+        }
+    }
+    free(blockAt);
+    if (!ok) return false;
+
+    for (int b = 0; b < ir->blockCount; b++) {
+        ir->blocks[b].idom = -1;
+        ir->blocks[b].offset = -1;
+    }
+    int* order = (int*)malloc(sizeof(int) * ir->blockCount);
+    ir->rpo = (int*)malloc(sizeof(int) * ir->blockCount);
+    if (order == NULL || ir->rpo == NULL) exit(1);
+    postorder(ir, 0, order);
+    for (int i = 0; i < ir->rpoCount; i++) {
+        ir->rpo[i] = order[ir->rpoCount - 1 - i];
+        ir->blocks[ir->rpo[i]].order = i;
+    }
+    free(order);
+
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (!block->reached) continue;
+        for (int i = 0; i < block->succCount; i++) {
+            IrBlock* succ = &ir->blocks[block->succs[i]];
+            appendInt(&succ->preds, &succ->predCount, &succ->predCapacity, b);
+        }
+    }
+    return true;
+}
+
+static bool liftInstructions(Ir* ir, int b, int* stack, int* height) {
+    Chunk* chunk = ir->chunk;
+    IrBlock* block = &ir->blocks[b];
+    int h = *height;
+    bool terminated = false;
+
+    #define NEEDS(n) do { if (h < (n)) return false; } while (false)
+    #define PUSH(value) do { if (h >= FRAME_SLOTS) return false; stack[h++] = (value); } while (false)
+    #define ARG(value, i) (ir->values[value].args[i])
+
+    for (int offset = block->start; offset < block->end; offset += instructionLength(chunk, offset)) {
+        if (ir->valueCount > MAX_VALUES) return false;
+        uint8_t op = chunk->code[offset];
+        uint8_t operand = offset + 1 < chunk->count ? chunk->code[offset + 1] : 0;
+        int line = chunk->lines[offset];
+        int value;
+        switch (op) {
+            case OP_CONSTANT: PUSH(newValue(ir, b, IR_CONSTANT, line, operand, 0)); break;
+            case OP_NIL: PUSH(newValue(ir, b, IR_NIL, line, 0, 0)); break;
+            case OP_TRUE: PUSH(newValue(ir, b, IR_TRUE, line, 0, 0)); break;
+            case OP_FALSE: PUSH(newValue(ir, b, IR_FALSE, line, 0, 0)); break;
+            case OP_POP: NEEDS(1); h--; break;
+            case OP_GET_LOCAL:
+                if (operand >= h) return false;
+                PUSH(stack[operand]);
+                break;
+            case OP_SET_LOCAL:
+                NEEDS(1);
+                if (operand >= h) return false;
+                stack[operand] = stack[h - 1];
+                break;
+            case OP_GET_GLOBAL: PUSH(newValue(ir, b, IR_GET_GLOBAL, line, operand, 0)); break;
+            case OP_GET_UPVALUE: PUSH(newValue(ir, b, IR_GET_UPVALUE, line, operand, 0)); break;
+            case OP_SET_GLOBAL:
+            case OP_SET_UPVALUE:
+                NEEDS(1);
+                value = newValue(ir, b, op == OP_SET_GLOBAL ? IR_SET_GLOBAL : IR_SET_UPVALUE, line, operand, 1);
+                ARG(value, 0) = stack[h - 1];
+                break;
+            case OP_GET_PROPERTY:
+                NEEDS(1);
+                value = newValue(ir, b, IR_GET_PROPERTY, line, operand, 1);
+                ARG(value, 0) = stack[h - 1];
+                stack[h - 1] = value;
+                break;
+            case OP_SET_PROPERTY:
+                NEEDS(2);
+                value = newValue(ir, b, IR_SET_PROPERTY, line, operand, 2);
+                ARG(value, 0) = stack[h - 2];
+                ARG(value, 1) = stack[h - 1];
+                // the assigned value is left on the stack.
+                stack[h - 2] = stack[h - 1];
+                h--;
+                break;
+            case OP_EQUAL:
+            case OP_GREATER:
+            case OP_LESS:
+            case OP_ADD:
+            case OP_SUBTRACT:
+            case OP_MULTIPLY:
+            case OP_DIVIDE:
+            case OP_GREATER_NUMBER:
+            case OP_LESS_NUMBER:
+            case OP_ADD_NUMBER:
+            case OP_SUBTRACT_NUMBER:
+            case OP_MULTIPLY_NUMBER:
+            case OP_DIVIDE_NUMBER: {
+                NEEDS(2);
+                IrOp irOp;
+                switch (op) {
+                    case OP_EQUAL: irOp = IR_EQUAL; break;
+                    case OP_GREATER: case OP_GREATER_NUMBER: irOp = IR_GREATER; break;
+                    case OP_LESS: case OP_LESS_NUMBER: irOp = IR_LESS; break;
+                    case OP_ADD: case OP_ADD_NUMBER: irOp = IR_ADD; break;
+                    case OP_SUBTRACT: case OP_SUBTRACT_NUMBER: irOp = IR_SUBTRACT; break;
+                    case OP_MULTIPLY: case OP_MULTIPLY_NUMBER: irOp = IR_MULTIPLY; break;
+                    default: irOp = IR_DIVIDE; break;
+                }
+                value = newValue(ir, b, irOp, line, 0, 2);
+                // the compiler already proved the operands of these to be numbers.
+                ir->values[value].unchecked = op >= OP_GREATER_NUMBER;
+                ARG(value, 0) = stack[h - 2];
+                ARG(value, 1) = stack[h - 1];
+                h -= 2;
+                PUSH(value);
+                break;
+            }
+            case OP_NOT:
+            case OP_NEGATE:
+            case OP_NEGATE_NUMBER:
+                NEEDS(1);
+                value = newValue(ir, b, op == OP_NOT ? IR_NOT : IR_NEGATE, line, 0, 1);
+                ir->values[value].unchecked = op == OP_NEGATE_NUMBER;
+                ARG(value, 0) = stack[h - 1];
+                stack[h - 1] = value;
+                break;
+            case OP_PRINT:
+                NEEDS(1);
+                value = newValue(ir, b, IR_PRINT, line, 0, 1);
+                ARG(value, 0) = stack[--h];
+                break;
+            case OP_CALL:
+            case OP_TAIL_CALL:
+            case OP_INVOKE:
+            case OP_TAIL_INVOKE: {
+                // callee or receiver, then the arguments.
+                bool invoke = op == OP_INVOKE || op == OP_TAIL_INVOKE;
+                int argCount = (invoke ? chunk->code[offset + 2] : operand) + 1;
+                NEEDS(argCount);
+                IrOp irOp = op == OP_CALL ? IR_CALL : op == OP_TAIL_CALL ? IR_TAIL_CALL :
+                    op == OP_INVOKE ? IR_INVOKE : IR_TAIL_INVOKE;
+                value = newValue(ir, b, irOp, line, invoke ? operand : 0, argCount);
+                for (int i = 0; i < argCount; i++) ARG(value, i) = stack[h - argCount + i];
+                h -= argCount;
+                PUSH(value);
+                break;
+            }
+            case OP_JUMP:
+            case OP_LOOP:
+                newValue(ir, b, IR_JUMP, line, 0, 0);
+                terminated = true;
+                break;
+            case OP_JUMP_IF_FALSE:
+                // the condition stays on the stack on both paths.
+                NEEDS(1);
+                value = newValue(ir, b, IR_BRANCH, line, 0, 1);
+                ARG(value, 0) = stack[h - 1];
+                terminated = true;
+                break;
+            case OP_RETURN:
+                NEEDS(1);
+                value = newValue(ir, b, IR_RETURN, line, 0, 1);
+                ARG(value, 0) = stack[--h];
+                terminated = true;
+                break;
+            default:
+                return false;
+        }
+    }
+    if (!terminated) newValue(ir, b, IR_JUMP, ir->chunk->lines[block->end - 1], 0, 0);
+
+    #undef NEEDS
+    #undef PUSH
+    #undef ARG
+
+    *height = h;
+    return true;
+}
+
+static bool liftBlocks(Ir* ir) {
+    int* stack = (int*)malloc(sizeof(int) * FRAME_SLOTS);
+    if (stack == NULL) exit(1);
+    int line = ir->chunk->lines[0];
+
+    // the entry block holds the callee or receiver and the arguments.
+    IrBlock* entry = &ir->blocks[0];
+    int height = ir->function->arity + 1;
+    for (int i = 0; i < height; i++) stack[i] = newValue(ir, 0, IR_PARAM, line, i, 0);
+    newValue(ir, 0, IR_JUMP, line, 0, 0);
+    entry->exit = (int*)malloc(sizeof(int) * height);
+    if (entry->exit == NULL) exit(1);
+    memcpy(entry->exit, stack, sizeof(int) * height);
+    entry->exitHeight = height;
+    entry->lifted = true;
+
+    bool ok = true;
+    // in reverse postorder every block comes after its predecessors, loop back
+    // edges aside, so the stack is known before a block is entered.
+    for (int r = 1; r < ir->rpoCount && ok; r++) {
+        int b = ir->rpo[r];
+        IrBlock* block = &ir->blocks[b];
+        bool header = false;
+        int first = -1;
+        for (int i = 0; i < block->predCount; i++) {
+            int pred = block->preds[i];
+            if (!ir->blocks[pred].lifted) {
+                header = true;
+            } else if (first == -1) {
+                first = pred;
+            } else if (ir->blocks[pred].exitHeight != ir->blocks[first].exitHeight) {
+                ok = false;
+            }
+        }
+        if (first == -1 || !ok) {
+            ok = false;
+            break;
+        }
+
+        height = ir->blocks[first].exitHeight;
+        block->entryHeight = height;
+        int blockLine = ir->chunk->lines[block->start];
+        for (int slot = 0; slot < height; slot++) {
+            int same = ir->blocks[first].exit[slot];
+            bool differs = false;
+            for (int i = 0; i < block->predCount; i++) {
+                int pred = block->preds[i];
+                if (ir->blocks[pred].lifted && ir->blocks[pred].exit[slot] != same) differs = true;
+            }
+            if (!header && !differs) {
+                stack[slot] = same;
+                continue;
+            }
+            // back edges fill in their arguments once they have been lifted.
+            int phi = newValue(ir, b, IR_PHI, blockLine, slot, block->predCount);
+            for (int i = 0; i < block->predCount; i++) {
+                int pred = block->preds[i];
+                ir->values[phi].args[i] = ir->blocks[pred].lifted ? ir->blocks[pred].exit[slot] : -1;
+            }
+            stack[slot] = phi;
+        }
+
+        if (!liftInstructions(ir, b, stack, &height)) {
+            ok = false;
+            break;
+        }
+        block->exit = (int*)malloc(sizeof(int) * (height + 1));
+        if (block->exit == NULL) exit(1);
+        memcpy(block->exit, stack, sizeof(int) * height);
+        block->exitHeight = height;
+        block->lifted = true;
+    }
+    free(stack);
+    if (!ok) return false;
+
+    for (int v = 0; v < ir->valueCount; v++) {
+        IrValue* value = &ir->values[v];
+        if (value->op != IR_PHI) continue;
+        IrBlock* block = &ir->blocks[value->block];
+        for (int i = 0; i < value->argCount; i++) {
+            if (value->args[i] != -1) continue;
+            IrBlock* pred = &ir->blocks[block->preds[i]];
+            if (!pred->lifted || pred->exitHeight != block->entryHeight) return false;
+            value->args[i] = pred->exit[value->operand];
+        }
+    }
+    return true;
+}
+
+// a phi whose arguments are all one value, or itself, is that value.
+static bool simplifyPhis(Ir* ir) {
+    bool simplified = false;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int v = 0; v < ir->valueCount; v++) {
+            IrValue* value = &ir->values[v];
+            if (value->op != IR_PHI || value->block < 0) continue;
+            int same = -1;
+            bool trivial = true;
+            for (int i = 0; i < value->argCount && trivial; i++) {
+                int arg = resolve(ir, value->args[i]);
+                if (arg == v || arg == same) continue;
+                if (same != -1) trivial = false;
+                same = arg;
+            }
+            if (!trivial || same == -1) continue;
+            replaceValue(ir, v, same);
+            changed = simplified = true;
+        }
+    }
+    return simplified;
+}
+
+static int intersect(Ir* ir, int a, int b) {
+    while (a != b) {
+        while (ir->blocks[a].order > ir->blocks[b].order) a = ir->blocks[a].idom;
+        while (ir->blocks[b].order > ir->blocks[a].order) b = ir->blocks[b].idom;
+    }
+    return a;
+}
+
+static void computeDominators(Ir* ir) {
+    ir->blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 1; i < ir->rpoCount; i++) {
+            IrBlock* block = &ir->blocks[ir->rpo[i]];
+            int idom = -1;
+            for (int j = 0; j < block->predCount; j++) {
+                int pred = block->preds[j];
+                if (ir->blocks[pred].idom == -1) continue;
+                idom = idom == -1 ? pred : intersect(ir, pred, idom);
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool dominates(Ir* ir, int a, int b) {
+    while (b != a && b != 0) b = ir->blocks[b].idom;
+    return a == b;
+}
+
+// speculate that parameters every call so far passed a number for stay
+// numbers, when they are used in arithmetic. the guards are checked on entry.
+static void chooseGuards(Ir* ir) {
+    for (int v = 0; v < ir->valueCount; v++) {
+        IrValue* value = &ir->values[v];
+        if (value->block < 0 || !isNumeric(value->op)) continue;
+        for (int i = 0; i < value->argCount; i++) {
+            IrValue* arg = &ir->values[resolve(ir, value->args[i])];
+            int slot = arg->operand;
+            if (arg->op != IR_PARAM || slot == 0 || slot > 32) continue;
+            if (ir->function->numberArgs & (1u << (slot - 1))) ir->guarded[slot] = true;
+        }
+    }
+}
+
+static int typeOf(Ir* ir, IrValue* value) {
+    switch (value->op) {
+        case IR_PARAM: return ir->guarded[value->operand] ? TYPE_NUMBER : TYPE_ANY;
+        case IR_CONSTANT: {
+            Value constant = ir->chunk->constants.values[value->operand];
+            if (IS_NUMBER(constant)) return TYPE_NUMBER;
+            return IS_STRING(constant) ? TYPE_STRING : TYPE_OBJECT;
+        }
+        case IR_NIL: return TYPE_NIL;
+        case IR_TRUE:
+        case IR_FALSE:
+        case IR_LESS:
+        case IR_GREATER:
+        case IR_EQUAL:
+        case IR_NOT:
+            return TYPE_BOOL;
+        case IR_PHI: {
+            int type = 0;
+            for (int i = 0; i < value->argCount; i++) type |= ir->values[resolve(ir, value->args[i])].type;
+            return type;
+        }
+        case IR_ADD: {
+            if (value->unchecked) return TYPE_NUMBER;
+            int a = ir->values[resolve(ir, value->args[0])].type;
+            int b = ir->values[resolve(ir, value->args[1])].type;
+            if (a == TYPE_NUMBER && b == TYPE_NUMBER) return TYPE_NUMBER;
+            if (a == TYPE_STRING && b == TYPE_STRING) return TYPE_STRING;
+            return TYPE_NUMBER | TYPE_STRING;
+        }
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_NEGATE:
+            return TYPE_NUMBER;
+        default:
+            return TYPE_ANY;
+    }
+}
+
+// types start empty and only grow, so this settles even around loops.
+static void inferTypes(Ir* ir) {
+    for (int v = 0; v < ir->valueCount; v++) ir->values[v].type = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int i = 0; i < ir->rpoCount; i++) {
+            IrBlock* block = &ir->blocks[ir->rpo[i]];
+            for (int j = 0; j < block->count; j++) {
+                IrValue* value = &ir->values[block->values[j]];
+                int type = typeOf(ir, value);
+                if (type != value->type) {
+                    value->type = type;
+                    changed = true;
+                }
+            }
+        }
+    }
+}
+
+// an operation whose operands are numbers, by type or because a check that
+// dominates it already passed on them, doesn't need to check them again.
+static bool eliminateChecks(Ir* ir, int b) {
+    bool changed = false;
+    int* marked = NULL;
+    int markedCount = 0;
+    int markedCapacity = 0;
+    IrBlock* block = &ir->blocks[b];
+    for (int i = 0; i < block->count; i++) {
+        IrValue* value = &ir->values[block->values[i]];
+        if (!isNumeric(value->op) || value->unchecked) continue;
+        bool numbers = true;
+        for (int j = 0; j < value->argCount; j++) {
+            int arg = resolve(ir, value->args[j]);
+            if (ir->values[arg].type != TYPE_NUMBER && !ir->known[arg]) numbers = false;
+        }
+        if (numbers) {
+            value->unchecked = true;
+            changed = true;
+        } else if (value->op != IR_ADD) {
+            // once it has run, its operands were numbers.
+            for (int j = 0; j < value->argCount; j++) {
+                int arg = resolve(ir, value->args[j]);
+                if (ir->known[arg]) continue;
+                ir->known[arg] = true;
+                appendInt(&marked, &markedCount, &markedCapacity, arg);
+            }
+        }
+    }
+    for (int i = 0; i < ir->rpoCount; i++) {
+        int child = ir->rpo[i];
+        if (child != b && ir->blocks[child].idom == b) changed |= eliminateChecks(ir, child);
+    }
+    for (int i = 0; i < markedCount; i++) ir->known[marked[i]] = false;
+    free(marked);
+    return changed;
+}
+
+static bool sameValue(Ir* ir, IrValue* a, IrValue* b) {
+    if (a->op != b->op || a->argCount != b->argCount) return false;
+    if (a->op == IR_CONSTANT) {
+        Value x = ir->chunk->constants.values[a->operand];
+        Value y = ir->chunk->constants.values[b->operand];
+        // 0 and -0 are equal but aren't the same constant.
+        if (IS_NUMBER(x) && IS_NUMBER(y)) {
+            double dx = AS_NUMBER(x);
+            double dy = AS_NUMBER(y);
+            if (memcmp(&dx, &dy, sizeof(double)) != 0) return false;
+        } else if (!valuesEqual(x, y)) {
+            return false;
+        }
+    }
+    for (int i = 0; i < a->argCount; i++) {
+        if (resolve(ir, a->args[i]) != resolve(ir, b->args[i])) return false;
+    }
+    return true;
+}
+
+// a pure value computed again where an equal one dominates it is that one.
+static bool eliminateCommon(Ir* ir, int b, int** available, int* count, int* capacity) {
+    bool changed = false;
+    int base = *count;
+    IrBlock* block = &ir->blocks[b];
+    for (int i = 0; i < block->count;) {
+        int v = block->values[i];
+        IrValue* value = &ir->values[v];
+        if (!isPure(value->op)) {
+            i++;
+            continue;
+        }
+        int found = -1;
+        for (int j = 0; j < *count && found == -1; j++) {
+            if (sameValue(ir, &ir->values[(*available)[j]], value)) found = (*available)[j];
+        }
+        if (found == -1) {
+            appendInt(available, count, capacity, v);
+            i++;
+            continue;
+        }
+        replaceValue(ir, v, found);
+        changed = true;
+    }
+    for (int i = 0; i < ir->rpoCount; i++) {
+        int child = ir->rpo[i];
+        if (child != b && ir->blocks[child].idom == b) changed |= eliminateCommon(ir, child, available, count, capacity);
+    }
+    *count = base;
+    return changed;
+}
+
+// move values that can't fail and only depend on values from outside a loop
+// into the block the loop is entered from.
+static void hoistLoops(Ir* ir) {
+    int* worklist = (int*)malloc(sizeof(int) * ir->blockCount);
+    if (worklist == NULL) exit(1);
+    // inner loops first, so what they hoist can move further out.
+    for (int i = ir->rpoCount - 1; i >= 0; i--) {
+        int header = ir->rpo[i];
+        IrBlock* block = &ir->blocks[header];
+        for (int b = 0; b < ir->blockCount; b++) ir->blocks[b].inLoop = false;
+        block->inLoop = true;
+        int top = 0;
+        for (int j = 0; j < block->predCount; j++) {
+            int pred = block->preds[j];
+            if (!dominates(ir, header, pred) || ir->blocks[pred].inLoop) continue;
+            ir->blocks[pred].inLoop = true;
+            worklist[top++] = pred;
+        }
+        if (top == 0) continue;
+        while (top > 0) {
+            IrBlock* body = &ir->blocks[worklist[--top]];
+            for (int j = 0; j < body->predCount; j++) {
+                int pred = body->preds[j];
+                if (ir->blocks[pred].inLoop) continue;
+                ir->blocks[pred].inLoop = true;
+                worklist[top++] = pred;
+            }
+        }
+
+        int preheader = -1;
+        int outside = 0;
+        for (int j = 0; j < block->predCount; j++) {
+            if (ir->blocks[block->preds[j]].inLoop) continue;
+            preheader = block->preds[j];
+            outside++;
+        }
+        if (outside != 1 || ir->blocks[preheader].succCount != 1) continue;
+
+        bool changed = true;
+        while (changed) {
+            changed = false;
+            for (int j = 0; j < ir->rpoCount; j++) {
+                IrBlock* body = &ir->blocks[ir->rpo[j]];
+                if (!body->inLoop) continue;
+                for (int k = 0; k < body->count;) {
+                    int v = body->values[k];
+                    IrValue* value = &ir->values[v];
+                    bool invariant = isSafe(value);
+                    for (int a = 0; a < value->argCount && invariant; a++) {
+                        if (ir->blocks[ir->values[resolve(ir, value->args[a])].block].inLoop) invariant = false;
+                    }
+                    if (!invariant) {
+                        k++;
+                        continue;
+                    }
+                    unlinkValue(body, v);
+                    IrBlock* target = &ir->blocks[preheader];
+                    insertValue(target, target->count - 1, v);
+                    value->block = preheader;
+                    changed = true;
+                }
+            }
+        }
+    }
+    free(worklist);
+}
+
+static void countUses(Ir* ir) {
+    for (int v = 0; v < ir->valueCount; v++) ir->values[v].uses = 0;
+    for (int v = 0; v < ir->valueCount; v++) {
+        IrValue* value = &ir->values[v];
+        if (value->block < 0) continue;
+        for (int i = 0; i < value->argCount; i++) ir->values[resolve(ir, value->args[i])].uses++;
+    }
+}
+
+static void removeDead(Ir* ir) {
+    countUses(ir);
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int v = 0; v < ir->valueCount; v++) {
+            IrValue* value = &ir->values[v];
+            if (value->block < 0 || value->uses > 0) continue;
+            if (!isSafe(value) && value->op != IR_PHI && value->op != IR_GET_UPVALUE) continue;
+            for (int i = 0; i < value->argCount; i++) ir->values[resolve(ir, value->args[i])].uses--;
+            removeValue(ir, v);
+            changed = true;
+        }
+    }
+}
+
+// lowering to register instructions. every value gets its own register,
+// parameters keep the slots the call put them in.
+
+static void emitByte(Lowering* out, uint8_t byte, int line) {
+    if (out->count == out->capacity) {
+        out->capacity = out->capacity < 64 ? 64 : out->capacity * 2;
+        out->code = (uint8_t*)realloc(out->code, out->capacity);
+        out->lines = (int*)realloc(out->lines, sizeof(int) * out->capacity);
+        if (out->code == NULL || out->lines == NULL) exit(1);
+    }
+    out->code[out->count] = byte;
+    out->lines[out->count] = line;
+    out->count++;
+}
+
+static void emitBytes(Lowering* out, uint8_t a, uint8_t b, int line) {
+    emitByte(out, a, line);
+    emitByte(out, b, line);
+}
+
+static void emitJumpTo(Ir* ir, Lowering* out, int block, int line) {
+    int target = ir->blocks[block].offset;
+    if (target >= 0) {
+        int jump = out->count + 3 - target;
+        if (jump > UINT16_MAX) out->failed = true;
+        emitByte(out, OP_LOOP, line);
+        emitBytes(out, (jump >> 8) & 0xff, jump & 0xff, line);
+        return;
+    }
+    emitByte(out, OP_JUMP, line);
+    emitBytes(out, 0xff, 0xff, line);
+    appendInt(&out->fixups, &out->fixupCount, &out->fixupCapacity, out->count - 2);
+    appendInt(&out->fixups, &out->fixupCount, &out->fixupCapacity, block);
+}
+
+static void patchJump(Lowering* out, int at, int target) {
+    int jump = target - at - 2;
+    if (jump > UINT16_MAX) out->failed = true;
+    out->code[at] = (jump >> 8) & 0xff;
+    out->code[at + 1] = jump & 0xff;
+}
+
+// set the phis of to from the values they take coming from from. the copies
+// happen all at once, so one reading another's destination goes first.
+static int emitCopies(Ir* ir, Lowering* out, int from, int to, int line, bool count) {
+    IrBlock* target = &ir->blocks[to];
+    int pred = 0;
+    while (target->preds[pred] != from) pred++;
+
+    int dsts[UINT8_COUNT];
+    int srcs[UINT8_COUNT];
+    int copies = 0;
+    for (int i = 0; i < target->count; i++) {
+        IrValue* phi = &ir->values[target->values[i]];
+        if (phi->op != IR_PHI) break;
+        int src = ir->values[resolve(ir, phi->args[pred])].reg;
+        if (src == phi->reg) continue;
+        dsts[copies] = phi->reg;
+        srcs[copies] = src;
+        copies++;
+    }
+    if (count) return copies;
+
+    while (copies > 0) {
+        bool progress = false;
+        for (int i = 0; i < copies; i++) {
+            bool read = false;
+            for (int j = 0; j < copies && !read; j++) read = j != i && srcs[j] == dsts[i];
+            if (read) continue;
+            emitByte(out, OP_MOVE, line);
+            emitBytes(out, dsts[i], srcs[i], line);
+            dsts[i] = dsts[copies - 1];
+            srcs[i] = srcs[copies - 1];
+            copies--;
+            progress = true;
+            break;
+        }
+        if (progress) continue;
+        // every destination is still to be read. save one and read it from the scratch register.
+        emitByte(out, OP_MOVE, line);
+        emitBytes(out, out->scratch, dsts[0], line);
+        for (int j = 0; j < copies; j++) {
+            if (srcs[j] == dsts[0]) srcs[j] = out->scratch;
+        }
+    }
+    return 0;
+}
+
+static int nextBlock(Ir* ir, int b) {
+    for (b++; b < ir->blockCount; b++) {
+        if (ir->blocks[b].reached) return b;
+    }
+    return -1;
+}
+
+static uint8_t registerOp(IrValue* value) {
+    switch (value->op) {
+        case IR_ADD: return value->unchecked ? OP_ADD_NUMBER_R : OP_ADD_R;
+        case IR_SUBTRACT: return value->unchecked ? OP_SUBTRACT_NUMBER_R : OP_SUBTRACT_R;
+        case IR_MULTIPLY: return value->unchecked ? OP_MULTIPLY_NUMBER_R : OP_MULTIPLY_R;
+        case IR_DIVIDE: return value->unchecked ? OP_DIVIDE_NUMBER_R : OP_DIVIDE_R;
+        case IR_LESS: return value->unchecked ? OP_LESS_NUMBER_R : OP_LESS_R;
+        case IR_GREATER: return value->unchecked ? OP_GREATER_NUMBER_R : OP_GREATER_R;
+        case IR_NEGATE: return value->unchecked ? OP_NEGATE_NUMBER_R : OP_NEGATE_R;
+        case IR_EQUAL: return OP_EQUAL_R;
+        default: return OP_NOT_R;
+    }
+}
+
+static void emitArgs(Ir* ir, Lowering* out, IrValue* value) {
+    for (int i = 0; i < value->argCount; i++) {
+        IrValue* arg = &ir->values[resolve(ir, value->args[i])];
+        if (!arg->onStack) emitBytes(out, OP_PUSH_R, arg->reg, value->line);
+    }
+}
+
+// results left on the stack by stack instructions go to the value's register.
+static void emitResult(Lowering* out, IrValue* value) {
+    if (value->onStack) return;
+    if (value->reg >= 0) emitBytes(out, OP_POP_R, value->reg, value->line);
+    else emitByte(out, OP_POP, value->line);
+}
+
+static void emitValue(Ir* ir, Lowering* out, int b, int v) {
+    IrValue* value = &ir->values[v];
+    int line = value->line;
+    // a checked operation nothing reads still runs for its error.
+    int dst = value->reg >= 0 ? value->reg : out->scratch;
+    int arg0 = value->argCount > 0 ? ir->values[resolve(ir, value->args[0])].reg : 0;
+    int arg1 = value->argCount > 1 ? ir->values[resolve(ir, value->args[1])].reg : 0;
+    switch (value->op) {
+        case IR_PARAM:
+        case IR_PHI:
+            break;
+        case IR_CONSTANT:
+            emitByte(out, OP_LOAD_CONSTANT, line);
+            emitBytes(out, dst, value->operand, line);
+            break;
+        case IR_NIL: emitBytes(out, OP_LOAD_NIL, dst, line); break;
+        case IR_TRUE: emitBytes(out, OP_LOAD_TRUE, dst, line); break;
+        case IR_FALSE: emitBytes(out, OP_LOAD_FALSE, dst, line); break;
+        case IR_ADD:
+        case IR_SUBTRACT:
+        case IR_MULTIPLY:
+        case IR_DIVIDE:
+        case IR_LESS:
+        case IR_GREATER:
+        case IR_EQUAL:
+            emitBytes(out, registerOp(value), dst, line);
+            emitBytes(out, arg0, arg1, line);
+            break;
+        case IR_NEGATE:
+        case IR_NOT:
+            emitByte(out, registerOp(value), line);
+            emitBytes(out, dst, arg0, line);
+            break;
+        case IR_GET_GLOBAL:
+        case IR_GET_UPVALUE:
+            emitBytes(out, value->op == IR_GET_GLOBAL ? OP_GET_GLOBAL : OP_GET_UPVALUE, value->operand, line);
+            emitResult(out, value);
+            break;
+        case IR_SET_GLOBAL:
+        case IR_SET_UPVALUE:
+            emitArgs(ir, out, value);
+            emitBytes(out, value->op == IR_SET_GLOBAL ? OP_SET_GLOBAL : OP_SET_UPVALUE, value->operand, line);
+            emitByte(out, OP_POP, line);
+            break;
+        case IR_GET_PROPERTY:
+            emitArgs(ir, out, value);
+            emitBytes(out, OP_GET_PROPERTY, value->operand, line);
+            emitResult(out, value);
+            break;
+        case IR_SET_PROPERTY:
+            emitArgs(ir, out, value);
+            emitBytes(out, OP_SET_PROPERTY, value->operand, line);
+            emitByte(out, OP_POP, line);
+            break;
+        case IR_CALL:
+        case IR_TAIL_CALL:
+            emitArgs(ir, out, value);
+            emitBytes(out, value->op == IR_CALL ? OP_CALL : OP_TAIL_CALL, value->argCount - 1, line);
+            emitResult(out, value);
+            break;
+        case IR_INVOKE:
+        case IR_TAIL_INVOKE:
+            emitArgs(ir, out, value);
+            emitBytes(out, value->op == IR_INVOKE ? OP_INVOKE : OP_TAIL_INVOKE, value->operand, line);
+            emitByte(out, value->argCount - 1, line);
+            emitResult(out, value);
+            break;
+        case IR_PRINT:
+            emitArgs(ir, out, value);
+            emitByte(out, OP_PRINT, line);
+            break;
+        case IR_RETURN:
+            emitArgs(ir, out, value);
+            emitByte(out, OP_RETURN, line);
+            break;
+        case IR_JUMP: {
+            int succ = ir->blocks[b].succs[0];
+            emitCopies(ir, out, b, succ, line, false);
+            if (succ != nextBlock(ir, b)) emitJumpTo(ir, out, succ, line);
+            break;
+        }
+        case IR_BRANCH: {
+            int taken = ir->blocks[b].succs[0];
+            int skipped = ir->blocks[b].succs[1];
+            emitBytes(out, OP_JUMP_IF_FALSE_R, arg0, line);
+            emitBytes(out, 0xff, 0xff, line);
+            int at = out->count - 2;
+            if (emitCopies(ir, out, b, skipped, line, true) == 0 && ir->blocks[skipped].offset < 0) {
+                // nothing to copy on the way, so the branch goes straight there.
+                appendInt(&out->fixups, &out->fixupCount, &out->fixupCapacity, at);
+                appendInt(&out->fixups, &out->fixupCount, &out->fixupCapacity, skipped);
+                emitCopies(ir, out, b, taken, line, false);
+                if (taken != nextBlock(ir, b)) emitJumpTo(ir, out, taken, line);
+                break;
+            }
+            emitCopies(ir, out, b, taken, line, false);
+            emitJumpTo(ir, out, taken, line);
+            patchJump(out, at, out->count);
+            emitCopies(ir, out, b, skipped, line, false);
+            if (skipped != nextBlock(ir, b)) emitJumpTo(ir, out, skipped, line);
+            break;
+        }
+    }
+}
+
+static bool readsStack(IrOp op) {
+    switch (op) {
+        case IR_SET_GLOBAL:
+        case IR_SET_UPVALUE:
+        case IR_GET_PROPERTY:
+        case IR_SET_PROPERTY:
+        case IR_CALL:
+        case IR_TAIL_CALL:
+        case IR_INVOKE:
+        case IR_TAIL_INVOKE:
+        case IR_PRINT:
+        case IR_RETURN:
+            return true;
+        default:
+            return false;
+    }
+}
+
+static bool leavesStack(IrOp op) {
+    switch (op) {
+        case IR_GET_GLOBAL:
+        case IR_GET_UPVALUE:
+        case IR_GET_PROPERTY:
+        case IR_CALL:
+        case IR_TAIL_CALL:
+        case IR_INVOKE:
+        case IR_TAIL_INVOKE:
+            return true;
+        default:
+            return false;
+    }
+}
+
+// a stack instruction's result that only feeds a later stack instruction of the
+// same block can wait on the stack instead of taking a pop and a push through a
+// register. what is in between leaves the stack as it found it, so this holds
+// as long as the waiting values are read in the order they were pushed.
+static void keepOnStack(Ir* ir) {
+    int* user = (int*)malloc(sizeof(int) * ir->valueCount);
+    int* position = (int*)malloc(sizeof(int) * ir->valueCount);
+    int* waiting = (int*)malloc(sizeof(int) * ir->valueCount);
+    if (user == NULL || position == NULL || waiting == NULL) exit(1);
+    for (int v = 0; v < ir->valueCount; v++) {
+        IrValue* value = &ir->values[v];
+        if (value->block < 0) continue;
+        for (int i = 0; i < value->argCount; i++) user[resolve(ir, value->args[i])] = v;
+    }
+
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (!block->reached) continue;
+        for (int i = 0; i < block->count; i++) position[block->values[i]] = i;
+        int count = 0;
+        for (int i = 0; i < block->count; i++) {
+            int v = block->values[i];
+            IrValue* value = &ir->values[v];
+            if (readsStack(value->op)) {
+                while (count > 0 && user[waiting[count - 1]] == v) count--;
+            }
+            if (!leavesStack(value->op) || value->uses != 1) continue;
+            int u = user[v];
+            IrValue* reader = &ir->values[u];
+            if (reader->block != b || !readsStack(reader->op)) continue;
+            // the arguments before this one must be waiting already, on top.
+            int before = 0;
+            while (before < count && user[waiting[count - 1 - before]] == u) before++;
+            if (before >= reader->argCount || resolve(ir, reader->args[before]) != v) continue;
+            if (before == 0 && count > 0 && position[user[waiting[count - 1]]] < position[u]) continue;
+            value->onStack = true;
+            waiting[count++] = v;
+        }
+    }
+    free(user);
+    free(position);
+    free(waiting);
+}
+
+static bool lower(Ir* ir, Tier* tier) {
+    // registers: the callframe's arguments, then one per value something reads.
+    int registers = ir->function->arity + 1;
+    countUses(ir);
+    keepOnStack(ir);
+    for (int v = 0; v < ir->valueCount; v++) {
+        IrValue* value = &ir->values[v];
+        if (value->block < 0 || !hasResult(value->op) || value->onStack) continue;
+        if (value->op == IR_PARAM) value->reg = value->operand;
+        else if (value->uses > 0) value->reg = registers++;
+    }
+    Lowering out;
+    memset(&out, 0, sizeof(Lowering));
+    out.scratch = registers++;
+    if (registers > MAX_REGISTERS) return false;
+
+    int line = ir->chunk->lines[0];
+    // guards run before anything else so a failing one leaves the frame as the baseline code expects it.
+    for (int slot = 1; slot <= ir->function->arity; slot++) {
+        if (ir->guarded[slot]) emitBytes(&out, OP_GUARD_NUMBER, slot, line);
+    }
+    emitBytes(&out, OP_RESERVE, registers, line);
+
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (!block->reached) continue;
+        block->offset = out.count;
+        for (int i = 0; i < block->count; i++) emitValue(ir, &out, b, block->values[i]);
+    }
+    for (int i = 0; i < out.fixupCount; i += 2) {
+        patchJump(&out, out.fixups[i], ir->blocks[out.fixups[i + 1]].offset);
+    }
+    free(out.fixups);
+    if (out.failed) {
+        free(out.code);
+        free(out.lines);
+        return false;
+    }
+
+    initChunk(&tier->chunk);
+    tier->chunk.code = out.code;
+    tier->chunk.lines = out.lines;
+    tier->chunk.count = out.count;
+    tier->chunk.capacity = out.capacity;
+    tier->chunk.constants = ir->chunk->constants;
+    tier->deoptimized = false;
+    // callframes of the function reserve enough for either code.
+    int slots = chunkStackSlots(&tier->chunk, ir->function->arity);
+    if (slots > ir->function->maxSlots) ir->function->maxSlots = slots;
+    return true;
+}
+
+static void printType(int type) {
+    if (type == TYPE_ANY) {
+        printf("any");
+        return;
+    }
+    static const char* names[] = {"number", "bool", "nil", "string", "object"};
+    bool first = true;
+    for (int i = 0; i < 5; i++) {
+        if (!(type & (1 << i))) continue;
+        printf("%s%s", first ? "" : "|", names[i]);
+        first = false;
+    }
+}
+
+static void printIr(Ir* ir) {
+    printf("== ir %s ==\n", ir->function->name != NULL ? ir->function->name->chars : "<script>");
+    for (int b = 0; b < ir->blockCount; b++) {
+        IrBlock* block = &ir->blocks[b];
+        if (!block->reached) continue;
+        printf("b%d:", b);
+        if (block->predCount > 0) printf(" <-");
+        for (int i = 0; i < block->predCount; i++) printf(" b%d", block->preds[i]);
+        printf("\n");
+        for (int i = 0; i < block->count; i++) {
+            int v = block->values[i];
+            IrValue* value = &ir->values[v];
+            printf("    ");
+            if (hasResult(value->op)) printf("v%d = ", v);
+            printf("%s%s", irNames[value->op], value->unchecked ? ".number" : "");
+            switch (value->op) {
+                case IR_PARAM:
+                case IR_GET_UPVALUE:
+                case IR_SET_UPVALUE:
+                    printf(" %d", value->operand);
+                    break;
+                case IR_CONSTANT:
+                case IR_GET_GLOBAL:
+                case IR_SET_GLOBAL:
+                case IR_GET_PROPERTY:
+                case IR_SET_PROPERTY:
+                case IR_INVOKE:
+                case IR_TAIL_INVOKE:
+                    printf(" '");
+                    printValue(ir->chunk->constants.values[value->operand]);
+                    printf("'");
+                    break;
+                default:
+                    break;
+            }
+            for (int j = 0; j < value->argCount; j++) printf(" v%d", resolve(ir, value->args[j]));
+            for (int j = 0; j < block->succCount && i == block->count - 1; j++) printf(" b%d", block->succs[j]);
+            if (hasResult(value->op)) {
+                printf(" : ");
+                printType(value->type);
+            }
+            if (value->op == IR_PARAM && ir->guarded[value->operand]) printf(" (guarded)");
+            printf("\n");
+        }
+    }
+}
+
+static void freeIr(Ir* ir) {
+    for (int v = 0; v < ir->valueCount; v++) free(ir->values[v].args);
+    free(ir->values);
+    for (int b = 0; b < ir->blockCount; b++) {
+        free(ir->blocks[b].values);
+        free(ir->blocks[b].preds);
+        free(ir->blocks[b].exit);
+    }
+    free(ir->blocks);
+    free(ir->rpo);
+    free(ir->known);
+    free(ir->guarded);
+}
+
+bool optimizeFunction(VM* vm, ObjFunction* function) {
+    if (function->chunk.handlerCount > 0 || function->arity + 1 >= MAX_REGISTERS) return false;
+    Ir ir;
+    memset(&ir, 0, sizeof(Ir));
+    ir.vm = vm;
+    ir.function = function;
+    ir.chunk = &function->chunk;
+    ir.guarded = (bool*)calloc(function->arity + 1, sizeof(bool));
+    if (ir.guarded == NULL) exit(1);
+
+    bool ok = buildBlocks(&ir) && liftBlocks(&ir);
+    Tier* tier = NULL;
+    if (ok) {
+        ir.known = (bool*)calloc(ir.valueCount, sizeof(bool));
+        if (ir.known == NULL) exit(1);
+        computeDominators(&ir);
+        simplifyPhis(&ir);
+        chooseGuards(&ir);
+        for (int round = 0; round < MAX_ROUNDS; round++) {
+            inferTypes(&ir);
+            int* available = NULL;
+            int count = 0;
+            int capacity = 0;
+            bool changed = eliminateChecks(&ir, 0);
+            changed |= eliminateCommon(&ir, 0, &available, &count, &capacity);
+            changed |= simplifyPhis(&ir);
+            free(available);
+            if (!changed) break;
+        }
+        hoistLoops(&ir);
+        removeDead(&ir);
+        inferTypes(&ir);
+
+        tier = (Tier*)malloc(sizeof(Tier));
+        if (tier == NULL) exit(1);
+        ok = lower(&ir, tier);
+    }
+
+    if (ok) {
+        function->tier = tier;
+        if (vm->dumpIR) {
+            char title[64];
+            snprintf(title, sizeof(title), "%s (optimized)", function->name != NULL ? function->name->chars : "<script>");
+            printIr(&ir);
+            disassembleChunk(&tier->chunk, title);
+        }
+    } else {
+        free(tier);
+    }
+    freeIr(&ir);
+    return ok;
+}
+
+void freeTier(Tier* tier) {
+    // the constants belong to the function's own chunk.
+    free(tier->chunk.code);
+    free(tier->chunk.lines);
+    free(tier);
+}
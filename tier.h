@@ -0,0 +1,26 @@
+#ifndef clox_tier_h
+#define clox_tier_h
+
+#include "chunk.h"
+#include "common.h"
+#include "object.h"
+
+// calls it takes for a function to be optimized.
+#define TIER_THRESHOLD 1000
+
+// code of a function that got hot. its bytecode is lifted into ssa form,
+// optimized using the argument types seen so far and lowered to register
+// instructions that run in the function's callframe like the baseline code
+// does. the types it speculated on are guarded on entry. a guard failing
+// sends the call, and every later one, back to the baseline chunk.
+typedef struct Tier {
+    Chunk chunk; // code and lines. constants are shared with the function's chunk.
+    bool deoptimized;
+} Tier;
+
+// lift, optimize and lower a hot function into function->tier. false if it
+// uses something the tier doesn't handle, like closures or try blocks.
+bool optimizeFunction(VM* vm, ObjFunction* function);
+void freeTier(Tier* tier);
+
+#endif
@@ -7,16 +7,20 @@
 
 bool valuesEqual(Value a, Value b) {
     #ifdef NAN_BOXING
+        if (IS_INT(a) && IS_INT(b)) return a == b;
         if (IS_NUMBER(a) && IS_NUMBER(b)) {
             return AS_NUMBER(a) == AS_NUMBER(b);
         }
         return a == b;
     #else
+        if (IS_NUMBER(a) && IS_NUMBER(b)) {
+            if (IS_INT(a) && IS_INT(b)) return AS_INT(a) == AS_INT(b);
+            return AS_NUMBER(a) == AS_NUMBER(b);
+        }
         if (a.type != b.type) return false;
         switch (a.type) {
             case VAL_BOOL: return AS_BOOL(a) == AS_BOOL(b);
             case VAL_NIL: return true;
-            case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
             case VAL_OBJ: return AS_OBJ(a) == AS_OBJ(b);
             default: return false; // unreachable
         }
@@ -29,41 +33,46 @@ void initValueArray(ValueArray* array) {
     array->count = 0;
 }
 
-void writeValueArray(ValueArray* array, Value value) {
+void writeValueArray(VM* vm, ValueArray* array, Value value) {
     if (array->capacity < array->count + 1) {
         int oldCapacity = array->capacity;
         array->capacity = GROW_CAPACITY(oldCapacity);
-        array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->capacity);
+        array->values = GROW_ARRAY(vm, Value, array->values, oldCapacity, array->capacity);
     }
 
     array->values[array->count] = value;
     array->count++;
 }
 
-void freeValueArray(ValueArray* array) {
-    FREE_ARRAY(Value, array->values, array->capacity);
+void freeValueArray(VM* vm, ValueArray* array) {
+    FREE_ARRAY(vm, Value, array->values, array->capacity);
     initValueArray(array);
 }
 
 void printValue(Value value) {
+    fprintValue(stdout, value);
+}
+
+void fprintValue(FILE* file, Value value) {
     #ifdef NAN_BOXING
         if (IS_BOOL(value)) {
-            printf(AS_BOOL(value) ? "true" : "false");
+            fprintf(file, AS_BOOL(value) ? "true" : "false");
         } else if (IS_NIL(value)) {
-            printf("nil");
+            fprintf(file, "nil");
         } else if (IS_NUMBER(value)) {
-            printf("%g", AS_NUMBER(value));
+            fprintf(file, "%g", AS_NUMBER(value));
         } else if (IS_OBJ(value)) {
-            printObject(value);
+            printObject(file, value);
         }
     #else
         switch (value.type) {
             case VAL_BOOL:
-                printf(AS_BOOL(value) ? "true" : "false");
+                fprintf(file, AS_BOOL(value) ? "true" : "false");
                 break;
-            case VAL_NIL: printf("nil"); break;
-            case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
-            case VAL_OBJ: printObject(value); break;
+            case VAL_NIL: fprintf(file, "nil"); break;
+            case VAL_NUMBER:
+            case VAL_INT: fprintf(file, "%g", AS_NUMBER(value)); break;
+            case VAL_OBJ: printObject(file, value); break;
         };
     #endif
 }
\ No newline at end of file
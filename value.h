@@ -1,6 +1,8 @@
 #ifndef clox_value_h
 #define clox_value_h
 
+#include <math.h>
+#include <stdio.h>
 #include <string.h>
 
 #include "common.h"
@@ -17,16 +19,20 @@ typedef struct ObjString ObjString;
 #define TAG_NIL 1 // 01
 #define TAG_FALSE 2 // 10
 #define TAG_TRUE 3 // 11
+// an int has the bit below the quiet nan set and the int in the low 32 bits.
+#define TAG_INT ((uint64_t)0x0001000000000000)
 
 typedef uint64_t Value;
 
 #define IS_BOOL(value) (((value) | 1) == TRUE_VAL)
 #define IS_NIL(value) ((value) == NIL_VAL)
-#define IS_NUMBER(value) (((value) & QNAN) != QNAN)
+#define IS_INT(value) (((value) & (SIGN_BIT | QNAN | TAG_INT)) == (QNAN | TAG_INT))
+#define IS_NUMBER(value) (((value) & QNAN) != QNAN || IS_INT(value))
 #define IS_OBJ(value) \
     (((value) & (QNAN | SIGN_BIT)) == (QNAN | SIGN_BIT))
 
 #define AS_BOOL(value) ((value) == TRUE_VAL)
+#define AS_INT(value) ((int32_t)(uint32_t)(value))
 #define AS_NUMBER(value) valueToNum(value)
 #define AS_OBJ(value) \
     ((Obj*)(uintptr_t)((value) & ~(SIGN_BIT | QNAN)))
@@ -35,11 +41,13 @@ typedef uint64_t Value;
 #define FALSE_VAL ((Value)(uint64_t)(QNAN | TAG_FALSE))
 #define TRUE_VAL ((Value)(uint64_t)(QNAN | TAG_TRUE))
 #define NIL_VAL ((Value)(uint64_t)(QNAN | TAG_NIL))
+#define INT_VAL(i) ((Value)(QNAN | TAG_INT | (uint64_t)(uint32_t)(i)))
 #define NUMBER_VAL(num) numToValue(num)
 #define OBJ_VAL(obj) \
     (Value)(SIGN_BIT | QNAN | (uint64_t)(uintptr_t)(obj))
 
 static inline double valueToNum(Value value) {
+    if (IS_INT(value)) return AS_INT(value);
     double num;
     memcpy(&num, &value, sizeof(Value));
     return num;
@@ -58,6 +66,7 @@ typedef enum {
     VAL_NIL,
     VAL_OBJ,
     VAL_NUMBER,
+    VAL_INT,
 } ValueType;
 
 typedef struct {
@@ -65,26 +74,63 @@ typedef struct {
     union {
         bool boolean;
         double number;
+        int32_t integer;
         Obj* obj;
     } as;
 } Value;
 
 #define IS_BOOL(value) ((value).type == VAL_BOOL)
 #define IS_NIL(value) ((value).type == VAL_NIL)
-#define IS_NUMBER(value) ((value).type == VAL_NUMBER)
+#define IS_INT(value) ((value).type == VAL_INT)
+#define IS_NUMBER(value) ((value).type == VAL_NUMBER || (value).type == VAL_INT)
 #define IS_OBJ(value) ((value).type == VAL_OBJ)
 
 #define AS_OBJ(value) ((value).as.obj)
 #define AS_BOOL(value) ((value).as.boolean)
-#define AS_NUMBER(value) ((value).as.number)
+#define AS_INT(value) ((value).as.integer)
+#define AS_NUMBER(value) valueToNum(value)
 
 # define BOOL_VAL(value) ((Value){VAL_BOOL, {.boolean = value}})
 # define NIL_VAL ((Value){VAL_NIL, {.number = 0}})
+# define INT_VAL(value) ((Value){VAL_INT, {.integer = value}})
 # define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
 #define OBJ_VAL(object) ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
+static inline double valueToNum(Value value) {
+    return value.type == VAL_INT ? value.as.integer : value.as.number;
+}
+
 #endif
 
+// lox has one number type. an int is a number that happens to be a 32-bit
+// integer, kept unboxed so integer arithmetic skips the doubles. results are
+// exactly what the doubles would give: one that doesn't fit in an int, or is
+// -0, is a double.
+static inline Value wideToValue(int64_t wide) {
+    if (wide < INT32_MIN || wide > INT32_MAX) return NUMBER_VAL((double)wide);
+    return INT_VAL((int32_t)wide);
+}
+
+static inline Value multiplyInts(int32_t a, int32_t b) {
+    int64_t product = (int64_t)a * b;
+    // a negative times zero is -0.
+    if (product == 0 && (a < 0 || b < 0)) return NUMBER_VAL(-0.0);
+    return wideToValue(product);
+}
+
+static inline Value negateInt(int32_t a) {
+    if (a == 0) return NUMBER_VAL(-0.0);
+    return wideToValue(-(int64_t)a);
+}
+
+// a number as an int if it is one, like a constant the compiler or a loader makes.
+static inline Value exactNumber(double num) {
+    if (num >= INT32_MIN && num <= INT32_MAX && num == (int32_t)num && !(num == 0 && signbit(num))) {
+        return INT_VAL((int32_t)num);
+    }
+    return NUMBER_VAL(num);
+}
+
 typedef struct {
     int capacity;
     int count;
@@ -93,8 +139,9 @@ typedef struct {
 
 bool valuesEqual(Value a, Value b);
 void initValueArray(ValueArray* array);
-void writeValueArray(ValueArray* array, Value value);
-void freeValueArray(ValueArray* array);
+void writeValueArray(VM* vm, ValueArray* array, Value value);
+void freeValueArray(VM* vm, ValueArray* array);
 void printValue(Value value);
+void fprintValue(FILE* file, Value value);
 
 #endif
\ No newline at end of file
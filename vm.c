@@ -5,223 +5,579 @@
 
 #include "common.h"
 #include "vm.h"
+#include "channel.h"
 #include "compiler.h"
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
+#include "module.h"
+#include "serialize.h"
+#include "tier.h"
 
-VM vm;
+static bool clockNative(VM* vm, int argCount, Value* args) {
+    args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+    return true;
+}
+
+// fiber natives switch stacks, so they live next to call() below.
+static bool fiberNative(VM* vm, int argCount, Value* args);
+static bool resumeNative(VM* vm, int argCount, Value* args);
+static bool yieldNative(VM* vm, int argCount, Value* args);
+static bool isDoneNative(VM* vm, int argCount, Value* args);
+// higher-order natives call back into lox through callNested() below.
+static bool eachNative(VM* vm, int argCount, Value* args);
+static bool foldNative(VM* vm, int argCount, Value* args);
+
+// store the vm's stacks back into the running fiber.
+static void saveFiber(VM* vm) {
+    ObjFiber* fiber = vm->fiber;
+    fiber->frames = vm->frames;
+    fiber->frameCount = vm->frameCount;
+    fiber->frameCapacity = vm->frameCapacity;
+    fiber->stack = vm->stack;
+    fiber->stackTop = vm->stackTop;
+    fiber->stackCapacity = vm->stackCapacity;
+    fiber->openUpvalues = vm->openUpvalues;
+}
 
-static Value clockNative(int argCount, Value* args) {
-    return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+// make fiber the running fiber.
+static void loadFiber(VM* vm, ObjFiber* fiber) {
+    vm->fiber = fiber;
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->frameCapacity = fiber->frameCapacity;
+    vm->stack = fiber->stack;
+    vm->stackTop = fiber->stackTop;
+    vm->stackCapacity = fiber->stackCapacity;
+    vm->openUpvalues = fiber->openUpvalues;
 }
 
-static void resetStack() {
-    vm.stackTop = vm.stack;
+static void resetStack(VM* vm) {
+    // an error kills the running fiber and every fiber on its resume chain,
+    // and lands back in the main fiber.
+    while (vm->fiber != vm->mainFiber) {
+        ObjFiber* fiber = vm->fiber;
+        ObjFiber* next = fiber->caller != NULL ? fiber->caller : vm->mainFiber;
+        saveFiber(vm);
+        fiber->state = FIBER_DONE;
+        fiber->caller = NULL;
+        loadFiber(vm, next);
+    }
+    if (vm->fiber != NULL) vm->fiber->state = FIBER_RUNNING;
+    // fibers parked in the event loop are abandoned too.
+    resetEventLoop(&vm->loop);
+    vm->stackTop = vm->stack;
     // callframe stack is empty when vm starts up.
-    vm.frameCount = 0;
-    vm.openUpvalues = NULL;
+    vm->frameCount = 0;
+    vm->openUpvalues = NULL;
 }
 
 // clean up resources used by vm.
-void freeVM() {
+void freeVM(VM* vm) {
+    // the stacks belong to the running fiber and are freed with the other objects.
+    saveFiber(vm);
+    vm->fiber = NULL;
+    vm->mainFiber = NULL;
+    freeEventLoop(&vm->loop);
+    vm->frames = NULL;
+    vm->frameCapacity = 0;
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
     // free global variable table.
-    freeTable(&vm.globals);
+    freeTable(vm, &vm->globals);
+    freeTable(vm, &vm->builtins);
+    freeTable(vm, &vm->modules);
     // free internal strings hash table.
-    freeTable(&vm.strings);
-    freeObjects();
+    freeTable(vm, &vm->strings);
+    while (vm->scripts != NULL) releaseScript(vm, vm->scripts);
+    freeObjects(vm);
+    // functions pointing into images are gone, so the mappings can go too.
+    freeImages(vm->images);
+    vm->images = NULL;
+#ifdef DEBUG_COUNT_FRAMES
+    fprintf(stderr, "%llu callframes pushed\n", (unsigned long long)vm->framesPushed);
+#endif
 }
 
-static void runtimeError(const char* format, ...) {
-    va_list args;
-    va_start(args, format);
-    vfprintf(stderr, format, args);
-    va_end(args);
-    fputs("\n", stderr);
+// code a frame is running: its function's chunk or the optimized tier's.
+static Chunk* frameChunk(CallFrame* frame) {
+    ObjFunction* function = FROM_REF(ObjFunction, frame->closure->function);
+    Tier* tier = function->tier;
+    if (tier != NULL && frame->ip >= tier->chunk.code && frame->ip <= tier->chunk.code + tier->chunk.count) {
+        return &tier->chunk;
+    }
+    return &function->chunk;
+}
+
+// globals a frame reads and defines: its module's namespace, or the vm's in the script.
+static Table* frameGlobals(VM* vm, CallFrame* frame) {
+    ObjInstance* module = FROM_REF(ObjFunction, frame->closure->function)->module;
+    return module != NULL ? &module->fields : &vm->globals;
+}
+
+// a deep trace shows this many of its innermost and outermost frames.
+#define TRACE_ENDS 10
 
-    // stack trace
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->closure->function;
+static void printStackTrace(VM* vm, CallFrame* frames, int frameCount) {
+    for (int i = frameCount - 1; i >= 0; i--) {
+        if (frameCount > TRACE_ENDS * 2 && i == frameCount - 1 - TRACE_ENDS) {
+            // a runaway recursion would print thousands of the same line.
+            fprintf(vm->err, "... %d more frames\n", frameCount - TRACE_ENDS * 2);
+            i = TRACE_ENDS;
+        }
+        CallFrame* frame = &frames[i];
+        ObjFunction* function = FROM_REF(ObjFunction, frame->closure->function);
+        Chunk* chunk = frameChunk(frame);
         // line number curresponding to current ip.
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", function->chunk.lines[instruction]);
+        size_t instruction = frame->ip - chunk->code - 1;
+        fprintf(vm->err, "[line %d] in ", chunk->lines[instruction]);
         if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        }else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+            fprintf(vm->err, "script\n");
+        } else {
+            fprintf(vm->err, "%s()\n", function->name->chars);
         }
+    }
+}
 
-        resetStack();
+// find the innermost try block covering where a frame at or above baseFrame is.
+// returns the frame's index, or -1 if there is none.
+static int findHandler(VM* vm, int baseFrame, Handler** handler) {
+    for (int i = vm->frameCount - 1; i >= baseFrame; i--) {
+        CallFrame* frame = &vm->frames[i];
+        Chunk* chunk = frameChunk(frame);
+        // ip is past the instruction that threw, or past the call a frame is waiting on.
+        int offset = (int)(frame->ip - chunk->code) - 1;
+        for (int j = 0; j < chunk->handlerCount; j++) {
+            if (offset >= chunk->handlers[j].start && offset < chunk->handlers[j].end) {
+                *handler = &chunk->handlers[j];
+                return i;
+            }
+        }
     }
+    return -1;
+}
 
-    // get topmost callframe.
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
-    size_t instruction = frame->ip - frame->closure->function->chunk.code - 1;
-    int line = frame->closure->function->chunk.lines[instruction];
-    fprintf(stderr, "[line %d] in script\n", line);
-    resetStack();
+// whether an error thrown now would be caught. handlers only catch errors from
+// their own fiber, and not while it is being parked or switched away from.
+static bool isCaught(VM* vm) {
+    Handler* handler;
+    return vm->fiber != NULL && vm->fiber->state == FIBER_RUNNING && findHandler(vm, 0, &handler) >= 0;
 }
 
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+// an uncaught error ends the script with a stack trace.
+static void reportError(VM* vm) {
+    // stack trace of the running fiber, then of each fiber waiting on it.
+    printStackTrace(vm, vm->frames, vm->frameCount);
+    for (ObjFiber* fiber = vm->fiber->caller; fiber != NULL; fiber = fiber->caller) {
+        printStackTrace(vm, fiber->frames, fiber->frameCount);
+    }
+
+    resetStack(vm);
 }
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    vm.bytesAllocated = 0;
-    vm.nextGC = 1024 * 1024;
+// start unwinding with value. run() moves to the handler once the error gets back to it.
+static void throwValue(VM* vm, Value value) {
+    if (isCaught(vm)) {
+        vm->exception = value;
+        return;
+    }
+    fprintValue(vm->err, value);
+    fputs("\n", vm->err);
+    reportError(vm);
+}
+
+void runtimeError(VM* vm, const char* format, ...) {
+    va_list args;
+    va_start(args, format);
+    if (isCaught(vm)) {
+        // the message is the value the catch block gets.
+        char message[1024];
+        int length = vsnprintf(message, sizeof(message), format, args);
+        va_end(args);
+        if (length >= (int)sizeof(message)) length = (int)sizeof(message) - 1;
+        vm->exception = OBJ_VAL(copyString(vm, message, length));
+        return;
+    }
+    vfprintf(vm->err, format, args);
+    va_end(args);
+    fputs("\n", vm->err);
+    reportError(vm);
+}
+
+void defineNative(VM* vm, const char* name, NativeFn function) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function)));
+    tableSet(vm, &vm->globals, AS_STRING(vm->stackTop[-2]), vm->stackTop[-1]);
+    pop(vm);
+    pop(vm);
+}
+
+void initVM(VM* vm) {
+    vm->frames = NULL;
+    vm->frameCapacity = 0;
+    vm->framesMax = FRAMES_MAX;
+    vm->stack = NULL;
+    vm->stackCapacity = 0;
+    vm->fiber = NULL;
+    vm->mainFiber = NULL;
+    vm->nestedRuns = 0;
+    vm->exception = NIL_VAL;
+    vm->lazyFunctions = false;
+    vm->modulePath = NULL;
+    vm->tierThreshold = TIER_THRESHOLD;
+    vm->dumpIR = false;
+#ifdef DEBUG_COUNT_FRAMES
+    vm->framesPushed = 0;
+#endif
+    initEventLoop(&vm->loop);
+    resetStack(vm);
+    initHeap(&vm->heap);
+    vm->bytesAllocated = 0;
+    vm->nextGC = 1024 * 1024;
+    vm->pauseGC = false;
 
     // initialize gray stack.
-    vm.grayCount = 0;
-    vm.grayCapacity = 0;
-    vm.grayStack = NULL;
+    vm->grayCount = 0;
+    vm->grayCapacity = 0;
+    vm->grayStack = NULL;
+    vm->markThreads = 1;
+    vm->parser = NULL;
+    vm->images = NULL;
+    vm->scripts = NULL;
+    vm->out = stdout;
+    vm->err = stderr;
 
-    initTable(&vm.strings);
-    vm.initString = NULL;
-    vm.initString = copyString("init", 4);
+    initTable(&vm->strings);
+    vm->initString = NULL;
     // initialize global variable table.
-    initTable(&vm.globals);
+    initTable(&vm->globals);
+    initTable(&vm->builtins);
+    initTable(&vm->modules);
+
+    // the main fiber owns the initial stacks.
+    vm->mainFiber = newFiber(vm, NULL);
+    loadFiber(vm, vm->mainFiber);
+
+    vm->initString = copyString(vm, "init", 4);
 
-    defineNative("clock", clockNative);
+    defineNative(vm, "clock", clockNative);
+    defineNative(vm, "fiber", fiberNative);
+    defineNative(vm, "resume", resumeNative);
+    defineNative(vm, "yield", yieldNative);
+    defineNative(vm, "isDone", isDoneNative);
+    defineNative(vm, "each", eachNative);
+    defineNative(vm, "fold", foldNative);
+    defineChannelNatives(vm);
+    defineIoNatives(vm);
+    tableAddAll(vm, &vm->globals, &vm->builtins);
 }
 
-void push(Value value) {
-    *vm.stackTop = value;
-    vm.stackTop++;
+void resetGlobals(VM* vm) {
+    // tasks the last script never awaited don't carry over.
+    resetEventLoop(&vm->loop);
+    freeTable(vm, &vm->globals);
+    tableAddAll(vm, &vm->builtins, &vm->globals);
+    freeTable(vm, &vm->modules);
 }
 
-Value pop() {
-    vm.stackTop--;
-    return *vm.stackTop;
+void push(VM* vm, Value value) {
+    *vm->stackTop = value;
+    vm->stackTop++;
 }
 
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+Value pop(VM* vm) {
+    vm->stackTop--;
+    return *vm->stackTop;
 }
 
-static bool call(ObjClosure* closure, int argCount) {
+static Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
+}
+
+static void growStack(VM* vm, int capacity) {
+    Value* oldStack = vm->stack;
+    vm->stack = GROW_ARRAY(vm, Value, vm->stack, vm->stackCapacity, capacity);
+    vm->stackCapacity = capacity;
+    if (vm->stack == oldStack) return;
+
+    // stack moved. rebase every pointer into it.
+    vm->stackTop = vm->stack + (vm->stackTop - oldStack);
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = vm->stack + (vm->frames[i].slots - oldStack);
+    }
+    // closed upvalues point to their own closed field and are not on the list.
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = FROM_REF(ObjUpvalue, upvalue->next)) {
+        upvalue->location = vm->stack + (upvalue->location - oldStack);
+    }
+}
+
+// make room for count more values on the stack.
+static bool ensureStack(VM* vm, int count) {
+    int needed = (int)(vm->stackTop - vm->stack) + count;
+    if (needed > vm->stackCapacity) {
+        int stackMax = vm->framesMax * FRAME_SLOTS;
+        if (needed > stackMax) return false;
+        int capacity = vm->stackCapacity;
+        while (capacity < needed) capacity = GROW_CAPACITY(capacity);
+        if (capacity > stackMax) capacity = stackMax;
+        growStack(vm, capacity);
+    }
+    return true;
+}
+
+// make room for one more callframe and the stack of function, whose
+// callee and arguments are on top of the stack.
+static bool ensureFrame(VM* vm, ObjFunction* function) {
+    if (vm->frameCount == vm->frameCapacity) {
+        if (vm->frameCapacity >= vm->framesMax) return false;
+        int capacity = GROW_CAPACITY(vm->frameCapacity);
+        if (capacity > vm->framesMax) capacity = vm->framesMax;
+        vm->frames = GROW_ARRAY(vm, CallFrame, vm->frames, vm->frameCapacity, capacity);
+        vm->frameCapacity = capacity;
+    }
+    return ensureStack(vm, function->maxSlots - function->arity - 1 + FRAME_HEADROOM);
+}
+
+// compile a function body the compiler skipped. its compile error has been printed,
+// the runtime error makes the call fail like any other.
+static bool compileLazy(VM* vm, ObjFunction* function) {
+    if (compileLazyBody(vm, function)) return true;
+    runtimeError(vm, "Can't compile %s().", function->name->chars);
+    return false;
+}
+
+// code a call to function starts running. until the function is hot this
+// counts calls and notes which arguments were numbers, then it is optimized.
+static uint8_t* entryPoint(VM* vm, ObjFunction* function, Value* args) {
+    Tier* tier = function->tier;
+    if (tier != NULL) return tier->deoptimized ? function->chunk.code : tier->chunk.code;
+    if (function->calls < 0 || vm->tierThreshold == 0) return function->chunk.code;
+
+    for (int i = 0; i < function->arity && i < 32; i++) {
+        if (!IS_NUMBER(args[i])) function->numberArgs &= ~(1u << i);
+    }
+    if (++function->calls < vm->tierThreshold) return function->chunk.code;
+    if (!optimizeFunction(vm, function)) {
+        function->calls = -1;
+        return function->chunk.code;
+    }
+    return function->tier->chunk.code;
+}
+
+static bool call(VM* vm, ObjClosure* closure, int argCount) {
+    ObjFunction* function = FROM_REF(ObjFunction, closure->function);
     // check number of argument against function arity.
-    if (argCount != closure->function->arity) {
-        runtimeError("Expected %d arguments but got %d.", closure->function->arity, argCount);
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
         return false;
     }
+    if (function->lazy != NULL && !compileLazy(vm, function)) return false;
+    // optimizing the function can make its frames bigger, so it comes first.
+    uint8_t* ip = entryPoint(vm, function, vm->stackTop - argCount);
 
-    // ensure call chain depth doesn't overflow callframe array.
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack overflow.");
+    // ensure call chain depth doesn't exceed the stack limits.
+    if (!ensureFrame(vm, function)) {
+        runtimeError(vm, "Stack overflow.");
         return false;
     }
 
     // inialize callframe on the stack.
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = &vm->frames[vm->frameCount++];
+#ifdef DEBUG_COUNT_FRAMES
+    vm->framesPushed++;
+#endif
     frame->closure = closure;
-    frame->ip = closure->function->chunk.code;
+    frame->ip = ip;
     // minus 1 account for stack slot zero.
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
     return true;
 }
 
 
-static bool callValue(Value callee, int argCount) {
+static bool callValue(VM* vm, Value callee, int argCount) {
     // check if value being called is function object.
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
             case OBJ_BOUND_METHOD: {
                 ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
                 // put instance at top of stack.
-                vm.stackTop[-argCount - 1] = bound->receiver;
-                return call(bound->method, argCount);
+                vm->stackTop[-argCount - 1] = bound->receiver;
+                return call(vm, FROM_REF(ObjClosure, bound->method), argCount);
             }
             case OBJ_CLASS: {
                 // create instance of the called class
                 ObjClass* klass = AS_CLASS(callee);
-                vm.stackTop[-argCount - 1] = OBJ_VAL(newInstance(klass));
+                vm->stackTop[-argCount - 1] = OBJ_VAL(newInstance(vm, klass));
                 // initialize instance.
                 Value initializer;
-                if (tableGet(&klass->methods, vm.initString, &initializer)) {
-                    return call(AS_CLOSURE(initializer), argCount);
+                if (tableGet(&klass->methods, vm->initString, &initializer)) {
+                    return call(vm, AS_CLOSURE(initializer), argCount);
                 } else if (argCount != 0) {
-                    runtimeError("Expected 0 arguments but go %d.", argCount);
+                    runtimeError(vm, "Expected 0 arguments but go %d.", argCount);
+                    return false;
                 }
                 return true;
             }
             // handle closure.
             case OBJ_CLOSURE:
-                return call(AS_CLOSURE(callee), argCount); 
+                return call(vm, AS_CLOSURE(callee), argCount); 
             case OBJ_NATIVE: {
                 // invoke c function.
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                // push result back in stack.
-                push(result);
+                ObjFiber* fiber = vm->fiber;
+                // a native that calls back into lox may grow the stack and move it.
+                int args = (int)(vm->stackTop - vm->stack) - argCount;
+                if (!native(vm, argCount, vm->stack + args)) return false;
+                // result is already in the callee slot.
+                // natives that switch fibers pop their arguments before switching.
+                if (vm->fiber == fiber) vm->stackTop = vm->stack + args;
                 return true;
             }
             default:
                 break;
         }
     }
-    runtimeError("Can only call functions and classes");
+    runtimeError(vm, "Can only call functions and classes");
     return false;
 }
 
-static bool invokeFromClass(ObjClass* klass, ObjString* name, int argCount) {
+static bool tailCall(VM* vm, ObjClosure* closure, int argCount);
+static bool tailCallValue(VM* vm, Value callee, int argCount);
+
+// a tail invoke replaces the current callframe instead of pushing one.
+static bool invokeFromClass(VM* vm, ObjClass* klass, ObjString* name, int argCount, bool tail) {
     Value method;
     // look up method in class.
     if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
     // create a call to the method.
-    return call(AS_CLOSURE(method), argCount);
+    return tail ? tailCall(vm, AS_CLOSURE(method), argCount) : call(vm, AS_CLOSURE(method), argCount);
 }
 
-static bool invoke(ObjString* name, int argCount) {
-    Value receiver = peek(argCount);
-    // check if instance
+// what a method does if its whole body is one of the patterns an invoke can run in place.
+static InlineKind inlineKind(ObjFunction* function, Value* value) {
+    Chunk* chunk = &function->chunk;
+    uint8_t* code = chunk->code;
+    if (chunk->handlerCount > 0 || chunk->count < 2) return INLINE_NONE;
+    switch (code[0]) {
+        case OP_CONSTANT:
+            if (chunk->count < 3 || code[2] != OP_RETURN) return INLINE_NONE;
+            *value = chunk->constants.values[code[1]];
+            return INLINE_CONSTANT;
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+            if (code[1] != OP_RETURN) return INLINE_NONE;
+            *value = code[0] == OP_NIL ? NIL_VAL : BOOL_VAL(code[0] == OP_TRUE);
+            return INLINE_CONSTANT;
+        case OP_GET_LOCAL:
+            break;
+        default:
+            return INLINE_NONE;
+    }
+    if (code[1] != 0 || chunk->count < 3) return INLINE_NONE;
+    if (code[2] == OP_RETURN) return INLINE_THIS;
+    if (function->arity == 0 && chunk->count >= 5 && code[2] == OP_GET_PROPERTY && code[4] == OP_RETURN) {
+        *value = chunk->constants.values[code[3]];
+        return INLINE_GETTER;
+    }
+    if (function->arity == 1 && chunk->count >= 9 && code[2] == OP_GET_LOCAL && code[3] == 1 &&
+        code[4] == OP_SET_PROPERTY && code[6] == OP_POP && code[7] == OP_NIL && code[8] == OP_RETURN) {
+        *value = chunk->constants.values[code[5]];
+        return INLINE_SETTER;
+    }
+    return INLINE_NONE;
+}
+
+// invoke through the cache of the calling function. a receiver of the cached
+// class skips the method lookup, and a small leaf method is run right here
+// instead of getting a callframe. anything unusual takes the call so errors
+// come from the method as they would without the cache.
+static bool invokeCached(VM* vm, ObjFunction* caller, int constant, int argCount, bool tail) {
+    ObjString* name = AS_STRING(caller->chunk.constants.values[constant]);
+    Value receiver = peek(vm, argCount);
     if (!IS_INSTANCE(receiver)) {
-        runtimeError("Only instances have methods");
+        runtimeError(vm, "Only instances have methods");
         return false;
     }
-    
-    Value value;
     ObjInstance* instance = AS_INSTANCE(receiver);
-    // get field incase not method call.
+    Value value;
+    // a field shadows the method whatever class the instance has.
     if (tableGet(&instance->fields, name, &value)) {
-        vm.stackTop[-argCount - 1] = value;
-        return callValue(value, argCount);
+        vm->stackTop[-argCount - 1] = value;
+        return tail ? tailCallValue(vm, value, argCount) : callValue(vm, value, argCount);
+    }
+
+    if (caller->invokeCaches == NULL) {
+        int count = caller->chunk.constants.count;
+        InvokeCache* caches = ALLOCATE(vm, InvokeCache, count);
+        for (int i = 0; i < count; i++) caches[i].klass = NULL;
+        caller->invokeCaches = caches;
+        caller->invokeCacheCount = count;
+    }
+    InvokeCache* cache = &caller->invokeCaches[constant];
+    if (cache->klass != instance->klass) {
+        Value method;
+        if (!tableGet(&instance->klass->methods, name, &method)) {
+            runtimeError(vm, "Undefined property '%s'.", name->chars);
+            return false;
+        }
+        ObjClosure* closure = AS_CLOSURE(method);
+        ObjFunction* function = FROM_REF(ObjFunction, closure->function);
+        if (argCount != function->arity) return call(vm, closure, argCount);
+        if (function->lazy != NULL && !compileLazy(vm, function)) return false;
+        cache->klass = instance->klass;
+        cache->method = closure;
+        cache->kind = inlineKind(function, &cache->value);
     }
+    if (argCount != FROM_REF(ObjFunction, cache->method->function)->arity) return call(vm, cache->method, argCount);
 
-    return invokeFromClass(instance->klass, name, argCount);
+    switch (cache->kind) {
+        case INLINE_GETTER:
+            if (!tableGet(&instance->fields, AS_STRING(cache->value), &value)) break;
+            vm->stackTop[-1] = value;
+            return true;
+        case INLINE_SETTER:
+            tableSet(vm, &instance->fields, AS_STRING(cache->value), peek(vm, 0));
+            vm->stackTop -= 1;
+            vm->stackTop[-1] = NIL_VAL;
+            return true;
+        case INLINE_CONSTANT:
+            vm->stackTop -= argCount;
+            vm->stackTop[-1] = cache->value;
+            return true;
+        case INLINE_THIS:
+            vm->stackTop -= argCount;
+            return true;
+        case INLINE_NONE:
+            break;
+    }
+    return tail ? tailCall(vm, cache->method, argCount) : call(vm, cache->method, argCount);
 }
 
-static bool bindMethod(ObjClass* klass, ObjString* name) {
+static bool bindMethod(VM* vm, ObjClass* klass, ObjString* name) {
     Value method;
     // find method in class
     if (!tableGet(&klass->methods, name, &method)) {
-        runtimeError("Undefined property '%s'.", name->chars);
+        runtimeError(vm, "Undefined property '%s'.", name->chars);
         return false;
     }
     // wrap method in bound method with instance from top of the stack.
-    ObjBoundMethod* bound = newBoundMethod(peek(0), AS_CLOSURE(method));
-    pop();
-    push(OBJ_VAL(bound));
+    ObjBoundMethod* bound = newBoundMethod(vm, peek(vm, 0), AS_CLOSURE(method));
+    pop(vm);
+    push(vm, OBJ_VAL(bound));
     return true;
 }
 
-static ObjUpvalue* captureUpvalue(Value* local) {
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
     // look for existing upvalue in open upvalues list before closing over a local variable.
     ObjUpvalue* prevUpvalue = NULL;
-    ObjUpvalue* upvalue = vm.openUpvalues;
+    ObjUpvalue* upvalue = vm->openUpvalues;
     while (upvalue != NULL && upvalue->location > local) {
         prevUpvalue = upvalue;
-        upvalue = upvalue->next;
+        upvalue = FROM_REF(ObjUpvalue, upvalue->next);
     }
 
     // found existing upvalue for the local variable.
@@ -229,113 +585,411 @@ static ObjUpvalue* captureUpvalue(Value* local) {
         return upvalue;
     }
 
-    ObjUpvalue* createdUpvalue = newUpvalue(local);
+    ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
+    createdUpvalue->next = TO_REF(upvalue);
     // insert upvalue to open upvalues list.
     if (prevUpvalue == NULL) {
-        vm.openUpvalues = createdUpvalue;
+        vm->openUpvalues = createdUpvalue;
     } else {
-        prevUpvalue->next = createdUpvalue;
+        prevUpvalue->next = TO_REF(createdUpvalue);
     }
 
     return createdUpvalue;
 }
 
-static void closeUpvalues(Value* last) {
-    while (vm.openUpvalues != NULL && vm.openUpvalues->location >= last) {
-        ObjUpvalue* upvalue = vm.openUpvalues;
+static void closeUpvalues(VM* vm, Value* last) {
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
         // copy variable value
         upvalue->closed = *upvalue->location;
         // update location of upvalue object.
         upvalue->location = &upvalue->closed;
-        vm.openUpvalues = upvalue->next;
+        vm->openUpvalues = FROM_REF(ObjUpvalue, upvalue->next);
+        upvalue->fiber = NULL;
+    }
+}
+
+static bool tailCall(VM* vm, ObjClosure* closure, int argCount) {
+    ObjFunction* function = FROM_REF(ObjFunction, closure->function);
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return false;
+    }
+    if (function->lazy != NULL && !compileLazy(vm, function)) return false;
+
+    // reuse the callframe of the returning function.
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
+    // the replaced function's locals are going away.
+    closeUpvalues(vm, frame->slots);
+    // slide callee and arguments down to the start of the frame's stack window.
+    memmove(frame->slots, vm->stackTop - argCount - 1, sizeof(Value) * (argCount + 1));
+    vm->stackTop = frame->slots + argCount + 1;
+
+    uint8_t* ip = entryPoint(vm, function, frame->slots + 1);
+    // the new function may need a bigger frame than the one it replaces.
+    if (!ensureStack(vm, function->maxSlots - argCount - 1 + FRAME_HEADROOM)) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    frame->closure = closure;
+    frame->ip = ip;
+    return true;
+}
+
+static bool tailCallValue(VM* vm, Value callee, int argCount) {
+    if (IS_CLOSURE(callee)) {
+        return tailCall(vm, AS_CLOSURE(callee), argCount);
+    }
+    if (IS_BOUND_METHOD(callee)) {
+        ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
+        vm->stackTop[-argCount - 1] = bound->receiver;
+        return tailCall(vm, FROM_REF(ObjClosure, bound->method), argCount);
+    }
+    // other callees don't push a callframe to replace.
+    return callValue(vm, callee, argCount);
+}
+
+bool transferFiber(VM* vm, ObjFiber* fiber, Value value) {
+    // a native below would come back to a different stack than it left.
+    if (vm->nestedRuns > 0) {
+        runtimeError(vm, "Can't switch fibers inside a call from a native.");
+        return false;
+    }
+    saveFiber(vm);
+    loadFiber(vm, fiber);
+    FiberState state = fiber->state;
+    fiber->state = FIBER_RUNNING;
+
+    if (state == FIBER_NEW) {
+        // stack holds just the closure.
+        ObjClosure* closure = AS_CLOSURE(vm->stack[0]);
+        ObjFunction* function = FROM_REF(ObjFunction, closure->function);
+        if (function->arity == 1) push(vm, value);
+        return call(vm, closure, function->arity);
+    }
+    // value is the result of the call the fiber is parked in.
+    vm->stackTop[-1] = value;
+    return true;
+}
+
+// switch back to the fiber that resumed the running one.
+static void returnToCaller(VM* vm, FiberState state, Value value) {
+    ObjFiber* fiber = vm->fiber;
+    ObjFiber* caller = fiber->caller;
+    saveFiber(vm);
+    fiber->state = state;
+    fiber->caller = NULL;
+    loadFiber(vm, caller);
+    // the caller is parked in its resume call. value becomes that call's result.
+    vm->stackTop[-1] = value;
+}
+
+// fiber(fn) wraps a function taking zero or one parameters.
+static bool fiberNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1) {
+        runtimeError(vm, "Expected 1 arguments but got %d.", argCount);
+        return false;
+    }
+    if (!IS_CLOSURE(args[0]) || FROM_REF(ObjFunction, AS_CLOSURE(args[0])->function)->arity > 1) {
+        runtimeError(vm, "Fiber needs a function that takes 0 or 1 parameters.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newFiber(vm, AS_CLOSURE(args[0])));
+    return true;
+}
+
+// resume(fiber, value) runs fiber until it yields or returns, and evaluates to that value.
+// value is passed to the fiber's function on the first resume and returned by yield() after that.
+static bool resumeNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 && argCount != 2) {
+        runtimeError(vm, "Expected 1 or 2 arguments but got %d.", argCount);
+        return false;
+    }
+    if (!IS_FIBER(args[0])) {
+        runtimeError(vm, "Can only resume fibers.");
+        return false;
+    }
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->state == FIBER_RUNNING) {
+        runtimeError(vm, "Can't resume a running fiber.");
+        return false;
+    }
+    if (fiber->state == FIBER_DONE) {
+        runtimeError(vm, "Can't resume a finished fiber.");
+        return false;
+    }
+    if (fiber->isTask || fiber->state == FIBER_WAITING) {
+        runtimeError(vm, "Can't resume a fiber the event loop runs.");
+        return false;
+    }
+
+    if (vm->nestedRuns > 0) {
+        runtimeError(vm, "Can't switch fibers inside a call from a native.");
+        return false;
+    }
+
+    Value value = argCount == 2 ? args[1] : NIL_VAL;
+    // park in this call. args[-1] receives whatever the fiber hands back.
+    vm->stackTop = args;
+    fiber->caller = vm->fiber;
+    return transferFiber(vm, fiber, value);
+}
+
+// yield(value) suspends the running fiber and returns value from the resume that ran it.
+static bool yieldNative(VM* vm, int argCount, Value* args) {
+    if (argCount > 1) {
+        runtimeError(vm, "Expected 0 or 1 arguments but got %d.", argCount);
+        return false;
     }
+    if (vm->fiber->caller == NULL) {
+        if (vm->fiber->isTask) {
+            // a task yields to the other ready tasks.
+            vm->stackTop = args;
+            return yieldTask(vm);
+        }
+        runtimeError(vm, "Can't yield from the main fiber.");
+        return false;
+    }
+
+    if (vm->nestedRuns > 0) {
+        runtimeError(vm, "Can't switch fibers inside a call from a native.");
+        return false;
+    }
+
+    Value value = argCount == 1 ? args[0] : NIL_VAL;
+    vm->stackTop = args;
+    returnToCaller(vm, FIBER_SUSPENDED, value);
+    return true;
 }
 
-static void defineMethod(ObjString* name) {
+static bool isDoneNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 || !IS_FIBER(args[0])) {
+        runtimeError(vm, "Expected a fiber.");
+        return false;
+    }
+    args[-1] = BOOL_VAL(AS_FIBER(args[0])->state == FIBER_DONE);
+    return true;
+}
+
+static bool checkRange(VM* vm, int arity, int argCount, Value* args) {
+    if (argCount != arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", arity, argCount);
+        return false;
+    }
+    if (!IS_NUMBER(args[0]) || !IS_NUMBER(args[1])) {
+        runtimeError(vm, "Range bounds must be numbers.");
+        return false;
+    }
+    // room for the function and its arguments.
+    if (!ensureStack(vm, 3)) {
+        runtimeError(vm, "Stack overflow.");
+        return false;
+    }
+    return true;
+}
+
+// each(from, to, fn) calls fn(i) for i = from, from + 1, ... while i < to.
+static bool eachNative(VM* vm, int argCount, Value* args) {
+    // the stack can move while fn runs, so args is found again by offset.
+    int base = (int)(args - vm->stack);
+    if (!checkRange(vm, 3, argCount, args)) return false;
+    args = vm->stack + base;
+
+    double to = AS_NUMBER(args[1]);
+    for (double i = AS_NUMBER(args[0]); i < to; i++) {
+        push(vm, vm->stack[base + 2]);
+        push(vm, exactNumber(i));
+        if (!callNested(vm, 1)) return false;
+        pop(vm);
+    }
+    vm->stack[base - 1] = NIL_VAL;
+    return true;
+}
+
+// fold(from, to, initial, fn) returns fn(...fn(fn(initial, from), from + 1)..., to - 1).
+static bool foldNative(VM* vm, int argCount, Value* args) {
+    int base = (int)(args - vm->stack);
+    if (!checkRange(vm, 4, argCount, args)) return false;
+    args = vm->stack + base;
+
+    double to = AS_NUMBER(args[1]);
+    // the accumulator lives in the initial argument's slot where the gc can see it.
+    for (double i = AS_NUMBER(args[0]); i < to; i++) {
+        push(vm, vm->stack[base + 3]);
+        push(vm, vm->stack[base + 2]);
+        push(vm, exactNumber(i));
+        if (!callNested(vm, 2)) return false;
+        vm->stack[base + 2] = pop(vm);
+    }
+    vm->stack[base - 1] = vm->stack[base + 2];
+    return true;
+}
+
+static void defineMethod(VM* vm, ObjString* name) {
     // set method to class.
-    Value method = peek(0);
-    ObjClass* klass = AS_CLASS(peek(1));
-    tableSet(&klass->methods, name, method);
-    pop();
+    Value method = peek(vm, 0);
+    ObjClass* klass = AS_CLASS(peek(vm, 1));
+    tableSet(vm, &klass->methods, name, method);
+    pop(vm);
 }
 
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
-static void concatenate() {
+static void concatenate(VM* vm) {
     // peek string objects before pop to prevent gc from freeing them.
-    ObjString* b = AS_STRING(peek(0));
-    ObjString* a = AS_STRING(peek(1));
+    ObjString* b = AS_STRING(peek(vm, 0));
+    ObjString* a = AS_STRING(peek(vm, 1));
 
     int length = a->length + b->length;
-    char* chars = ALLOCATE(char, length + 1);
+    char* chars = ALLOCATE(vm, char, length + 1);
     memcpy(chars, a->chars, a->length);
     memcpy(chars + a->length, b->chars, b->length);
     chars[length] = '\0';
 
-    ObjString* result = takeString(chars, length);
-    pop();
-    pop();
-    push(OBJ_VAL(result));
+    ObjString* result = takeString(vm, chars, length);
+    pop(vm);
+    pop(vm);
+    push(vm, OBJ_VAL(result));
+}
+
+// move to the handler for the error being thrown, if one of the frames this run owns has it.
+static bool catchError(VM* vm, int baseFrame) {
+    Handler* handler;
+    int index = findHandler(vm, baseFrame, &handler);
+    if (index < 0) return false;
+
+    // drop the frames above the handler's and its temporaries, closing over any locals on the way.
+    CallFrame* frame = &vm->frames[index];
+    Value* top = frame->slots + handler->depth;
+    closeUpvalues(vm, top);
+    vm->frameCount = index + 1;
+    vm->stackTop = top;
+    push(vm, vm->exception);
+    vm->exception = NIL_VAL;
+    frame->ip = frameChunk(frame)->code + handler->target;
+    return true;
 }
 
-static InterpretResult run() {
+// run until the callframe stack is back down to baseFrame frames.
+static InterpretResult run(VM* vm, int baseFrame) {
     // get the topmost callframe.
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
     #define READ_BYTE() (*frame->ip++)
     // read constant from current function's constant table.
-    #define READ_CONSTANT() (frame->closure->function->chunk.constants.values[READ_BYTE()])
+    #define READ_CONSTANT() (FROM_REF(ObjFunction, frame->closure->function)->chunk.constants.values[READ_BYTE()])
     #define READ_SHORT() \
         (frame->ip += 2, (uint16_t)((frame->ip[-2] << 8) | frame->ip[-1]))
     #define READ_STRING() AS_STRING(READ_CONSTANT())
     #define BINARY_OP(valueType, op) \
         do { \
-            if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-                runtimeError("Operands must be numbers."); \
-                return INTERPRET_RUNTIME_ERROR; \
+            if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+                runtimeError(vm, "Operands must be numbers."); \
+                goto thrown; \
+            } \
+            double b = AS_NUMBER(pop(vm)); \
+            double a = AS_NUMBER(pop(vm)); \
+            push(vm, valueType(a op b)); \
+        } while (false)
+    // operands the compiler proved to be numbers.
+    #define NUMBER_BINARY_OP(valueType, op) \
+        do { \
+            double b = AS_NUMBER(pop(vm)); \
+            double a = AS_NUMBER(peek(vm, 0)); \
+            vm->stackTop[-1] = valueType(a op b); \
+        } while (false)
+    // two ints skip the doubles. intOp gives what the doubles would, as an int if it is one.
+    #define INT_ADD(a, b) wideToValue((int64_t)(a) + (b))
+    #define INT_SUBTRACT(a, b) wideToValue((int64_t)(a) - (b))
+    #define INT_GREATER(a, b) BOOL_VAL((a) > (b))
+    #define INT_LESS(a, b) BOOL_VAL((a) < (b))
+    #define INT_BINARY_OP(intOp, valueType, op) \
+        do { \
+            if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1))) { \
+                int32_t b = AS_INT(pop(vm)); \
+                vm->stackTop[-1] = intOp(AS_INT(vm->stackTop[-1]), b); \
+            } else { \
+                BINARY_OP(valueType, op); \
+            } \
+        } while (false)
+    #define INT_NUMBER_OP(intOp, valueType, op) \
+        do { \
+            if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1))) { \
+                int32_t b = AS_INT(pop(vm)); \
+                vm->stackTop[-1] = intOp(AS_INT(vm->stackTop[-1]), b); \
+            } else { \
+                NUMBER_BINARY_OP(valueType, op); \
+            } \
+        } while (false)
+    // register instructions name their destination first, then their operands.
+    #define REGISTER(index) (frame->slots[index])
+    #define REGISTER_OP(valueType, op) \
+        do { \
+            uint8_t dst = READ_BYTE(); \
+            Value a = REGISTER(READ_BYTE()); \
+            Value b = REGISTER(READ_BYTE()); \
+            if (!IS_NUMBER(a) || !IS_NUMBER(b)) { \
+                runtimeError(vm, "Operands must be numbers."); \
+                goto thrown; \
+            } \
+            REGISTER(dst) = valueType(AS_NUMBER(a) op AS_NUMBER(b)); \
+        } while (false)
+    #define NUMBER_OP(valueType, op) \
+        do { \
+            uint8_t dst = READ_BYTE(); \
+            double a = AS_NUMBER(REGISTER(READ_BYTE())); \
+            double b = AS_NUMBER(REGISTER(READ_BYTE())); \
+            REGISTER(dst) = valueType(a op b); \
+        } while (false)
+    #define INT_REGISTER_OP(intOp, checked, valueType, op) \
+        do { \
+            Value a = REGISTER(frame->ip[1]); \
+            Value b = REGISTER(frame->ip[2]); \
+            if (IS_INT(a) && IS_INT(b)) { \
+                REGISTER(frame->ip[0]) = intOp(AS_INT(a), AS_INT(b)); \
+                frame->ip += 3; \
+            } else { \
+                checked(valueType, op); \
             } \
-            double b = AS_NUMBER(pop()); \
-            double a = AS_NUMBER(pop()); \
-            push (valueType(a op b)); \
         } while (false)
 
     for (;;) {
         #ifdef DEBUG_TRACE_EXECUTION
             printf("          ");
-            for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+            for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
                 printf("[ ");
                 printValue(*slot);
                 printf(" ]");
             }
             printf("\n");
-            disassembleInstruction(&frame->closure->function->chunk, (int)(frame->ip - frame->closure->function->chunk.code));
+            disassembleInstruction(frameChunk(frame), (int)(frame->ip - frameChunk(frame)->code));
         #endif
 
         uint8_t instruction;
         switch (instruction = READ_BYTE()) {
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
-                push(constant);
+                push(vm, constant);
                 break;
             }
-            case OP_NIL: push(NIL_VAL); break;
-            case OP_TRUE: push(BOOL_VAL(true)); break;
-            case OP_FALSE: push(BOOL_VAL(false)); break;
-            case OP_POP: pop(); break;
+            case OP_NIL: push(vm, NIL_VAL); break;
+            case OP_TRUE: push(vm, BOOL_VAL(true)); break;
+            case OP_FALSE: push(vm, BOOL_VAL(false)); break;
+            case OP_POP: pop(vm); break;
             case OP_GET_LOCAL: {
                 // get stack slot where local variable lives.
                 uint8_t slot = READ_BYTE();
                 // access local variable from current frame's slots array
-                push(frame->slots[slot]);
+                push(vm, frame->slots[slot]);
                 break;
             }
             case OP_SET_LOCAL: {
                 // takes value from top of the stack 
                 // and stores in stack slot corresponding to the local variable
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
+                frame->slots[slot] = peek(vm, 0);
                 // it doesn't pop the value.
                 break;
             }
@@ -344,11 +998,14 @@ static InterpretResult run() {
                 ObjString* name = READ_STRING();
                 Value value;
                 // look up variable's value by its name in global hash table. 
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                // a module falls back to the builtins.
+                Table* globals = frameGlobals(vm, frame);
+                if (!tableGet(globals, name, &value) &&
+                        (globals == &vm->globals || !tableGet(&vm->builtins, name, &value))) {
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
+                    goto thrown;
                 }
-                push(value);
+                push(vm, value);
                 break;
             }
             case OP_DEFINE_GLOBAL: {
@@ -356,121 +1013,137 @@ static InterpretResult run() {
                 ObjString* name = READ_STRING();
                 // take value from top of stack and 
                 // store it in a hash table with the name as key
-                tableSet(&vm.globals, name, peek(0));
-                pop();
+                tableSet(vm, frameGlobals(vm, frame), name, peek(vm, 0));
+                pop(vm);
                 break;
             }
             case OP_SET_GLOBAL: {
                 ObjString* name = READ_STRING();
-                if (tableSet(&vm.globals, name, peek(0))) {
-                    tableDelete(&vm.globals, name);
-                    runtimeError("Undefined variable '%s'.", name->chars);
-                    return INTERPRET_RUNTIME_ERROR;
+                Table* globals = frameGlobals(vm, frame);
+                if (tableSet(vm, globals, name, peek(vm, 0))) {
+                    tableDelete(globals, name);
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
+                    goto thrown;
                 }
                 break;
             }
             case OP_GET_UPVALUE: {
                 // get upvalue from closure's upvalues array
                 uint8_t slot = READ_BYTE();
-                push(*frame->closure->upvalues[slot]->location);
+                push(vm, *FROM_REF(ObjUpvalue, frame->closure->upvalues[slot])->location);
                 break;
             }
             case OP_SET_UPVALUE: {
                 uint8_t slot = READ_BYTE();
-                *frame->closure->upvalues[slot]->location = peek(0);
+                *FROM_REF(ObjUpvalue, frame->closure->upvalues[slot])->location = peek(vm, 0);
                 break;
             }
             case OP_GET_PROPERTY: {
                 // check if instance
-                if (!IS_INSTANCE(peek(0))) {
-                    runtimeError("Only instances have properties");
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!IS_INSTANCE(peek(vm, 0))) {
+                    runtimeError(vm, "Only instances have properties");
+                    goto thrown;
                 }
                 // instance is at top of the stack.
-                ObjInstance* instance = AS_INSTANCE(peek(0));
+                ObjInstance* instance = AS_INSTANCE(peek(vm, 0));
                 // get field name from constant.
                 ObjString* name = READ_STRING();
 
                 Value value;
                 // lookup instance field table.
                 if (tableGet(&instance->fields, name, &value)) {
-                    pop(); // instnace.
-                    push(value);
+                    pop(vm); // instnace.
+                    push(vm, value);
                     break;
                 }
 
                 // handle bound method.
-                if (!bindMethod(instance->klass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!bindMethod(vm, instance->klass, name)) {
+                    goto thrown;
                 }
                 break;
 
-                runtimeError("undefined property '%s'.", name->chars);
-                return INTERPRET_RUNTIME_ERROR;
+                runtimeError(vm, "undefined property '%s'.", name->chars);
+                goto thrown;
             }
             case OP_SET_PROPERTY: {
                 // check if instance
-                if (!IS_INSTANCE(peek(1))) {
-                    runtimeError("Only instances have fields.");
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!IS_INSTANCE(peek(vm, 1))) {
+                    runtimeError(vm, "Only instances have fields.");
+                    goto thrown;
                 }
                 // value being set at top of the stack.
                 // instance below value.
-                ObjInstance* instance = AS_INSTANCE(peek(1));
-                tableSet(&instance->fields, READ_STRING(), peek(0));
+                ObjInstance* instance = AS_INSTANCE(peek(vm, 1));
+                tableSet(vm, &instance->fields, READ_STRING(), peek(vm, 0));
                 // pop instance, keep value
-                Value value = pop();
-                pop(); // instance
-                push(value);
+                Value value = pop(vm);
+                pop(vm); // instance
+                push(vm, value);
                 break;
             }
             case OP_GET_SUPER: {
                 ObjString* name = READ_STRING();
-                ObjClass* superclass = AS_CLASS(pop());
+                ObjClass* superclass = AS_CLASS(pop(vm));
 
                 // bind superclass method.
-                if (!bindMethod(superclass, name)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!bindMethod(vm, superclass, name)) {
+                    goto thrown;
                 }
                 break;
             }
             case OP_EQUAL: {
-                Value b = pop();
-                Value a = pop();
-                push(BOOL_VAL(valuesEqual(a, b)));
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(valuesEqual(a, b)));
                 break;
             }
-            case OP_GREATER: BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS: BINARY_OP(BOOL_VAL, <); break;
+            case OP_GREATER: INT_BINARY_OP(INT_GREATER, BOOL_VAL, >); break;
+            case OP_LESS: INT_BINARY_OP(INT_LESS, BOOL_VAL, <); break;
             case OP_ADD: {
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate();
-                } else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1))) {
+                    int32_t b = AS_INT(pop(vm));
+                    vm->stackTop[-1] = INT_ADD(AS_INT(vm->stackTop[-1]), b);
+                } else if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                    concatenate(vm);
+                } else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                    double b = AS_NUMBER(pop(vm));
+                    double a = AS_NUMBER(pop(vm));
+                    push(vm, NUMBER_VAL(a + b));
                 } else {
-                    runtimeError("Operands must be two numbers or two strings.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    runtimeError(vm, "Operands must be two numbers or two strings.");
+                    goto thrown;
                 }
                 break;
             };
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -); break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *); break;
+            case OP_SUBTRACT: INT_BINARY_OP(INT_SUBTRACT, NUMBER_VAL, -); break;
+            case OP_MULTIPLY: INT_BINARY_OP(multiplyInts, NUMBER_VAL, *); break;
             case OP_DIVIDE: BINARY_OP(NUMBER_VAL, /); break;
             case OP_NOT:
-                push(BOOL_VAL(isFalsey(pop())));
+                push(vm, BOOL_VAL(isFalsey(pop(vm))));
                 break;
             case OP_NEGATE: 
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number.");
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!IS_NUMBER(peek(vm, 0))) {
+                    runtimeError(vm, "Operand must be a number.");
+                    goto thrown;
+                }
+                // fall through.
+            case OP_NEGATE_NUMBER:
+                if (IS_INT(vm->stackTop[-1])) {
+                    vm->stackTop[-1] = negateInt(AS_INT(vm->stackTop[-1]));
+                } else {
+                    vm->stackTop[-1] = NUMBER_VAL(-AS_NUMBER(vm->stackTop[-1]));
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop()))); 
                 break;
+            case OP_GREATER_NUMBER: INT_NUMBER_OP(INT_GREATER, BOOL_VAL, >); break;
+            case OP_LESS_NUMBER: INT_NUMBER_OP(INT_LESS, BOOL_VAL, <); break;
+            case OP_ADD_NUMBER: INT_NUMBER_OP(INT_ADD, NUMBER_VAL, +); break;
+            case OP_SUBTRACT_NUMBER: INT_NUMBER_OP(INT_SUBTRACT, NUMBER_VAL, -); break;
+            case OP_MULTIPLY_NUMBER: INT_NUMBER_OP(multiplyInts, NUMBER_VAL, *); break;
+            case OP_DIVIDE_NUMBER: NUMBER_BINARY_OP(NUMBER_VAL, /); break;
             case OP_PRINT: {
-                printValue(pop());
-                printf("\n");
+                fprintValue(vm->out, pop(vm));
+                fputc('\n', vm->out);
                 break;
             }
             case OP_JUMP: {
@@ -480,7 +1153,7 @@ static InterpretResult run() {
             }
             case OP_JUMP_IF_FALSE: {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
+                if (isFalsey(peek(vm, 0))) frame->ip += offset;
                 break;
             }
             case OP_LOOP: {
@@ -491,45 +1164,79 @@ static InterpretResult run() {
             case OP_CALL: {
                 // get function being called and number of arguments passed to the function.
                 int argCount = READ_BYTE();
-                if (!callValue(peek(argCount), argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!callValue(vm, peek(vm, argCount), argCount)) {
+                    goto thrown;
                 }
                 // update current frame pointer. 
-                frame = &vm.frames[vm.frameCount - 1];
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_TAIL_CALL: {
+                int argCount = READ_BYTE();
+                if (!tailCallValue(vm, peek(vm, argCount), argCount)) {
+                    goto thrown;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
                 break;
             }
             case OP_INVOKE: {
-                ObjString* method = READ_STRING();
+                int constant = READ_BYTE();
                 int argCount = READ_BYTE();
-                if (!invoke(method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                if (!invokeCached(vm, FROM_REF(ObjFunction, frame->closure->function), constant, argCount, false)) {
+                    goto thrown;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                frame = &vm->frames[vm->frameCount - 1];
                 break;
             }
             case OP_SUPER_INVOKE: {
                 ObjString* method = READ_STRING();
                 int argCount = READ_BYTE();
-                ObjClass* superclass = AS_CLASS(pop());
-                if (!invokeFromClass(superclass, method, argCount)) {
-                    return INTERPRET_RUNTIME_ERROR;
+                ObjClass* superclass = AS_CLASS(pop(vm));
+                if (!invokeFromClass(vm, superclass, method, argCount, false)) {
+                    goto thrown;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_TAIL_INVOKE: {
+                int constant = READ_BYTE();
+                int argCount = READ_BYTE();
+                if (!invokeCached(vm, FROM_REF(ObjFunction, frame->closure->function), constant, argCount, true)) {
+                    goto thrown;
+                }
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_TAIL_SUPER_INVOKE: {
+                ObjString* method = READ_STRING();
+                int argCount = READ_BYTE();
+                ObjClass* superclass = AS_CLASS(pop(vm));
+                if (!invokeFromClass(vm, superclass, method, argCount, true)) {
+                    goto thrown;
                 }
-                frame = &vm.frames[vm.frameCount - 1];
+                frame = &vm->frames[vm->frameCount - 1];
                 break;
             }
             case OP_CLOSURE: {
                 // load compiled function from constant table.
                 ObjFunction* function = AS_FUNCTION(READ_CONSTANT());
+                // functions from an image load their constants the first time they are closed over.
+                if (function->pending != NULL && !loadImageConstants(vm, function)) {
+                    runtimeError(vm, "Corrupt bytecode image.");
+                    goto thrown;
+                }
+                // a function uses the globals of the module it is declared in.
+                function->module = FROM_REF(ObjFunction, frame->closure->function)->module;
                 // wrap compiled function with closure object.
-                ObjClosure* closure = newClosure(function);
+                ObjClosure* closure = newClosure(vm, function);
                 // push result onto the stack.
-                push(OBJ_VAL(closure));
+                push(vm, OBJ_VAL(closure));
                 // fill upvalue array
                 for (int i = 0; i < closure->upvalueCount; i++) {
                     uint8_t isLocal = READ_BYTE();
                     uint8_t index = READ_BYTE();
                     if (isLocal) {
-                        closure->upvalues[i] = captureUpvalue(frame->slots + index);
+                        closure->upvalues[i] = TO_REF(captureUpvalue(vm, frame->slots + index));
                     } else {
                         closure->upvalues[i] = frame->closure->upvalues[index];
                     }
@@ -537,47 +1244,204 @@ static InterpretResult run() {
                 break;
             }
             case OP_CLOSE_UPVALUE:
-                closeUpvalues(vm.stackTop - 1);
+                closeUpvalues(vm, vm->stackTop - 1);
                 // discard stack slot.
-                pop();
+                pop(vm);
                 break;
             case OP_RETURN: {
-                Value result = pop();
+                Value result = pop(vm);
                 // closes over outermost block scope that defines a function body.
-                closeUpvalues(frame->slots);
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    // exit interpreter.    
-                    pop();
-                    return INTERPRET_OK;
+                closeUpvalues(vm, frame->slots);
+                vm->frameCount--;
+                if (vm->frameCount == 0) {
+                    if (vm->fiber->caller != NULL) {
+                        // fiber finished. its return value is the result of the resume that ran it.
+                        vm->stackTop = vm->stack;
+                        returnToCaller(vm, FIBER_DONE, result);
+                        frame = &vm->frames[vm->frameCount - 1];
+                        break;
+                    }
+                    if (vm->fiber->isTask) {
+                        // result stays in slot zero for await.
+                        vm->stackTop = vm->stack;
+                        push(vm, result);
+                        if (!finishTask(vm, result)) goto thrown;
+                        frame = &vm->frames[vm->frameCount - 1];
+                        break;
+                    }
                 }
                 
                 // discard callee slots and back at the beginning of the returning function's stack window.
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
+                vm->stackTop = frame->slots;
+                push(vm, result);
+                // exit interpreter. the result takes the callee's slot for whoever started run().
+                if (vm->frameCount == baseFrame) return INTERPRET_OK;
+                frame = &vm->frames[vm->frameCount - 1];
                 break;
             }
             case OP_CLASS:
                 // get class name from constant table and create class object. 
-                push(OBJ_VAL(newClass(READ_STRING())));
+                push(vm, OBJ_VAL(newClass(vm, READ_STRING())));
                 break;
             case OP_INHERIT: {
-                Value superclass = peek(1);
+                Value superclass = peek(vm, 1);
                 if (!IS_CLASS(superclass)) {
-                    runtimeError("Superclass must be a class.");
-                    return INTERPRET_RUNTIME_ERROR;
+                    runtimeError(vm, "Superclass must be a class.");
+                    goto thrown;
                 }
-                ObjClass* subclass = AS_CLASS(peek(0));
+                ObjClass* subclass = AS_CLASS(peek(vm, 0));
                 // copy superclass methods to subclass
-                tableAddAll(&AS_CLASS(superclass)->methods, &subclass->methods);
-                pop();
+                tableAddAll(vm, &AS_CLASS(superclass)->methods, &subclass->methods);
+                pop(vm);
                 break;
             }
             case OP_METHOD:
-                defineMethod(READ_STRING());
+                defineMethod(vm, READ_STRING());
+                break;
+            case OP_THROW:
+                throwValue(vm, pop(vm));
+                goto thrown;
+            case OP_IMPORT: {
+                ObjString* name = READ_STRING();
+                Value loaded;
+                // a module runs once per vm. importing it again, or from inside itself, pushes its namespace and nil.
+                if (tableGet(&vm->modules, name, &loaded)) {
+                    push(vm, loaded);
+                    push(vm, NIL_VAL);
+                    break;
+                }
+                ObjString* path = findModule(vm, name);
+                if (path == NULL) goto thrown;
+                if (tableGet(&vm->modules, path, &loaded)) {
+                    tableSet(vm, &vm->modules, name, loaded);
+                    push(vm, loaded);
+                    push(vm, NIL_VAL);
+                    break;
+                }
+                push(vm, OBJ_VAL(path));
+                ObjFunction* function = loadModule(vm, path);
+                if (function == NULL) goto thrown;
+                push(vm, OBJ_VAL(function));
+                // the namespace is an instance of a class named after the module.
+                ObjClass* klass = newClass(vm, name);
+                push(vm, OBJ_VAL(klass));
+                ObjInstance* module = newInstance(vm, klass);
+                push(vm, OBJ_VAL(module));
+                function->module = module;
+                tableSet(vm, &vm->modules, name, OBJ_VAL(module));
+                tableSet(vm, &vm->modules, path, OBJ_VAL(module));
+                ObjClosure* closure = newClosure(vm, function);
+                vm->stackTop -= 4;
+                // the module's script runs in a frame of its own and leaves nil above the namespace.
+                push(vm, OBJ_VAL(module));
+                push(vm, OBJ_VAL(closure));
+                if (!call(vm, closure, 0)) goto thrown;
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+            case OP_RESERVE: {
+                // registers past the arguments start out nil.
+                Value* top = frame->slots + READ_BYTE();
+                while (vm->stackTop < top) push(vm, NIL_VAL);
+                break;
+            }
+            case OP_GUARD_NUMBER: {
+                uint8_t slot = READ_BYTE();
+                if (!IS_NUMBER(REGISTER(slot))) {
+                    // nothing has run yet. the call, and every later one, continues in the baseline code.
+                    ObjFunction* function = FROM_REF(ObjFunction, frame->closure->function);
+                    function->tier->deoptimized = true;
+                    frame->ip = function->chunk.code;
+                }
+                break;
+            }
+            case OP_MOVE: {
+                uint8_t dst = READ_BYTE();
+                REGISTER(dst) = REGISTER(READ_BYTE());
+                break;
+            }
+            case OP_LOAD_CONSTANT: {
+                uint8_t dst = READ_BYTE();
+                REGISTER(dst) = READ_CONSTANT();
+                break;
+            }
+            case OP_LOAD_NIL: REGISTER(READ_BYTE()) = NIL_VAL; break;
+            case OP_LOAD_TRUE: REGISTER(READ_BYTE()) = BOOL_VAL(true); break;
+            case OP_LOAD_FALSE: REGISTER(READ_BYTE()) = BOOL_VAL(false); break;
+            case OP_PUSH_R: push(vm, REGISTER(READ_BYTE())); break;
+            case OP_POP_R: REGISTER(READ_BYTE()) = pop(vm); break;
+            case OP_EQUAL_R: {
+                uint8_t dst = READ_BYTE();
+                Value a = REGISTER(READ_BYTE());
+                Value b = REGISTER(READ_BYTE());
+                REGISTER(dst) = BOOL_VAL(valuesEqual(a, b));
+                break;
+            }
+            case OP_GREATER_R: INT_REGISTER_OP(INT_GREATER, REGISTER_OP, BOOL_VAL, >); break;
+            case OP_LESS_R: INT_REGISTER_OP(INT_LESS, REGISTER_OP, BOOL_VAL, <); break;
+            case OP_ADD_R: {
+                uint8_t dst = READ_BYTE();
+                Value a = REGISTER(READ_BYTE());
+                Value b = REGISTER(READ_BYTE());
+                if (IS_INT(a) && IS_INT(b)) {
+                    REGISTER(dst) = INT_ADD(AS_INT(a), AS_INT(b));
+                } else if (IS_STRING(a) && IS_STRING(b)) {
+                    push(vm, a);
+                    push(vm, b);
+                    concatenate(vm);
+                    REGISTER(dst) = pop(vm);
+                } else if (IS_NUMBER(a) && IS_NUMBER(b)) {
+                    REGISTER(dst) = NUMBER_VAL(AS_NUMBER(a) + AS_NUMBER(b));
+                } else {
+                    runtimeError(vm, "Operands must be two numbers or two strings.");
+                    goto thrown;
+                }
+                break;
+            }
+            case OP_SUBTRACT_R: INT_REGISTER_OP(INT_SUBTRACT, REGISTER_OP, NUMBER_VAL, -); break;
+            case OP_MULTIPLY_R: INT_REGISTER_OP(multiplyInts, REGISTER_OP, NUMBER_VAL, *); break;
+            case OP_DIVIDE_R: REGISTER_OP(NUMBER_VAL, /); break;
+            case OP_NOT_R: {
+                uint8_t dst = READ_BYTE();
+                REGISTER(dst) = BOOL_VAL(isFalsey(REGISTER(READ_BYTE())));
+                break;
+            }
+            case OP_NEGATE_R: {
+                uint8_t dst = READ_BYTE();
+                Value a = REGISTER(READ_BYTE());
+                if (!IS_NUMBER(a)) {
+                    runtimeError(vm, "Operand must be a number.");
+                    goto thrown;
+                }
+                REGISTER(dst) = IS_INT(a) ? negateInt(AS_INT(a)) : NUMBER_VAL(-AS_NUMBER(a));
+                break;
+            }
+            case OP_GREATER_NUMBER_R: INT_REGISTER_OP(INT_GREATER, NUMBER_OP, BOOL_VAL, >); break;
+            case OP_LESS_NUMBER_R: INT_REGISTER_OP(INT_LESS, NUMBER_OP, BOOL_VAL, <); break;
+            case OP_ADD_NUMBER_R: INT_REGISTER_OP(INT_ADD, NUMBER_OP, NUMBER_VAL, +); break;
+            case OP_SUBTRACT_NUMBER_R: INT_REGISTER_OP(INT_SUBTRACT, NUMBER_OP, NUMBER_VAL, -); break;
+            case OP_MULTIPLY_NUMBER_R: INT_REGISTER_OP(multiplyInts, NUMBER_OP, NUMBER_VAL, *); break;
+            case OP_DIVIDE_NUMBER_R: NUMBER_OP(NUMBER_VAL, /); break;
+            case OP_NEGATE_NUMBER_R: {
+                uint8_t dst = READ_BYTE();
+                Value a = REGISTER(READ_BYTE());
+                REGISTER(dst) = IS_INT(a) ? negateInt(AS_INT(a)) : NUMBER_VAL(-AS_NUMBER(a));
+                break;
+            }
+            case OP_JUMP_IF_FALSE_R: {
+                Value condition = REGISTER(READ_BYTE());
+                uint16_t offset = READ_SHORT();
+                if (isFalsey(condition)) frame->ip += offset;
                 break;
+            }
         }
+        continue;
+
+    thrown:
+        // nothing is spent on try blocks until something is thrown. then the
+        // exception tables of the frames this run owns are searched for a handler.
+        if (!catchError(vm, baseFrame)) return INTERPRET_RUNTIME_ERROR;
+        frame = &vm->frames[vm->frameCount - 1];
     }
 
     #undef READ_BYTE
@@ -585,20 +1449,207 @@ static InterpretResult run() {
     #undef READ_CONSTANT
     #undef READ_STRING
     #undef BINARY_OP
+    #undef NUMBER_BINARY_OP
+    #undef INT_ADD
+    #undef INT_SUBTRACT
+    #undef INT_GREATER
+    #undef INT_LESS
+    #undef INT_BINARY_OP
+    #undef INT_NUMBER_OP
+    #undef INT_REGISTER_OP
+    #undef REGISTER
+    #undef REGISTER_OP
+    #undef NUMBER_OP
 }
 
-InterpretResult interpret(const char* source) {
+// run() for a call made from c. when lox code is already running, it is a
+// native's call back into lox and the run nests inside the one that called the native.
+static InterpretResult runNested(VM* vm, int baseFrame) {
+    if (baseFrame == 0) return run(vm, 0);
+    vm->nestedRuns++;
+    InterpretResult result = run(vm, baseFrame);
+    vm->nestedRuns--;
+    return result;
+}
+
+// checked before the callee's frame is pushed so the stack trace ends at the native.
+static bool checkNesting(VM* vm) {
+    if (vm->frameCount > 0 && vm->nestedRuns == NESTED_RUNS_MAX) {
+        runtimeError(vm, "Too many nested calls from natives.");
+        return false;
+    }
+    return true;
+}
+
+bool callNested(VM* vm, int argCount) {
+    int baseFrame = vm->frameCount;
+    if (!checkNesting(vm)) return false;
+    if (!callValue(vm, peek(vm, argCount), argCount)) return false;
+    // natives and classes without an initializer finish inside callValue.
+    if (vm->frameCount == baseFrame) return true;
+    return runNested(vm, baseFrame) == INTERPRET_OK;
+}
+
+InterpretResult interpret(VM* vm, const char* source) {
     // compile from source.
-    ObjFunction* function = compile(source);
+    ObjFunction* function = compile(vm, source);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
 
+    return interpretFunction(vm, function);
+}
+
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
     // push top-level function to vm stack.
-    push(OBJ_VAL(function));
-    ObjClosure* closure = newClosure(function);
-    pop();
-    push(OBJ_VAL(closure));
+    push(vm, OBJ_VAL(function));
+    ObjClosure* closure = newClosure(vm, function);
+    pop(vm);
+    push(vm, OBJ_VAL(closure));
     // call the top-level function.
-    call(closure, 0);
+    call(vm, closure, 0);
+
+    InterpretResult result = run(vm, 0);
+    // the script's return value.
+    if (result == INTERPRET_OK) pop(vm);
+    return result;
+}
 
-    return run();
+Script* compileScript(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, source);
+    if (function == NULL) return NULL;
+    return newScript(vm, function);
+}
+
+Script* newScript(VM* vm, ObjFunction* function) {
+    push(vm, OBJ_VAL(function));
+    Script* script = ALLOCATE(vm, Script, 1);
+    pop(vm);
+    script->function = function;
+    script->prev = NULL;
+    script->next = vm->scripts;
+    if (vm->scripts != NULL) vm->scripts->prev = script;
+    vm->scripts = script;
+    return script;
+}
+
+InterpretResult runScript(VM* vm, Script* script, bool freshGlobals) {
+    if (freshGlobals) resetGlobals(vm);
+    return interpretFunction(vm, script->function);
+}
+
+void releaseScript(VM* vm, Script* script) {
+    if (script->prev != NULL) {
+        script->prev->next = script->next;
+    } else {
+        vm->scripts = script->next;
+    }
+    if (script->next != NULL) script->next->prev = script->prev;
+    FREE(vm, Script, script);
+}
+
+InterpretResult callFunction(VM* vm, const char* name, int argCount, Value* args, Value* result) {
+    *result = NIL_VAL;
+    if (argCount > UINT8_MAX) {
+        runtimeError(vm, "Can't have more than 255 arguments.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    if (!ensureStack(vm, argCount + 1)) {
+        runtimeError(vm, "Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    // the arguments go on the stack before the name is interned so a
+    // collection can't free them.
+    push(vm, NIL_VAL);
+    for (int i = 0; i < argCount; i++) push(vm, args[i]);
+    Value callee;
+    if (!tableGet(&vm->globals, copyString(vm, name, (int)strlen(name)), &callee)) {
+        runtimeError(vm, "Undefined function '%s'.", name);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    vm->stackTop[-argCount - 1] = callee;
+
+    if (!callNested(vm, argCount)) return INTERPRET_RUNTIME_ERROR;
+    *result = pop(vm);
+    return INTERPRET_OK;
+}
+
+InterpretResult callBatch(VM* vm, Value callee, int argCount, int count, const Value* args, Value* results) {
+    if (argCount > UINT8_MAX) {
+        runtimeError(vm, "Can't have more than 255 arguments.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    ObjClosure* closure = NULL;
+    Value receiver = callee;
+    if (IS_CLOSURE(callee)) {
+        closure = AS_CLOSURE(callee);
+    } else if (IS_BOUND_METHOD(callee)) {
+        closure = FROM_REF(ObjClosure, AS_BOUND_METHOD(callee)->method);
+        receiver = AS_BOUND_METHOD(callee)->receiver;
+    }
+
+    if (closure == NULL) {
+        // natives and classes don't run in a callframe of their own.
+        if (!ensureStack(vm, argCount + 1)) {
+            runtimeError(vm, "Stack overflow.");
+            return INTERPRET_RUNTIME_ERROR;
+        }
+        for (int i = 0; i < count; i++) {
+            push(vm, callee);
+            for (int j = 0; j < argCount; j++) push(vm, args[i * argCount + j]);
+            if (!callNested(vm, argCount)) return INTERPRET_RUNTIME_ERROR;
+            results[i] = pop(vm);
+        }
+        return INTERPRET_OK;
+    }
+
+    ObjFunction* function = FROM_REF(ObjFunction, closure->function);
+    if (argCount != function->arity) {
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
+        return INTERPRET_RUNTIME_ERROR;
+    }
+    if (!checkNesting(vm)) return INTERPRET_RUNTIME_ERROR;
+    // keeps the callee alive between records, when no callframe holds it.
+    push(vm, callee);
+    if (function->lazy != NULL && !compileLazy(vm, function)) return INTERPRET_RUNTIME_ERROR;
+    // every record starts at the same slot and the stack never shrinks, so
+    // the room for a record's frame is reserved once for the whole batch.
+    int reserved = function->maxSlots;
+    if (!ensureFrame(vm, function) || !ensureStack(vm, reserved + FRAME_HEADROOM)) {
+        runtimeError(vm, "Stack overflow.");
+        return INTERPRET_RUNTIME_ERROR;
+    }
+
+    size_t argBytes = sizeof(Value) * argCount;
+    int baseFrame = vm->frameCount;
+    for (int i = 0; i < count; i++) {
+        // the stack may have moved during the last record, so slots is found again.
+        Value* slots = vm->stackTop;
+        slots[0] = receiver;
+        memcpy(slots + 1, args + i * argCount, argBytes);
+        vm->stackTop = slots + argCount + 1;
+        uint8_t* ip = entryPoint(vm, function, slots + 1);
+        if (function->maxSlots > reserved) {
+            // the function was just optimized into code with a bigger frame.
+            reserved = function->maxSlots;
+            if (!ensureStack(vm, reserved - argCount - 1 + FRAME_HEADROOM)) {
+                runtimeError(vm, "Stack overflow.");
+                return INTERPRET_RUNTIME_ERROR;
+            }
+        }
+
+        CallFrame* frame = &vm->frames[vm->frameCount++];
+#ifdef DEBUG_COUNT_FRAMES
+        vm->framesPushed++;
+#endif
+        frame->closure = closure;
+        frame->ip = ip;
+        frame->slots = vm->stackTop - argCount - 1;
+        InterpretResult status = runNested(vm, baseFrame);
+        if (status != INTERPRET_OK) return status;
+        results[i] = pop(vm);
+    }
+    pop(vm);
+    return INTERPRET_OK;
 }
\ No newline at end of file
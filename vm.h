@@ -2,40 +2,72 @@
 #define clox_vm_h
 
 #include "chunk.h"
+#include "io.h"
+#include "memory.h"
 #include "value.h"
 #include "object.h"
 #include "table.h"
 
-#define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
+// stacks start small and grow on demand.
+#define FRAMES_INITIAL 8
+#define STACK_INITIAL FRAME_SLOTS
+// default hard cap on call depth. configurable per vm through framesMax.
+#define FRAMES_MAX 16384
+// cap on natives calling lox calling natives, each of which nests a run() on the c stack.
+#define NESTED_RUNS_MAX 256
+// stack slots budgeted per callframe. the stack starts with this many and is
+// capped at framesMax times it. each frame reserves its function's maxSlots.
+#define FRAME_SLOTS (UINT8_COUNT * 2)
+// slots past a frame's deepest point for values the vm and natives keep on
+// the stack while an instruction runs.
+#define FRAME_HEADROOM 8
 
-
-// a callframe represents a single ongoing function call.
-typedef struct {
-    ObjClosure* closure;
-    uint8_t* ip; // caller's ip. when return from a function. the VM will jump to ip of the caller's callframe.
-    Value* slots; // points to the VM's stack at the first slot this function can use.
-} CallFrame;
-
-typedef struct {
-    CallFrame frames[FRAMES_MAX]; // function calls have stack semantics.
+struct VM {
+    // stacks of the running fiber.
+    CallFrame* frames; // function calls have stack semantics.
     int frameCount; // stores current height of the callframe stack. it is the number of ongoing function calls.
+    int frameCapacity;
+    int framesMax; // hard cap on frameCapacity. stack capacity is capped at framesMax * FRAME_SLOTS.
 
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
+    int stackCapacity;
     Table globals; // hash table for gloabl variables. 
+    Table builtins; // globals defined by the vm itself. restored by resetGlobals.
     Table strings; // hash table of internal strings.
     ObjString* initString;
     ObjUpvalue* openUpvalues; // head pointer of upvalues list.
+    ObjFiber* fiber; // running fiber.
+    ObjFiber* mainFiber; // fiber scripts start in.
+    int nestedRuns; // run() calls made from natives still going. fibers can't switch under them.
+    Value exception; // error being thrown, until run() reaches the try block that catches it.
+    bool lazyFunctions; // compile skips function bodies. each is compiled on its first call.
+    Table modules; // namespace of every module imported, by name and by path.
+    const char* modulePath; // directories import searches, separated by ':'. NULL for the default.
+    int tierThreshold; // calls before a function is optimized. 0 never optimizes.
+    bool dumpIR; // print the ir and code of every function the tier optimizes.
+#ifdef DEBUG_COUNT_FRAMES
+    uint64_t framesPushed;
+#endif
+    EventLoop loop;
 
     size_t bytesAllocated;
     size_t nextGC;
+    bool pauseGC; // set while restoring a snapshot. everything allocated then is live.
 
-    Obj* objects;
+    Heap heap;
     int grayCount;
     int grayCapacity;
     Obj** grayStack; // worklist to keep track of gray objects.
-} VM;
+    int markThreads; // threads marking a big heap. 1 marks on the collecting thread only.
+
+    FILE* out; // destination of print statements.
+    FILE* err; // destination of compile and runtime errors.
+
+    struct Parser* parser; // compiler state while compiling. its functions are gc roots.
+    struct Image* images; // bytecode images mapped by this vm. unmapped by freeVM.
+    struct Script* scripts; // compiled scripts held by the embedder. gc roots.
+};
 
 typedef enum {
     INTERPRET_OK,
@@ -43,12 +75,55 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
+// a compiled script the embedder can run any number of times without
+// recompiling it. the vm keeps its function alive until it is released.
+typedef struct Script {
+    struct Script* prev;
+    struct Script* next;
+    ObjFunction* function;
+} Script;
 
-void initVM();
-void freeVM();
-InterpretResult interpret(const char* source);
-void push(Value value);
-Value pop();
+void initVM(VM* vm);
+void freeVM(VM* vm);
+InterpretResult interpret(VM* vm, const char* source);
+// run a top-level function that was already compiled, e.g. loaded from a bytecode cache.
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+// drop script-defined globals, keeping natives. interned strings stay warm.
+// modules imported so far will run again on their next import.
+void resetGlobals(VM* vm);
+// compile source into a script. NULL after reporting a compile error.
+Script* compileScript(VM* vm, const char* source);
+// hold a top-level function that was compiled some other way as a script.
+Script* newScript(VM* vm, ObjFunction* function);
+// run a compiled script. with freshGlobals, globals left by earlier runs are dropped first.
+InterpretResult runScript(VM* vm, Script* script, bool freshGlobals);
+// let the vm collect the script's function. scripts still held are freed by freeVM.
+void releaseScript(VM* vm, Script* script);
+// call the value argCount slots below the top of the stack with the arguments
+// above it and run it to completion, from c or from inside a native. the
+// callee and arguments are replaced by the result. false after a runtime
+// error, which has already been reported, so a native just returns false too.
+// a call can move the stack, so natives find their args again by offset from vm->stack.
+bool callNested(VM* vm, int argCount);
+// call the global function named name from c.
+// args are copied onto the vm stack. result is not a gc root, so an object
+// in it must be stored somewhere the vm marks before the vm allocates again.
+InterpretResult callFunction(VM* vm, const char* name, int argCount, Value* args, Value* result);
+// call callee once per record. args holds count
+// records of argCount values each and results receives count return values.
+// every record of a closure or bound method runs in a callframe at the same
+// stack slot, so its arity and the stack room are checked once per batch,
+// and again only if the tier makes its frame bigger. neither array is a gc root, so objects in them
+// must stay reachable from the vm, e.g. through a global. stops at the first error.
+InterpretResult callBatch(VM* vm, Value callee, int argCount, int count, const Value* args, Value* results);
+void push(VM* vm, Value value);
+Value pop(VM* vm);
+// throw a runtime error. if no try block catches it, print it with a stack trace and unwind the vm.
+// natives call it before returning false.
+void runtimeError(VM* vm, const char* format, ...);
+void defineNative(VM* vm, const char* name, NativeFn function);
+// switch to fiber. the caller has already parked the running fiber.
+// a new fiber starts its function with value as the argument, any other gets value as the result of the call it is parked in.
+bool transferFiber(VM* vm, ObjFiber* fiber, Value value);
 
 #endif
\ No newline at end of file